@@ -1,15 +1,45 @@
 #include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <chrono>
 #include <csignal>
+#include <cstdlib>
 #include <iostream>
 #include <map>
 #include <string>
+#include <thread>
+#include <vector>
 
 typedef void (*sighandler_t)(int sig);
 
 #include "impl_msgq.h"
 #include "impl_zmq.h"
 #include "services.h"
+#include "selfdrive/common/swaglog.h"
+
+// Messages up to this size are coalesced into one msgq batch, larger ones are forwarded directly.
+// zmq subscribers may be conflated, which doesn't work with multipart messages, so zmq never batches
+#define BATCH_MAX_MSG_SIZE (4 * 1024)
+#define BATCH_MAX_SIZE (64 * 1024)
+// Upper bound on messages forwarded per topic per poll, so a busy topic can't starve the others
+#define MAX_DRAIN 256
+#define STATS_INTERVAL_S 10
+
+struct BridgeTopic {
+  std::string name;
+  int frequency;
+  bool batch;
+  SubSocket *sub_sock;
+  PubSocket *pub_sock;
+  std::atomic<uint64_t> forwarded{0}, dropped{0};
+};
+
+struct Batch {
+  std::vector<char> buf;
+  std::vector<size_t> offsets;
+  std::vector<size_t> sizes;
+  std::vector<char *> data;
+};
 
 void sigpipe_handler(int sig) {
   assert(sig == SIGPIPE);
@@ -29,6 +59,89 @@ static std::vector<std::string> get_services(std::string whitelist_str, bool zmq
   return service_list;
 }
 
+static int get_frequency(std::string name) {
+  for (const auto& it : services) {
+    if (name == it.name) return it.frequency;
+  }
+  return 0;
+}
+
+static void flush_batch(BridgeTopic *topic, Batch &batch) {
+  size_t n = batch.sizes.size();
+  if (n == 0) return;
+
+  batch.data.clear();
+  for (size_t offset : batch.offsets) {
+    batch.data.push_back(batch.buf.data() + offset);
+  }
+
+  if (topic->pub_sock->sendBatch(batch.data.data(), batch.sizes.data(), n) < 0) {
+    topic->dropped += n;
+  } else {
+    topic->forwarded += n;
+  }
+
+  batch.buf.clear();
+  batch.offsets.clear();
+  batch.sizes.clear();
+}
+
+static void forward(BridgeTopic *topic, Batch &batch) {
+  for (int i = 0; i < MAX_DRAIN; i++) {
+    Message *msg = topic->sub_sock->borrow();
+    if (msg == NULL) break;
+
+    size_t size = msg->getSize();
+    if (topic->batch && size <= BATCH_MAX_MSG_SIZE) {
+      if (batch.buf.size() + size > BATCH_MAX_SIZE) {
+        flush_batch(topic, batch);
+      }
+      batch.offsets.push_back(batch.buf.size());
+      batch.sizes.push_back(size);
+      batch.buf.insert(batch.buf.end(), msg->getData(), msg->getData() + size);
+
+      // The copy was overwritten by the publisher, don't forward it
+      if (!msg->release()) {
+        batch.buf.resize(batch.offsets.back());
+        batch.offsets.pop_back();
+        batch.sizes.pop_back();
+        topic->dropped++;
+      }
+    } else {
+      flush_batch(topic, batch);
+
+      bool sent = topic->pub_sock->sendMessage(msg) >= 0;
+      if (!msg->release() || !sent) {
+        topic->dropped++;
+      } else {
+        topic->forwarded++;
+      }
+    }
+    delete msg;
+  }
+
+  flush_batch(topic, batch);
+}
+
+static void bridge_thread(std::vector<BridgeTopic *> topics, bool zmq_to_msgq) {
+  Poller *poller = zmq_to_msgq ? (Poller *)new ZMQPoller() : (Poller *)new MSGQPoller();
+
+  std::map<SubSocket*, BridgeTopic*> sub2topic;
+  for (auto topic : topics) {
+    poller->registerSocket(topic->sub_sock);
+    sub2topic[topic->sub_sock] = topic;
+  }
+
+  Batch batch;
+  batch.buf.reserve(BATCH_MAX_SIZE);
+
+  while (true) {
+    for (auto sub_sock : poller->poll(100)) {
+      forward(sub2topic[sub_sock], batch);
+    }
+  }
+}
+
 int main(int argc, char** argv) {
   signal(SIGPIPE, (sighandler_t)sigpipe_handler);
 
@@ -36,43 +149,71 @@ int main(int argc, char** argv) {
   std::string ip = zmq_to_msgq ? argv[1] : "127.0.0.1";
   std::string whitelist_str = zmq_to_msgq ? std::string(argv[2]) : "";
 
-  Poller *poller;
+  // BRIDGE_THREADS shards the topics over a pool of forwarding threads
+  int num_threads = getenv("BRIDGE_THREADS") ? std::max(1, atoi(getenv("BRIDGE_THREADS"))) : 1;
+
   Context *pub_context;
   Context *sub_context;
   if (zmq_to_msgq) {  // republishes zmq debugging messages as msgq
-    poller = new ZMQPoller();
     pub_context = new MSGQContext();
     sub_context = new ZMQContext();
   } else {
-    poller = new MSGQPoller();
     pub_context = new ZMQContext();
     sub_context = new MSGQContext();
   }
 
-  std::map<SubSocket*, PubSocket*> sub2pub;
+  std::vector<BridgeTopic*> topics;
   for (auto endpoint: get_services(whitelist_str, zmq_to_msgq)) {
-    PubSocket * pub_sock;
-    SubSocket * sub_sock;
+    BridgeTopic *topic = new BridgeTopic;
+    topic->name = endpoint;
+    topic->frequency = get_frequency(endpoint);
+    topic->batch = zmq_to_msgq;
     if (zmq_to_msgq) {
-      pub_sock = new MSGQPubSocket();
-      sub_sock = new ZMQSubSocket();
+      topic->pub_sock = new MSGQPubSocket();
+      topic->sub_sock = new ZMQSubSocket();
     } else {
-      pub_sock = new ZMQPubSocket();
-      sub_sock = new MSGQSubSocket();
+      topic->pub_sock = new ZMQPubSocket();
+      topic->sub_sock = new MSGQSubSocket();
     }
-    pub_sock->connect(pub_context, endpoint);
-    sub_sock->connect(sub_context, endpoint, ip, false);
+    topic->pub_sock->connect(pub_context, endpoint);
+    topic->sub_sock->connect(sub_context, endpoint, ip, false);
+    topics.push_back(topic);
+  }
+
+  // Balance the threads by message rate, assigning the busiest topics first
+  std::vector<BridgeTopic*> sorted_topics = topics;
+  std::sort(sorted_topics.begin(), sorted_topics.end(), [](BridgeTopic *a, BridgeTopic *b) { return a->frequency > b->frequency; });
 
-    poller->registerSocket(sub_sock);
-    sub2pub[sub_sock] = pub_sock;
+  std::vector<std::vector<BridgeTopic*>> shards(num_threads);
+  std::vector<int> shard_load(num_threads, 0);
+  for (auto topic : sorted_topics) {
+    int idx = std::min_element(shard_load.begin(), shard_load.end()) - shard_load.begin();
+    shards[idx].push_back(topic);
+    shard_load[idx] += std::max(topic->frequency, 1);
   }
 
+  std::vector<std::thread> threads;
+  for (auto &shard : shards) {
+    if (!shard.empty()) {
+      threads.emplace_back(bridge_thread, shard, zmq_to_msgq);
+    }
+  }
+
+  // per topic throughput, warnings only when it dropped
+  std::map<BridgeTopic*, uint64_t> last_forwarded, last_dropped;
   while (true) {
-    for (auto sub_sock : poller->poll(100)) {
-      Message * msg = sub_sock->receive();
-      if (msg == NULL) continue;
-      sub2pub[sub_sock]->sendMessage(msg);
-      delete msg;
+    std::this_thread::sleep_for(std::chrono::seconds(STATS_INTERVAL_S));
+
+    for (auto topic : topics) {
+      uint64_t forwarded = topic->forwarded, dropped = topic->dropped;
+      unsigned long forwarded_delta = forwarded - last_forwarded[topic], dropped_delta = dropped - last_dropped[topic];
+      if (dropped_delta > 0) {
+        LOGW("bridge %s: forwarded %lu, dropped %lu messages in %ds", topic->name.c_str(), forwarded_delta, dropped_delta, STATS_INTERVAL_S);
+      } else if (forwarded_delta > 0) {
+        LOGD("bridge %s: forwarded %lu messages in %ds", topic->name.c_str(), forwarded_delta, STATS_INTERVAL_S);
+      }
+      last_forwarded[topic] = forwarded;
+      last_dropped[topic] = dropped;
     }
   }
   return 0;
@@ -16,23 +16,27 @@ void sig_handler(int signal) {
   msgq_do_exit = 1;
 }
 
-static bool service_exists(std::string path){
+static const service *get_service(std::string path){
   for (const auto& it : services) {
     if (it.name == path) {
-      return true;
+      return &it;
     }
   }
-  return false;
+  return NULL;
 }
 
-static size_t get_size(std::string endpoint){
-  size_t sz = DEFAULT_SEGMENT_SIZE;
+static bool service_exists(std::string path){
+  return get_service(path) != NULL;
+}
 
-  if (endpoint == "roadCameraState" || endpoint == "driverCameraState" || endpoint == "wideRoadCameraState"){
-    sz *= 10;
-  }
+static size_t get_size(std::string endpoint){
+  const service *s = get_service(endpoint);
+  return (s != NULL) ? s->segment_size : DEFAULT_SEGMENT_SIZE;
+}
 
-  return sz;
+static size_t get_max_readers(std::string endpoint){
+  const service *s = get_service(endpoint);
+  return (s != NULL) ? s->max_readers : NUM_READERS;
 }
 
 
@@ -58,8 +62,29 @@ void MSGQMessage::takeOwnership(char * d, size_t sz) {
   data = d;
 }
 
+void MSGQMessage::borrow(msgq_queue_t * q, char * d, size_t sz) {
+  borrowed_q = q;
+  size = sz;
+  data = d;
+}
+
+bool MSGQMessage::release() {
+  if (borrowed_q == NULL){
+    close();
+    return true;
+  }
+
+  msgq_msg_t msg = {size, data};
+  bool valid = msgq_msg_release(&msg, borrowed_q);
+  borrowed_q = NULL;
+  size = 0;
+  return valid;
+}
+
 void MSGQMessage::close() {
-  if (size > 0){
+  if (borrowed_q != NULL){
+    release();
+  } else if (size > 0){
     delete[] data;
   }
   size = 0;
@@ -78,7 +103,7 @@ int MSGQSubSocket::connect(Context *context, std::string endpoint, std::string a
   }
 
   q = new msgq_queue_t;
-  int r = msgq_new_queue(q, endpoint.c_str(), get_size(endpoint));
+  int r = msgq_new_queue(q, endpoint.c_str(), get_size(endpoint), get_max_readers(endpoint));
   if (r != 0){
     return r;
   }
@@ -151,6 +176,18 @@ Message * MSGQSubSocket::receive(bool non_blocking){
   return (Message*)r;
 }
 
+Message * MSGQSubSocket::borrow(){
+  msgq_msg_t msg;
+
+  if (msgq_msg_borrow(&msg, q) <= 0){
+    return NULL;
+  }
+
+  MSGQMessage *r = new MSGQMessage;
+  r->borrow(q, msg.data, msg.size);
+  return (Message*)r;
+}
+
 void MSGQSubSocket::setTimeout(int t){
   timeout = t;
 }
@@ -170,7 +207,7 @@ int MSGQPubSocket::connect(Context *context, std::string endpoint, bool check_en
   }
 
   q = new msgq_queue_t;
-  int r = msgq_new_queue(q, endpoint.c_str(), get_size(endpoint));
+  int r = msgq_new_queue(q, endpoint.c_str(), get_size(endpoint), get_max_readers(endpoint));
   if (r != 0){
     return r;
   }
@@ -196,6 +233,16 @@ int MSGQPubSocket::send(char *data, size_t size){
   return msgq_msg_send(&msg, q);
 }
 
+int MSGQPubSocket::sendBatch(char **data, size_t *sizes, size_t n){
+  batch.resize(n);
+  for (size_t i = 0; i < n; i++){
+    batch[i].data = data[i];
+    batch[i].size = sizes[i];
+  }
+
+  return msgq_msg_send_batch(batch.data(), n, q);
+}
+
 bool MSGQPubSocket::all_readers_updated() {
   return msgq_all_readers_updated(q);
 }
@@ -19,10 +19,13 @@ class MSGQMessage : public Message {
 private:
   char * data;
   size_t size;
+  msgq_queue_t * borrowed_q = NULL;
 public:
   void init(size_t size);
   void init(char *data, size_t size);
   void takeOwnership(char *data, size_t size);
+  void borrow(msgq_queue_t *q, char *data, size_t size);
+  bool release();
   size_t getSize(){return size;}
   char * getData(){return data;}
   void close();
@@ -38,16 +41,19 @@ public:
   void setTimeout(int timeout);
   void * getRawSocket() {return (void*)q;}
   Message *receive(bool non_blocking=false);
+  Message *borrow();
   ~MSGQSubSocket();
 };
 
 class MSGQPubSocket : public PubSocket {
 private:
   msgq_queue_t * q = NULL;
+  std::vector<msgq_msg_t> batch;
 public:
   int connect(Context *context, std::string endpoint, bool check_endpoint=true);
   int sendMessage(Message *message);
   int send(char *data, size_t size);
+  int sendBatch(char **data, size_t *sizes, size_t n);
   bool all_readers_updated();
   ~MSGQPubSocket();
 };
@@ -12,6 +12,9 @@
 
 #define MSG_MULTIPLE_PUBLISHERS 100
 
+enum class ServiceId : int; // generated in services.h
+struct msgq_pollitem_t;
+
 bool messaging_use_zmq();
 
 class Context {
@@ -28,6 +31,8 @@ public:
   virtual void close() = 0;
   virtual size_t getSize() = 0;
   virtual char * getData() = 0;
+  // Frees the message. Returns false if it was borrowed and the data got overwritten while in use
+  virtual bool release() { close(); return true; }
   virtual ~Message(){};
 };
 
@@ -37,6 +42,8 @@ public:
   virtual int connect(Context *context, std::string endpoint, std::string address, bool conflate=false, bool check_endpoint=true) = 0;
   virtual void setTimeout(int timeout) = 0;
   virtual Message *receive(bool non_blocking=false) = 0;
+  // Non blocking receive that avoids copying when the transport allows it, call release() when done
+  virtual Message *borrow() { return receive(true); }
   virtual void * getRawSocket() = 0;
   static SubSocket * create();
   static SubSocket * create(Context * context, std::string endpoint, std::string address="127.0.0.1", bool conflate=false, bool check_endpoint=true);
@@ -48,6 +55,13 @@ public:
   virtual int connect(Context *context, std::string endpoint, bool check_endpoint=true) = 0;
   virtual int sendMessage(Message *message) = 0;
   virtual int send(char *data, size_t size) = 0;
+  // Publishes a burst of messages, readers are notified once. Returns the number of messages sent
+  virtual int sendBatch(char **data, size_t *sizes, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+      if (send(data[i], sizes[i]) < 0) return -1;
+    }
+    return n;
+  }
   virtual bool all_readers_updated() = 0;
   static PubSocket * create();
   static PubSocket * create(Context * context, std::string endpoint, bool check_endpoint=true);
@@ -92,6 +106,43 @@ private:
   std::map<std::string, SubMessage *> services_;
 };
 
+// SubMaster addressed by ServiceId. Lookups are array indexed and, on msgq,
+// update() reuses preallocated buffers and readers instead of allocating.
+class IndexedSubMaster {
+public:
+  IndexedSubMaster(const std::vector<ServiceId> &service_list,
+                   const char *address = nullptr, const std::vector<ServiceId> &ignore_alive = {});
+  void update(int timeout = 1000);
+  inline bool allAlive() const { return all_(false, true); }
+  inline bool allValid() const { return all_(true, false); }
+  inline bool allAliveAndValid() const { return all_(true, true); }
+  ~IndexedSubMaster();
+
+  uint64_t frame = 0;
+  inline bool updated(ServiceId id) const {
+    int i = static_cast<int>(id);
+    return (updated_[i / 64] >> (i % 64)) & 1;
+  }
+  bool alive(ServiceId id) const;
+  bool valid(ServiceId id) const;
+  uint64_t rcv_frame(ServiceId id) const;
+  uint64_t rcv_time(ServiceId id) const;
+  cereal::Event::Reader &operator[](ServiceId id) const;
+
+private:
+  struct SubMessage;
+  bool all_(bool valid, bool alive) const;
+  size_t receive_msgq(SubMessage *m);
+  void set_updated(SubMessage *m, size_t words, uint64_t current_time);
+
+  Poller *poller_ = nullptr; // only used with zmq
+  msgq_pollitem_t *polls_ = nullptr;
+  std::vector<SubMessage *> messages_; // indexed by ServiceId, nullptr if not subscribed
+  std::vector<SubMessage *> subscribed_;
+  std::map<SubSocket *, SubMessage *> sockets_;
+  std::vector<uint64_t> updated_; // bitmap indexed by ServiceId
+};
+
 class MessageBuilder : public capnp::MallocMessageBuilder {
 public:
   MessageBuilder() = default;
@@ -0,0 +1,192 @@
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <time.h>
+
+#include "impl_msgq.h"
+#include "impl_zmq.h"
+
+// End to end latency and throughput of the msgq and zmq transports.
+// Every configuration prints one JSON object per line to stdout.
+//
+// usage: messaging_benchmark [latency samples] [msgq|zmq]
+
+#define MSGQ_ENDPOINT "messaging_benchmark"
+#define ZMQ_ENDPOINT "58999" // without check_endpoint zmq takes a port
+
+#define PHASE_WARMUP 0
+#define PHASE_LATENCY 1
+#define PHASE_THROUGHPUT 2
+
+struct BenchHeader {
+  uint64_t send_time;
+  uint64_t phase;
+};
+
+struct BenchConfig {
+  bool zmq;
+  size_t msg_size;
+  int num_readers;
+  bool conflate;
+};
+
+struct ReaderStats {
+  std::atomic<bool> warm{false};
+  std::vector<uint64_t> latencies;
+  uint64_t received = 0;
+  uint64_t last_rcv_time = 0;
+};
+
+static inline uint64_t nanos_since_boot() {
+  struct timespec t;
+  clock_gettime(CLOCK_BOOTTIME, &t);
+  return t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+static void sleep_us(uint64_t us) {
+  std::this_thread::sleep_for(std::chrono::microseconds(us));
+}
+
+static void reader_thread(const BenchConfig cfg, Context *ctx, ReaderStats *stats,
+                          std::atomic<int> *connected, std::atomic<bool> *exit) {
+  SubSocket *sock = cfg.zmq ? (SubSocket *)new ZMQSubSocket() : (SubSocket *)new MSGQSubSocket();
+  int r = sock->connect(ctx, cfg.zmq ? ZMQ_ENDPOINT : MSGQ_ENDPOINT, "127.0.0.1", cfg.conflate, false);
+  assert(r == 0);
+
+  Poller *poller = cfg.zmq ? (Poller *)new ZMQPoller() : (Poller *)new MSGQPoller();
+  poller->registerSocket(sock);
+  (*connected)++;
+
+  while (!*exit) {
+    for (auto s : poller->poll(10)) {
+      Message *msg = s->receive(true);
+      if (msg == NULL) continue;
+
+      uint64_t now = nanos_since_boot();
+      BenchHeader hdr;
+      memcpy(&hdr, msg->getData(), sizeof(hdr));
+
+      if (hdr.phase == PHASE_LATENCY) {
+        stats->latencies.push_back(now - hdr.send_time);
+      } else if (hdr.phase == PHASE_THROUGHPUT) {
+        stats->received++;
+        stats->last_rcv_time = now;
+      } else {
+        stats->warm = true;
+      }
+      delete msg;
+    }
+  }
+
+  delete poller;
+  delete sock;
+}
+
+static double percentile(const std::vector<uint64_t> &sorted, double p) {
+  if (sorted.empty()) return 0;
+  size_t idx = std::min(sorted.size() - 1, (size_t)(p * sorted.size()));
+  return sorted[idx] / 1000.0;
+}
+
+static void run_config(const BenchConfig &cfg, int latency_samples) {
+  Context *ctx = cfg.zmq ? (Context *)new ZMQContext() : (Context *)new MSGQContext();
+  PubSocket *pub = cfg.zmq ? (PubSocket *)new ZMQPubSocket() : (PubSocket *)new MSGQPubSocket();
+  int r = pub->connect(ctx, cfg.zmq ? ZMQ_ENDPOINT : MSGQ_ENDPOINT, false);
+  assert(r == 0);
+
+  std::atomic<int> connected(0);
+  std::atomic<bool> exit(false);
+  std::vector<ReaderStats> stats(cfg.num_readers);
+  std::vector<std::thread> readers;
+  for (int i = 0; i < cfg.num_readers; i++) {
+    stats[i].latencies.reserve(latency_samples);
+    readers.emplace_back(reader_thread, cfg, ctx, &stats[i], &connected, &exit);
+  }
+  while (connected < cfg.num_readers) sleep_us(1000);
+
+  std::vector<char> payload(cfg.msg_size, 0);
+  BenchHeader *hdr = (BenchHeader *)payload.data();
+
+  // Wait until every subscriber receives, zmq drops everything sent before the connection is up
+  hdr->phase = PHASE_WARMUP;
+  for (int i = 0; i < 500; i++) {
+    hdr->send_time = nanos_since_boot();
+    pub->send(payload.data(), payload.size());
+    sleep_us(10 * 1000);
+    if (std::all_of(stats.begin(), stats.end(), [](const ReaderStats &s) { return s.warm.load(); })) break;
+  }
+
+  // Latency, paced so every message is consumed before the next one is sent
+  hdr->phase = PHASE_LATENCY;
+  for (int i = 0; i < latency_samples; i++) {
+    hdr->send_time = nanos_since_boot();
+    pub->send(payload.data(), payload.size());
+    sleep_us(1000);
+  }
+  sleep_us(50 * 1000);
+
+  // Throughput, back to back sends of ~64 MiB
+  int num_msgs = std::max((size_t)100, (64 * 1024 * 1024) / cfg.msg_size);
+  hdr->phase = PHASE_THROUGHPUT;
+  uint64_t start_time = nanos_since_boot();
+  for (int i = 0; i < num_msgs; i++) {
+    hdr->send_time = nanos_since_boot();
+    pub->send(payload.data(), payload.size());
+  }
+  sleep_us(200 * 1000);
+
+  exit = true;
+  for (auto &t : readers) t.join();
+
+  std::vector<uint64_t> latencies;
+  uint64_t received = 0, end_time = start_time;
+  for (auto &s : stats) {
+    latencies.insert(latencies.end(), s.latencies.begin(), s.latencies.end());
+    received += s.received;
+    end_time = std::max(end_time, s.last_rcv_time);
+  }
+  std::sort(latencies.begin(), latencies.end());
+
+  double seconds = std::max(end_time - start_time, (uint64_t)1) * 1e-9;
+  double msgs_per_sec = received / seconds / cfg.num_readers;
+
+  printf("{\"transport\": \"%s\", \"size\": %zu, \"readers\": %d, \"conflate\": %s, "
+         "\"latency_samples\": %zu, \"p50_us\": %.2f, \"p99_us\": %.2f, \"p999_us\": %.2f, "
+         "\"throughput_msgs_per_sec\": %.1f, \"throughput_mb_per_sec\": %.2f, \"delivered\": %.4f}\n",
+         cfg.zmq ? "zmq" : "msgq", cfg.msg_size, cfg.num_readers, cfg.conflate ? "true" : "false",
+         latencies.size(), percentile(latencies, 0.5), percentile(latencies, 0.99), percentile(latencies, 0.999),
+         msgs_per_sec, msgs_per_sec * cfg.msg_size / (1024.0 * 1024.0),
+         (double)received / ((uint64_t)num_msgs * cfg.num_readers));
+  fflush(stdout);
+
+  delete pub;
+  delete ctx;
+}
+
+int main(int argc, char *argv[]) {
+  int latency_samples = argc > 1 ? atoi(argv[1]) : 1000;
+  std::string only = argc > 2 ? argv[2] : "";
+
+  const size_t sizes[] = {64, 1024, 16 * 1024, 256 * 1024, 1024 * 1024};
+  const int reader_counts[] = {1, 2, NUM_READERS / 2, NUM_READERS};
+
+  for (bool zmq : {false, true}) {
+    if (!only.empty() && only != (zmq ? "zmq" : "msgq")) continue;
+
+    for (size_t size : sizes) {
+      for (int num_readers : reader_counts) {
+        for (bool conflate : {false, true}) {
+          run_config({zmq, size, num_readers, conflate}, latency_samples);
+        }
+      }
+    }
+  }
+  return 0;
+}
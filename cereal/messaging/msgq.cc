@@ -7,7 +7,7 @@
 #include <chrono>
 #include <algorithm>
 #include <cstdlib>
-#include <csignal>
+#include <climits>
 #include <random>
 
 #include <poll.h>
@@ -19,12 +19,78 @@
 #include <fcntl.h>
 #include <unistd.h>
 
+#ifdef __linux__
+#include <linux/futex.h>
+#endif
+
 #include <stdio.h>
 
 #include "msgq.h"
 
-void sigusr2_handler(int signal) {
-  assert(signal == SIGUSR2);
+// Readers block on a futex word indexed by their thread id. The file is sparse,
+// only the pages of thread ids that actually poll use memory.
+#define MSGQ_WAKE_PATH "/dev/shm/msgq_wake"
+#define MSGQ_WAKE_SLOTS (1 << 22) // PID_MAX_LIMIT on 64 bit
+#define MSGQ_WAKE_WAITING (1U << 31)
+
+static uint32_t msgq_gettid(void){
+  #ifdef __APPLE__
+    return getpid();
+  #else
+    return syscall(SYS_gettid);
+  #endif
+}
+
+static std::atomic<uint32_t> *msgq_wake_words(void){
+  static std::atomic<uint32_t> *words = [](){
+    std::atomic<uint32_t> *r = NULL;
+    size_t size = MSGQ_WAKE_SLOTS * sizeof(uint32_t);
+
+    int fd = open(MSGQ_WAKE_PATH, O_RDWR | O_CREAT, 0777);
+    if (fd < 0){
+      std::cout << "Warning, could not open: " << MSGQ_WAKE_PATH << std::endl;
+      return r;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && (st.st_size >= (off_t)size || ftruncate(fd, size) == 0)){
+      void * mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+      if (mem != MAP_FAILED){
+        r = reinterpret_cast<std::atomic<uint32_t>*>(mem);
+      }
+    }
+    close(fd);
+    return r;
+  }();
+  return words;
+}
+
+static void msgq_wake_wait(std::atomic<uint32_t> *w, uint32_t val, int64_t ns){
+  #ifdef __linux__
+    struct timespec ts = {(time_t)(ns / 1000000000), (long)(ns % 1000000000)};
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(w), FUTEX_WAIT, val, &ts, NULL, 0);
+  #else
+    // No futex, fall back to polling
+    struct timespec ts = {0, (long)std::min<int64_t>(ns, 1000 * 1000)};
+    nanosleep(&ts, NULL);
+  #endif
+}
+
+static void thread_wake(uint32_t tid){
+  std::atomic<uint32_t> *w = &msgq_wake_words()[tid % MSGQ_WAKE_SLOTS];
+
+  // Bump the sequence number and clear the waiting flag in one go
+  uint32_t old = *w;
+  while (!w->compare_exchange_weak(old, (old + 1) & ~MSGQ_WAKE_WAITING)){
+    ;
+  }
+
+  // Only enter the kernel if the thread is blocked in msgq_poll
+  #ifdef __linux__
+    if (old & MSGQ_WAKE_WAITING){
+      syscall(SYS_futex, reinterpret_cast<uint32_t*>(w), FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+    }
+  #endif
 }
 
 uint64_t msgq_get_uid(void){
@@ -82,9 +148,12 @@ void msgq_wait_for_subscriber(msgq_queue_t *q){
 }
 
 
-int msgq_new_queue(msgq_queue_t * q, const char * path, size_t size){
+int msgq_new_queue(msgq_queue_t * q, const char * path, size_t size, size_t max_readers){
   assert(size < 0xFFFFFFFF); // Buffer must be smaller than 2^32 bytes
-  std::signal(SIGUSR2, sigusr2_handler);
+
+  if (msgq_wake_words() == NULL){
+    return -1;
+  }
 
   const char * prefix = "/dev/shm/";
   char * full_path = new char[strlen(path) + strlen(prefix) + 1];
@@ -116,21 +185,30 @@ int msgq_new_queue(msgq_queue_t * q, const char * path, size_t size){
 
   // Setup pointers to header segment
   q->num_readers = reinterpret_cast<std::atomic<uint64_t>*>(&header->num_readers);
+  q->max_readers = reinterpret_cast<std::atomic<uint64_t>*>(&header->max_readers);
   q->write_pointer = reinterpret_cast<std::atomic<uint64_t>*>(&header->write_pointer);
   q->write_uid = reinterpret_cast<std::atomic<uint64_t>*>(&header->write_uid);
 
-  for (size_t i = 0; i < NUM_READERS; i++){
+  for (size_t i = 0; i < MAX_NUM_READERS; i++){
     q->read_pointers[i] = reinterpret_cast<std::atomic<uint64_t>*>(&header->read_pointers[i]);
     q->read_valids[i] = reinterpret_cast<std::atomic<uint64_t>*>(&header->read_valids[i]);
     q->read_uids[i] = reinterpret_cast<std::atomic<uint64_t>*>(&header->read_uids[i]);
+    q->read_tids[i] = reinterpret_cast<std::atomic<uint64_t>*>(&header->read_tids[i]);
   }
 
   q->data = mem + sizeof(msgq_header_t);
   q->size = size;
   q->reader_id = -1;
 
+  // The first process to open a fresh queue sets the reader capacity, a new publisher resets it
+  q->max_readers_local = std::min(std::max(max_readers, (size_t)1), (size_t)MAX_NUM_READERS);
+  uint64_t no_readers = 0;
+  std::atomic_compare_exchange_strong(q->max_readers, &no_readers, q->max_readers_local);
+
   q->endpoint = path;
   q->read_conflate = false;
+  q->borrowed = false;
+  q->borrow_read_pointer = 0;
 
   return 0;
 }
@@ -148,8 +226,9 @@ void msgq_init_publisher(msgq_queue_t * q) {
 
   *q->write_uid = uid;
   *q->num_readers = 0;
+  *q->max_readers = q->max_readers_local;
 
-  for (size_t i = 0; i < NUM_READERS; i++){
+  for (size_t i = 0; i < MAX_NUM_READERS; i++){
     *q->read_valids[i] = false;
     *q->read_uids[i] = 0;
   }
@@ -157,15 +236,6 @@ void msgq_init_publisher(msgq_queue_t * q) {
   q->write_uid_local = uid;
 }
 
-static void thread_signal(uint32_t tid) {
-  #ifndef SYS_tkill
-    // TODO: this won't work for multithreaded programs
-    kill(tid, SIGUSR2);
-  #else
-    syscall(SYS_tkill, tid, SIGUSR2);
-  #endif
-}
-
 void msgq_init_subscriber(msgq_queue_t * q) {
   assert(q != NULL);
   assert(q->num_readers != NULL);
@@ -176,20 +246,20 @@ void msgq_init_subscriber(msgq_queue_t * q) {
   while (true){
     uint64_t cur_num_readers = *q->num_readers;
     uint64_t new_num_readers = cur_num_readers + 1;
+    uint64_t max_readers = std::min<uint64_t>(*q->max_readers, MAX_NUM_READERS);
 
     // No more slots available. Reset all subscribers to kick out inactive ones
-    if (new_num_readers > NUM_READERS){
+    if (new_num_readers > max_readers){
       std::cout << "Warning, evicting all subscribers!" << std::endl;
       *q->num_readers = 0;
 
-      for (size_t i = 0; i < NUM_READERS; i++){
+      for (size_t i = 0; i < MAX_NUM_READERS; i++){
         *q->read_valids[i] = false;
 
-        uint64_t old_uid = *q->read_uids[i];
         *q->read_uids[i] = 0;
 
         // Wake up reader in case they are in a poll
-        thread_signal(old_uid & 0xFFFFFFFF);
+        thread_wake(*q->read_tids[i]);
       }
 
       continue;
@@ -207,6 +277,7 @@ void msgq_init_subscriber(msgq_queue_t * q) {
       // on the first read the read pointer will be synchronized with the write pointer
       *q->read_valids[cur_num_readers] = false;
       *q->read_pointers[cur_num_readers] = 0;
+      *q->read_tids[cur_num_readers] = uid & 0xFFFFFFFF;
       *q->read_uids[cur_num_readers] = uid;
       break;
     }
@@ -216,30 +287,19 @@ void msgq_init_subscriber(msgq_queue_t * q) {
   msgq_reset_reader(q);
 }
 
-int msgq_msg_send(msgq_msg_t * msg, msgq_queue_t *q){
-  // Die if we are no longer the active publisher
-  if (q->write_uid_local != *q->write_uid){
-    std::cout << "Killing old publisher: " << q->endpoint << std::endl;
-    errno = EADDRINUSE;
-    return -1;
-  }
-
+// Copies one message into the ring at the local write pointer, without publishing it to readers
+static void msgq_msg_write(msgq_msg_t * msg, msgq_queue_t *q, uint64_t num_readers, uint32_t *write_cycles, uint32_t *write_pointer){
   uint64_t total_msg_size = ALIGN(msg->size + sizeof(int64_t));
 
   // We need to fit at least three messages in the queue,
   // then we can always safely access the last message
   assert(3 * total_msg_size <= q->size);
 
-  uint64_t num_readers = *q->num_readers;
-
-  uint32_t write_cycles, write_pointer;
-  UNPACK64(write_cycles, write_pointer, *q->write_pointer);
-
-  char *p = q->data + write_pointer; // add base offset
+  char *p = q->data + *write_pointer; // add base offset
 
   // Check remaining space
   // Always leave space for a wraparound tag for the next message, including alignment
-  int64_t remaining_space = q->size - write_pointer - total_msg_size - sizeof(int64_t);
+  int64_t remaining_space = q->size - *write_pointer - total_msg_size - sizeof(int64_t);
   if (remaining_space <= 0){
     // Write -1 size tag indicating wraparound
     *(int64_t*)p = -1;
@@ -251,29 +311,29 @@ int msgq_msg_send(msgq_msg_t * msg, msgq_queue_t *q){
       uint64_t read_cycles = read_pointer >> 32;
       read_pointer &= 0xFFFFFFFF;
 
-      if ((read_pointer > write_pointer) && (read_cycles != write_cycles)) {
+      if ((read_pointer > *write_pointer) && (read_cycles != *write_cycles)) {
         *q->read_valids[i] = false;
       }
     }
 
     // Update global and local copies of write pointer and write_cycles
-    write_pointer = 0;
-    write_cycles = write_cycles + 1;
-    PACK64(*q->write_pointer, write_cycles, write_pointer);
+    *write_pointer = 0;
+    *write_cycles = *write_cycles + 1;
+    PACK64(*q->write_pointer, *write_cycles, *write_pointer);
 
     // Set actual pointer to the beginning of the data segment
     p = q->data;
   }
 
   // Invalidate readers that are in the area that will be written
-  uint64_t start = write_pointer;
+  uint64_t start = *write_pointer;
   uint64_t end = ALIGN(start + sizeof(int64_t) + msg->size);
 
   for (uint64_t i = 0; i < num_readers; i++){
     uint32_t read_cycles, read_pointer;
     UNPACK64(read_cycles, read_pointer, *q->read_pointers[i]);
 
-    if ((read_pointer >= start) && (read_pointer < end) && (read_cycles != write_cycles)) {
+    if ((read_pointer >= start) && (read_pointer < end) && (read_cycles != *write_cycles)) {
       *q->read_valids[i] = false;
     }
   }
@@ -285,19 +345,66 @@ int msgq_msg_send(msgq_msg_t * msg, msgq_queue_t *q){
 
   // Copy data
   memcpy(p + sizeof(int64_t), msg->data, msg->size);
+
+  *write_pointer = ALIGN(*write_pointer + msg->size + sizeof(int64_t));
+}
+
+int msgq_msg_send(msgq_msg_t * msg, msgq_queue_t *q){
+  return (msgq_msg_send_batch(msg, 1, q) < 0) ? -1 : msg->size;
+}
+
+// Makes everything up to the local write pointer visible and wakes every reader once
+static void msgq_publish(msgq_queue_t *q, uint64_t num_readers, uint32_t write_cycles, uint32_t write_pointer){
   __sync_synchronize();
 
   // Update write pointer
-  uint32_t new_ptr = ALIGN(write_pointer + msg->size + sizeof(int64_t));
-  PACK64(*q->write_pointer, write_cycles, new_ptr);
+  PACK64(*q->write_pointer, write_cycles, write_pointer);
 
   // Notify readers
   for (uint64_t i = 0; i < num_readers; i++){
-    uint64_t reader_uid = *q->read_uids[i];
-    thread_signal(reader_uid & 0xFFFFFFFF);
+    thread_wake(*q->read_tids[i]);
   }
+}
 
-  return msg->size;
+// Writes all messages into the ring, then makes them visible with a single
+// write pointer update and wakes every reader once. A batch larger than the
+// ring would overwrite its own unpublished start, so it is published in
+// pieces that each fit in one lap. Returns the number of messages sent.
+int msgq_msg_send_batch(msgq_msg_t * msgs, size_t nmsgs, msgq_queue_t *q){
+  // Die if we are no longer the active publisher
+  if (q->write_uid_local != *q->write_uid){
+    std::cout << "Killing old publisher: " << q->endpoint << std::endl;
+    errno = EADDRINUSE;
+    return -1;
+  }
+
+  if (nmsgs == 0){
+    return 0;
+  }
+
+  uint64_t num_readers = *q->num_readers;
+
+  uint32_t write_cycles, write_pointer;
+  UNPACK64(write_cycles, write_pointer, *q->write_pointer);
+  uint32_t start_cycles = write_cycles, start_pointer = write_pointer;
+
+  for (size_t i = 0; i < nmsgs; i++){
+    // Bytes written since the last publish, including wraparound slack
+    uint64_t pending = (uint64_t)(write_cycles - start_cycles) * q->size + write_pointer - start_pointer;
+
+    // Worst case this message costs its own size plus a wraparound at the end of the ring
+    uint64_t total_msg_size = ALIGN(msgs[i].size + sizeof(int64_t));
+    if (pending > 0 && pending + 2 * total_msg_size + sizeof(int64_t) > q->size){
+      msgq_publish(q, num_readers, write_cycles, write_pointer);
+      start_cycles = write_cycles;
+      start_pointer = write_pointer;
+    }
+
+    msgq_msg_write(&msgs[i], q, num_readers, &write_cycles, &write_pointer);
+  }
+
+  msgq_publish(q, num_readers, write_cycles, write_pointer);
+  return nmsgs;
 }
 
 
@@ -415,41 +522,154 @@ int msgq_msg_recv(msgq_msg_t * msg, msgq_queue_t * q){
 }
 
 
+// Zero copy variant of msgq_msg_recv. msg->data points directly into the shared segment
+// and stays 8 byte aligned, so it can be handed to a capnp reader as is. The read pointer
+// is left on the borrowed message, this makes the publisher invalidate us when it
+// overwrites the data. Every borrow has to be followed by msgq_msg_release before the
+// next borrow, recv or poll on this queue. Never call msgq_msg_close on a borrowed message.
+int msgq_msg_borrow(msgq_msg_t * msg, msgq_queue_t * q){
+  assert(!q->borrowed);
 
-int msgq_poll(msgq_pollitem_t * items, size_t nitems, int timeout){
-  int num = 0;
+ start:
+  int id = q->reader_id;
+  assert(id >= 0); // Make sure subscriber is initialized
 
-  // Check if messages ready
-  for (size_t i = 0; i < nitems; i++) {
-    items[i].revents = msgq_msg_ready(items[i].q);
-    if (items[i].revents) num++;
+  if (q->read_uid_local != *q->read_uids[id]){
+    std::cout << q->endpoint << ": Reader was evicted, reconnecting" << std::endl;
+    msgq_init_subscriber(q);
+    goto start;
+  }
+
+  // Check valid
+  if (!*q->read_valids[id]){
+    msgq_reset_reader(q);
+    goto start;
+  }
+
+  uint32_t read_cycles, read_pointer;
+  UNPACK64(read_cycles, read_pointer, *q->read_pointers[id]);
+
+  uint32_t write_cycles, write_pointer;
+  UNPACK64(write_cycles, write_pointer, *q->write_pointer);
+
+  char * p = q->data + read_pointer;
+
+  // Check if new message is available
+  if (read_pointer == write_pointer) {
+    msg->size = 0;
+    msg->data = NULL;
+    return 0;
+  }
+
+  // Read potential message size
+  std::atomic<int64_t> *size_p = reinterpret_cast<std::atomic<int64_t>*>(p);
+  std::int64_t size = *size_p;
+
+  // Check if the size that was read is valid
+  if (!*q->read_valids[id]){
+    msgq_reset_reader(q);
+    goto start;
+  }
+
+  // If size is -1 the buffer was full, and we need to wrap around
+  if (size == -1){
+    read_cycles++;
+    PACK64(*q->read_pointers[id], read_cycles, 0);
+    goto start;
+  }
+
+  assert((uint64_t)size < q->size);
+  assert(size > 0);
+
+  uint32_t new_read_pointer = ALIGN(read_pointer + sizeof(std::int64_t) + size);
+
+  // If conflate is true, check if this is the latest message, else start over
+  if (q->read_conflate){
+    if (new_read_pointer != write_pointer){
+      // Update read pointer
+      PACK64(*q->read_pointers[id], read_cycles, new_read_pointer);
+      goto start;
+    }
+  }
+
+  __sync_synchronize();
+  msg->data = p + sizeof(int64_t);
+  msg->size = size;
+
+  q->borrowed = true;
+  PACK64(q->borrow_read_pointer, read_cycles, new_read_pointer);
+
+  return msg->size;
+}
+
+// Hands a borrowed message back to the queue and advances the read pointer.
+// Returns false if the publisher overwrote the data while it was borrowed,
+// in that case everything read from it must be discarded.
+bool msgq_msg_release(msgq_msg_t * msg, msgq_queue_t * q){
+  assert(q->borrowed);
+  int id = q->reader_id;
+
+  __sync_synchronize();
+  q->borrowed = false;
+  msg->size = 0;
+  msg->data = NULL;
+
+  // The writer invalidates us before touching the data, so checking after the
+  // consumer is done covers every write that happened during the borrow.
+  // An evicted or invalidated reader is reset on the next recv.
+  if (q->read_uid_local != *q->read_uids[id] || !*q->read_valids[id]){
+    return false;
   }
 
-  int ms = (timeout == -1) ? 100 : timeout;
-  struct timespec ts;
-  ts.tv_sec = ms / 1000;
-  ts.tv_nsec = (ms % 1000) * 1000 * 1000;
+  *q->read_pointers[id] = q->borrow_read_pointer;
+  return true;
+}
+
+
+
+int msgq_poll(msgq_pollitem_t * items, size_t nitems, int timeout){
+  uint32_t tid = msgq_gettid();
+  std::atomic<uint32_t> *w = &msgq_wake_words()[tid % MSGQ_WAKE_SLOTS];
 
+  // Publishers wake the thread stored in the reader slot, make sure that is us
+  for (size_t i = 0; i < nitems; i++) {
+    msgq_queue_t *q = items[i].q;
+    if (q->reader_id >= 0 && *q->read_tids[q->reader_id] != tid){
+      *q->read_tids[q->reader_id] = tid;
+    }
+  }
 
-  while (num == 0) {
-    int ret;
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout);
+  int num = 0;
 
-    ret = nanosleep(&ts, &ts);
+  while (true) {
+    // Announce we are about to block before checking the queues. A publisher that
+    // advances after this point either changes the futex word or is seen below.
+    uint32_t seq = w->fetch_or(MSGQ_WAKE_WAITING) | MSGQ_WAKE_WAITING;
 
     // Check if messages ready
     for (size_t i = 0; i < nitems; i++) {
-      if (items[i].revents == 0 && msgq_msg_ready(items[i].q)){
-        num += 1;
-        items[i].revents = 1;
-      }
+      items[i].revents = msgq_msg_ready(items[i].q);
+      if (items[i].revents) num++;
     }
 
-    // exit if we had a timeout and the sleep finished
-    if (timeout != -1 && ret == 0){
+    if (num > 0){
       break;
     }
+
+    // Blocking polls still recheck every 100 ms
+    int64_t ns = 100 * 1000 * 1000;
+    if (timeout != -1){
+      ns = std::min(ns, (int64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(deadline - std::chrono::steady_clock::now()).count());
+      if (ns <= 0){
+        break;
+      }
+    }
+
+    msgq_wake_wait(w, seq, ns);
   }
 
+  *w &= ~MSGQ_WAKE_WAITING;
   return num;
 }
 
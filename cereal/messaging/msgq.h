@@ -5,7 +5,8 @@
 #include <atomic>
 
 #define DEFAULT_SEGMENT_SIZE (10 * 1024 * 1024)
-#define NUM_READERS 10
+#define NUM_READERS 10 // default reader capacity, per service values come from services.h
+#define MAX_NUM_READERS 32 // reader slots allocated in the header
 #define ALIGN(n) ((n + (8 - 1)) & -8)
 
 #define UNPACK64(higher, lower, input) do {uint64_t tmp = input; higher = tmp >> 32; lower = tmp & 0xFFFFFFFF;} while (0)
@@ -13,26 +14,35 @@
 
 struct  msgq_header_t {
   uint64_t num_readers;
+  uint64_t max_readers;
   uint64_t write_pointer;
   uint64_t write_uid;
-  uint64_t read_pointers[NUM_READERS];
-  uint64_t read_valids[NUM_READERS];
-  uint64_t read_uids[NUM_READERS];
+  uint64_t read_pointers[MAX_NUM_READERS];
+  uint64_t read_valids[MAX_NUM_READERS];
+  uint64_t read_uids[MAX_NUM_READERS];
+  uint64_t read_tids[MAX_NUM_READERS]; // thread to wake when new data arrives, set by msgq_poll
 };
 
 struct msgq_queue_t {
   std::atomic<uint64_t> *num_readers;
+  std::atomic<uint64_t> *max_readers;
   std::atomic<uint64_t> *write_pointer;
   std::atomic<uint64_t> *write_uid;
-  std::atomic<uint64_t> *read_pointers[NUM_READERS];
-  std::atomic<uint64_t> *read_valids[NUM_READERS];
-  std::atomic<uint64_t> *read_uids[NUM_READERS];
+  std::atomic<uint64_t> *read_pointers[MAX_NUM_READERS];
+  std::atomic<uint64_t> *read_valids[MAX_NUM_READERS];
+  std::atomic<uint64_t> *read_uids[MAX_NUM_READERS];
+  std::atomic<uint64_t> *read_tids[MAX_NUM_READERS];
   char * mmap_p;
   char * data;
   size_t size;
   int reader_id;
   uint64_t read_uid_local;
   uint64_t write_uid_local;
+  uint64_t max_readers_local;
+
+  // Packed read pointer past the message handed out by msgq_msg_borrow
+  bool borrowed;
+  uint64_t borrow_read_pointer;
 
   bool read_conflate;
   std::string endpoint;
@@ -55,13 +65,16 @@ int msgq_msg_init_size(msgq_msg_t *msg, size_t size);
 int msgq_msg_init_data(msgq_msg_t *msg, char * data, size_t size);
 int msgq_msg_close(msgq_msg_t *msg);
 
-int msgq_new_queue(msgq_queue_t * q, const char * path, size_t size);
+int msgq_new_queue(msgq_queue_t * q, const char * path, size_t size, size_t max_readers=NUM_READERS);
 void msgq_close_queue(msgq_queue_t *q);
 void msgq_init_publisher(msgq_queue_t * q);
 void msgq_init_subscriber(msgq_queue_t * q);
 
 int msgq_msg_send(msgq_msg_t *msg, msgq_queue_t *q);
+int msgq_msg_send_batch(msgq_msg_t *msgs, size_t nmsgs, msgq_queue_t *q);
 int msgq_msg_recv(msgq_msg_t *msg, msgq_queue_t *q);
+int msgq_msg_borrow(msgq_msg_t *msg, msgq_queue_t *q);
+bool msgq_msg_release(msgq_msg_t *msg, msgq_queue_t *q);
 int msgq_msg_ready(msgq_queue_t * q);
 int msgq_poll(msgq_pollitem_t * items, size_t nitems, int timeout);
 
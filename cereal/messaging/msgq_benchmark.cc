@@ -0,0 +1,73 @@
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#include "msgq.h"
+
+// Compares publishing 100 message bursts one at a time against msgq_msg_send_batch
+// with a subscriber draining the queue from another thread.
+
+#define BURST_SIZE 100
+#define NUM_BURSTS 2000
+#define MSG_SIZE 256
+
+static double bench_bursts(const char *endpoint, bool batch, uint64_t *ready_polls) {
+  msgq_queue_t pub, sub;
+  msgq_new_queue(&pub, endpoint, DEFAULT_SEGMENT_SIZE);
+  msgq_new_queue(&sub, endpoint, DEFAULT_SEGMENT_SIZE);
+  msgq_init_publisher(&pub);
+  msgq_init_subscriber(&sub);
+
+  std::atomic<bool> done(false);
+  std::atomic<uint64_t> polls(0);
+  std::thread reader([&]() {
+    msgq_pollitem_t item = {&sub, 0};
+    msgq_msg_t msg;
+    while (!done) {
+      if (msgq_poll(&item, 1, 10) == 0) continue;
+      polls++;
+      while (msgq_msg_recv(&msg, &sub) > 0) {
+        msgq_msg_close(&msg);
+      }
+    }
+  });
+
+  std::vector<char> payload(MSG_SIZE, 0x5a);
+  std::vector<msgq_msg_t> msgs(BURST_SIZE, msgq_msg_t{MSG_SIZE, payload.data()});
+
+  double total_us = 0;
+  for (int i = 0; i < NUM_BURSTS; i++) {
+    auto start = std::chrono::steady_clock::now();
+    if (batch) {
+      msgq_msg_send_batch(msgs.data(), msgs.size(), &pub);
+    } else {
+      for (auto &m : msgs) msgq_msg_send(&m, &pub);
+    }
+    total_us += std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+
+    // Let the reader catch up so every burst starts from an idle subscriber
+    std::this_thread::sleep_for(std::chrono::microseconds(500));
+  }
+
+  done = true;
+  reader.join();
+  *ready_polls = polls;
+
+  msgq_close_queue(&sub);
+  msgq_close_queue(&pub);
+  return total_us / NUM_BURSTS;
+}
+
+int main() {
+  uint64_t polls_single, polls_batch;
+  double single_us = bench_bursts("msgq_benchmark_single", false, &polls_single);
+  double batch_us = bench_bursts("msgq_benchmark_batch", true, &polls_batch);
+
+  printf("%d x %d byte bursts, %d bursts\n", BURST_SIZE, MSG_SIZE, NUM_BURSTS);
+  printf("send:       %8.2f us/burst, %lu polls returning ready\n", single_us, (unsigned long)polls_single);
+  printf("send_batch: %8.2f us/burst, %lu polls returning ready\n", batch_us, (unsigned long)polls_batch);
+  return 0;
+}
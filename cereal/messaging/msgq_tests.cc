@@ -0,0 +1,257 @@
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#include "catch2/catch.hpp"
+#include "msgq.h"
+
+#define MSG_SIZE 100
+
+// Message of MSG_SIZE bytes starting with its sequence number, filled with its low byte
+static void fill_msg(std::vector<char> &buf, uint32_t seq){
+  buf.assign(MSG_SIZE, (char)(seq & 0xFF));
+  memcpy(buf.data(), &seq, sizeof(seq));
+}
+
+// Sequence number of a message written by fill_msg, -1 if it is torn
+static int64_t msg_seq(const char *data, size_t size){
+  uint32_t seq;
+  if (size != MSG_SIZE) return -1;
+  memcpy(&seq, data, sizeof(seq));
+  for (size_t i = sizeof(seq); i < size; i++){
+    if (data[i] != (char)(seq & 0xFF)) return -1;
+  }
+  return seq;
+}
+
+static void send_seq(msgq_queue_t *q, uint32_t seq){
+  std::vector<char> buf;
+  fill_msg(buf, seq);
+  msgq_msg_t msg = {buf.size(), buf.data()};
+  REQUIRE(msgq_msg_send(&msg, q) == MSG_SIZE);
+}
+
+// Next message on q, -2 if there is none
+static int64_t recv_seq(msgq_queue_t *q){
+  msgq_msg_t msg;
+  if (msgq_msg_recv(&msg, q) <= 0) return -2;
+  int64_t seq = msg_seq(msg.data, msg.size);
+  msgq_msg_close(&msg);
+  return seq;
+}
+
+TEST_CASE("msgq_msg_release detects a borrowed message the publisher overwrote"){
+  // room for nine messages, ten wrap around onto the borrowed one
+  msgq_queue_t pub, sub;
+  REQUIRE(msgq_new_queue(&pub, "test_msgq_borrow", 1024) == 0);
+  REQUIRE(msgq_new_queue(&sub, "test_msgq_borrow", 1024) == 0);
+  msgq_init_publisher(&pub);
+  msgq_init_subscriber(&sub);
+
+  send_seq(&pub, 0);
+
+  msgq_msg_t msg;
+  REQUIRE(msgq_msg_borrow(&msg, &sub) == MSG_SIZE);
+  REQUIRE(msg_seq(msg.data, msg.size) == 0);
+
+  SECTION("not overwritten"){
+    send_seq(&pub, 1);
+    REQUIRE(msgq_msg_release(&msg, &sub));
+    REQUIRE(recv_seq(&sub) == 1);
+    REQUIRE(recv_seq(&sub) == -2);
+  }
+  SECTION("overwritten"){
+    for (uint32_t seq = 1; seq <= 10; seq++){
+      send_seq(&pub, seq);
+    }
+    REQUIRE(!msgq_msg_release(&msg, &sub));
+
+    // the reader starts over at the newest message instead of reading the lap it missed
+    REQUIRE(recv_seq(&sub) == -2);
+    send_seq(&pub, 11);
+    REQUIRE(recv_seq(&sub) == 11);
+  }
+
+  msgq_close_queue(&sub);
+  msgq_close_queue(&pub);
+}
+
+TEST_CASE("msgq_msg_recv skips a lap it missed instead of returning overwritten data"){
+  msgq_queue_t pub, sub;
+  REQUIRE(msgq_new_queue(&pub, "test_msgq_lapped", 1024) == 0);
+  REQUIRE(msgq_new_queue(&sub, "test_msgq_lapped", 1024) == 0);
+  msgq_init_publisher(&pub);
+  msgq_init_subscriber(&sub);
+
+  for (uint32_t seq = 0; seq < 30; seq++){
+    send_seq(&pub, seq);
+  }
+  REQUIRE(recv_seq(&sub) == -2);
+  send_seq(&pub, 30);
+  REQUIRE(recv_seq(&sub) == 30);
+
+  msgq_close_queue(&sub);
+  msgq_close_queue(&pub);
+}
+
+// Readers block in msgq_poll on their own thread, the publisher sends one message
+// per round once all of them are waiting. Returns the slowest wake up in ms.
+static double max_poll_wake_ms(const char *endpoint, int num_readers, int rounds){
+  msgq_queue_t pub;
+  REQUIRE(msgq_new_queue(&pub, endpoint, 1024 * 1024) == 0);
+  msgq_init_publisher(&pub);
+
+  std::atomic<int> waiting(0);
+  std::atomic<int64_t> sent_ns(0);
+  std::atomic<int64_t> max_wake_ns(0);
+  std::atomic<int> failures(0);
+
+  std::vector<std::thread> readers;
+  for (int i = 0; i < num_readers; i++){
+    readers.emplace_back([&](){
+      msgq_queue_t sub;
+      if (msgq_new_queue(&sub, endpoint, 1024 * 1024) != 0){
+        failures++;
+        return;
+      }
+      msgq_init_subscriber(&sub);
+      msgq_pollitem_t item = {&sub, 0};
+
+      for (int round = 0; round < rounds; round++){
+        waiting++;
+        int num = msgq_poll(&item, 1, 1000);
+        int64_t now = std::chrono::steady_clock::now().time_since_epoch().count();
+
+        if (num != 1 || recv_seq(&sub) != round){
+          failures++;
+          break;
+        }
+        int64_t wake = now - sent_ns;
+        int64_t prev = max_wake_ns;
+        while (wake > prev && !max_wake_ns.compare_exchange_weak(prev, wake)){
+          ;
+        }
+      }
+      msgq_close_queue(&sub);
+    });
+  }
+
+  for (int round = 0; round < rounds; round++){
+    while (waiting < num_readers * (round + 1) && failures == 0){
+      std::this_thread::yield();
+    }
+    // let them get past the ready check and into the futex wait
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+
+    std::vector<char> buf;
+    fill_msg(buf, round);
+    msgq_msg_t msg = {buf.size(), buf.data()};
+    sent_ns = std::chrono::steady_clock::now().time_since_epoch().count();
+    msgq_msg_send(&msg, &pub);
+  }
+
+  for (auto &t : readers) t.join();
+  msgq_close_queue(&pub);
+
+  REQUIRE(failures == 0);
+  return std::chrono::duration<double, std::milli>(std::chrono::nanoseconds(max_wake_ns)).count();
+}
+
+TEST_CASE("msgq_poll wakes blocked readers when a message is sent"){
+  // a missed wake up would only be noticed by the 100 ms recheck
+  SECTION("one reader"){
+    REQUIRE(max_poll_wake_ms("test_msgq_poll_1", 1, 5) < 50);
+  }
+  SECTION("several readers"){
+    REQUIRE(max_poll_wake_ms("test_msgq_poll_4", 4, 5) < 50);
+  }
+}
+
+TEST_CASE("msgq_msg_send_batch sends batches larger than the ring"){
+  const size_t ring_size = 4096;
+  const uint32_t batch_size = 200; // 112 bytes each in the ring, more than five laps
+
+  msgq_queue_t pub, sub;
+  REQUIRE(msgq_new_queue(&pub, "test_msgq_batch", ring_size) == 0);
+  REQUIRE(msgq_new_queue(&sub, "test_msgq_batch", ring_size) == 0);
+  msgq_init_publisher(&pub);
+  msgq_init_subscriber(&sub);
+
+  std::vector<std::vector<char>> bufs(batch_size);
+  std::vector<msgq_msg_t> msgs(batch_size);
+  auto fill_batch = [&](uint32_t first_seq, uint32_t n){
+    for (uint32_t i = 0; i < n; i++){
+      fill_msg(bufs[i], first_seq + i);
+      msgs[i] = {bufs[i].size(), bufs[i].data()};
+    }
+  };
+
+  SECTION("a batch that fits is delivered in order across the wrap around"){
+    // start halfway through the ring so the batch wraps
+    for (uint32_t seq = 0; seq < 18; seq++){
+      send_seq(&pub, seq);
+      REQUIRE(recv_seq(&sub) == seq);
+    }
+    fill_batch(18, 30);
+    REQUIRE(msgq_msg_send_batch(msgs.data(), 30, &pub) == 30);
+    for (uint32_t seq = 18; seq < 48; seq++){
+      REQUIRE(recv_seq(&sub) == seq);
+    }
+    REQUIRE(recv_seq(&sub) == -2);
+  }
+  SECTION("a reader that doesn't keep up is reset, not handed a torn lap"){
+    fill_batch(0, batch_size);
+    REQUIRE(msgq_msg_send_batch(msgs.data(), batch_size, &pub) == (int)batch_size);
+    REQUIRE(recv_seq(&sub) == -2);
+
+    send_seq(&pub, batch_size);
+    REQUIRE(recv_seq(&sub) == batch_size);
+  }
+  SECTION("a concurrent reader only sees whole messages, in order"){
+    std::atomic<bool> done(false);
+    std::vector<int64_t> received;
+    std::thread reader([&](){
+      msgq_pollitem_t item = {&sub, 0};
+      while (true){
+        if (msgq_poll(&item, 1, 10) == 0){
+          if (done) break;
+          continue;
+        }
+        int64_t seq;
+        while ((seq = recv_seq(&sub)) != -2){
+          received.push_back(seq);
+        }
+      }
+    });
+
+    const uint32_t num_batches = 20;
+    for (uint32_t b = 0; b < num_batches; b++){
+      fill_batch(b * batch_size, batch_size);
+      REQUIRE(msgq_msg_send_batch(msgs.data(), batch_size, &pub) == (int)batch_size);
+    }
+    // once the reader is idle again a batch that fits reaches it whole
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    const uint32_t last_seq = num_batches * batch_size;
+    fill_batch(last_seq, 10);
+    REQUIRE(msgq_msg_send_batch(msgs.data(), 10, &pub) == 10);
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    done = true;
+    reader.join();
+
+    bool in_order = true;
+    for (size_t i = 0; i < received.size(); i++){
+      in_order = in_order && received[i] >= 0 && (i == 0 || received[i] > received[i - 1]);
+    }
+    REQUIRE(in_order);
+    REQUIRE(received.size() >= 10);
+    for (uint32_t i = 0; i < 10; i++){
+      REQUIRE(received[received.size() - 10 + i] == last_seq + i);
+    }
+  }
+
+  msgq_close_queue(&sub);
+  msgq_close_queue(&pub);
+}
@@ -3,9 +3,11 @@
 #include <stdlib.h>
 #include <string>
 #include <mutex>
+#include <algorithm>
 
 #include "services.h"
 #include "messaging.h"
+#include "msgq.h"
 
 const bool SIMULATION = (getenv("SIMULATION") != nullptr) && (std::string(getenv("SIMULATION")) == "1");
 
@@ -52,6 +54,7 @@ struct SubMaster::SubMessage {
   uint64_t rcv_time = 0, rcv_frame = 0;
   void *allocated_msg_reader = nullptr;
   capnp::FlatArrayMessageReader *msg_reader = nullptr;
+  Message *msg = nullptr;  // backs msg_reader when the received data is already word aligned
   AlignedBuffer aligned_buf;
   cereal::Event::Reader event;
 };
@@ -92,10 +95,22 @@ void SubMaster::update(int timeout) {
     SubMessage *m = messages_.at(s);
 
     m->msg_reader->~FlatArrayMessageReader();
+    delete m->msg;
+    m->msg = nullptr;
+
+    // Messages are received into a fresh heap buffer, only copy into aligned_buf if that isn't word aligned
+    kj::ArrayPtr<const capnp::word> words;
+    if (((uintptr_t)msg->getData() % sizeof(capnp::word)) == 0 && (msg->getSize() % sizeof(capnp::word)) == 0) {
+      words = kj::ArrayPtr<const capnp::word>((const capnp::word *)msg->getData(), msg->getSize() / sizeof(capnp::word));
+      m->msg = msg;
+    } else {
+      words = m->aligned_buf.align(msg);
+      delete msg;
+    }
+
     capnp::ReaderOptions options;
     options.traversalLimitInWords = kj::maxValue; // Don't limit
-    m->msg_reader = new (m->allocated_msg_reader) capnp::FlatArrayMessageReader(m->aligned_buf.align(msg), options);
-    delete msg;
+    m->msg_reader = new (m->allocated_msg_reader) capnp::FlatArrayMessageReader(words, options);
     messages.push_back({m->name, m->msg_reader->getRoot<cereal::Event>()});
   }
 
@@ -181,6 +196,174 @@ SubMaster::~SubMaster() {
     SubMessage *m = kv.second;
     m->msg_reader->~FlatArrayMessageReader();
     free(m->allocated_msg_reader);
+    delete m->msg;
+    delete m->socket;
+    delete m;
+  }
+}
+
+struct IndexedSubMaster::SubMessage {
+  int id = 0;
+  SubSocket *socket = nullptr;
+  int freq = 0;
+  bool alive = false, valid = true, ignore_alive = false;
+  uint64_t rcv_time = 0, rcv_frame = 0;
+  // Double buffered, a message that turns out to be overwritten while copying leaves the current event intact
+  kj::Array<capnp::word> buf[2];
+  int cur_buf = 0;
+  alignas(capnp::FlatArrayMessageReader) char reader_storage[sizeof(capnp::FlatArrayMessageReader)];
+  capnp::FlatArrayMessageReader *msg_reader = nullptr;
+  cereal::Event::Reader event;
+};
+
+IndexedSubMaster::IndexedSubMaster(const std::vector<ServiceId> &service_list, const char *address,
+                                   const std::vector<ServiceId> &ignore_alive)
+    : messages_(NUM_SERVICES, nullptr), updated_((NUM_SERVICES + 63) / 64, 0) {
+  if (messaging_use_zmq()) {
+    poller_ = Poller::create();
+  } else {
+    polls_ = new msgq_pollitem_t[service_list.size()];
+  }
+
+  for (auto id : service_list) {
+    int i = static_cast<int>(id);
+    assert(i >= 0 && i < NUM_SERVICES && messages_[i] == nullptr);
+
+    SubSocket *socket = SubSocket::create(message_context.context(), services[i].name, address ? address : "127.0.0.1", true);
+    assert(socket != 0);
+
+    SubMessage *m = new SubMessage;
+    m->id = i;
+    m->socket = socket;
+    m->freq = services[i].frequency;
+    m->ignore_alive = std::find(ignore_alive.begin(), ignore_alive.end(), id) != ignore_alive.end();
+    m->buf[0] = kj::heapArray<capnp::word>(1024);
+    m->buf[1] = kj::heapArray<capnp::word>(1024);
+    m->msg_reader = new (m->reader_storage) capnp::FlatArrayMessageReader({});
+
+    if (poller_) {
+      poller_->registerSocket(socket);
+      sockets_[socket] = m;
+    } else {
+      polls_[subscribed_.size()].q = (msgq_queue_t *)socket->getRawSocket();
+    }
+    messages_[i] = m;
+    subscribed_.push_back(m);
+  }
+}
+
+// Copies the latest message into the spare buffer and returns its size in words, 0 if there was none.
+// The data is borrowed straight from the queue, so no Message is allocated and it is only copied once.
+size_t IndexedSubMaster::receive_msgq(SubMessage *m) {
+  msgq_queue_t *q = (msgq_queue_t *)m->socket->getRawSocket();
+  msgq_msg_t msg;
+  if (msgq_msg_borrow(&msg, q) <= 0) return 0;
+
+  size_t words = (msg.size + sizeof(capnp::word) - 1) / sizeof(capnp::word);
+  kj::Array<capnp::word> &buf = m->buf[!m->cur_buf];
+  if (buf.size() < words) {
+    buf = kj::heapArray<capnp::word>(std::max(words, 2 * buf.size()));
+  }
+  memcpy(buf.begin(), msg.data, msg.size);
+
+  // The publisher overwrote the data while we were copying, keep the previous event
+  if (!msgq_msg_release(&msg, q)) return 0;
+
+  m->cur_buf = !m->cur_buf;
+  return words;
+}
+
+void IndexedSubMaster::set_updated(SubMessage *m, size_t words, uint64_t current_time) {
+  m->msg_reader->~FlatArrayMessageReader();
+  capnp::ReaderOptions options;
+  options.traversalLimitInWords = kj::maxValue; // Don't limit
+  m->msg_reader = new (m->reader_storage) capnp::FlatArrayMessageReader(m->buf[m->cur_buf].slice(0, words), options);
+
+  updated_[m->id / 64] |= 1ULL << (m->id % 64);
+
+  m->event = m->msg_reader->getRoot<cereal::Event>();
+  m->rcv_time = current_time;
+  m->rcv_frame = frame;
+  m->valid = m->event.getValid();
+  if (SIMULATION) m->alive = true;
+}
+
+void IndexedSubMaster::update(int timeout) {
+  std::fill(updated_.begin(), updated_.end(), 0);
+  if (++frame == UINT64_MAX) frame = 1;
+
+  if (polls_ != nullptr) {
+    msgq_poll(polls_, subscribed_.size(), timeout);
+    uint64_t current_time = nanos_since_boot();
+
+    for (size_t i = 0; i < subscribed_.size(); i++) {
+      if (!polls_[i].revents) continue;
+
+      size_t words = receive_msgq(subscribed_[i]);
+      if (words > 0) set_updated(subscribed_[i], words, current_time);
+    }
+  } else {
+    auto sockets = poller_->poll(timeout);
+    uint64_t current_time = nanos_since_boot();
+
+    for (auto s : sockets) {
+      Message *msg = s->receive(true);
+      if (msg == nullptr) continue;
+
+      SubMessage *m = sockets_.at(s);
+      size_t words = (msg->getSize() + sizeof(capnp::word) - 1) / sizeof(capnp::word);
+      kj::Array<capnp::word> &buf = m->buf[!m->cur_buf];
+      if (buf.size() < words) {
+        buf = kj::heapArray<capnp::word>(std::max(words, 2 * buf.size()));
+      }
+      memcpy(buf.begin(), msg->getData(), msg->getSize());
+      delete msg;
+
+      m->cur_buf = !m->cur_buf;
+      set_updated(m, words, current_time);
+    }
+  }
+
+  if (!SIMULATION) {
+    uint64_t current_time = nanos_since_boot();
+    for (auto m : subscribed_) {
+      m->alive = (m->freq <= (1e-5) || ((current_time - m->rcv_time) * (1e-9)) < (10.0 / m->freq));
+    }
+  }
+}
+
+bool IndexedSubMaster::all_(bool valid, bool alive) const {
+  for (auto m : subscribed_) {
+    if ((valid && !m->valid) || (alive && !(m->alive || m->ignore_alive))) return false;
+  }
+  return true;
+}
+
+bool IndexedSubMaster::alive(ServiceId id) const {
+  return messages_[static_cast<int>(id)]->alive;
+}
+
+bool IndexedSubMaster::valid(ServiceId id) const {
+  return messages_[static_cast<int>(id)]->valid;
+}
+
+uint64_t IndexedSubMaster::rcv_frame(ServiceId id) const {
+  return messages_[static_cast<int>(id)]->rcv_frame;
+}
+
+uint64_t IndexedSubMaster::rcv_time(ServiceId id) const {
+  return messages_[static_cast<int>(id)]->rcv_time;
+}
+
+cereal::Event::Reader &IndexedSubMaster::operator[](ServiceId id) const {
+  return messages_[static_cast<int>(id)]->event;
+}
+
+IndexedSubMaster::~IndexedSubMaster() {
+  delete poller_;
+  delete[] polls_;
+  for (auto m : subscribed_) {
+    m->msg_reader->~FlatArrayMessageReader();
     delete m->socket;
     delete m;
   }
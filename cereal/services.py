@@ -6,18 +6,45 @@ TICI = os.path.isfile('/TICI')
 RESERVED_PORT = 8022  # sshd
 STARTING_PORT = 8001
 
+# msgq queue defaults, keep in sync with messaging/msgq.h
+DEFAULT_SEGMENT_SIZE = 10 * 1024 * 1024
+DEFAULT_READERS = 10
+
+LARGE_SEGMENT_SERVICES = ["roadCameraState", "driverCameraState", "wideRoadCameraState"]
+HIGH_FANOUT_SERVICES = ["carState", "controlsState", "deviceState", "modelV2"]
+# msgq caps a message at a third of its segment. procLog grows with the number of
+# processes and threads and thumbnail carries a jpeg, so neither has a small bound
+LARGE_MESSAGE_SERVICES = ["procLog", "thumbnail"]
+
 
 def new_port(port: int):
   port += STARTING_PORT
   return port + 1 if port >= RESERVED_PORT else port
 
 
+def get_segment_size(name: str, frequency: float) -> int:
+  if name in LARGE_SEGMENT_SERVICES:
+    return 10 * DEFAULT_SEGMENT_SIZE
+  if name in LARGE_MESSAGE_SERVICES:
+    return DEFAULT_SEGMENT_SIZE
+  # slow services with small messages only ever have a few in flight
+  if 0. < frequency <= 1.:
+    return DEFAULT_SEGMENT_SIZE // 10
+  return DEFAULT_SEGMENT_SIZE
+
+
+def get_max_readers(name: str) -> int:
+  return 2 * DEFAULT_READERS if name in HIGH_FANOUT_SERVICES else DEFAULT_READERS
+
+
 class Service:
   def __init__(self, port: int, should_log: bool, frequency: float, decimation: Optional[int] = None):
     self.port = port
     self.should_log = should_log
     self.frequency = frequency
     self.decimation = decimation
+    self.segment_size = DEFAULT_SEGMENT_SIZE
+    self.max_readers = DEFAULT_READERS
 
 DCAM_FREQ = 10. if not TICI else 20.
 
@@ -66,19 +93,28 @@ services = {
 service_list = {name: Service(new_port(idx), *vals) for  # type: ignore
                 idx, (name, vals) in enumerate(services.items())}
 
+for name, service in service_list.items():
+  service.segment_size = get_segment_size(name, service.frequency)
+  service.max_readers = get_max_readers(name)
+
 
 def build_header():
   h = ""
   h += "/* THIS IS AN AUTOGENERATED FILE, PLEASE EDIT services.py */\n"
   h += "#ifndef __SERVICES_H\n"
   h += "#define __SERVICES_H\n"
-  h += "struct service { char name[0x100]; int port; bool should_log; int frequency; int decimation; };\n"
+  h += "struct service { char name[0x100]; int port; bool should_log; int frequency; int decimation; int segment_size; int max_readers; };\n"
   h += "static struct service services[] = {\n"
   for k, v in service_list.items():
     should_log = "true" if v.should_log else "false"
     decimation = -1 if v.decimation is None else v.decimation
-    h += '  { "%s", %d, %s, %d, %d },\n' % \
-         (k, v.port, should_log, v.frequency, decimation)
+    h += '  { "%s", %d, %s, %d, %d, %d, %d },\n' % \
+         (k, v.port, should_log, v.frequency, decimation, v.segment_size, v.max_readers)
+  h += "};\n"
+  h += "#define NUM_SERVICES %d\n" % len(service_list)
+  h += "enum class ServiceId : int {\n"
+  for k in service_list.keys():
+    h += "  %s,\n" % k
   h += "};\n"
   h += "#endif\n"
   return h
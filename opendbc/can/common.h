@@ -2,6 +2,7 @@
 
 #include <vector>
 #include <map>
+#include <queue>
 #include <unordered_map>
 
 #include "common_dbc.h"
@@ -13,6 +14,8 @@
 #endif
 
 #define MAX_BAD_COUNTER 5
+// 11 bit addresses are looked up directly, extended ones by binary search
+#define CAN_STD_ADDRESSES 0x800
 
 // Helper functions
 unsigned int honda_checksum(unsigned int address, uint64_t d, int l);
@@ -25,6 +28,8 @@ unsigned int pedal_checksum(uint64_t d, int l);
 uint64_t read_u64_be(const uint8_t* v);
 uint64_t read_u64_le(const uint8_t* v);
 
+typedef unsigned int (*checksum_func)(unsigned int address, uint64_t d, int l);
+
 class MessageState {
 public:
   uint32_t address;
@@ -43,6 +48,19 @@ public:
   bool ignore_checksum = false;
   bool ignore_counter = false;
 
+  // Decode plan built by compile(), one entry per parse_sigs, little endian signals first
+  size_t num_le = 0;
+  std::vector<uint64_t> shifts, masks, sign_bits;
+  std::vector<double> factors, offsets;
+  std::vector<int64_t> raw;
+
+  checksum_func checksum = nullptr;
+  bool checksum_le = false;
+  int checksum_idx = -1;
+  int counter_idx = -1;
+  int counter_size = 0;
+
+  void compile();
   bool parse(uint64_t sec, uint16_t ts_, uint8_t * dat);
   bool update_counter_generic(int64_t v, int cnt_size);
 };
@@ -53,7 +71,31 @@ private:
   kj::Array<capnp::word> aligned_buf;
 
   const DBC *dbc = NULL;
-  std::unordered_map<uint32_t, MessageState> message_states;
+
+  // sorted by address
+  std::vector<MessageState> message_states;
+  std::vector<int16_t> address_index;
+
+  // (seen + check_threshold, index) of every checked message that hasn't timed out, earliest first.
+  // Entries are refreshed lazily when they expire, so parsing never touches the heap.
+  typedef std::pair<uint64_t, size_t> Deadline;
+  std::priority_queue<Deadline, std::vector<Deadline>, std::greater<Deadline>> deadlines;
+  std::vector<size_t> expired;
+
+  // Stable signal indices, signal_offsets holds the index of the first signal of each state
+  std::vector<uint32_t> signal_offsets;
+  std::vector<uint32_t> signal_addresses;
+  std::vector<const char *> signal_names;
+
+  // states updated since the last query
+  std::vector<bool> state_updated;
+  std::vector<size_t> updated_states;
+  // signals of updated_states[0] already returned by a query that ran out of space
+  size_t partial_signals = 0;
+
+  void init_states(std::map<uint32_t, MessageState> &states);
+  MessageState *lookup_state(uint32_t address);
+  void parse_state(MessageState *state, uint64_t sec, uint16_t ts, uint8_t *dat);
 
 public:
   bool can_valid = false;
@@ -70,16 +112,54 @@ public:
   void UpdateCans(uint64_t sec, const capnp::DynamicStruct::Reader& cans);
   void UpdateValid(uint64_t sec);
   std::vector<SignalValue> query_latest();
+
+  // Signal indices are resolved once and stay valid for the lifetime of the parser
+  size_t num_signals() const { return signal_addresses.size(); }
+  int signal_index(uint32_t address, const std::string &name) const;
+  uint32_t signal_address(size_t index) const { return signal_addresses[index]; }
+  const char *signal_name(size_t index) const { return signal_names[index]; }
+  // Writes the signals of messages updated since the last call into a caller owned buffer, returns the count.
+  // A message with more signals than max_updates is returned in pieces over consecutive calls
+  size_t query_latest(SignalUpdate *updates, size_t max_updates);
+};
+
+// A signal with its bit position resolved, mask is in frame byte order
+struct PackSlot {
+  const char *name;
+  SignalType type;
+  bool is_little_endian;
+  int shift;
+  uint64_t value_mask;
+  uint64_t mask;
+  double factor, offset;
+};
+
+struct PackTemplate {
+  uint32_t address;
+  unsigned int size;
+  std::vector<PackSlot> slots;  // in DBC order
+
+  int counter_slot = -1;
+  int checksum_slot = -1;
+  checksum_func checksum = nullptr;
+  bool checksum_reversed = false;
 };
 
 class CANPacker {
 private:
   const DBC *dbc = NULL;
-  std::map<std::pair<uint32_t, std::string>, Signal> signal_lookup;
   std::map<uint32_t, Msg> message_lookup;
+  std::vector<PackTemplate> templates;
+  std::map<uint32_t, int> template_lookup;
 
 public:
   CANPacker(const std::string& dbc_name);
   uint64_t pack(uint32_t address, const std::vector<SignalPackValue> &values, int counter);
   Msg* lookup_message(uint32_t address);
+
+  // Templates and signal slots are resolved once, frames are then packed by index
+  int lookup_template(uint32_t address) const;
+  int lookup_slot(int tmpl, const char *name) const;
+  uint64_t pack_slots(int tmpl, const SignalSlotValue *values, size_t num_values, int counter) const;
+  void pack_many(const PackRequest *requests, size_t num_requests, const SignalSlotValue *values, uint64_t *out) const;
 };
@@ -65,10 +65,25 @@ cdef extern from "common_dbc.h":
     const char* name
     double value
 
+  cdef struct SignalUpdate:
+    uint32_t index
+    uint16_t ts
+    double value
+
   cdef struct SignalPackValue:
     const char * name
     double value
 
+  cdef struct SignalSlotValue:
+    int slot
+    double value
+
+  cdef struct PackRequest:
+    int tmpl
+    size_t first_value
+    size_t num_values
+    int counter
+
 
 cdef extern from "common.h":
   cdef const DBC* dbc_lookup(const string);
@@ -78,7 +93,15 @@ cdef extern from "common.h":
     CANParser(int, string, vector[MessageParseOptions], vector[SignalParseOptions])
     void update_string(string, bool)
     vector[SignalValue] query_latest()
+    size_t num_signals()
+    uint32_t signal_address(size_t)
+    const char* signal_name(size_t)
+    size_t query_latest(SignalUpdate*, size_t)
 
   cdef cppclass CANPacker:
    CANPacker(string)
    uint64_t pack(uint32_t, vector[SignalPackValue], int counter)
+   int lookup_template(uint32_t)
+   int lookup_slot(int, const char*)
+   uint64_t pack_slots(int, const SignalSlotValue*, size_t, int counter)
+   void pack_many(const PackRequest*, size_t, const SignalSlotValue*, uint64_t*)
@@ -12,6 +12,18 @@ struct SignalPackValue {
   double value;
 };
 
+struct SignalSlotValue {
+  int slot;  // from CANPacker::lookup_slot
+  double value;
+};
+
+struct PackRequest {
+  int tmpl;  // from CANPacker::lookup_template
+  size_t first_value;
+  size_t num_values;
+  int counter;
+};
+
 struct SignalParseOptions {
   uint32_t address;
   const char* name;
@@ -30,6 +42,12 @@ struct SignalValue {
   double value;
 };
 
+struct SignalUpdate {
+  uint32_t index;  // stable signal index, see CANParser::signal_index
+  uint16_t ts;
+  double value;
+};
+
 enum SignalType {
   DEFAULT,
   HONDA_CHECKSUM,
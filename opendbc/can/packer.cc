@@ -1,4 +1,5 @@
 #include <cassert>
+#include <cstring>
 #include <utility>
 #include <algorithm>
 #include <map>
@@ -20,15 +21,12 @@ uint64_t ReverseBytes(uint64_t x) {
           ((x & 0x00000000000000ffull) << 56);
 }
 
-static uint64_t set_value(uint64_t ret, const Signal& sig, int64_t ival) {
-  int shift = sig.is_little_endian? sig.b1 : sig.bo;
-  uint64_t mask = ((1ULL << sig.b2)-1) << shift;
-  uint64_t dat = (ival & ((1ULL << sig.b2)-1)) << shift;
-  if (sig.is_little_endian) {
+static uint64_t set_value(uint64_t ret, const PackSlot& slot, int64_t ival) {
+  uint64_t dat = (ival & slot.value_mask) << slot.shift;
+  if (slot.is_little_endian) {
     dat = ReverseBytes(dat);
-    mask = ReverseBytes(mask);
   }
-  ret &= ~mask;
+  ret &= ~slot.mask;
   ret |= dat;
   return ret;
 }
@@ -40,79 +38,124 @@ CANPacker::CANPacker(const std::string& dbc_name) {
   for (int i=0; i<dbc->num_msgs; i++) {
     const Msg* msg = &dbc->msgs[i];
     message_lookup[msg->address] = *msg;
+
+    PackTemplate tmpl = {.address = msg->address, .size = msg->size};
     for (int j=0; j<msg->num_sigs; j++) {
       const Signal* sig = &msg->sigs[j];
-      signal_lookup[std::make_pair(msg->address, std::string(sig->name))] = *sig;
+      int shift = sig->is_little_endian ? sig->b1 : sig->bo;
+      uint64_t value_mask = sig->b2 >= 64 ? ~0ULL : (1ULL << sig->b2) - 1;
+      uint64_t mask = value_mask << shift;
+      tmpl.slots.push_back((PackSlot){
+        .name = sig->name,
+        .type = sig->type,
+        .is_little_endian = sig->is_little_endian,
+        .shift = shift,
+        .value_mask = value_mask,
+        .mask = sig->is_little_endian ? ReverseBytes(mask) : mask,
+        .factor = sig->factor,
+        .offset = sig->offset,
+      });
+
+      if (strcmp(sig->name, "COUNTER") == 0) {
+        tmpl.counter_slot = j;
+      } else if (strcmp(sig->name, "CHECKSUM") == 0) {
+        tmpl.checksum_slot = j;
+        switch (sig->type) {
+          case SignalType::HONDA_CHECKSUM: tmpl.checksum = honda_checksum; break;
+          case SignalType::TOYOTA_CHECKSUM: tmpl.checksum = toyota_checksum; break;
+          case SignalType::SUBARU_CHECKSUM: tmpl.checksum = subaru_checksum; break;
+          // FIXME: Hackish fix for an endianness issue. The message is in reverse byte order
+          // until later in the pack process. Checksums can be run backwards, CRCs not so much.
+          // The correct fix is unclear but this works for the moment.
+          case SignalType::VOLKSWAGEN_CHECKSUM: tmpl.checksum = volkswagen_crc; tmpl.checksum_reversed = true; break;
+          case SignalType::CHRYSLER_CHECKSUM: tmpl.checksum = chrysler_checksum; tmpl.checksum_reversed = true; break;
+          default: break;
+        }
+      }
     }
+    template_lookup[msg->address] = templates.size();
+    templates.push_back(tmpl);
   }
   init_crc_lookup_tables();
 }
 
+int CANPacker::lookup_template(uint32_t address) const {
+  auto it = template_lookup.find(address);
+  return it == template_lookup.end() ? -1 : it->second;
+}
+
+int CANPacker::lookup_slot(int tmpl, const char *name) const {
+  // a few DBCs repeat signal names within a message, the last definition wins
+  const auto &slots = templates[tmpl].slots;
+  for (int i = slots.size() - 1; i >= 0; i--) {
+    if (strcmp(slots[i].name, name) == 0) return i;
+  }
+  return -1;
+}
+
 uint64_t CANPacker::pack(uint32_t address, const std::vector<SignalPackValue> &signals, int counter) {
-  uint64_t ret = 0;
-  for (const auto& sigval : signals) {
-    std::string name = std::string(sigval.name);
-    double value = sigval.value;
+  int tmpl = lookup_template(address);
+  if (tmpl < 0) {
+    WARN("undefined message %d\n", address);
+    return 0;
+  }
 
-    auto sig_it = signal_lookup.find(std::make_pair(address, name));
-    if (sig_it == signal_lookup.end()) {
-      WARN("undefined signal %s - %d\n", name.c_str(), address);
+  std::vector<SignalSlotValue> values;
+  values.reserve(signals.size());
+  for (const auto& sigval : signals) {
+    int slot = lookup_slot(tmpl, sigval.name);
+    if (slot < 0) {
+      WARN("undefined signal %s - %d\n", sigval.name, address);
       continue;
     }
-    const auto& sig = sig_it->second;
+    values.push_back({slot, sigval.value});
+  }
+  return pack_slots(tmpl, values.data(), values.size(), counter);
+}
 
-    int64_t ival = (int64_t)(round((value - sig.offset) / sig.factor));
-    if (ival < 0) {
-      ival = (1ULL << sig.b2) + ival;
-    }
+uint64_t CANPacker::pack_slots(int tmpl_idx, const SignalSlotValue *values, size_t num_values, int counter) const {
+  const PackTemplate &tmpl = templates[tmpl_idx];
 
-    ret = set_value(ret, sig, ival);
+  uint64_t ret = 0;
+  for (size_t i = 0; i < num_values; i++) {
+    if (values[i].slot < 0) {
+      WARN("undefined signal - %d\n", tmpl.address);
+      continue;
+    }
+    const auto& slot = tmpl.slots[values[i].slot];
+    int64_t ival = (int64_t)(round((values[i].value - slot.offset) / slot.factor));
+    ret = set_value(ret, slot, ival);
   }
 
   if (counter >= 0){
-    auto sig_it = signal_lookup.find(std::make_pair(address, "COUNTER"));
-    if (sig_it == signal_lookup.end()) {
+    if (tmpl.counter_slot < 0) {
       WARN("COUNTER not defined\n");
       return ret;
     }
-    const auto& sig = sig_it->second;
+    const auto& slot = tmpl.slots[tmpl.counter_slot];
 
-    if ((sig.type != SignalType::HONDA_COUNTER) && (sig.type != SignalType::VOLKSWAGEN_COUNTER)) {
+    if ((slot.type != SignalType::HONDA_COUNTER) && (slot.type != SignalType::VOLKSWAGEN_COUNTER)) {
       WARN("COUNTER signal type not valid\n");
     }
 
-    ret = set_value(ret, sig, counter);
+    ret = set_value(ret, slot, counter);
   }
 
-  auto sig_it_checksum = signal_lookup.find(std::make_pair(address, "CHECKSUM"));
-  if (sig_it_checksum != signal_lookup.end()) {
-    const auto& sig = sig_it_checksum->second;
-    if (sig.type == SignalType::HONDA_CHECKSUM) {
-      unsigned int chksm = honda_checksum(address, ret, message_lookup[address].size);
-      ret = set_value(ret, sig, chksm);
-    } else if (sig.type == SignalType::TOYOTA_CHECKSUM) {
-      unsigned int chksm = toyota_checksum(address, ret, message_lookup[address].size);
-      ret = set_value(ret, sig, chksm);
-    } else if (sig.type == SignalType::VOLKSWAGEN_CHECKSUM) {
-      // FIXME: Hackish fix for an endianness issue. The message is in reverse byte order
-      // until later in the pack process. Checksums can be run backwards, CRCs not so much.
-      // The correct fix is unclear but this works for the moment.
-      unsigned int chksm = volkswagen_crc(address, ReverseBytes(ret), message_lookup[address].size);
-      ret = set_value(ret, sig, chksm);
-    } else if (sig.type == SignalType::SUBARU_CHECKSUM) {
-      unsigned int chksm = subaru_checksum(address, ret, message_lookup[address].size);
-      ret = set_value(ret, sig, chksm);
-    } else if (sig.type == SignalType::CHRYSLER_CHECKSUM) {
-      unsigned int chksm = chrysler_checksum(address, ReverseBytes(ret), message_lookup[address].size);
-      ret = set_value(ret, sig, chksm);
-    } else {
-      //WARN("CHECKSUM signal type not valid\n");
-    }
+  if (tmpl.checksum != nullptr) {
+    unsigned int chksm = tmpl.checksum(tmpl.address, tmpl.checksum_reversed ? ReverseBytes(ret) : ret, tmpl.size);
+    ret = set_value(ret, tmpl.slots[tmpl.checksum_slot], chksm);
   }
 
   return ret;
 }
 
+void CANPacker::pack_many(const PackRequest *requests, size_t num_requests, const SignalSlotValue *values, uint64_t *out) const {
+  for (size_t i = 0; i < num_requests; i++) {
+    const PackRequest &req = requests[i];
+    out[i] = pack_slots(req.tmpl, values + req.first_value, req.num_values, req.counter);
+  }
+}
+
 Msg* CANPacker::lookup_message(uint32_t address) {
   return &message_lookup[address];
 }
@@ -9,7 +9,7 @@ from libcpp cimport bool
 from posix.dlfcn cimport dlopen, dlsym, RTLD_LAZY
 
 from .common cimport CANPacker as cpp_CANPacker
-from .common cimport dbc_lookup, SignalPackValue, DBC
+from .common cimport dbc_lookup, SignalPackValue, SignalSlotValue, PackRequest, DBC
 
 
 cdef class CANPacker:
@@ -18,6 +18,10 @@ cdef class CANPacker:
     const DBC *dbc
     map[string, (int, int)] name_to_address_and_size
     map[int, int] address_to_size
+    dict templates
+    vector[SignalSlotValue] slot_values
+    vector[PackRequest] requests
+    vector[uint64_t] packed
 
   def __init__(self, dbc_name):
     self.dbc = dbc_lookup(dbc_name)
@@ -31,21 +35,34 @@ cdef class CANPacker:
       self.name_to_address_and_size[string(msg.name)] = (msg.address, msg.size)
       self.address_to_size[msg.address] = msg.size
 
-  cdef uint64_t pack(self, addr, values, counter):
-    cdef vector[SignalPackValue] values_thing
-    cdef SignalPackValue spv
-
-    names = []
+    # Resolve the template and signal slots of every message once
+    self.templates = {}
+    for i in range(num_msgs):
+      msg = self.dbc[0].msgs[i]
+      tmpl = self.packer.lookup_template(msg.address)
+      slots = {}
+      for j in range(msg.num_sigs):
+        slots[msg.sigs[j].name.decode('utf8')] = self.packer.lookup_slot(tmpl, msg.sigs[j].name)
+      self.templates[msg.address] = (tmpl, slots)
 
-    for name, value in values.iteritems():
-      n = name.encode('utf8')
-      names.append(n) # TODO: find better way to keep reference to temp string around
+  cdef int add_values(self, addr, values):
+    tmpl, slots = self.templates.get(addr, (-1, None))
+    if tmpl < 0:
+      return -1
 
-      spv.name = n
-      spv.value = value
-      values_thing.push_back(spv)
+    cdef SignalSlotValue ssv
+    for name, value in values.items():
+      ssv.slot = slots.get(name, -1)
+      ssv.value = value
+      self.slot_values.push_back(ssv)
+    return tmpl
 
-    return self.packer.pack(addr, values_thing, counter)
+  cdef uint64_t pack(self, addr, values, counter):
+    self.slot_values.clear()
+    cdef int tmpl = self.add_values(addr, values)
+    if tmpl < 0:
+      return 0
+    return self.packer.pack_slots(tmpl, self.slot_values.data(), self.slot_values.size(), counter)
 
   cdef inline uint64_t ReverseBytes(self, uint64_t x):
     return (((x & 0xff00000000000000ull) >> 56) |
@@ -57,13 +74,48 @@ cdef class CANPacker:
            ((x & 0x000000000000ff00ull) << 40) |
            ((x & 0x00000000000000ffull) << 56))
 
-  cpdef make_can_msg(self, name_or_addr, bus, values, counter=-1):
-    cdef int addr, size
+  cdef lookup_address_and_size(self, name_or_addr):
     if type(name_or_addr) == int:
-      addr = name_or_addr
-      size = self.address_to_size[name_or_addr]
+      return name_or_addr, self.address_to_size[name_or_addr]
     else:
-      addr, size = self.name_to_address_and_size[name_or_addr.encode('utf8')]
+      return self.name_to_address_and_size[name_or_addr.encode('utf8')]
+
+  cpdef make_can_msg(self, name_or_addr, bus, values, counter=-1):
+    cdef int addr, size
+    addr, size = self.lookup_address_and_size(name_or_addr)
     cdef uint64_t val = self.pack(addr, values, counter)
     val = self.ReverseBytes(val)
     return [addr, 0, (<char *>&val)[:size], bus]
+
+  cpdef make_can_msgs(self, msgs):
+    """Packs a list of (name_or_addr, bus, values[, counter]) in one call, returns the can messages"""
+    cdef PackRequest req
+    cdef uint64_t val
+    self.slot_values.clear()
+    self.requests.clear()
+
+    # messages that aren't in the DBC are packed as all zeros, like make_can_msg
+    addrs = []
+    for m in msgs:
+      addr, size = self.lookup_address_and_size(m[0])
+      addrs.append((addr, size, m[1]))
+
+      req.first_value = self.slot_values.size()
+      req.tmpl = self.add_values(addr, m[2])
+      req.num_values = self.slot_values.size() - req.first_value
+      req.counter = m[3] if len(m) > 3 else -1
+      if req.tmpl >= 0:
+        self.requests.push_back(req)
+
+    self.packed.resize(self.requests.size())
+    self.packer.pack_many(self.requests.data(), self.requests.size(), self.slot_values.data(), self.packed.data())
+
+    ret = []
+    cdef size_t i = 0
+    for addr, size, bus in addrs:
+      val = 0
+      if self.templates.get(addr, (-1, None))[0] >= 0:
+        val = self.ReverseBytes(self.packed[i])
+        i += 1
+      ret.append([addr, 0, (<char *>&val)[:size], bus])
+    return ret
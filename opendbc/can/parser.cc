@@ -13,76 +13,91 @@
 // #define DEBUG printf
 #define INFO printf
 
-bool MessageState::parse(uint64_t sec, uint16_t ts_, uint8_t * dat) {
-  uint64_t dat_le = read_u64_le(dat);
-  uint64_t dat_be = read_u64_be(dat);
-
-  for (int i=0; i < parse_sigs.size(); i++) {
-    auto& sig = parse_sigs[i];
-    int64_t tmp;
+static unsigned int pedal_checksum_addr(unsigned int address, uint64_t d, int l) {
+  return pedal_checksum(d, l);
+}
 
-    if (sig.is_little_endian){
-      tmp = (dat_le >> sig.b1) & ((1ULL << sig.b2)-1);
-    } else {
-      tmp = (dat_be >> sig.bo) & ((1ULL << sig.b2)-1);
+void MessageState::compile() {
+  // Group signals by endianness so each group is decoded by one tight loop
+  std::vector<size_t> order(parse_sigs.size());
+  for (size_t i = 0; i < order.size(); i++) order[i] = i;
+  std::stable_partition(order.begin(), order.end(), [&](size_t i) { return parse_sigs[i].is_little_endian; });
+
+  std::vector<Signal> sigs;
+  std::vector<double> sig_vals;
+  for (size_t i : order) {
+    sigs.push_back(parse_sigs[i]);
+    sig_vals.push_back(vals[i]);
+  }
+  parse_sigs = sigs;
+  vals = sig_vals;
+
+  num_le = 0;
+  shifts.clear();
+  masks.clear();
+  sign_bits.clear();
+  factors.clear();
+  offsets.clear();
+  raw.assign(parse_sigs.size(), 0);
+
+  for (int i = 0; i < parse_sigs.size(); i++) {
+    const Signal &sig = parse_sigs[i];
+    num_le += sig.is_little_endian;
+    shifts.push_back(sig.is_little_endian ? sig.b1 : sig.bo);
+    masks.push_back(sig.b2 >= 64 ? ~0ULL : (1ULL << sig.b2) - 1);
+    sign_bits.push_back(sig.is_signed ? (1ULL << (sig.b2 - 1)) : 0);
+    factors.push_back(sig.factor);
+    offsets.push_back(sig.offset);
+
+    switch (sig.type) {
+      case SignalType::HONDA_CHECKSUM: checksum = honda_checksum; checksum_le = false; checksum_idx = i; break;
+      case SignalType::TOYOTA_CHECKSUM: checksum = toyota_checksum; checksum_le = false; checksum_idx = i; break;
+      case SignalType::VOLKSWAGEN_CHECKSUM: checksum = volkswagen_crc; checksum_le = true; checksum_idx = i; break;
+      case SignalType::SUBARU_CHECKSUM: checksum = subaru_checksum; checksum_le = false; checksum_idx = i; break;
+      case SignalType::CHRYSLER_CHECKSUM: checksum = chrysler_checksum; checksum_le = true; checksum_idx = i; break;
+      case SignalType::PEDAL_CHECKSUM: checksum = pedal_checksum_addr; checksum_le = false; checksum_idx = i; break;
+      case SignalType::HONDA_COUNTER:
+      case SignalType::VOLKSWAGEN_COUNTER:
+      case SignalType::PEDAL_COUNTER:
+        counter_idx = i;
+        counter_size = sig.b2;
+        break;
+      default:
+        break;
     }
+  }
+}
 
-    if (sig.is_signed) {
-      tmp -= (tmp >> (sig.b2-1)) ? (1ULL << sig.b2) : 0; //signed
-    }
+bool MessageState::parse(uint64_t sec, uint16_t ts_, uint8_t * dat) {
+  uint64_t dat_le = read_u64_le(dat);
+  uint64_t dat_be = read_u64_be(dat);
 
-    DEBUG("parse 0x%X %s -> %lld\n", address, sig.name, tmp);
+  const size_t num_sigs = raw.size();
+  for (size_t i = 0; i < num_le; i++) {
+    raw[i] = (dat_le >> shifts[i]) & masks[i];
+  }
+  for (size_t i = num_le; i < num_sigs; i++) {
+    raw[i] = (dat_be >> shifts[i]) & masks[i];
+  }
+  // sign extend, sign_bits is 0 for unsigned signals
+  for (size_t i = 0; i < num_sigs; i++) {
+    raw[i] = (raw[i] ^ sign_bits[i]) - sign_bits[i];
+  }
 
-    if (!ignore_checksum) {
-      if (sig.type == SignalType::HONDA_CHECKSUM) {
-        if (honda_checksum(address, dat_be, size) != tmp) {
-          INFO("0x%X CHECKSUM FAIL\n", address);
-          return false;
-        }
-      } else if (sig.type == SignalType::TOYOTA_CHECKSUM) {
-        if (toyota_checksum(address, dat_be, size) != tmp) {
-          INFO("0x%X CHECKSUM FAIL\n", address);
-          return false;
-        }
-      } else if (sig.type == SignalType::VOLKSWAGEN_CHECKSUM) {
-        if (volkswagen_crc(address, dat_le, size) != tmp) {
-          INFO("0x%X CRC FAIL\n", address);
-          return false;
-        }
-      } else if (sig.type == SignalType::SUBARU_CHECKSUM) {
-        if (subaru_checksum(address, dat_be, size) != tmp) {
-          INFO("0x%X CHECKSUM FAIL\n", address);
-          return false;
-        }
-      } else if (sig.type == SignalType::CHRYSLER_CHECKSUM) {
-        if (chrysler_checksum(address, dat_le, size) != tmp) {
-          INFO("0x%X CHECKSUM FAIL\n", address);
-          return false;
-        }
-      } else if (sig.type == SignalType::PEDAL_CHECKSUM) {
-        if (pedal_checksum(dat_be, size) != tmp) {
-          INFO("0x%X PEDAL CHECKSUM FAIL\n", address);
-          return false;
-        }
-      }
+  if (checksum != nullptr && !ignore_checksum) {
+    if (checksum(address, checksum_le ? dat_le : dat_be, size) != raw[checksum_idx]) {
+      INFO("0x%X CHECKSUM FAIL\n", address);
+      return false;
     }
-    if (!ignore_counter) {
-      if (sig.type == SignalType::HONDA_COUNTER) {
-        if (!update_counter_generic(tmp, sig.b2)) {
-          return false;
-        }
-      } else if (sig.type == SignalType::VOLKSWAGEN_COUNTER) {
-          if (!update_counter_generic(tmp, sig.b2)) {
-          return false;
-        }
-      } else if (sig.type == SignalType::PEDAL_COUNTER) {
-        if (!update_counter_generic(tmp, sig.b2)) {
-          return false;
-        }
-      }
+  }
+  if (counter_idx >= 0 && !ignore_counter) {
+    if (!update_counter_generic(raw[counter_idx], counter_size)) {
+      return false;
     }
+  }
 
-    vals[i] = tmp * sig.factor + sig.offset;
+  for (size_t i = 0; i < num_sigs; i++) {
+    vals[i] = raw[i] * factors[i] + offsets[i];
   }
   ts = ts_;
   seen = sec;
@@ -118,8 +133,9 @@ CANParser::CANParser(int abus, const std::string& dbc_name,
   assert(dbc);
   init_crc_lookup_tables();
 
+  std::map<uint32_t, MessageState> states;
   for (const auto& op : options) {
-    MessageState &state = message_states[op.address];
+    MessageState &state = states[op.address];
     state.address = op.address;
     // state.check_frequency = op.check_frequency,
 
@@ -165,7 +181,10 @@ CANParser::CANParser(int abus, const std::string& dbc_name,
         }
       }
     }
+
+    state.compile();
   }
+  init_states(states);
 }
 
 CANParser::CANParser(int abus, const std::string& dbc_name, bool ignore_checksum, bool ignore_counter)
@@ -176,6 +195,7 @@ CANParser::CANParser(int abus, const std::string& dbc_name, bool ignore_checksum
   assert(dbc);
   init_crc_lookup_tables();
 
+  std::map<uint32_t, MessageState> states;
   for (int i = 0; i < dbc->num_msgs; i++) {
     const Msg* msg = &dbc->msgs[i];
     MessageState state = {
@@ -191,7 +211,59 @@ CANParser::CANParser(int abus, const std::string& dbc_name, bool ignore_checksum
       state.vals.push_back(0);
     }
 
-    message_states[state.address] = state;
+    state.compile();
+    states[state.address] = state;
+  }
+  init_states(states);
+}
+
+void CANParser::init_states(std::map<uint32_t, MessageState> &states) {
+  address_index.assign(CAN_STD_ADDRESSES, -1);
+  for (auto &kv : states) {
+    size_t idx = message_states.size();
+    if (kv.first < CAN_STD_ADDRESSES) {
+      address_index[kv.first] = idx;
+    }
+    if (kv.second.check_threshold > 0) {
+      deadlines.push({kv.second.seen + kv.second.check_threshold, idx});
+    }
+    message_states.push_back(std::move(kv.second));
+  }
+
+  for (const auto &state : message_states) {
+    signal_offsets.push_back(signal_addresses.size());
+    for (const auto &sig : state.parse_sigs) {
+      signal_addresses.push_back(state.address);
+      signal_names.push_back(sig.name);
+    }
+  }
+
+  // Every signal is reported by the first query, so callers start out with the defaults
+  state_updated.assign(message_states.size(), true);
+  updated_states.reserve(message_states.size());
+  for (size_t i = 0; i < message_states.size(); i++) {
+    updated_states.push_back(i);
+  }
+}
+
+MessageState *CANParser::lookup_state(uint32_t address) {
+  if (address < CAN_STD_ADDRESSES) {
+    int idx = address_index[address];
+    return idx < 0 ? nullptr : &message_states[idx];
+  }
+
+  auto it = std::lower_bound(message_states.begin(), message_states.end(), address,
+                             [](const MessageState &state, uint32_t addr) { return state.address < addr; });
+  return (it != message_states.end() && it->address == address) ? &*it : nullptr;
+}
+
+void CANParser::parse_state(MessageState *state, uint64_t sec, uint16_t ts, uint8_t *dat) {
+  if (state->parse(sec, ts, dat)) {
+    size_t idx = state - message_states.data();
+    if (!state_updated[idx]) {
+      state_updated[idx] = true;
+      updated_states.push_back(idx);
+    }
   }
 }
 
@@ -228,8 +300,8 @@ void CANParser::UpdateCans(uint64_t sec, const capnp::List<cereal::CanData>::Rea
       // DEBUG("skip %d: wrong bus\n", cmsg.getAddress());
       continue;
     }
-    auto state_it = message_states.find(cmsg.getAddress());
-    if (state_it == message_states.end()) {
+    MessageState *state = lookup_state(cmsg.getAddress());
+    if (state == nullptr) {
       // DEBUG("skip %d: not specified\n", cmsg.getAddress());
       continue;
     }
@@ -238,7 +310,7 @@ void CANParser::UpdateCans(uint64_t sec, const capnp::List<cereal::CanData>::Rea
     uint8_t dat[8] = {0};
     memcpy(dat, cmsg.getDat().begin(), cmsg.getDat().size());
 
-    state_it->second.parse(sec, cmsg.getBusTime(), dat);
+    parse_state(state, sec, cmsg.getBusTime(), dat);
   }
 }
 #endif
@@ -252,8 +324,8 @@ void CANParser::UpdateCans(uint64_t sec, const capnp::DynamicStruct::Reader& cms
     return;
   }
 
-  auto state_it = message_states.find(cmsg.get("address").as<uint32_t>());
-  if (state_it == message_states.end()) {
+  MessageState *state = lookup_state(cmsg.get("address").as<uint32_t>());
+  if (state == nullptr) {
     DEBUG("skip %d: not specified\n", cmsg.get("address").as<uint32_t>());
     return;
   }
@@ -262,29 +334,47 @@ void CANParser::UpdateCans(uint64_t sec, const capnp::DynamicStruct::Reader& cms
   if (dat.size() > 8) return; //shouldn't ever happen
   uint8_t data[8] = {0};
   memcpy(data, dat.begin(), dat.size());
-  state_it->second.parse(sec, cmsg.get("busTime").as<uint16_t>(), data);
+  parse_state(state, sec, cmsg.get("busTime").as<uint16_t>(), data);
 }
 
 void CANParser::UpdateValid(uint64_t sec) {
-  can_valid = true;
-  for (const auto& kv : message_states) {
-    const auto& state = kv.second;
-    if (state.check_threshold > 0 && (sec - state.seen) > state.check_threshold) {
+  // Timed out messages become valid again once they are received
+  for (size_t i = 0; i < expired.size();) {
+    const MessageState &state = message_states[expired[i]];
+    if ((sec - state.seen) <= state.check_threshold) {
+      deadlines.push({state.seen + state.check_threshold, expired[i]});
+      expired[i] = expired.back();
+      expired.pop_back();
+    } else {
+      i++;
+    }
+  }
+
+  // Only messages whose deadline passed need checking, the rest were seen recently enough
+  while (!deadlines.empty() && deadlines.top().first < sec) {
+    size_t idx = deadlines.top().second;
+    deadlines.pop();
+
+    const MessageState &state = message_states[idx];
+    if ((sec - state.seen) > state.check_threshold) {
       if (state.seen > 0) {
         DEBUG("0x%X TIMEOUT\n", state.address);
       } else {
         DEBUG("0x%X MISSING\n", state.address);
       }
-      can_valid = false;
+      expired.push_back(idx);
+    } else {
+      deadlines.push({state.seen + state.check_threshold, idx});
     }
   }
+
+  can_valid = expired.empty();
 }
 
 std::vector<SignalValue> CANParser::query_latest() {
   std::vector<SignalValue> ret;
 
-  for (const auto& kv : message_states) {
-    const auto& state = kv.second;
+  for (const auto& state : message_states) {
     if (last_sec != 0 && state.seen != last_sec) continue;
 
     for (int i=0; i<state.parse_sigs.size(); i++) {
@@ -300,3 +390,46 @@ std::vector<SignalValue> CANParser::query_latest() {
 
   return ret;
 }
+
+int CANParser::signal_index(uint32_t address, const std::string &name) const {
+  for (size_t i = 0; i < signal_addresses.size(); i++) {
+    if (signal_addresses[i] == address && name == signal_names[i]) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+size_t CANParser::query_latest(SignalUpdate *updates, size_t max_updates) {
+  size_t count = 0, done = 0;
+  for (; done < updated_states.size(); done++) {
+    size_t idx = updated_states[done];
+    const MessageState &state = message_states[idx];
+    size_t start = (done == 0) ? partial_signals : 0;
+    size_t end = state.vals.size();
+
+    if (count + (end - start) > max_updates) {
+      // messages that don't fit stay pending for the next call,
+      // unless the buffer can't hold this one at all, then it is split
+      if (count > 0) break;
+      end = start + max_updates;
+    }
+
+    for (size_t i = start; i < end; i++) {
+      updates[count++] = (SignalUpdate){
+        .index = (uint32_t)(signal_offsets[idx] + i),
+        .ts = state.ts,
+        .value = state.vals[i],
+      };
+    }
+
+    if (end < state.vals.size()) {
+      partial_signals = end;
+      break;
+    }
+    partial_signals = 0;
+    state_updated[idx] = false;
+  }
+  updated_states.erase(updated_states.begin(), updated_states.begin() + done);
+  return count;
+}
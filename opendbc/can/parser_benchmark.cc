@@ -0,0 +1,185 @@
+#include <cassert>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "common.h"
+
+// Decodes CAN frames through the compiled MessageState::parse and the
+// previous per signal decode loop, checks they agree and reports ns/frame.
+//
+// usage: parser_benchmark <dbc name> [decompressed rlog] [bus]
+// Without an rlog, one hour of 100 Hz frames with random payloads is generated for every message in the DBC.
+
+struct Frame {
+  uint32_t address;
+  uint16_t bus_time;
+  uint8_t dat[8];
+};
+
+// The decode loop before decode plans, kept as the reference implementation
+static bool legacy_parse(MessageState &state, uint64_t sec, uint16_t ts_, uint8_t *dat) {
+  uint64_t dat_le = read_u64_le(dat);
+  uint64_t dat_be = read_u64_be(dat);
+
+  for (int i = 0; i < state.parse_sigs.size(); i++) {
+    auto &sig = state.parse_sigs[i];
+    int64_t tmp;
+
+    // guarded against 1ULL << 64, which the original left undefined
+    uint64_t mask = sig.b2 >= 64 ? ~0ULL : (1ULL << sig.b2) - 1;
+    if (sig.is_little_endian) {
+      tmp = (dat_le >> sig.b1) & mask;
+    } else {
+      tmp = (dat_be >> sig.bo) & mask;
+    }
+
+    if (sig.is_signed) {
+      tmp -= (tmp >> (sig.b2 - 1)) ? (1ULL << sig.b2) : 0;
+    }
+
+    if (!state.ignore_checksum) {
+      if ((sig.type == SignalType::HONDA_CHECKSUM && honda_checksum(state.address, dat_be, state.size) != tmp) ||
+          (sig.type == SignalType::TOYOTA_CHECKSUM && toyota_checksum(state.address, dat_be, state.size) != tmp) ||
+          (sig.type == SignalType::VOLKSWAGEN_CHECKSUM && volkswagen_crc(state.address, dat_le, state.size) != tmp) ||
+          (sig.type == SignalType::SUBARU_CHECKSUM && subaru_checksum(state.address, dat_be, state.size) != tmp) ||
+          (sig.type == SignalType::CHRYSLER_CHECKSUM && chrysler_checksum(state.address, dat_le, state.size) != tmp) ||
+          (sig.type == SignalType::PEDAL_CHECKSUM && pedal_checksum(dat_be, state.size) != tmp)) {
+        return false;
+      }
+    }
+    if (!state.ignore_counter) {
+      if (sig.type == SignalType::HONDA_COUNTER || sig.type == SignalType::VOLKSWAGEN_COUNTER || sig.type == SignalType::PEDAL_COUNTER) {
+        if (!state.update_counter_generic(tmp, sig.b2)) {
+          return false;
+        }
+      }
+    }
+
+    state.vals[i] = tmp * sig.factor + sig.offset;
+  }
+  state.ts = ts_;
+  state.seen = sec;
+
+  return true;
+}
+
+static std::unordered_map<uint32_t, MessageState> build_states(const DBC *dbc, bool ignore_checks) {
+  std::unordered_map<uint32_t, MessageState> states;
+  for (int i = 0; i < dbc->num_msgs; i++) {
+    const Msg *msg = &dbc->msgs[i];
+    MessageState state = {
+      .address = msg->address,
+      .size = msg->size,
+      .ignore_checksum = ignore_checks,
+      .ignore_counter = ignore_checks,
+    };
+    for (int j = 0; j < msg->num_sigs; j++) {
+      state.parse_sigs.push_back(msg->sigs[j]);
+      state.vals.push_back(0);
+    }
+    state.compile();
+    states[state.address] = state;
+  }
+  return states;
+}
+
+#ifndef DYNAMIC_CAPNP
+static std::vector<Frame> load_rlog(const char *path, int bus) {
+  std::ifstream f(path, std::ios::binary | std::ios::ate);
+  assert(f.good());
+  size_t size = f.tellg();
+  kj::Array<capnp::word> buf = kj::heapArray<capnp::word>(size / sizeof(capnp::word) + 1);
+  f.seekg(0);
+  f.read((char *)buf.begin(), size);
+
+  std::vector<Frame> frames;
+  kj::ArrayPtr<const capnp::word> words(buf.begin(), size / sizeof(capnp::word));
+  while (words.size() > 0) {
+    capnp::FlatArrayMessageReader reader(words);
+    cereal::Event::Reader event = reader.getRoot<cereal::Event>();
+    if (event.which() == cereal::Event::CAN) {
+      for (auto cmsg : event.getCan()) {
+        if (cmsg.getSrc() != bus || cmsg.getDat().size() > 8) continue;
+        Frame frame = {.address = cmsg.getAddress(), .bus_time = cmsg.getBusTime()};
+        memset(frame.dat, 0, sizeof(frame.dat));
+        memcpy(frame.dat, cmsg.getDat().begin(), cmsg.getDat().size());
+        frames.push_back(frame);
+      }
+    }
+    words = kj::arrayPtr(reader.getEnd(), words.end());
+  }
+  return frames;
+}
+#endif
+
+static std::vector<Frame> synthesize_frames(const DBC *dbc) {
+  std::mt19937_64 rng(0);
+  std::vector<Frame> frames;
+  for (int t = 0; t < 3600 * 100; t++) {
+    for (int i = 0; i < dbc->num_msgs; i++) {
+      Frame frame = {.address = dbc->msgs[i].address, .bus_time = (uint16_t)t};
+      uint64_t dat = rng();
+      memcpy(frame.dat, &dat, sizeof(frame.dat));
+      frames.push_back(frame);
+    }
+  }
+  return frames;
+}
+
+template <typename F>
+static double time_ns_per_frame(const std::vector<Frame> &frames, std::unordered_map<uint32_t, MessageState> &states, F parse) {
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < frames.size(); i++) {
+    auto it = states.find(frames[i].address);
+    if (it == states.end()) continue;
+    uint8_t dat[8];
+    memcpy(dat, frames[i].dat, sizeof(dat));
+    parse(it->second, i, frames[i].bus_time, dat);
+  }
+  return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / frames.size();
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 2) {
+    printf("usage: %s <dbc name> [decompressed rlog] [bus]\n", argv[0]);
+    return 1;
+  }
+
+  const DBC *dbc = dbc_lookup(argv[1]);
+  assert(dbc);
+  init_crc_lookup_tables();
+
+  bool synthetic = argc < 3;
+#ifndef DYNAMIC_CAPNP
+  std::vector<Frame> frames = synthetic ? synthesize_frames(dbc) : load_rlog(argv[2], argc > 3 ? atoi(argv[3]) : 0);
+#else
+  std::vector<Frame> frames = synthesize_frames(dbc);
+#endif
+
+  // random payloads never pass checksums, only decode them
+  auto legacy_states = build_states(dbc, synthetic);
+  auto states = build_states(dbc, synthetic);
+
+  double legacy_ns = time_ns_per_frame(frames, legacy_states, legacy_parse);
+  double ns = time_ns_per_frame(frames, states, [](MessageState &s, uint64_t sec, uint16_t ts, uint8_t *dat) { return s.parse(sec, ts, dat); });
+
+  // Both paths must end up with the same values
+  size_t mismatches = 0;
+  for (auto &kv : states) {
+    const MessageState &a = kv.second, &b = legacy_states.at(kv.first);
+    mismatches += (a.seen != b.seen) || (a.vals != b.vals);
+  }
+
+  printf("%s: %zu frames\n", dbc->name, frames.size());
+  printf("legacy:   %6.1f ns/frame\n", legacy_ns);
+  printf("compiled: %6.1f ns/frame\n", ns);
+  printf("%zu messages differ\n", mismatches);
+  return mismatches != 0;
+}
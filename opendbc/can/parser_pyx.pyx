@@ -9,7 +9,7 @@ from libcpp.map cimport map
 from libcpp cimport bool
 
 from .common cimport CANParser as cpp_CANParser
-from .common cimport SignalParseOptions, MessageParseOptions, dbc_lookup, SignalValue, DBC
+from .common cimport SignalParseOptions, MessageParseOptions, dbc_lookup, SignalValue, SignalUpdate, DBC
 
 import os
 import numbers
@@ -24,7 +24,9 @@ cdef class CANParser:
     map[string, uint32_t] msg_name_to_address
     map[uint32_t, string] address_to_msg_name
     vector[SignalValue] can_values
+    vector[SignalUpdate] updates
     bool test_mode_enabled
+    list sig_names, sig_addresses, sig_vl, sig_ts
 
   cdef readonly:
     string dbc_name
@@ -101,13 +103,25 @@ cdef class CANParser:
       message_options_v.push_back(mpo)
 
     self.can = new cpp_CANParser(bus, dbc_name, message_options_v, signal_options_v)
+
+    # Resolve the target dicts of every signal once, updates are written by stable signal index
+    cdef size_t num_signals = self.can.num_signals()
+    self.updates.resize(num_signals)
+    self.sig_names, self.sig_addresses, self.sig_vl, self.sig_ts = [], [], [], []
+    for i in range(num_signals):
+      address = self.can.signal_address(i)
+      name = <unicode>self.address_to_msg_name[address].c_str()
+      self.sig_names.append(<unicode>self.can.signal_name(i))
+      self.sig_addresses.append(address)
+      self.sig_vl.append((self.vl[address], self.vl[name]))
+      self.sig_ts.append((self.ts[address], self.ts[name]))
+
     self.update_vl()
 
   cdef unordered_set[uint32_t] update_vl(self):
-    cdef string sig_name
     cdef unordered_set[uint32_t] updated_val
 
-    can_values = self.can.query_latest()
+    cdef size_t num_updates = self.can.query_latest(self.updates.data(), self.updates.size())
     valid = self.can.can_valid
 
     # Update invalid flag
@@ -116,18 +130,20 @@ cdef class CANParser:
         self.can_invalid_cnt = 0
     self.can_valid = self.can_invalid_cnt < CAN_INVALID_CNT
 
-    for cv in can_values:
-      # Cast char * directly to unicode
-      name = <unicode>self.address_to_msg_name[cv.address].c_str()
-      cv_name = <unicode>cv.name
-
-      self.vl[cv.address][cv_name] = cv.value
-      self.ts[cv.address][cv_name] = cv.ts
+    cdef size_t i
+    cdef SignalUpdate u
+    for i in range(num_updates):
+      u = self.updates[i]
+      sig_name = self.sig_names[u.index]
+      vl_addr, vl_name = self.sig_vl[u.index]
+      ts_addr, ts_name = self.sig_ts[u.index]
 
-      self.vl[name][cv_name] = cv.value
-      self.ts[name][cv_name] = cv.ts
+      vl_addr[sig_name] = u.value
+      vl_name[sig_name] = u.value
+      ts_addr[sig_name] = u.ts
+      ts_name[sig_name] = u.ts
 
-      updated_val.insert(cv.address)
+      updated_val.insert(self.sig_addresses[u.index])
 
     return updated_val
 
@@ -76,16 +76,85 @@ void gen_crc_lookup_table(uint8_t poly, uint8_t crc_lut[]) {
   }
 }
 
+AddrTable tx_msg_table = {.list = NULL};
+AddrTable rx_check_table = {.list = NULL};
+
+static uint32_t addr_table_hash(int addr, int bus) {
+  uint32_t key = ((uint32_t)addr << 3) ^ (uint32_t)bus;
+  return (key * 2654435761U) >> (32U - ADDR_TABLE_BITS);
+}
+
+static void addr_table_reset(AddrTable *table, const void *list, int list_len) {
+  table->list = list;
+  table->list_len = list_len;
+  table->num_entries = 0U;
+  table->linear = false;
+  for (uint32_t i = 0U; i < ADDR_TABLE_SIZE; i++) {
+    table->entries[i].check_idx = -1;
+  }
+}
+
+// entries with the same key are probed in insertion order, so lookups see them in list order
+static void addr_table_insert(AddrTable *table, int addr, int bus, int len, int check_idx, int msg_idx) {
+  if ((table->num_entries >= (ADDR_TABLE_SIZE / 2U)) || (check_idx > 127)) {
+    table->linear = true;
+  } else {
+    uint32_t slot = addr_table_hash(addr, bus);
+    while (table->entries[slot].check_idx >= 0) {
+      slot = (slot + 1U) & (ADDR_TABLE_SIZE - 1U);
+    }
+    table->entries[slot].addr = (uint32_t)addr;
+    table->entries[slot].bus = (uint8_t)bus;
+    table->entries[slot].len = (uint8_t)len;
+    table->entries[slot].check_idx = check_idx;
+    table->entries[slot].msg_idx = msg_idx;
+    table->num_entries += 1U;
+  }
+}
+
+static void build_tx_msg_table(const CanMsg msg_list[], int len) {
+  addr_table_reset(&tx_msg_table, msg_list, len);
+  // scanning a short list is cheaper than hashing
+  if (len < ADDR_TABLE_MIN_TX_MSGS) {
+    tx_msg_table.linear = true;
+  }
+  for (int i = 0; (i < len) && !tx_msg_table.linear; i++) {
+    addr_table_insert(&tx_msg_table, msg_list[i].addr, msg_list[i].bus, msg_list[i].len, i, 0);
+  }
+}
+
+static void build_rx_check_table(const AddrCheckStruct addr_list[], int len) {
+  addr_table_reset(&rx_check_table, addr_list, len);
+  for (int i = 0; i < len; i++) {
+    for (int j = 0; addr_list[i].msg[j].addr != 0; j++) {
+      addr_table_insert(&rx_check_table, addr_list[i].msg[j].addr, addr_list[i].msg[j].bus, addr_list[i].msg[j].len, i, j);
+    }
+  }
+}
+
 bool msg_allowed(CAN_FIFOMailBox_TypeDef *to_send, const CanMsg msg_list[], int len) {
   int addr = GET_ADDR(to_send);
   int bus = GET_BUS(to_send);
   int length = GET_LEN(to_send);
 
+  // short lists and lists picked at runtime are scanned, the table is built in set_safety_hooks
   bool allowed = false;
-  for (int i = 0; i < len; i++) {
-    if ((addr == msg_list[i].addr) && (bus == msg_list[i].bus) && (length == msg_list[i].len)) {
-      allowed = true;
-      break;
+  if ((len < ADDR_TABLE_MIN_TX_MSGS) || (tx_msg_table.list != msg_list) || (tx_msg_table.list_len != len) || tx_msg_table.linear) {
+    for (int i = 0; i < len; i++) {
+      if ((addr == msg_list[i].addr) && (bus == msg_list[i].bus) && (length == msg_list[i].len)) {
+        allowed = true;
+        break;
+      }
+    }
+  } else {
+    uint32_t slot = addr_table_hash(addr, bus);
+    while (tx_msg_table.entries[slot].check_idx >= 0) {
+      const AddrTableEntry *entry = &tx_msg_table.entries[slot];
+      if (((uint32_t)addr == entry->addr) && (bus == entry->bus) && (length == entry->len)) {
+        allowed = true;
+        break;
+      }
+      slot = (slot + 1U) & (ADDR_TABLE_SIZE - 1U);
     }
   }
   return allowed;
@@ -97,11 +166,7 @@ uint32_t get_ts_elapsed(uint32_t ts, uint32_t ts_last) {
   return ts - ts_last;
 }
 
-int get_addr_check_index(CAN_FIFOMailBox_TypeDef *to_push, AddrCheckStruct addr_list[], const int len) {
-  int bus = GET_BUS(to_push);
-  int addr = GET_ADDR(to_push);
-  int length = GET_LEN(to_push);
-
+static int get_addr_check_index_linear(int addr, int bus, int length, AddrCheckStruct addr_list[], const int len) {
   int index = -1;
   for (int i = 0; i < len; i++) {
     // if multiple msgs are allowed, determine which one is present on the bus
@@ -126,6 +191,37 @@ int get_addr_check_index(CAN_FIFOMailBox_TypeDef *to_push, AddrCheckStruct addr_
   return index;
 }
 
+int get_addr_check_index(CAN_FIFOMailBox_TypeDef *to_push, AddrCheckStruct addr_list[], const int len) {
+  int bus = GET_BUS(to_push);
+  int addr = GET_ADDR(to_push);
+  int length = GET_LEN(to_push);
+
+  // the table is built in set_safety_hooks, lists picked at runtime are scanned
+  int index = -1;
+  if (rx_check_table.linear || (rx_check_table.list != addr_list) || (rx_check_table.list_len != len)) {
+    index = get_addr_check_index_linear(addr, bus, length, addr_list, len);
+  } else {
+    uint32_t slot = addr_table_hash(addr, bus);
+    while (rx_check_table.entries[slot].check_idx >= 0) {
+      const AddrTableEntry *entry = &rx_check_table.entries[slot];
+      if (((uint32_t)addr == entry->addr) && (bus == entry->bus) && (length == entry->len)) {
+        int i = entry->check_idx;
+        // if multiple msgs are allowed, the first one seen on the bus is checked from then on
+        if (!addr_list[i].msg_seen) {
+          addr_list[i].index = entry->msg_idx;
+          addr_list[i].msg_seen = true;
+        }
+        if (addr_list[i].index == entry->msg_idx) {
+          index = i;
+          break;
+        }
+      }
+      slot = (slot + 1U) & (ADDR_TABLE_SIZE - 1U);
+    }
+  }
+  return index;
+}
+
 // 1Hz safety function called by main. Now just a check for lagging safety messages
 void safety_tick(const safety_hooks *hooks) {
   uint32_t ts = microsecond_timer_get();
@@ -305,6 +401,9 @@ int set_safety_hooks(uint16_t mode, int16_t param) {
       safety_hook_registry[i].hooks->addr_check[j].msg_seen = false;
     }
   }
+  // build the lookup tables here, never in the rx/tx path
+  build_rx_check_table(current_hooks->addr_check, (current_hooks->addr_check != NULL) ? current_hooks->addr_check_len : 0);
+  build_tx_msg_table(current_hooks->tx_msgs, (current_hooks->tx_msgs != NULL) ? current_hooks->tx_msgs_len : 0);
   if ((set_status == 0) && (current_hooks->init != NULL)) {
     current_hooks->init(param);
   }
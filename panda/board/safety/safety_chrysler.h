@@ -212,4 +212,6 @@ const safety_hooks chrysler_hooks = {
   .fwd = chrysler_fwd_hook,
   .addr_check = chrysler_rx_checks,
   .addr_check_len = sizeof(chrysler_rx_checks) / sizeof(chrysler_rx_checks[0]),
+  .tx_msgs = CHRYSLER_TX_MSGS,
+  .tx_msgs_len = sizeof(CHRYSLER_TX_MSGS) / sizeof(CHRYSLER_TX_MSGS[0]),
 };
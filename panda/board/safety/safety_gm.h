@@ -218,4 +218,6 @@ const safety_hooks gm_hooks = {
   .fwd = default_fwd_hook,
   .addr_check = gm_rx_checks,
   .addr_check_len = sizeof(gm_rx_checks) / sizeof(gm_rx_checks[0]),
+  .tx_msgs = GM_TX_MSGS,
+  .tx_msgs_len = sizeof(GM_TX_MSGS) / sizeof(GM_TX_MSGS[0]),
 };
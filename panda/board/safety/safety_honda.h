@@ -393,6 +393,8 @@ const safety_hooks honda_nidec_hooks = {
   .fwd = honda_nidec_fwd_hook,
   .addr_check = honda_rx_checks,
   .addr_check_len = sizeof(honda_rx_checks) / sizeof(honda_rx_checks[0]),
+  .tx_msgs = HONDA_N_TX_MSGS,
+  .tx_msgs_len = sizeof(HONDA_N_TX_MSGS) / sizeof(HONDA_N_TX_MSGS[0]),
 };
 
 const safety_hooks honda_bosch_giraffe_hooks = {
@@ -403,6 +405,8 @@ const safety_hooks honda_bosch_giraffe_hooks = {
   .fwd = honda_bosch_fwd_hook,
   .addr_check = honda_rx_checks,
   .addr_check_len = sizeof(honda_rx_checks) / sizeof(honda_rx_checks[0]),
+  .tx_msgs = HONDA_BG_TX_MSGS,
+  .tx_msgs_len = sizeof(HONDA_BG_TX_MSGS) / sizeof(HONDA_BG_TX_MSGS[0]),
 };
 
 const safety_hooks honda_bosch_harness_hooks = {
@@ -413,4 +417,6 @@ const safety_hooks honda_bosch_harness_hooks = {
   .fwd = honda_bosch_fwd_hook,
   .addr_check = honda_bh_rx_checks,
   .addr_check_len = sizeof(honda_bh_rx_checks) / sizeof(honda_bh_rx_checks[0]),
+  .tx_msgs = HONDA_BH_TX_MSGS,
+  .tx_msgs_len = sizeof(HONDA_BH_TX_MSGS) / sizeof(HONDA_BH_TX_MSGS[0]),
 };
@@ -293,6 +293,8 @@ const safety_hooks hyundai_hooks = {
   .fwd = hyundai_fwd_hook,
   .addr_check = hyundai_rx_checks,
   .addr_check_len = sizeof(hyundai_rx_checks) / sizeof(hyundai_rx_checks[0]),
+  .tx_msgs = HYUNDAI_TX_MSGS,
+  .tx_msgs_len = sizeof(HYUNDAI_TX_MSGS) / sizeof(HYUNDAI_TX_MSGS[0]),
 };
 
 const safety_hooks hyundai_legacy_hooks = {
@@ -303,4 +305,6 @@ const safety_hooks hyundai_legacy_hooks = {
   .fwd = hyundai_fwd_hook,
   .addr_check = hyundai_legacy_rx_checks,
   .addr_check_len = sizeof(hyundai_legacy_rx_checks) / sizeof(hyundai_legacy_rx_checks[0]),
+  .tx_msgs = HYUNDAI_TX_MSGS,
+  .tx_msgs_len = sizeof(HYUNDAI_TX_MSGS) / sizeof(HYUNDAI_TX_MSGS[0]),
 };
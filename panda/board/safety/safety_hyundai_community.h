@@ -299,4 +299,6 @@ const safety_hooks hyundai_community_hooks = {
   .fwd = hyundai_community_fwd_hook,
   .addr_check = hyundai_community_rx_checks,
   .addr_check_len = sizeof(hyundai_community_rx_checks) / sizeof(hyundai_community_rx_checks[0]),
+  .tx_msgs = HYUNDAI_COMMUNITY_TX_MSGS,
+  .tx_msgs_len = sizeof(HYUNDAI_COMMUNITY_TX_MSGS) / sizeof(HYUNDAI_COMMUNITY_TX_MSGS[0]),
 };
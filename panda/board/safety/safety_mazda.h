@@ -198,4 +198,6 @@ const safety_hooks mazda_hooks = {
   .fwd = mazda_fwd_hook,
   .addr_check = mazda_rx_checks,
   .addr_check_len = sizeof(mazda_rx_checks) / sizeof(mazda_rx_checks[0]),
+  .tx_msgs = MAZDA_TX_MSGS,
+  .tx_msgs_len = sizeof(MAZDA_TX_MSGS) / sizeof(MAZDA_TX_MSGS[0]),
 };
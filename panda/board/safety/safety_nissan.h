@@ -204,4 +204,6 @@ const safety_hooks nissan_hooks = {
   .fwd = nissan_fwd_hook,
   .addr_check = nissan_rx_checks,
   .addr_check_len = sizeof(nissan_rx_checks) / sizeof(nissan_rx_checks[0]),
+  .tx_msgs = NISSAN_TX_MSGS,
+  .tx_msgs_len = sizeof(NISSAN_TX_MSGS) / sizeof(NISSAN_TX_MSGS[0]),
 };
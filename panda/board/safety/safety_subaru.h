@@ -328,6 +328,8 @@ const safety_hooks subaru_hooks = {
   .fwd = subaru_fwd_hook,
   .addr_check = subaru_rx_checks,
   .addr_check_len = sizeof(subaru_rx_checks) / sizeof(subaru_rx_checks[0]),
+  .tx_msgs = SUBARU_TX_MSGS,
+  .tx_msgs_len = sizeof(SUBARU_TX_MSGS) / sizeof(SUBARU_TX_MSGS[0]),
 };
 
 const safety_hooks subaru_legacy_hooks = {
@@ -338,4 +340,6 @@ const safety_hooks subaru_legacy_hooks = {
   .fwd = subaru_legacy_fwd_hook,
   .addr_check = subaru_l_rx_checks,
   .addr_check_len = sizeof(subaru_l_rx_checks) / sizeof(subaru_l_rx_checks[0]),
+  .tx_msgs = SUBARU_L_TX_MSGS,
+  .tx_msgs_len = sizeof(SUBARU_L_TX_MSGS) / sizeof(SUBARU_L_TX_MSGS[0]),
 };
@@ -203,4 +203,6 @@ const safety_hooks tesla_hooks = {
   .fwd = tesla_fwd_hook,
   .addr_check = tesla_rx_checks,
   .addr_check_len = TESLA_RX_CHECK_LEN,
+  .tx_msgs = TESLA_TX_MSGS,
+  .tx_msgs_len = sizeof(TESLA_TX_MSGS) / sizeof(TESLA_TX_MSGS[0]),
 };
@@ -285,4 +285,6 @@ const safety_hooks toyota_hooks = {
   .fwd = toyota_fwd_hook,
   .addr_check = toyota_rx_checks,
   .addr_check_len = sizeof(toyota_rx_checks)/sizeof(toyota_rx_checks[0]),
+  .tx_msgs = TOYOTA_TX_MSGS,
+  .tx_msgs_len = sizeof(TOYOTA_TX_MSGS) / sizeof(TOYOTA_TX_MSGS[0]),
 };
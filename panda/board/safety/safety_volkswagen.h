@@ -392,6 +392,8 @@ const safety_hooks volkswagen_mqb_hooks = {
   .fwd = volkswagen_fwd_hook,
   .addr_check = volkswagen_mqb_rx_checks,
   .addr_check_len = sizeof(volkswagen_mqb_rx_checks) / sizeof(volkswagen_mqb_rx_checks[0]),
+  .tx_msgs = VOLKSWAGEN_MQB_TX_MSGS,
+  .tx_msgs_len = sizeof(VOLKSWAGEN_MQB_TX_MSGS) / sizeof(VOLKSWAGEN_MQB_TX_MSGS[0]),
 };
 
 // Volkswagen PQ35/PQ46/NMS platforms
@@ -403,4 +405,6 @@ const safety_hooks volkswagen_pq_hooks = {
   .fwd = volkswagen_fwd_hook,
   .addr_check = volkswagen_pq_rx_checks,
   .addr_check_len = sizeof(volkswagen_pq_rx_checks) / sizeof(volkswagen_pq_rx_checks[0]),
+  .tx_msgs = VOLKSWAGEN_PQ_TX_MSGS,
+  .tx_msgs_len = sizeof(VOLKSWAGEN_PQ_TX_MSGS) / sizeof(VOLKSWAGEN_PQ_TX_MSGS[0]),
 };
@@ -43,6 +43,28 @@ typedef struct {
   bool lagging;                      // true if and only if the time between updates is excessive
 } AddrCheckStruct;
 
+// open addressing tables that map a (bus, addr) to its entries in a CanMsg or AddrCheckStruct list,
+// so the per frame lookup doesn't depend on how many messages a safety mode checks
+#define ADDR_TABLE_SIZE 128U  // power of 2, at least twice the longest list so probe chains stay short
+#define ADDR_TABLE_BITS 7U
+#define ADDR_TABLE_MIN_TX_MSGS 8  // shorter tx lists are scanned, see tests/safety_benchmark.c
+
+typedef struct {
+  uint32_t addr;
+  uint8_t bus;
+  uint8_t len;
+  int8_t check_idx;  // index into the list, -1 for an empty slot
+  int8_t msg_idx;    // index into AddrCheckStruct.msg, 0 for CanMsg lists
+} AddrTableEntry;
+
+typedef struct {
+  const void *list;  // list the table was built from
+  int list_len;
+  uint32_t num_entries;
+  bool linear;       // list doesn't fit, fall back to scanning it
+  AddrTableEntry entries[ADDR_TABLE_SIZE];
+} AddrTable;
+
 int safety_rx_hook(CAN_FIFOMailBox_TypeDef *to_push);
 int safety_tx_hook(CAN_FIFOMailBox_TypeDef *to_send);
 int safety_tx_lin_hook(int lin_num, uint8_t *data, int len);
@@ -87,6 +109,8 @@ typedef struct {
   fwd_hook fwd;
   AddrCheckStruct *addr_check;
   const int addr_check_len;
+  const CanMsg *tx_msgs;             // list passed to msg_allowed, looked up through a table built in set_safety_hooks
+  const int tx_msgs_len;
 } safety_hooks;
 
 void safety_tick(const safety_hooks *hooks);
@@ -0,0 +1,22 @@
+// Every safety model compiled for the host as a shared library, for replaying
+// logged CAN through the same hooks the firmware runs.
+
+#include "safety_host.h"
+
+void safety_set_timer(uint32_t us) {
+  host_timer = us;
+}
+
+// called at 1Hz by the firmware's tick handler
+void safety_periodic_tick(void) {
+  safety_mode_cnt += 1U;
+  safety_tick(current_hooks);
+}
+
+bool safety_get_controls_allowed(void) {
+  return controls_allowed;
+}
+
+bool safety_get_relay_malfunction(void) {
+  return relay_malfunction;
+}
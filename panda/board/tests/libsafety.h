@@ -0,0 +1,32 @@
+// Host build of the panda safety models, see libsafety.c
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef struct {
+  uint32_t RIR;
+  uint32_t RDTR;
+  uint32_t RDLR;
+  uint32_t RDHR;
+} CAN_FIFOMailBox_TypeDef;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// from safety.h
+int set_safety_hooks(uint16_t mode, int16_t param);
+int safety_rx_hook(CAN_FIFOMailBox_TypeDef *to_push);
+int safety_tx_hook(CAN_FIFOMailBox_TypeDef *to_send);
+int safety_fwd_hook(int bus_num, CAN_FIFOMailBox_TypeDef *to_fwd);
+
+// what the firmware does around the hooks
+void safety_set_timer(uint32_t us);
+void safety_periodic_tick(void);
+bool safety_get_controls_allowed(void);
+bool safety_get_relay_malfunction(void);
+
+#ifdef __cplusplus
+}
+#endif
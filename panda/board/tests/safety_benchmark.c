@@ -0,0 +1,219 @@
+/*
+gcc -O2 -std=gnu11 safety_benchmark.c -o safety_benchmark && ./safety_benchmark [can dump]
+
+Replays CAN frames through the Hyundai and Toyota safety hooks, comparing the
+address check table lookups against the linear scans they replaced.
+
+A can dump has one frame per line: "<bus> <addr> <hex data>", e.g. from a log with
+  for msg in LogReader(path): [print(c.src, c.address, c.dat.hex()) for c in msg.can] if msg.which() == 'can' else None
+Without one, ten minutes of synthetic 100 Hz traffic is generated for every checked
+message plus unchecked addresses, like a car's powertrain bus.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "safety_host.h"
+
+#define MAX_FRAMES (1024 * 1024 * 8)
+#define NUM_UNCHECKED 60
+
+typedef struct {
+  CAN_FIFOMailBox_TypeDef msg;
+  uint32_t dt_us;  // time since the previous frame
+} Frame;
+
+// The lookups before the address check tables, kept as the reference implementation
+static bool legacy_msg_allowed(CAN_FIFOMailBox_TypeDef *to_send, const CanMsg msg_list[], int len) {
+  int addr = GET_ADDR(to_send);
+  int bus = GET_BUS(to_send);
+  int length = GET_LEN(to_send);
+
+  bool allowed = false;
+  for (int i = 0; i < len; i++) {
+    if ((addr == msg_list[i].addr) && (bus == msg_list[i].bus) && (length == msg_list[i].len)) {
+      allowed = true;
+      break;
+    }
+  }
+  return allowed;
+}
+
+static int legacy_get_addr_check_index(CAN_FIFOMailBox_TypeDef *to_push, AddrCheckStruct addr_list[], const int len) {
+  int bus = GET_BUS(to_push);
+  int addr = GET_ADDR(to_push);
+  int length = GET_LEN(to_push);
+
+  int index = -1;
+  for (int i = 0; i < len; i++) {
+    if (!addr_list[i].msg_seen) {
+      for (uint8_t j = 0U; addr_list[i].msg[j].addr != 0; j++) {
+        if ((addr == addr_list[i].msg[j].addr) && (bus == addr_list[i].msg[j].bus) &&
+              (length == addr_list[i].msg[j].len)) {
+          addr_list[i].index = j;
+          addr_list[i].msg_seen = true;
+          break;
+        }
+      }
+    }
+
+    int idx = addr_list[i].index;
+    if ((addr == addr_list[i].msg[idx].addr) && (bus == addr_list[i].msg[idx].bus) &&
+        (length == addr_list[i].msg[idx].len)) {
+      index = i;
+      break;
+    }
+  }
+  return index;
+}
+
+static void set_frame(CAN_FIFOMailBox_TypeDef *msg, int bus, uint32_t addr, int len, const uint8_t dat[8]) {
+  msg->RIR = (addr >= 0x800U) ? ((addr << 3) | 4U) : (addr << 21);
+  msg->RDTR = ((uint32_t)bus << 4) | (uint32_t)len;
+  msg->RDLR = dat[0] | (dat[1] << 8) | (dat[2] << 16) | ((uint32_t)dat[3] << 24);
+  msg->RDHR = dat[4] | (dat[5] << 8) | (dat[6] << 16) | ((uint32_t)dat[7] << 24);
+}
+
+static size_t load_frames(const char *path, Frame *frames) {
+  FILE *f = fopen(path, "r");
+  if (f == NULL) {
+    printf("can't open %s\n", path);
+    exit(1);
+  }
+
+  size_t n = 0;
+  int bus;
+  unsigned int addr;
+  char hex[64];
+  while ((n < MAX_FRAMES) && (fscanf(f, "%d %u %63s", &bus, &addr, hex) == 3)) {
+    uint8_t dat[8] = {0};
+    int len = MIN((int)strlen(hex) / 2, 8);
+    for (int i = 0; i < len; i++) {
+      unsigned int b;
+      sscanf(&hex[i * 2], "%2x", &b);
+      dat[i] = b;
+    }
+    set_frame(&frames[n].msg, bus, addr, len, dat);
+    frames[n].dt_us = 10;  // ~1000 frames per 10 ms, like a busy bus
+    n++;
+  }
+  fclose(f);
+  return n;
+}
+
+static size_t synthesize_frames(const safety_hooks *hooks, Frame *frames) {
+  srand(0);
+  size_t n = 0;
+  for (int t = 0; t < 600 * 100; t++) {
+    size_t start = n;
+    for (int i = 0; i < hooks->addr_check_len; i++) {
+      const CanMsgCheck *m = &hooks->addr_check[i].msg[0];
+      // slower messages only show up every few steps
+      if ((t % MAX(m->expected_timestep / 10000U, 1U)) == 0U) {
+        uint8_t dat[8];
+        for (int b = 0; b < 8; b++) dat[b] = rand();
+        set_frame(&frames[n++].msg, m->bus, m->addr, m->len, dat);
+      }
+    }
+    for (int i = 0; i < NUM_UNCHECKED; i++) {
+      uint8_t dat[8];
+      for (int b = 0; b < 8; b++) dat[b] = rand();
+      set_frame(&frames[n++].msg, i % 8 == 0 ? 2 : 0, 0x100 + i * 13, 8, dat);
+    }
+    for (size_t i = start; i < n; i++) {
+      frames[i].dt_us = (i == start) ? 10000U - (n - start - 1U) : 1U;
+    }
+  }
+  return n;
+}
+
+static double now_ns(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1e9 + t.tv_nsec;
+}
+
+static void bench_mode(const char *name, uint16_t mode, Frame *frames, size_t n, const char *dump) {
+  set_safety_hooks(mode, 0);
+  const safety_hooks *hooks = current_hooks;
+  const CanMsg *tx_msgs = hooks->tx_msgs;
+  int tx_len = hooks->tx_msgs_len;
+  if (dump == NULL) {
+    n = synthesize_frames(hooks, frames);
+  }
+
+  // the tables only serve the mode's own lists, the legacy scan updates the seen flags of a copy
+  AddrCheckStruct *checks = hooks->addr_check;
+  size_t checks_size = hooks->addr_check_len * sizeof(AddrCheckStruct);
+  AddrCheckStruct *legacy_checks = malloc(checks_size);
+  memcpy(legacy_checks, checks, checks_size);
+
+  volatile int sink = 0;
+  double start = now_ns();
+  for (size_t i = 0; i < n; i++) {
+    sink += legacy_get_addr_check_index(&frames[i].msg, legacy_checks, hooks->addr_check_len);
+  }
+  double legacy_rx_ns = (now_ns() - start) / n;
+
+  start = now_ns();
+  for (size_t i = 0; i < n; i++) {
+    sink += get_addr_check_index(&frames[i].msg, checks, hooks->addr_check_len);
+  }
+  double rx_ns = (now_ns() - start) / n;
+
+  start = now_ns();
+  for (size_t i = 0; i < n; i++) {
+    sink += legacy_msg_allowed(&frames[i].msg, tx_msgs, tx_len);
+  }
+  double legacy_tx_ns = (now_ns() - start) / n;
+
+  start = now_ns();
+  for (size_t i = 0; i < n; i++) {
+    sink += msg_allowed(&frames[i].msg, tx_msgs, tx_len);
+  }
+  double tx_ns = (now_ns() - start) / n;
+
+  // both lookups have to agree on every frame
+  size_t mismatches = 0;
+  set_safety_hooks(mode, 0);
+  memcpy(legacy_checks, checks, checks_size);
+  for (size_t i = 0; i < n; i++) {
+    mismatches += legacy_get_addr_check_index(&frames[i].msg, legacy_checks, hooks->addr_check_len) !=
+                  get_addr_check_index(&frames[i].msg, checks, hooks->addr_check_len);
+    mismatches += legacy_msg_allowed(&frames[i].msg, tx_msgs, tx_len) != msg_allowed(&frames[i].msg, tx_msgs, tx_len);
+  }
+
+  // the whole rx hook, as it runs in the CAN interrupt
+  set_safety_hooks(mode, 0);
+  start = now_ns();
+  for (size_t i = 0; i < n; i++) {
+    host_timer_advance(frames[i].dt_us);
+    sink += safety_rx_hook(&frames[i].msg);
+  }
+  double hook_ns = (now_ns() - start) / n;
+
+  printf("%s: %zu frames, %d rx checks, %d tx msgs\n", name, n, hooks->addr_check_len, tx_len);
+  printf("  get_addr_check_index: %6.1f -> %6.1f ns/frame\n", legacy_rx_ns, rx_ns);
+  printf("  msg_allowed:          %6.1f -> %6.1f ns/frame\n", legacy_tx_ns, tx_ns);
+  printf("  rx hook:              %6.1f ns/frame\n", hook_ns);
+  printf("  %zu lookups differ\n", mismatches);
+
+  free(legacy_checks);
+  if (mismatches != 0U) {
+    exit(1);
+  }
+}
+
+int main(int argc, char *argv[]) {
+  const char *dump = (argc > 1) ? argv[1] : NULL;
+  Frame *frames = malloc(MAX_FRAMES * sizeof(Frame));
+  size_t n = (dump != NULL) ? load_frames(dump, frames) : 0;
+
+  bench_mode("hyundai", SAFETY_HYUNDAI, frames, n, dump);
+  bench_mode("toyota", SAFETY_TOYOTA, frames, n, dump);
+
+  free(frames);
+  return 0;
+}
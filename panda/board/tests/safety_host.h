@@ -0,0 +1,73 @@
+// Definitions the safety code expects from the firmware, so the safety models
+// can be compiled and run on the host. Include instead of main.c, then safety.h.
+
+#include <stddef.h>
+
+#include "libsafety.h"
+
+// from stm32fx/llcan.h
+#define GET_BUS(msg) (((msg)->RDTR >> 4) & 0xFF)
+#define GET_LEN(msg) ((msg)->RDTR & 0xF)
+#define GET_ADDR(msg) ((((msg)->RIR & 4) != 0) ? ((msg)->RIR >> 3) : ((msg)->RIR >> 21))
+#define GET_BYTE(msg, b) (((int)(b) > 3) ? (((msg)->RDHR >> (8U * ((unsigned int)(b) % 4U))) & 0xFFU) : (((msg)->RDLR >> (8U * (unsigned int)(b))) & 0xFFU))
+#define GET_BYTES_04(msg) ((msg)->RDLR)
+#define GET_BYTES_48(msg) ((msg)->RDHR)
+#define GET_FLAG(value, mask) (((__typeof__(mask))(value) & (mask)) == (mask))
+
+// from config.h
+#define MIN(a,b) \
+ ({ __typeof__ (a) _a = (a); \
+     __typeof__ (b) _b = (b); \
+   (_a < _b) ? _a : _b; })
+
+#define MAX(a,b) \
+ ({ __typeof__ (a) _a = (a); \
+     __typeof__ (b) _b = (b); \
+   (_a > _b) ? _a : _b; })
+
+#define ABS(a) \
+ ({ __typeof__ (a) _a = (a); \
+   (_a > 0) ? _a : (-_a); })
+
+#define UNUSED(x) (void)(x)
+
+// debug output from the safety modes is dropped
+#define puts(a) UNUSED(a)
+#define puth(a) UNUSED(a)
+
+// from boards/board_declarations.h
+#define CAN_MODE_NORMAL 0U
+#define CAN_MODE_GMLAN_CAN2 1U
+#define CAN_MODE_GMLAN_CAN3 2U
+#define CAN_MODE_OBD_CAN2 3U
+
+typedef struct {
+  const bool has_obd;
+  void (*set_can_mode)(uint8_t mode);
+} board;
+
+static void host_set_can_mode(uint8_t mode) {
+  UNUSED(mode);
+}
+
+const board host_board = {.has_obd = true, .set_can_mode = host_set_can_mode};
+const board *current_board = &host_board;
+
+// the host advances time explicitly, see host_timer_advance
+uint32_t host_timer = 0U;
+
+uint32_t microsecond_timer_get(void) {
+  return host_timer;
+}
+
+void host_timer_advance(uint32_t us) {
+  host_timer += us;
+}
+
+#include "../faults.h"
+
+#define ALLOW_DEBUG
+#include "../safety.h"
+
+#undef puts
+#undef puth
@@ -0,0 +1,183 @@
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include <capnp/schema.h>
+#include <capnp/serialize.h>
+#include "cereal/gen/cpp/car.capnp.h"
+#include "cereal/gen/cpp/log.capnp.h"
+
+#include "libsafety.h"
+
+// Replays the CAN of a log through the panda safety hooks, the same way the firmware
+// calls them, and reports ns/frame per hook and the decisions the hooks made.
+// Exits non zero if the safety model rejected received frames or blocked sends while
+// controls were allowed.
+//
+// usage: safety_replay <decompressed rlog> [safety model] [safety param]
+// The safety model and param default to the ones in the log's carParams,
+// models are named as in car.capnp, e.g. hyundaiCommunity.
+
+struct HookStats {
+  const char *name;
+  uint64_t frames = 0;
+  double total_ns = 0;
+  std::vector<double> batch_ns;  // ns/frame of every event
+
+  template <typename F>
+  void time(size_t n, F f) {
+    if (n == 0) return;
+    auto start = std::chrono::steady_clock::now();
+    f();
+    double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+    frames += n;
+    total_ns += ns;
+    batch_ns.push_back(ns / n);
+  }
+
+  void print() {
+    if (frames == 0) {
+      printf("%-4s: no frames\n", name);
+      return;
+    }
+    std::sort(batch_ns.begin(), batch_ns.end());
+    printf("%-4s: %8lu frames, %6.1f ns/frame, p99 event %6.1f ns/frame, max event %6.1f ns/frame\n",
+           name, (unsigned long)frames, total_ns / frames, batch_ns[batch_ns.size() * 99 / 100], batch_ns.back());
+  }
+};
+
+static int safety_model_from_name(const std::string &name) {
+  for (auto e : capnp::Schema::from<cereal::CarParams::SafetyModel>().getEnumerants()) {
+    if (name == e.getProto().getName().cStr()) return e.getOrdinal();
+  }
+  return -1;
+}
+
+static void to_mailbox(cereal::CanData::Reader can, CAN_FIFOMailBox_TypeDef *msg) {
+  uint32_t addr = can.getAddress();
+  auto dat = can.getDat();
+  uint8_t buf[8] = {0};
+  memcpy(buf, dat.begin(), std::min(dat.size(), sizeof(buf)));
+
+  msg->RIR = (addr >= 0x800U) ? ((addr << 3) | 4U) : (addr << 21);
+  msg->RDTR = ((uint32_t)(can.getSrc() & 0x7FU) << 4) | std::min(dat.size(), sizeof(buf));
+  msg->RDLR = buf[0] | (buf[1] << 8) | (buf[2] << 16) | ((uint32_t)buf[3] << 24);
+  msg->RDHR = buf[4] | (buf[5] << 8) | (buf[6] << 16) | ((uint32_t)buf[7] << 24);
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 2) {
+    printf("usage: %s <decompressed rlog> [safety model] [safety param]\n", argv[0]);
+    return 1;
+  }
+
+  std::ifstream f(argv[1], std::ios::binary | std::ios::ate);
+  assert(f.good());
+  size_t size = f.tellg();
+  kj::Array<capnp::word> buf = kj::heapArray<capnp::word>(size / sizeof(capnp::word) + 1);
+  f.seekg(0);
+  f.read((char *)buf.begin(), size);
+
+  std::vector<kj::ArrayPtr<const capnp::word>> events;
+  int safety_model = -1, safety_param = 0;
+  kj::ArrayPtr<const capnp::word> words(buf.begin(), size / sizeof(capnp::word));
+  while (words.size() > 0) {
+    capnp::FlatArrayMessageReader reader(words);
+    kj::ArrayPtr<const capnp::word> event_words(words.begin(), reader.getEnd());
+    cereal::Event::Reader event = reader.getRoot<cereal::Event>();
+    if (event.which() == cereal::Event::CAR_PARAMS && safety_model < 0) {
+      safety_model = (int)event.getCarParams().getSafetyModel();
+      safety_param = event.getCarParams().getSafetyParam();
+    }
+    if (event.which() == cereal::Event::CAN || event.which() == cereal::Event::SENDCAN) {
+      events.push_back(event_words);
+    }
+    words = kj::arrayPtr(reader.getEnd(), words.end());
+  }
+
+  if (argc > 2) {
+    safety_model = safety_model_from_name(argv[2]);
+    safety_param = (argc > 3) ? atoi(argv[3]) : 0;
+  }
+  if (safety_model < 0 || set_safety_hooks(safety_model, safety_param) != 0) {
+    printf("unknown safety model, pass one that is in car.capnp and built in\n");
+    return 1;
+  }
+  printf("safety model %d, param %d, %zu CAN events\n", safety_model, safety_param, events.size());
+
+  HookStats rx = {"rx"}, tx = {"tx"}, fwd = {"fwd"};
+  uint64_t rx_invalid = 0, tx_blocked = 0, tx_controls_blocked = 0;
+  // -1 is the normal "don't forward" result, a frame only counts as blocked
+  // when other frames from its bus are forwarded
+  uint64_t fwd_forwarded[4] = {0}, fwd_dropped[4] = {0};
+  uint64_t last_tick = 0;
+  std::vector<CAN_FIFOMailBox_TypeDef> msgs;
+
+  for (auto event_words : events) {
+    capnp::FlatArrayMessageReader reader(event_words);
+    cereal::Event::Reader event = reader.getRoot<cereal::Event>();
+    uint64_t mono_time = event.getLogMonoTime();
+    safety_set_timer(mono_time / 1000U);
+    if (mono_time - last_tick >= 1000000000ULL) {
+      safety_periodic_tick();
+      last_tick = mono_time;
+    }
+
+    msgs.clear();
+    if (event.which() == cereal::Event::SENDCAN) {
+      for (auto can : event.getSendcan()) {
+        msgs.emplace_back();
+        to_mailbox(can, &msgs.back());
+      }
+
+      // controls can only change on rx, it's the same for every frame of the event
+      bool controls_allowed = safety_get_controls_allowed();
+      uint64_t blocked = 0;
+      tx.time(msgs.size(), [&]() {
+        for (auto &msg : msgs) blocked += safety_tx_hook(&msg) == 0;
+      });
+      tx_blocked += blocked;
+      tx_controls_blocked += controls_allowed ? blocked : 0;
+    } else {
+      // frames sent or rejected by the panda are echoed with the high bits of src set
+      for (auto can : event.getCan()) {
+        if (can.getSrc() >= 128) continue;
+        msgs.emplace_back();
+        to_mailbox(can, &msgs.back());
+      }
+
+      rx.time(msgs.size(), [&]() {
+        for (auto &msg : msgs) rx_invalid += safety_rx_hook(&msg) == 0;
+      });
+      fwd.time(msgs.size(), [&]() {
+        for (auto &msg : msgs) {
+          int bus = (msg.RDTR >> 4) & 0x3U;
+          if (safety_fwd_hook(bus, &msg) == -1) {
+            fwd_dropped[bus]++;
+          } else {
+            fwd_forwarded[bus]++;
+          }
+        }
+      });
+    }
+  }
+
+  uint64_t fwd_blocked = 0;
+  for (int bus = 0; bus < 4; bus++) {
+    if (fwd_forwarded[bus] > 0) fwd_blocked += fwd_dropped[bus];
+  }
+
+  rx.print();
+  tx.print();
+  fwd.print();
+  printf("rx invalid: %lu, tx blocked: %lu (%lu while controls allowed), fwd blocked: %lu, relay malfunction: %d\n",
+         (unsigned long)rx_invalid, (unsigned long)tx_blocked, (unsigned long)tx_controls_blocked,
+         (unsigned long)fwd_blocked, safety_get_relay_malfunction());
+  return (rx_invalid > 0 || tx_controls_blocked > 0) ? 1 : 0;
+}
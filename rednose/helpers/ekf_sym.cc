@@ -3,6 +3,69 @@
 using namespace EKFS;
 using namespace Eigen;
 
+void Observation::reset(double t, int kind) {
+  this->t = t;
+  this->kind = kind;
+  this->offsets.clear();
+  this->z_rows.clear();
+  this->extra_args_size.clear();
+  this->data.clear();
+}
+
+void Observation::add(const Map<VectorXd> &z, const Map<MatrixXdr> &R, const std::vector<double> &extra_args) {
+  assert(z.rows() == R.rows());
+  assert(z.rows() == R.cols());
+
+  this->offsets.push_back(this->data.size());
+  this->z_rows.push_back(z.rows());
+  this->extra_args_size.push_back(extra_args.size());
+  this->data.insert(this->data.end(), z.data(), z.data() + z.size());
+  this->data.insert(this->data.end(), R.data(), R.data() + R.size());
+  this->data.insert(this->data.end(), extra_args.begin(), extra_args.end());
+}
+
+void RewindHistory::init(int capacity, int dim_x, int dim_err) {
+  this->capacity = capacity;
+  this->dim_x = dim_x;
+  this->dim_err = dim_err;
+  this->t.resize(capacity);
+  this->states.resize(capacity * dim_x);
+  this->covs.resize(capacity * dim_err * dim_err);
+  this->observations.resize(capacity);
+  this->clear();
+}
+
+void RewindHistory::clear() {
+  this->start = 0;
+  this->count = 0;
+}
+
+void RewindHistory::push(double filter_time, const VectorXd &x, const MatrixXdr &P, const Observation &obs) {
+  assert(x.size() == this->dim_x && P.size() == this->dim_err * this->dim_err);
+  if (this->count == this->capacity) {
+    this->start = this->slot(1);
+    this->count--;
+  }
+
+  int i = this->slot(this->count++);
+  this->t[i] = filter_time;
+  memcpy(&this->states[i * this->dim_x], x.data(), this->dim_x * sizeof(double));
+  memcpy(&this->covs[i * this->dim_err * this->dim_err], P.data(), this->dim_err * this->dim_err * sizeof(double));
+  this->observations[i] = obs;
+}
+
+void RewindHistory::pop_back(Observation &obs) {
+  assert(this->count > 0);
+  std::swap(this->observations[this->slot(--this->count)], obs);
+}
+
+double RewindHistory::restore_back(VectorXd &x, MatrixXdr &P) const {
+  int i = this->slot(this->count - 1);
+  memcpy(x.data(), &this->states[i * this->dim_x], this->dim_x * sizeof(double));
+  memcpy(P.data(), &this->covs[i * this->dim_err * this->dim_err], this->dim_err * this->dim_err * sizeof(double));
+  return this->t[i];
+}
+
 EKFSym::EKFSym(std::string name, Map<MatrixXdr> Q, Map<VectorXd> x_initial, Map<MatrixXdr> P_initial, int dim_main,
     int dim_main_err, int N, int dim_augment, int dim_augment_err, std::vector<int> maha_test_kinds,
     std::vector<int> quaternion_idxs, std::vector<std::string> global_vars, double max_rewind_age)
@@ -39,6 +102,8 @@ EKFSym::EKFSym(std::string name, Map<MatrixXdr> Q, Map<VectorXd> x_initial, Map<
   this->Q = Q;
 
   this->max_rewind_age = max_rewind_age;
+  this->rewind_history.init(REWIND_TO_KEEP, this->dim_x, this->dim_err);
+  this->rewound.resize(REWIND_TO_KEEP);
   this->init_state(x_initial, P_initial, NAN);
 }
 
@@ -85,103 +150,85 @@ std::optional<Estimate> EKFSym::predict_and_update_batch(double t, int kind, std
 {
   // TODO handle rewinding at this level
 
-  std::deque<Observation> rewound;
+  int rewound = 0;
   if (!std::isnan(this->filter_time) && t < this->filter_time) {
-    if (this->rewind_t.empty() || t < this->rewind_t.front() || t < this->rewind_t.back() - this->max_rewind_age) {
+    if (this->rewind_history.empty() || t < this->rewind_history.front_t() || t < this->rewind_history.back_t() - this->max_rewind_age) {
       std::cout << "observation too old at " << t << " with filter at " << this->filter_time << ", ignoring" << std::endl;
       return std::nullopt;
     }
     rewound = this->rewind(t);
   }
 
-  Observation obs;
-  obs.t = t;
-  obs.kind = kind;
-  obs.extra_args = extra_args;
-  for (Map<VectorXd> zi : z_map) {
-    obs.z.push_back(zi);
-  }
-  for (Map<MatrixXdr> Ri : R_map) {
-    obs.R.push_back(Ri);
+  assert(z_map.size() == R_map.size());
+  assert(z_map.size() == extra_args.size());
+  this->new_obs.reset(t, kind);
+  for (size_t i = 0; i < z_map.size(); i++) {
+    this->new_obs.add(z_map[i], R_map[i], extra_args[i]);
   }
 
-  std::optional<Estimate> res = std::make_optional(this->predict_and_update_batch(obs, augment));
+  std::optional<Estimate> res = std::make_optional<Estimate>();
+  this->predict_and_update_batch(this->new_obs, augment, &*res);
 
   // optional fast forward
-  while (!rewound.empty()) {
-    this->predict_and_update_batch(rewound.front(), false);
-    rewound.pop_front();
+  for (int i = 0; i < rewound; i++) {
+    this->predict_and_update_batch(this->rewound[i], false, nullptr);
   }
 
   return res;
 }
 
 void EKFSym::reset_rewind() {
-  this->rewind_obscache.clear();
-  this->rewind_t.clear();
-  this->rewind_states.clear();
+  this->rewind_history.clear();
 }
 
-std::deque<Observation> EKFSym::rewind(double t) {
-  std::deque<Observation> rewound;
-
+// returns the number of observations undone, in rewound
+int EKFSym::rewind(double t) {
   // rewind observations until t is after previous observation
-  while (this->rewind_t.back() > t) {
-    rewound.push_front(this->rewind_obscache.back());
-    this->rewind_t.pop_back();
-    this->rewind_states.pop_back();
-    this->rewind_obscache.pop_back();
+  int n = 0;
+  while (this->rewind_history.back_t() > t) {
+    this->rewind_history.pop_back(this->rewound[n++]);
   }
+  std::reverse(this->rewound.begin(), this->rewound.begin() + n);
 
   // set the state to the time right before that
-  this->filter_time = this->rewind_t.back();
-  this->x = this->rewind_states.back().first;
-  this->P = this->rewind_states.back().second;
+  this->filter_time = this->rewind_history.restore_back(this->x, this->P);
 
-  return rewound;
+  return n;
 }
 
 void EKFSym::checkpoint(Observation& obs) {
-  // push to rewinder
-  this->rewind_t.push_back(this->filter_time);
-  this->rewind_states.push_back(std::make_pair(this->x, this->P));
-  this->rewind_obscache.push_back(obs);
-
-  // only keep a certain number around
-  if (this->rewind_t.size() > REWIND_TO_KEEP) {
-    this->rewind_t.pop_front();
-    this->rewind_states.pop_front();
-    this->rewind_obscache.pop_front();
-  }
+  // push to rewinder, only keeps a certain number around
+  this->rewind_history.push(this->filter_time, this->x, this->P, obs);
 }
 
-Estimate EKFSym::predict_and_update_batch(Observation& obs, bool augment) {
-  assert(obs.z.size() == obs.R.size());
-  assert(obs.z.size() == obs.extra_args.size());
-
+// res is only filled in when given, the fast forward after a rewind doesn't need it
+void EKFSym::predict_and_update_batch(Observation& obs, bool augment, Estimate *res) {
   this->predict(obs.t);
 
-  Estimate res;
-  res.t = obs.t;
-  res.kind = obs.kind;
-  res.z = obs.z;
-  res.extra_args = obs.extra_args;
-  res.xk1 = this->x;
-  res.Pk1 = this->P;
+  if (res) {
+    res->t = obs.t;
+    res->kind = obs.kind;
+    for (int i = 0; i < obs.size(); i++) {
+      res->z.push_back(obs.z(i));
+      res->extra_args.emplace_back(obs.extra_args(i), obs.extra_args(i) + obs.extra_args_size[i]);
+    }
+    res->xk1 = this->x;
+    res->Pk1 = this->P;
+  }
 
   // update batch
-  std::vector<VectorXd> y;
-  for (int i = 0; i < obs.z.size(); i++) {
-    assert(obs.z[i].rows() == obs.R[i].rows());
-    assert(obs.z[i].rows() == obs.R[i].cols());
-
+  for (int i = 0; i < obs.size(); i++) {
     // update state
-    y.push_back(this->update(obs.kind, obs.z[i], obs.R[i], obs.extra_args[i]));
+    int y_rows = this->update(obs.kind, obs.z(i), obs.R(i), obs.extra_args(i), obs.extra_args_size[i]);
+    if (res) {
+      res->y.push_back(Map<VectorXd>(this->y.data(), y_rows));
+    }
   }
 
-  res.xk = this->x;
-  res.Pk = this->P;
-  res.y = y;
+  if (res) {
+    res->xk = this->x;
+    res->Pk = this->P;
+  }
 
   assert(!augment); // TODO
   // if (augment) {
@@ -189,8 +236,6 @@ Estimate EKFSym::predict_and_update_batch(Observation& obs, bool augment) {
   // }
 
   this->checkpoint(obs);
-
-  return res;
 }
 
 void EKFSym::predict(double t) {
@@ -208,14 +253,17 @@ void EKFSym::predict(double t) {
   this->filter_time = t;
 }
 
-VectorXd EKFSym::update(int kind, VectorXd z, MatrixXdr R, std::vector<double> extra_args) {
-  this->ekf->updates.at(kind)(this->x.data(), this->P.data(), z.data(), R.data(), extra_args.data());
+// returns the number of rows of the innovation, left in y
+int EKFSym::update(int kind, Map<VectorXd> z, Map<MatrixXdr> R, double *extra_args, int extra_args_size) {
+  // the update overwrites z with the innovation, the observation has to stay intact for a rewind
+  this->y.assign(z.data(), z.data() + z.rows());
+  this->ekf->updates.at(kind)(this->x.data(), this->P.data(), this->y.data(), R.data(), extra_args);
   this->normalize_quaternions();
 
   if (this->msckf && std::find(this->feature_track_kinds.begin(), this->feature_track_kinds.end(), kind) != this->feature_track_kinds.end()) {
-    return z.head(z.rows() - extra_args.size());
+    return z.rows() - extra_args_size;
   }
-  return z;
+  return z.rows();
 }
 
 extra_routine_t EKFSym::get_extra_routine(const std::string& routine) {
@@ -2,9 +2,10 @@
 
 #include <iostream>
 #include <cassert>
+#include <cstring>
 #include <string>
 #include <vector>
-#include <deque>
+#include <algorithm>
 #include <unordered_map>
 #include <map>
 #include <cmath>
@@ -20,14 +21,60 @@ namespace EKFS {
 
 typedef Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> MatrixXdr;
 
+// z, R and extra args of each measurement are stored back to back in data, so
+// an observation that is reused keeps its capacity instead of reallocating
 typedef struct Observation {
   double t;
   int kind;
-  std::vector<Eigen::VectorXd> z;
-  std::vector<MatrixXdr> R;
-  std::vector<std::vector<double>> extra_args;
+  std::vector<int> offsets;  // of each measurement in data
+  std::vector<int> z_rows;
+  std::vector<int> extra_args_size;
+  std::vector<double> data;
+
+  void reset(double t, int kind);
+  void add(const Eigen::Map<Eigen::VectorXd> &z, const Eigen::Map<MatrixXdr> &R, const std::vector<double> &extra_args);
+  int size() const { return z_rows.size(); }
+  Eigen::Map<Eigen::VectorXd> z(int i) { return Eigen::Map<Eigen::VectorXd>(data.data() + offsets[i], z_rows[i]); }
+  Eigen::Map<MatrixXdr> R(int i) { return Eigen::Map<MatrixXdr>(data.data() + offsets[i] + z_rows[i], z_rows[i], z_rows[i]); }
+  double *extra_args(int i) { return data.data() + offsets[i] + z_rows[i] * (1 + z_rows[i]); }
 } Observation;
 
+// The last `capacity` observations, each with the filter time, state and covs
+// right after it was applied. A rewind restores the newest one it keeps, the
+// state after the last observation older than the one coming in. States and
+// covs are kept in preallocated slabs and observations are copied into slots
+// that keep their capacity, so after the first few checkpoints neither push
+// nor pop_back allocate.
+class RewindHistory {
+public:
+  void init(int capacity, int dim_x, int dim_err);
+  void clear();
+  int size() const { return count; }
+  bool empty() const { return count == 0; }
+  double front_t() const { return t[start]; }
+  double back_t() const { return t[slot(count - 1)]; }
+
+  // drops the oldest checkpoint when full
+  void push(double filter_time, const Eigen::VectorXd &x, const MatrixXdr &P, const Observation &obs);
+  // drops the newest checkpoint, swapping its observation into obs
+  void pop_back(Observation &obs);
+  // filter time, state and covs of the newest checkpoint
+  double restore_back(Eigen::VectorXd &x, MatrixXdr &P) const;
+
+private:
+  int slot(int i) const { return (start + i) % capacity; }
+
+  int capacity = 0;
+  int dim_x = 0;
+  int dim_err = 0;
+  int start = 0;
+  int count = 0;
+  std::vector<double> t;
+  std::vector<double> states;  // capacity x dim_x
+  std::vector<double> covs;  // capacity x dim_err x dim_err
+  std::vector<Observation> observations;
+};
+
 typedef struct Estimate {
   Eigen::VectorXd xk1;
   Eigen::VectorXd xk;
@@ -65,11 +112,11 @@ public:
   extra_routine_t get_extra_routine(const std::string& routine);
 
 private:
-  std::deque<Observation> rewind(double t);
+  int rewind(double t);
   void checkpoint(Observation& obs);
 
-  Estimate predict_and_update_batch(Observation& obs, bool augment);
-  Eigen::VectorXd update(int kind, Eigen::VectorXd z, MatrixXdr R, std::vector<double> extra_args);
+  void predict_and_update_batch(Observation& obs, bool augment, Estimate *res);
+  int update(int kind, Eigen::Map<Eigen::VectorXd> z, Eigen::Map<MatrixXdr> R, double *extra_args, int extra_args_size);
 
   // stuct with linked sympy generated functions
   const EKF *ekf = NULL;
@@ -100,9 +147,11 @@ private:
 
   // rewind stuff
   double max_rewind_age;
-  std::deque<double> rewind_t;
-  std::deque<std::pair<Eigen::VectorXd, MatrixXdr>> rewind_states;
-  std::deque<Observation> rewind_obscache;
+  RewindHistory rewind_history;
+  std::vector<Observation> rewound;  // undone by the last rewind, oldest first
+  Observation new_obs;  // being applied
+
+  std::vector<double> y;  // innovation of the last update
 
   Eigen::VectorXd augment_times;
 
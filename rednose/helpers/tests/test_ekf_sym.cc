@@ -0,0 +1,273 @@
+#define CATCH_CONFIG_MAIN
+#include "catch2/catch.hpp"
+
+#include <deque>
+#include <optional>
+#include <random>
+#include <vector>
+
+#include "rednose/helpers/ekf_sym.h"
+
+using namespace EKFS;
+using namespace Eigen;
+
+// Constant velocity filter, x = [pos, vel], with a position measurement as kind 0.
+// Linear, but every predict and update still depends on the order they run in.
+
+typedef Matrix<double, 2, 2, RowMajor> Matrix2dr;
+
+static void cv_predict(double *in_x, double *in_P, double *in_Q, double dt) {
+  Map<Vector2d> x(in_x);
+  Map<Matrix2dr> P(in_P), Q(in_Q);
+  Matrix2dr F;
+  F << 1, dt, 0, 1;
+  x = F * x;
+  P = F * P * F.transpose() + Q * dt;
+}
+
+static void cv_update_pos(double *in_x, double *in_P, double *in_z, double *in_R, double *in_ea) {
+  Map<Vector2d> x(in_x);
+  Map<Matrix2dr> P(in_P);
+  double y = in_z[0] - x(0);
+  Vector2d K = P.col(0) / (P(0, 0) + in_R[0]);
+  x += K * y;
+  P -= K * P.row(0);
+  in_z[0] = y;
+}
+
+static EKF cv_ekf = [](){
+  EKF ekf;
+  ekf.name = "test_cv";
+  ekf.kinds = {0};
+  ekf.predict = cv_predict;
+  ekf.updates[0] = cv_update_pos;
+  return ekf;
+}();
+ekf_init(cv_ekf);
+
+// The rewind of EKFSym as it was with deques, to compare against
+class DequeRewindFilter {
+public:
+  DequeRewindFilter(const VectorXd &x, const MatrixXdr &P, const MatrixXdr &Q, double max_rewind_age)
+    : x(x), P(P), Q(Q), filter_time(NAN), max_rewind_age(max_rewind_age) {}
+
+  bool predict_and_update(double t, double z, double R) {
+    std::deque<Obs> rewound;
+    if (!std::isnan(filter_time) && t < filter_time) {
+      if (rewind_t.empty() || t < rewind_t.front() || t < rewind_t.back() - max_rewind_age) {
+        return false;
+      }
+      while (rewind_t.back() > t) {
+        rewound.push_front(rewind_obs.back());
+        rewind_t.pop_back();
+        rewind_states.pop_back();
+        rewind_obs.pop_back();
+      }
+      filter_time = rewind_t.back();
+      x = rewind_states.back().first;
+      P = rewind_states.back().second;
+    }
+
+    apply({t, z, R});
+    for (const Obs &obs : rewound) {
+      apply(obs);
+    }
+    return true;
+  }
+
+  VectorXd x;
+  MatrixXdr P;
+  MatrixXdr Q;
+  double filter_time;
+
+private:
+  struct Obs {
+    double t, z, R;
+  };
+
+  void apply(Obs obs) {
+    if (std::isnan(filter_time)) filter_time = obs.t;
+    cv_predict(x.data(), P.data(), Q.data(), obs.t - filter_time);
+    filter_time = obs.t;
+    // the update leaves the innovation in z, the observation is kept for a rewind
+    double y = obs.z;
+    cv_update_pos(x.data(), P.data(), &y, &obs.R, nullptr);
+
+    rewind_t.push_back(filter_time);
+    rewind_states.push_back(std::make_pair(x, P));
+    rewind_obs.push_back(obs);
+    if (rewind_t.size() > REWIND_TO_KEEP) {
+      rewind_t.pop_front();
+      rewind_states.pop_front();
+      rewind_obs.pop_front();
+    }
+  }
+
+  double max_rewind_age;
+  std::deque<double> rewind_t;
+  std::deque<std::pair<VectorXd, MatrixXdr>> rewind_states;
+  std::deque<Obs> rewind_obs;
+};
+
+static Observation make_obs(double t, double z) {
+  VectorXd z_vec = VectorXd::Constant(1, z);
+  MatrixXdr R = MatrixXdr::Constant(1, 1, 0.5);
+  Observation obs;
+  obs.reset(t, 0);
+  obs.add(Map<VectorXd>(z_vec.data(), 1), Map<MatrixXdr>(R.data(), 1, 1), {});
+  return obs;
+}
+
+TEST_CASE("RewindHistory keeps the newest checkpoints across the wrap around") {
+  const int capacity = 8;
+  RewindHistory history;
+  history.init(capacity, 2, 2);
+
+  struct Checkpoint {
+    double t;
+    VectorXd x;
+    MatrixXdr P;
+  };
+  std::deque<Checkpoint> expected;
+
+  std::mt19937 gen(1234);
+  double t = 0;
+  for (int i = 0; i < 500; i++) {
+    // mostly pushes, with runs of pops and the odd clear, so the newest slot
+    // moves back over the start of the slabs as well as forward
+    int op = gen() % 10;
+    if (op < 6) {
+      t += 1;
+      VectorXd x = VectorXd::Constant(2, t);
+      MatrixXdr P = MatrixXdr::Constant(2, 2, -t);
+      history.push(t, x, P, make_obs(t, t));
+      expected.push_back({t, x, P});
+      if ((int)expected.size() > capacity) expected.pop_front();
+    } else if (op < 9) {
+      for (int n = gen() % 4; n > 0 && !expected.empty(); n--) {
+        Observation obs;
+        history.pop_back(obs);
+        REQUIRE(obs.t == expected.back().t);
+        REQUIRE(obs.z(0)(0) == expected.back().t);
+        expected.pop_back();
+      }
+    } else if (gen() % 10 == 0) {
+      history.clear();
+      expected.clear();
+    }
+
+    REQUIRE(history.size() == (int)expected.size());
+    if (!expected.empty()) {
+      REQUIRE(history.front_t() == expected.front().t);
+      REQUIRE(history.back_t() == expected.back().t);
+
+      VectorXd x(2);
+      MatrixXdr P(2, 2);
+      REQUIRE(history.restore_back(x, P) == expected.back().t);
+      REQUIRE(x == expected.back().x);
+      REQUIRE(P == expected.back().P);
+    }
+  }
+}
+
+static std::optional<Estimate> update_pos(EKFSym &filter, double t, double z) {
+  VectorXd z_vec = VectorXd::Constant(1, z);
+  MatrixXdr R = MatrixXdr::Constant(1, 1, 0.5);
+  return filter.predict_and_update_batch(t, 0, {Map<VectorXd>(z_vec.data(), 1)}, {Map<MatrixXdr>(R.data(), 1, 1)}, {{}});
+}
+
+// Runs the observations through EKFSym and the deque filter, checking they
+// accept the same ones and end up bit for bit in the same state after each.
+// Returns how many were rejected as too old
+static int compare_with_deques(const std::vector<std::pair<double, double>> &observations, double max_rewind_age) {
+  Matrix2dr Q = Matrix2dr::Identity() * 0.1;
+  Vector2d x0(0, 1);
+  Matrix2dr P0 = Matrix2dr::Identity() * 10;
+  EKFSym filter("test_cv", Map<MatrixXdr>(Q.data(), 2, 2), Map<VectorXd>(x0.data(), 2), Map<MatrixXdr>(P0.data(), 2, 2),
+                2, 2, 0, 0, 0, {}, {}, {}, max_rewind_age);
+  DequeRewindFilter reference(x0, P0, Q, max_rewind_age);
+
+  int rejected = 0;
+  for (auto [t, z] : observations) {
+    bool accepted = reference.predict_and_update(t, z, 0.5);
+    std::optional<Estimate> res = update_pos(filter, t, z);
+    REQUIRE(res.has_value() == accepted);
+    rejected += !accepted;
+
+    REQUIRE(filter.get_filter_time() == reference.filter_time);
+    REQUIRE(filter.state() == reference.x);
+    REQUIRE(filter.covs() == reference.P);
+  }
+  return rejected;
+}
+
+TEST_CASE("EKFSym rewinds like it did with deques") {
+  const double dt = 0.01;
+  std::vector<std::pair<double, double>> observations;
+  std::mt19937 gen(42);
+  std::normal_distribution<double> noise(0, 0.5);
+
+  // fill the history past REWIND_TO_KEEP so it wraps around
+  int i = 0;
+  for (; i < 2 * REWIND_TO_KEEP + 3; i++) {
+    observations.push_back({i * dt, i * dt + noise(gen)});
+  }
+  // the newest checkpoint is in the third slot, this rewinds over the start of the slabs
+  observations.push_back({(i - 5.5) * dt, (i - 5.5) * dt + noise(gen)});
+
+  // then a stream where every few observations one arrives late
+  for (; i < 3000; i++) {
+    observations.push_back({i * dt, i * dt + noise(gen)});
+    if (gen() % 4 == 0) {
+      double late = (i - 1 - (int)(gen() % 60) + 0.5) * dt;
+      observations.push_back({late, late + noise(gen)});
+    }
+  }
+
+  SECTION("too old for max_rewind_age") {
+    // anything more than 0.3 s late is dropped, well before the history runs out
+    observations.push_back({(i - 40.5) * dt, 0});
+    REQUIRE(compare_with_deques(observations, 0.3) > 0);
+  }
+  SECTION("too old for the history") {
+    // with a max_rewind_age that's never hit only the one older than the oldest
+    // checkpoint is dropped, the one right after it rewinds almost all of them.
+    // Late observations take checkpoints too, end in order to know which is the oldest
+    for (int end = i + REWIND_TO_KEEP; i < end; i++) {
+      observations.push_back({i * dt, i * dt + noise(gen)});
+    }
+    observations.push_back({(i - REWIND_TO_KEEP - 1.5) * dt, 0});
+    observations.push_back({(i - REWIND_TO_KEEP + 1.5) * dt, 0});
+    REQUIRE(compare_with_deques(observations, 1000) == 1);
+  }
+}
+
+TEST_CASE("EKFSym fast forwards in the order the observations were taken") {
+  Matrix2dr Q = Matrix2dr::Identity() * 0.1;
+  Vector2d x0(0, 1);
+  Matrix2dr P0 = Matrix2dr::Identity() * 10;
+  auto make_filter = [&]() {
+    return EKFSym("test_cv", Map<MatrixXdr>(Q.data(), 2, 2), Map<VectorXd>(x0.data(), 2), Map<MatrixXdr>(P0.data(), 2, 2),
+                  2, 2, 0, 0, 0, {}, {}, {}, 1.0);
+  };
+
+  // the same observations in time order and with two of them late
+  EKFSym in_order = make_filter();
+  for (double t : {0.1, 0.2, 0.3, 0.4, 0.5}) {
+    REQUIRE(update_pos(in_order, t, t * 2));
+  }
+  EKFSym late = make_filter();
+  for (double t : {0.1, 0.4, 0.5, 0.2, 0.3}) {
+    REQUIRE(update_pos(late, t, t * 2));
+  }
+
+  REQUIRE(late.get_filter_time() == in_order.get_filter_time());
+  REQUIRE(late.state() == in_order.state());
+  REQUIRE(late.covs() == in_order.covs());
+
+  // older than the oldest checkpoint, nothing changes
+  VectorXd x = late.state();
+  REQUIRE(!update_pos(late, 0.05, 0));
+  REQUIRE(late.state() == x);
+  REQUIRE(late.get_filter_time() == 0.5);
+}
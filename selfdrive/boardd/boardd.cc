@@ -12,6 +12,9 @@
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
+#include <memory>
+#include <sstream>
+#include <string>
 #include <thread>
 #include <unordered_map>
 
@@ -19,6 +22,7 @@
 
 #include "cereal/gen/cpp/car.capnp.h"
 #include "cereal/messaging/messaging.h"
+#include "selfdrive/common/latency.h"
 #include "selfdrive/common/params.h"
 #include "selfdrive/common/swaglog.h"
 #include "selfdrive/common/timing.h"
@@ -36,6 +40,14 @@
 #define NIBBLE_TO_HEX(n) ((n) < 10 ? (n) + '0' : ((n) - 10) + 'a')
 
 Panda * panda = nullptr;
+// extra pandas for more CAN buses, their buses are numbered after the ones of panda
+std::vector<std::string> aux_serials;
+std::vector<Panda *> aux_pandas;
+// aux pandas only see part of the car, the main panda's safety model would block all their tx,
+// so they run their own, noOutput unless AUX_PANDA_SAFETY picks one
+cereal::CarParams::SafetyModel aux_safety_model = cereal::CarParams::SafetyModel::NO_OUTPUT;
+int16_t aux_safety_param = 0;
+std::atomic<bool> power_save_set(false);
 std::atomic<bool> safety_setter_thread_running(false);
 std::atomic<bool> ignition(false);
 
@@ -44,6 +56,8 @@ volatile sig_atomic_t do_exit = 0;
 bool spoofing_started = false;
 bool fake_send = false;
 bool connected_once = false;
+bool async_can_recv = false;
+uint64_t can_coalesce_ns = 10000000ULL;  // one event per 10ms, like the synchronous receive
 
 void safety_setter_thread() {
   LOGD("Starting safety setter thread");
@@ -110,7 +124,18 @@ bool usb_connect() {
   std::unique_ptr<Panda> tmp_panda;
   try {
     assert(panda == nullptr);
-    tmp_panda = std::make_unique<Panda>();
+    // with aux pandas connected, the main one is the first panda that isn't one of them
+    std::string serial;
+    if (!aux_serials.empty()) {
+      for (const auto &s : Panda::list()) {
+        if (std::find(aux_serials.begin(), aux_serials.end(), s) == aux_serials.end()) {
+          serial = s;
+          break;
+        }
+      }
+      if (serial.empty()) return false;
+    }
+    tmp_panda = std::make_unique<Panda>(serial);
   } catch (std::exception &e) {
     return false;
   }
@@ -174,6 +199,23 @@ bool usb_connect() {
   return true;
 }
 
+// A missing aux panda doesn't hold up the main one, it's retried on the next reconnect
+void aux_usb_connect() {
+  assert(aux_pandas.empty());
+  for (size_t i = 0; i < aux_serials.size(); i++) {
+    try {
+      Panda *p = new Panda(aux_serials[i], (i + 1) * PANDA_BUS_CNT);
+      if (getenv("BOARDD_LOOPBACK")) {
+        p->set_loopback(true);
+      }
+      aux_pandas.push_back(p);
+      LOGW("connected to aux panda %s, buses %d-%d", aux_serials[i].c_str(), p->bus_offset, p->bus_offset + PANDA_BUS_CNT - 1);
+    } catch (std::exception &e) {
+      LOGE("failed to connect to aux panda %s", aux_serials[i].c_str());
+    }
+  }
+}
+
 // must be called before threads or with mutex
 void usb_retry_connect() {
   LOGW("attempting to connect");
@@ -181,10 +223,9 @@ void usb_retry_connect() {
   LOGW("connected to board");
 }
 
-void can_recv(PubMaster &pm) {
-  kj::Array<capnp::word> can_data;
-  panda->can_receive(can_data);
-  auto bytes = can_data.asBytes();
+void can_recv(PubMaster &pm, ArenaMessageBuilder &msg) {
+  panda->can_receive(msg);
+  auto bytes = msg.toBytes();
   pm.send("can", bytes.begin(), bytes.size());
 }
 
@@ -214,7 +255,11 @@ void can_send_thread() {
     //Dont send if older than 1 second
     if (nanos_since_boot() - event.getLogMonoTime() < 1e9) {
       if (!fake_send) {
+        // each panda picks the frames for its buses
         panda->can_send(event.getSendcan());
+        for (Panda *p : aux_pandas) {
+          if (p->connected) p->can_send(event.getSendcan());
+        }
       }
     }
 
@@ -230,18 +275,24 @@ void can_recv_thread() {
 
   // can = 8006
   PubMaster pm({"can"});
+  ArenaMessageBuilder msg(CAN_EVENT_WORDS);
 
   // run at 100hz
   const uint64_t dt = 10000000ULL;
   uint64_t next_frame_time = nanos_since_boot() + dt;
 
+  LatencyHistogram recv_latency("can_recv"), wakeup_latency("can_recv_wakeup");
   while (!do_exit && panda->connected) {
-    can_recv(pm);
+    {
+      ScopedLatency scope(recv_latency);
+      can_recv(pm, msg);
+    }
 
     uint64_t cur_time = nanos_since_boot();
     int64_t remaining = next_frame_time - cur_time;
     if (remaining > 0) {
       std::this_thread::sleep_for(std::chrono::nanoseconds(remaining));
+      wakeup_latency.add(std::max((int64_t)(nanos_since_boot() - next_frame_time), (int64_t)0));
     } else {
       if (ignition) {
         LOGW("missed cycles (%d) %lld", (int)-1*remaining/dt, remaining);
@@ -253,6 +304,83 @@ void can_recv_thread() {
   }
 }
 
+void can_recv_async_thread() {
+  LOGD("start async recv thread");
+
+  // every panda has its own transfers and usb event thread, all merged into one `can`
+  PubMaster pm({"can"});
+  std::vector<Panda *> pandas = {panda};
+  pandas.insert(pandas.end(), aux_pandas.begin(), aux_pandas.end());
+
+  CanRecvDoorbell doorbell;
+  std::vector<std::unique_ptr<CanPayloadQueue>> queues;
+  std::vector<CanRecvInput> inputs;
+  for (Panda *p : pandas) {
+    queues.push_back(std::make_unique<CanPayloadQueue>(&doorbell));
+    if (!p->can_recv_async_start(queues.back().get())) {
+      p->can_recv_async_stop();
+      if (p == panda) {
+        for (Panda *started : pandas) started->can_recv_async_stop();
+        can_recv_thread();
+        return;
+      }
+      continue;
+    }
+    inputs.push_back({queues.back().get(), p->bus_offset});
+  }
+
+  // publish as payloads come in, and at least at 100hz like the polling loop
+  CanRecvPump pump(inputs, &doorbell, can_coalesce_ns);
+  // from the completion of the oldest transfer in an event to its publish, and the build and send of it
+  LatencyHistogram delay_latency("can_recv_delay"), send_latency("can_recv_send");
+  while (!do_exit && panda->connected) {
+    bool valid = true;
+    for (Panda *p : pandas) {
+      valid = valid && p->comms_healthy;
+    }
+    auto bytes = pump.next(10000000LL, valid);
+    {
+      ScopedLatency scope(send_latency);
+      pm.send("can", bytes.begin(), bytes.size());
+    }
+    if (pump.oldest_recv_ns != 0) {
+      delay_latency.add(nanos_since_boot() - pump.oldest_recv_ns);
+    }
+  }
+
+  for (size_t i = 0; i < pandas.size(); i++) {
+    pandas[i]->can_recv_async_stop();
+    if (queues[i]->dropped() > 0) {
+      LOGW("can receive queue dropped %lu payloads of buses %d-%d", (unsigned long)queues[i]->dropped(),
+           pandas[i]->bus_offset, pandas[i]->bus_offset + PANDA_BUS_CNT - 1);
+    }
+  }
+}
+
+// Keeps an aux panda alive, in its own safety mode and the main panda's power save mode
+void aux_panda_thread(Panda *p) {
+  LOGD("start aux panda thread, buses %d-%d", p->bus_offset, p->bus_offset + PANDA_BUS_CNT - 1);
+
+  // run at 2hz
+  while (!do_exit && panda->connected && p->connected) {
+    health_t state = p->get_state();
+    if (state.safety_model != (uint8_t)aux_safety_model || state.safety_param != aux_safety_param) {
+      p->set_safety_model(aux_safety_model, aux_safety_param);
+    }
+#ifndef __x86_64__
+    if (state.power_save_enabled != power_save_set) {
+      p->set_power_saving(power_save_set);
+    }
+#endif
+    p->send_heartbeat();
+    util::sleep_for(500);
+  }
+
+  if (!p->connected) {
+    LOGE("lost aux panda, buses %d-%d", p->bus_offset, p->bus_offset + PANDA_BUS_CNT - 1);
+  }
+}
+
 void panda_state_thread() {
   LOGD("start panda state thread");
   PubMaster pm({"pandaState"});
@@ -344,6 +472,9 @@ void panda_state_thread() {
     ignition_last = ignition;
     uint16_t fan_speed_rpm = panda->get_fan_speed();
 
+    // aux pandas follow the main one's power saving
+    power_save_set = pandaState.power_save_enabled;
+
     // build msg
     MessageBuilder msg;
     auto evt = msg.initEvent();
@@ -582,21 +713,52 @@ int main() {
     fake_send = true;
   }
 
+  // ASYNC_CAN_RECV keeps bulk transfers in flight instead of polling at 100hz,
+  // CAN_COALESCE_US merges the payloads arriving within that many us into one event, 10ms by default,
+  // 0 publishes every payload as soon as it arrives
+  if (getenv("ASYNC_CAN_RECV")) {
+    async_can_recv = true;
+  }
+  if (const char *coalesce_us = getenv("CAN_COALESCE_US")) {
+    can_coalesce_ns = strtoull(coalesce_us, NULL, 10) * 1000ULL;
+  }
+
+  // AUX_PANDAS has the comma separated usb serials of the extra pandas,
+  // their frames are merged into `can` through the async receive
+  if (const char *serials = getenv("AUX_PANDAS")) {
+    std::istringstream ss(serials);
+    for (std::string serial; std::getline(ss, serial, ',');) {
+      if (!serial.empty()) aux_serials.push_back(serial);
+    }
+    async_can_recv = async_can_recv || !aux_serials.empty();
+  }
+  // AUX_PANDA_SAFETY is "<safety model id>[:<param>]" from car.capnp, e.g. 17 for allOutput
+  if (const char *aux_safety = getenv("AUX_PANDA_SAFETY")) {
+    char *end = nullptr;
+    aux_safety_model = cereal::CarParams::SafetyModel(strtol(aux_safety, &end, 10));
+    aux_safety_param = (*end == ':') ? atoi(end + 1) : 0;
+    LOGW("aux pandas use safety model %d with param %d", (int)aux_safety_model, aux_safety_param);
+  }
+
   while (!do_exit) {
     std::vector<std::thread> threads;
     threads.push_back(std::thread(panda_state_thread));
 
     // connect to the board
     usb_retry_connect();
+    aux_usb_connect();
 
     threads.push_back(std::thread(can_send_thread));
-    threads.push_back(std::thread(can_recv_thread));
+    threads.push_back(std::thread(async_can_recv ? can_recv_async_thread : can_recv_thread));
     threads.push_back(std::thread(hardware_control_thread));
+    for (Panda *p : aux_pandas) threads.push_back(std::thread(aux_panda_thread, p));
     if (!Params().getBool("WhitePandaSupport")) threads.push_back(std::thread(pigeon_thread));
 
     for (auto &t : threads) t.join();
 
     delete panda;
     panda = nullptr;
+    for (Panda *p : aux_pandas) delete p;
+    aux_pandas.clear();
   }
 }
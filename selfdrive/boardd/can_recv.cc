@@ -0,0 +1,216 @@
+#include "selfdrive/boardd/can_recv.h"
+
+#include <algorithm>
+#include <cassert>
+#include <climits>
+#include <cstring>
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "selfdrive/common/timing.h"
+
+bool CanPayloadQueue::push(const uint8_t *data, int size, uint64_t recv_ns) {
+  CanPayload *p = payloads.back();
+  if (p == nullptr) {
+    dropped_count += 1;
+    return false;
+  }
+
+  p->recv_ns = recv_ns;
+  p->size = std::min(size, RECV_SIZE);
+  memcpy(p->data, data, p->size);
+  payloads.push();
+  doorbell->ring();
+  return true;
+}
+
+size_t CanPayloadQueue::size() const {
+  return payloads.size();
+}
+
+CanPayload *CanPayloadQueue::at(size_t i) {
+  return payloads.at(i);
+}
+
+void CanPayloadQueue::pop(size_t n) {
+  payloads.pop(n);
+}
+
+bool CanPayloadQueue::wait(int64_t timeout_ns) {
+  return doorbell->wait(timeout_ns, [this]() { return size() > 0; });
+}
+
+void CanRecvDoorbell::ring() {
+  seq += 1;
+
+  // only enter the kernel if the consumer is blocked in wait
+  if (waiting.exchange(false)) {
+#ifdef __linux__
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(&seq), FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+#endif
+  }
+}
+
+void CanRecvDoorbell::sleep(uint32_t s, int64_t timeout_ns) {
+  // a ring after reading seq changes it, so the futex wait returns right away
+#ifdef __linux__
+  struct timespec ts = {(time_t)(timeout_ns / 1000000000), (long)(timeout_ns % 1000000000)};
+  syscall(SYS_futex, reinterpret_cast<uint32_t*>(&seq), FUTEX_WAIT, s, &ts, NULL, 0);
+#else
+  // No futex, fall back to polling
+  struct timespec ts = {0, (long)std::min<int64_t>(timeout_ns, 1000 * 1000)};
+  nanosleep(&ts, NULL);
+#endif
+}
+
+ArenaMessageBuilder::ArenaMessageBuilder(size_t first_segment_words) {
+  arena = kj::heapArray<capnp::word>(first_segment_words + 1);
+  memset(arena.begin(), 0, arena.size() * sizeof(capnp::word));
+  first_segment = kj::arrayPtr(arena.begin() + 1, first_segment_words);
+}
+
+cereal::Event::Builder ArenaMessageBuilder::initEvent(bool valid) {
+  if (builder) {
+    // capnp expects a zeroed first segment, clear what the last message used
+    auto segments = builder->getSegmentsForOutput();
+    if (segments.size() > 0 && segments[0].begin() == first_segment.begin()) {
+      memset(first_segment.begin(), 0, segments[0].size() * sizeof(capnp::word));
+    }
+    builder.reset();
+  }
+  builder.emplace(first_segment);
+
+  cereal::Event::Builder event = builder->initRoot<cereal::Event>();
+  event.setLogMonoTime(nanos_since_boot());
+  event.setValid(valid);
+  return event;
+}
+
+kj::ArrayPtr<capnp::byte> ArenaMessageBuilder::toBytes() {
+  auto segments = builder->getSegmentsForOutput();
+  if (segments.size() == 1 && segments[0].begin() == first_segment.begin()) {
+    // single segment table: segment count - 1, then its size in words
+    uint32_t *table = (uint32_t *)arena.begin();
+    table[0] = 0;
+    table[1] = segments[0].size();
+    return kj::arrayPtr((capnp::byte *)arena.begin(), (segments[0].size() + 1) * sizeof(capnp::word));
+  }
+
+  size_t size = capnp::computeSerializedSizeInWords(*builder);
+  if (flat.size() < size) {
+    flat = kj::heapArray<capnp::word>(size);
+  }
+  kj::ArrayOutputStream output_stream(kj::arrayPtr((capnp::byte *)flat.begin(), size * sizeof(capnp::word)));
+  capnp::writeMessage(output_stream, *builder);
+  return kj::arrayPtr((capnp::byte *)flat.begin(), size * sizeof(capnp::word));
+}
+
+void can_unpack_payload(const uint32_t *data, int size, capnp::List<cereal::CanData>::Builder can_data, int offset, uint8_t bus_offset) {
+  int num_msg = size / 0x10;
+  for (int i = 0; i < num_msg; i++) {
+    auto c = can_data[offset + i];
+    if (data[i*4] & 4) {
+      // extended
+      c.setAddress(data[i*4] >> 3);
+    } else {
+      // normal
+      c.setAddress(data[i*4] >> 21);
+    }
+    c.setBusTime(data[i*4+1] >> 16);
+    int len = data[i*4+1]&0xF;
+    c.setDat(kj::arrayPtr((uint8_t*)&data[i*4+2], len));
+    c.setSrc(((data[i*4+1] >> 4) & 0xff) + bus_offset);
+  }
+}
+
+int can_pack_payload(capnp::List<cereal::CanData>::Reader can_data_list, std::vector<uint32_t> &out, uint8_t bus_offset) {
+  const int msg_count = can_data_list.size();
+  out.resize(msg_count*4);
+
+  int i = 0;
+  for (auto cmsg : can_data_list) {
+    // frames for the buses of other pandas
+    if (cmsg.getSrc() < bus_offset || cmsg.getSrc() >= bus_offset + PANDA_BUS_CNT) continue;
+
+    if (cmsg.getAddress() >= 0x800) { // extended
+      out[i*4] = (cmsg.getAddress() << 3) | 5;
+    } else { // normal
+      out[i*4] = (cmsg.getAddress() << 21) | 1;
+    }
+    auto can_data = cmsg.getDat();
+    assert(can_data.size() <= 8);
+    out[i*4+1] = can_data.size() | ((cmsg.getSrc() - bus_offset) << 4);
+    out[i*4+2] = out[i*4+3] = 0;
+    memcpy(&out[i*4+2], can_data.begin(), can_data.size());
+    i++;
+  }
+  out.resize(i*4);
+  return i;
+}
+
+CanRecvPump::CanRecvPump(CanPayloadQueue *queue, uint64_t coalesce_ns)
+  : CanRecvPump({{queue, 0}}, queue->get_doorbell(), coalesce_ns) {}
+
+CanRecvPump::CanRecvPump(const std::vector<CanRecvInput> &inputs, CanRecvDoorbell *doorbell, uint64_t coalesce_ns)
+  : inputs(inputs), counts(inputs.size()), doorbell(doorbell), coalesce_ns(coalesce_ns), msg(CAN_EVENT_WORDS) {}
+
+size_t CanRecvPump::queued(bool *full) {
+  size_t n = 0;
+  for (size_t i = 0; i < inputs.size(); i++) {
+    counts[i] = inputs[i].queue->size();
+    n += counts[i];
+    if (full != nullptr && counts[i] >= CAN_RECV_QUEUE_SIZE) *full = true;
+  }
+  return n;
+}
+
+kj::ArrayPtr<capnp::byte> CanRecvPump::next(int64_t timeout_ns, bool valid) {
+  doorbell->wait(timeout_ns, [this]() { return queued() > 0; });
+  bool full = false;
+  size_t n = queued(&full);
+
+  oldest_recv_ns = 0;
+  for (size_t i = 0; i < inputs.size(); i++) {
+    if (counts[i] > 0 && (oldest_recv_ns == 0 || inputs[i].queue->at(0)->recv_ns < oldest_recv_ns)) {
+      oldest_recv_ns = inputs[i].queue->at(0)->recv_ns;
+    }
+  }
+
+  if (n > 0 && coalesce_ns > 0) {
+    // hold the event open for whatever else arrives in the window
+    uint64_t deadline = oldest_recv_ns + coalesce_ns;
+    for (uint64_t cur = nanos_since_boot(); cur < deadline && !full; cur = nanos_since_boot()) {
+      size_t last = n;
+      doorbell->wait(deadline - cur, [&]() { return queued() > last; });
+      n = queued(&full);
+    }
+  }
+
+  int num_msg = 0;
+  for (size_t i = 0; i < inputs.size(); i++) {
+    for (size_t j = 0; j < counts[i]; j++) {
+      num_msg += inputs[i].queue->at(j)->size / 0x10;
+    }
+  }
+
+  auto evt = msg.initEvent(valid);
+  auto can_data = evt.initCan(num_msg);
+  int offset = 0;
+  for (size_t i = 0; i < inputs.size(); i++) {
+    for (size_t j = 0; j < counts[i]; j++) {
+      CanPayload *p = inputs[i].queue->at(j);
+      can_unpack_payload(p->data, p->size, can_data, offset, inputs[i].bus_offset);
+      offset += p->size / 0x10;
+    }
+    inputs[i].queue->pop(counts[i]);
+  }
+
+  payloads += n;
+  frames += num_msg;
+
+  return msg.toBytes();
+}
@@ -0,0 +1,146 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <optional>
+#include <vector>
+
+#include "cereal/gen/cpp/log.capnp.h"
+#include "cereal/messaging/messaging.h"
+#include "selfdrive/common/spsc_ring.h"
+
+// double the FIFO size
+#define RECV_SIZE (0x1000)
+
+// bulk IN transfers kept in flight on the CAN endpoint
+#define CAN_RECV_TRANSFERS 4
+// an empty transfer is resubmitted after CAN_RECV_IDLE_US, doubling while the bus
+// stays quiet up to the 100hz cadence of the synchronous receive
+#define CAN_RECV_IDLE_US 1000
+#define CAN_RECV_IDLE_MAX_US 10000
+// bulk payloads buffered between the usb event thread and the publisher
+#define CAN_RECV_QUEUE_SIZE 32
+// buses of one panda, the buses of further pandas are numbered after them
+#define PANDA_BUS_CNT 4
+// first segment of a `can` event, room for a full payload of 8 byte frames
+// (2 words of CanData and 1 of dat per frame) and the event around it
+#define CAN_EVENT_WORDS ((RECV_SIZE/0x10) * 3 + 64)
+
+struct CanPayload {
+  uint64_t recv_ns;  // nanos_since_boot when the transfer completed
+  int size;
+  uint32_t data[RECV_SIZE/4];
+};
+
+// Wakes the consumer of one or more queues when a payload is pushed to any of them
+class CanRecvDoorbell {
+ public:
+  void ring();
+  // blocks until ready() or the timeout, ready is checked after announcing the wait
+  // so a push racing with it is never missed
+  template <typename F>
+  bool wait(int64_t timeout_ns, F ready) {
+    uint32_t s = seq;
+    waiting = true;
+    if (!ready() && timeout_ns > 0) {
+      sleep(s, timeout_ns);
+    }
+    waiting = false;
+    return ready();
+  }
+
+ private:
+  void sleep(uint32_t s, int64_t timeout_ns);
+  std::atomic<uint32_t> seq = 0;  // futex word, bumped on every ring
+  std::atomic<bool> waiting = false;
+};
+
+// Bulk payloads on their way to the publisher. They are pushed by whichever
+// thread handles libusb events, libusb runs those one at a time under its
+// event lock, so there is a single producer.
+class CanPayloadQueue {
+ public:
+  // queues of several pandas can share the doorbell of their consumer
+  CanPayloadQueue(CanRecvDoorbell *doorbell=nullptr) : doorbell(doorbell ? doorbell : &own_doorbell) {}
+  // copies the payload in, false if the queue is full and it was dropped
+  bool push(const uint8_t *data, int size, uint64_t recv_ns);
+  size_t size() const;
+  // i-th oldest payload, nullptr past the end
+  CanPayload *at(size_t i);
+  void pop(size_t n=1);
+  // blocks until a payload is queued, false on timeout
+  bool wait(int64_t timeout_ns);
+  uint64_t dropped() const { return dropped_count; }
+  CanRecvDoorbell *get_doorbell() const { return doorbell; }
+
+ private:
+  CanRecvDoorbell own_doorbell;
+  CanRecvDoorbell *doorbell;
+  std::atomic<uint64_t> dropped_count = 0;
+  SpscRing<CanPayload, CAN_RECV_QUEUE_SIZE> payloads;
+};
+
+// Fills the queue with bulk payloads from the CAN endpoint, a Panda with
+// in-flight libusb transfers or a replay of captured payloads in tests.
+class CanPayloadSource {
+ public:
+  virtual ~CanPayloadSource() {}
+  virtual bool can_recv_async_start(CanPayloadQueue *queue) = 0;
+  virtual void can_recv_async_stop() = 0;
+};
+
+// MessageBuilder that is reused from message to message. The first segment is
+// allocated once, and while the message fits in it toBytes returns it in place,
+// preceded by the segment table, instead of flattening it into a new array.
+class ArenaMessageBuilder {
+ public:
+  ArenaMessageBuilder(size_t first_segment_words);
+  // drops the previous message and starts a new event
+  cereal::Event::Builder initEvent(bool valid=true);
+  // serialized message, valid until the next initEvent
+  kj::ArrayPtr<capnp::byte> toBytes();
+
+ private:
+  kj::Array<capnp::word> arena;  // segment table word, then the first segment
+  kj::ArrayPtr<capnp::word> first_segment;
+  std::optional<capnp::MallocMessageBuilder> builder;
+  kj::Array<capnp::word> flat;  // only for messages that outgrew the first segment
+};
+
+// Unpacks the 16 byte frames of a bulk payload into can_data, starting at offset,
+// with bus_offset added to the panda's bus numbers
+void can_unpack_payload(const uint32_t *data, int size, capnp::List<cereal::CanData>::Builder can_data, int offset=0, uint8_t bus_offset=0);
+// Packs the sendcan frames for buses bus_offset to bus_offset + PANDA_BUS_CNT - 1 into the
+// panda's 16 byte format, reusing the capacity of out. Returns the number of frames packed.
+int can_pack_payload(capnp::List<cereal::CanData>::Reader can_data_list, std::vector<uint32_t> &out, uint8_t bus_offset=0);
+
+struct CanRecvInput {
+  CanPayloadQueue *queue;
+  uint8_t bus_offset;
+};
+
+// Builds `can` events as payloads arrive. A payload is published as soon as it is
+// queued, unless coalesce_ns is set, then everything arriving within coalesce_ns
+// of the first payload goes into the same event. With several pandas their payloads
+// are merged into one event, each with its buses shifted by its bus_offset.
+class CanRecvPump {
+ public:
+  CanRecvPump(CanPayloadQueue *queue, uint64_t coalesce_ns=0);
+  // the queues have to ring doorbell
+  CanRecvPump(const std::vector<CanRecvInput> &inputs, CanRecvDoorbell *doorbell, uint64_t coalesce_ns=0);
+  // Waits up to timeout_ns for payloads and returns the serialized event. Without
+  // payloads the event has no frames, like a synchronous read of an empty FIFO.
+  kj::ArrayPtr<capnp::byte> next(int64_t timeout_ns, bool valid);
+
+  uint64_t payloads = 0;
+  uint64_t frames = 0;
+  uint64_t oldest_recv_ns = 0;  // recv time of the first payload in the last event, 0 if none
+
+ private:
+  size_t queued(bool *full=nullptr);
+  std::vector<CanRecvInput> inputs;
+  std::vector<size_t> counts;  // payloads of each input that go into the event
+  CanRecvDoorbell *doorbell;
+  uint64_t coalesce_ns;
+  ArenaMessageBuilder msg;
+};
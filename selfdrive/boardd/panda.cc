@@ -2,6 +2,7 @@
 
 #include <unistd.h>
 
+#include <algorithm>
 #include <cassert>
 #include <stdexcept>
 #include <vector>
@@ -9,9 +10,10 @@
 #include "cereal/messaging/messaging.h"
 #include "selfdrive/common/gpio.h"
 #include "selfdrive/common/swaglog.h"
+#include "selfdrive/common/timing.h"
 #include "selfdrive/common/util.h"
 
-Panda::Panda() {
+Panda::Panda(std::string serial, uint8_t bus_offset) : bus_offset(bus_offset) {
   // init libusb
   int err = libusb_init(&ctx);
   if (err != 0) { goto fail; }
@@ -22,7 +24,11 @@ Panda::Panda() {
   libusb_set_debug(ctx, 3);
 #endif
 
-  dev_handle = libusb_open_device_with_vid_pid(ctx, 0xbbaa, 0xddcc);
+  if (serial.empty()) {
+    dev_handle = libusb_open_device_with_vid_pid(ctx, 0xbbaa, 0xddcc);
+  } else {
+    dev_handle = open_by_serial(ctx, serial);
+  }
   if (dev_handle == NULL) { goto fail; }
 
   if (libusb_kernel_driver_active(dev_handle, 0) == 1) {
@@ -58,11 +64,60 @@ fail:
 }
 
 Panda::~Panda() {
+  can_recv_async_stop();
   std::lock_guard lk(usb_lock);
   cleanup();
   connected = false;
 }
 
+static std::string usb_serial(libusb_device_handle *handle, const libusb_device_descriptor &desc) {
+  unsigned char serial[26] = {0};
+  int len = libusb_get_string_descriptor_ascii(handle, desc.iSerialNumber, serial, sizeof(serial) - 1);
+  return len > 0 ? std::string((char *)serial, len) : "";
+}
+
+// calls f with an open handle of every panda until it returns true, the handle
+// stays open only in that case
+template <typename F>
+static libusb_device_handle *find_panda(libusb_context *ctx, F f) {
+  libusb_device **dev_list = NULL;
+  ssize_t num_devices = libusb_get_device_list(ctx, &dev_list);
+  libusb_device_handle *found = NULL;
+  for (ssize_t i = 0; i < num_devices && found == NULL; i++) {
+    libusb_device_descriptor desc;
+    libusb_device_handle *handle = NULL;
+    if (libusb_get_device_descriptor(dev_list[i], &desc) != 0 || desc.idVendor != 0xbbaa || desc.idProduct != 0xddcc ||
+        libusb_open(dev_list[i], &handle) != 0) {
+      continue;
+    }
+    if (f(usb_serial(handle, desc))) {
+      found = handle;
+    } else {
+      libusb_close(handle);
+    }
+  }
+  if (dev_list != NULL) {
+    libusb_free_device_list(dev_list, 1);
+  }
+  return found;
+}
+
+libusb_device_handle *Panda::open_by_serial(libusb_context *ctx, const std::string &serial) {
+  return find_panda(ctx, [&](const std::string &s) { return s == serial; });
+}
+
+std::vector<std::string> Panda::list() {
+  std::vector<std::string> serials;
+  libusb_context *ctx = NULL;
+  if (libusb_init(&ctx) != 0) return serials;
+  find_panda(ctx, [&](const std::string &s) {
+    serials.push_back(s);
+    return false;
+  });
+  libusb_exit(ctx);
+  return serials;
+}
+
 void Panda::cleanup() {
   if (dev_handle) {
     libusb_release_interface(dev_handle, 0);
@@ -269,30 +324,12 @@ void Panda::send_heartbeat() {
 }
 
 void Panda::can_send(capnp::List<cereal::CanData>::Reader can_data_list) {
-  static std::vector<uint32_t> send;
-  const int msg_count = can_data_list.size();
-
-  send.resize(msg_count*0x10);
-
-  for (int i = 0; i < msg_count; i++) {
-    auto cmsg = can_data_list[i];
-    if (cmsg.getAddress() >= 0x800) { // extended
-      send[i*4] = (cmsg.getAddress() << 3) | 5;
-    } else { // normal
-      send[i*4] = (cmsg.getAddress() << 21) | 1;
-    }
-    auto can_data = cmsg.getDat();
-    assert(can_data.size() <= 8);
-    send[i*4+1] = can_data.size() | (cmsg.getSrc() << 4);
-    memcpy(&send[i*4+2], can_data.begin(), can_data.size());
-  }
-
-  usb_bulk_write(3, (unsigned char*)send.data(), send.size(), 5);
+  if (can_pack_payload(can_data_list, send_buf, bus_offset) == 0) return;
+  usb_bulk_write(3, (unsigned char*)send_buf.data(), send_buf.size() * sizeof(uint32_t), 5);
 }
 
-int Panda::can_receive(kj::Array<capnp::word>& out_buf) {
-  uint32_t data[RECV_SIZE/4];
-  int recv = usb_bulk_read(0x81, (unsigned char*)data, RECV_SIZE);
+int Panda::can_receive(ArenaMessageBuilder &msg) {
+  int recv = usb_bulk_read(0x81, (unsigned char*)recv_buf, RECV_SIZE);
 
   // Not sure if this can happen
   if (recv < 0) recv = 0;
@@ -301,27 +338,129 @@ int Panda::can_receive(kj::Array<capnp::word>& out_buf) {
     LOGW("Receive buffer full");
   }
 
-  size_t num_msg = recv / 0x10;
-  MessageBuilder msg;
-  auto evt = msg.initEvent();
-  evt.setValid(comms_healthy);
-
   // populate message
-  auto canData = evt.initCan(num_msg);
-  for (int i = 0; i < num_msg; i++) {
-    if (data[i*4] & 4) {
-      // extended
-      canData[i].setAddress(data[i*4] >> 3);
-      //printf("got extended: %x\n", data[i*4] >> 3);
-    } else {
-      // normal
-      canData[i].setAddress(data[i*4] >> 21);
+  auto evt = msg.initEvent(comms_healthy);
+  can_unpack_payload(recv_buf, recv, evt.initCan(recv / 0x10), 0, bus_offset);
+  return recv;
+}
+
+bool Panda::can_recv_async_start(CanPayloadQueue *queue) {
+  assert(!recv_running);
+  recv_queue = queue;
+  recv_running = true;
+
+  for (int i = 0; i < CAN_RECV_TRANSFERS; i++) {
+    auto t = std::make_unique<RecvTransfer>();
+    t->panda = this;
+    t->transfer = libusb_alloc_transfer(0);
+    if (t->transfer == NULL) break;
+    libusb_fill_bulk_transfer(t->transfer, dev_handle, 0x81, t->buf, RECV_SIZE, recv_transfer_done, t.get(), 0);
+    recv_transfers.push_back(std::move(t));
+  }
+
+  for (auto &t : recv_transfers) {
+    submit_recv_transfer(t.get());
+  }
+  if (recv_in_flight == 0) {
+    LOGE("failed to start async can receive");
+    recv_running = false;
+  }
+  recv_event_thread = std::thread(&Panda::recv_event_loop, this);
+  return recv_running;
+}
+
+void Panda::can_recv_async_stop() {
+  recv_running = false;
+  if (recv_event_thread.joinable()) {
+    recv_event_thread.join();
+  }
+  for (auto &t : recv_transfers) {
+    libusb_free_transfer(t->transfer);
+  }
+  recv_transfers.clear();
+}
+
+bool Panda::submit_recv_transfer(RecvTransfer *t) {
+  t->idle_since = 0;
+  recv_in_flight += 1;
+  int err = libusb_submit_transfer(t->transfer);
+  if (err != 0) {
+    recv_in_flight -= 1;
+    handle_usb_issue(err, __func__);
+  }
+  return err == 0;
+}
+
+void LIBUSB_CALL Panda::recv_transfer_done(libusb_transfer *transfer) {
+  RecvTransfer *t = (RecvTransfer *)transfer->user_data;
+  Panda *panda = t->panda;
+
+  switch (transfer->status) {
+    case LIBUSB_TRANSFER_COMPLETED:
+      if (transfer->actual_length == RECV_SIZE) {
+        LOGW("Receive buffer full");
+      }
+      if (transfer->actual_length > 0 && !panda->recv_queue->push(transfer->buffer, transfer->actual_length, nanos_since_boot())) {
+        LOGE_100("can receive queue full, dropped 0x%x", transfer->actual_length);
+      }
+      break;
+    case LIBUSB_TRANSFER_OVERFLOW:
+      panda->comms_healthy = false;
+      LOGE_100("overflow got 0x%x", transfer->actual_length);
+      break;
+    case LIBUSB_TRANSFER_NO_DEVICE:
+      panda->handle_usb_issue(LIBUSB_ERROR_NO_DEVICE, __func__);
+      break;
+    case LIBUSB_TRANSFER_CANCELLED:
+      break;
+    default:
+      LOGE_100("can receive transfer status %d", transfer->status);
+      break;
+  }
+
+  panda->recv_in_flight -= 1;
+  if (!panda->recv_running || !panda->connected || transfer->status == LIBUSB_TRANSFER_CANCELLED) {
+    return;
+  }
+
+  if (transfer->actual_length > 0) {
+    t->idle_us = CAN_RECV_IDLE_US;
+    panda->submit_recv_transfer(t);
+  } else {
+    // the panda answers right away when its FIFO is empty, poll again from the event loop
+    // instead of spinning on empty transfers, backing off while nothing arrives
+    t->idle_since = std::max<uint64_t>(nanos_since_boot(), 1);
+  }
+}
+
+void Panda::recv_event_loop() {
+  util::set_thread_name("boardd_usb_events");
+
+  while (recv_running && connected) {
+    struct timeval tv = {0, CAN_RECV_IDLE_US};
+    int err = libusb_handle_events_timeout_completed(ctx, &tv, NULL);
+    if (err != 0 && err != LIBUSB_ERROR_INTERRUPTED) {
+      handle_usb_issue(err, __func__);
+    }
+
+    uint64_t cur = nanos_since_boot();
+    for (auto &t : recv_transfers) {
+      uint64_t idle_since = t->idle_since;
+      if (idle_since != 0 && cur - idle_since >= t->idle_us * 1000ULL) {
+        t->idle_us = std::min<uint32_t>(t->idle_us * 2, CAN_RECV_IDLE_MAX_US);
+        submit_recv_transfer(t.get());
+      }
     }
-    canData[i].setBusTime(data[i*4+1] >> 16);
-    int len = data[i*4+1]&0xF;
-    canData[i].setDat(kj::arrayPtr((uint8_t*)&data[i*4+2], len));
-    canData[i].setSrc((data[i*4+1] >> 4) & 0xff);
   }
-  out_buf = capnp::messageToFlatArray(msg);
-  return recv;
+
+  // wait for the cancelled transfers to come back before they are freed
+  recv_running = false;
+  for (auto &t : recv_transfers) {
+    libusb_cancel_transfer(t->transfer);
+  }
+  while (recv_in_flight > 0) {
+    struct timeval tv = {0, 100000};
+    int err = libusb_handle_events_timeout_completed(ctx, &tv, NULL);
+    if (err != 0 && err != LIBUSB_ERROR_INTERRUPTED) break;
+  }
 }
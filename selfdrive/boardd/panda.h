@@ -3,17 +3,19 @@
 #include <atomic>
 #include <cstdint>
 #include <ctime>
+#include <memory>
 #include <mutex>
 #include <optional>
+#include <string>
+#include <thread>
 #include <vector>
 
 #include <libusb-1.0/libusb.h>
 
 #include "cereal/gen/cpp/car.capnp.h"
 #include "cereal/gen/cpp/log.capnp.h"
+#include "selfdrive/boardd/can_recv.h"
 
-// double the FIFO size
-#define RECV_SIZE (0x1000)
 #define TIMEOUT 0
 
 // copied from panda/board/main.c
@@ -40,23 +42,51 @@ struct __attribute__((packed)) health_t {
 };
 
 
-class Panda {
+class Panda : public CanPayloadSource {
  private:
   libusb_context *ctx = NULL;
   libusb_device_handle *dev_handle = NULL;
   std::mutex usb_lock;
   void handle_usb_issue(int err, const char func[]);
   void cleanup();
+  static libusb_device_handle *open_by_serial(libusb_context *ctx, const std::string &serial);
+
+  // async CAN receive
+  struct RecvTransfer {
+    Panda *panda;
+    libusb_transfer *transfer;
+    std::atomic<uint64_t> idle_since = 0;  // set when it came back empty and waits to be resubmitted
+    uint32_t idle_us = CAN_RECV_IDLE_US;   // backoff before that, only touched by the usb event thread
+    uint8_t buf[RECV_SIZE];
+  };
+  std::vector<std::unique_ptr<RecvTransfer>> recv_transfers;
+  CanPayloadQueue *recv_queue = nullptr;
+  std::atomic<bool> recv_running = false;
+  std::atomic<int> recv_in_flight = 0;
+  std::thread recv_event_thread;
+  bool submit_recv_transfer(RecvTransfer *t);
+  void recv_event_loop();
+  static void LIBUSB_CALL recv_transfer_done(libusb_transfer *transfer);
+
+  uint32_t recv_buf[RECV_SIZE/4];
+  std::vector<uint32_t> send_buf;
 
  public:
-  Panda();
+  // opens the panda with that usb serial, or the first one found without one
+  Panda(std::string serial="", uint8_t bus_offset=0);
   ~Panda();
 
+  // usb serials of the connected pandas
+  static std::vector<std::string> list();
+
   std::atomic<bool> connected = true;
   std::atomic<bool> comms_healthy = true;
   cereal::PandaState::PandaType hw_type = cereal::PandaState::PandaType::UNKNOWN;
   bool is_pigeon = false;
   bool has_rtc = false;
+  // added to the bus numbers of received frames, sendcan frames for the buses
+  // bus_offset to bus_offset + PANDA_BUS_CNT - 1 go to this panda
+  const uint8_t bus_offset;
 
   // HW communication
   int usb_write(uint8_t bRequest, uint16_t wValue, uint16_t wIndex, unsigned int timeout=TIMEOUT);
@@ -81,5 +111,10 @@ class Panda {
   void set_usb_power_mode(cereal::PandaState::UsbPowerMode power_mode);
   void send_heartbeat();
   void can_send(capnp::List<cereal::CanData>::Reader can_data_list);
-  int can_receive(kj::Array<capnp::word>& out_buf);
+  int can_receive(ArenaMessageBuilder &msg);
+
+  // Keeps CAN_RECV_TRANSFERS bulk reads in flight on the CAN endpoint and queues
+  // every payload as its transfer completes. can_receive must not be used meanwhile.
+  bool can_recv_async_start(CanPayloadQueue *queue) override;
+  void can_recv_async_stop() override;
 };
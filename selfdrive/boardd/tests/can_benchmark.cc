@@ -0,0 +1,140 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <random>
+#include <vector>
+
+#include "selfdrive/boardd/can_recv.h"
+#include "selfdrive/common/benchmark.h"
+
+// Builds `can` events from full 256 frame bulk payloads and packs 256 frame sendcan
+// lists the way boardd did before the reused builders and the way it does now,
+// reporting us and heap allocations per cycle.
+//
+// usage: can_benchmark [cycles]
+
+static uint64_t allocations = 0;
+
+void *operator new(size_t size) {
+#ifndef __GLIBC__
+  allocations++;
+#endif
+  void *p = malloc(size);
+  if (p == nullptr) throw std::bad_alloc();
+  return p;
+}
+void operator delete(void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+
+#ifdef __GLIBC__
+// capnp allocates its segments with calloc
+extern "C" void *__libc_malloc(size_t size);
+extern "C" void *__libc_calloc(size_t n, size_t size);
+extern "C" void *__libc_realloc(void *p, size_t size);
+extern "C" void *malloc(size_t size) { allocations++; return __libc_malloc(size); }
+extern "C" void *calloc(size_t n, size_t size) { allocations++; return __libc_calloc(n, size); }
+extern "C" void *realloc(void *p, size_t size) { allocations++; return __libc_realloc(p, size); }
+#endif
+
+#define NUM_FRAMES (RECV_SIZE / 0x10)
+
+// can_receive and can_send before the reused builders, kept as the reference implementation
+static kj::Array<capnp::word> legacy_can_receive(const uint32_t *data, int recv) {
+  size_t num_msg = recv / 0x10;
+  MessageBuilder msg;
+  auto evt = msg.initEvent();
+  evt.setValid(true);
+  can_unpack_payload(data, recv, evt.initCan(num_msg));
+  return capnp::messageToFlatArray(msg);
+}
+
+static void legacy_can_send(capnp::List<cereal::CanData>::Reader can_data_list, std::vector<uint32_t> &send) {
+  const int msg_count = can_data_list.size();
+  send.resize(msg_count*0x10);
+  for (int i = 0; i < msg_count; i++) {
+    auto cmsg = can_data_list[i];
+    if (cmsg.getAddress() >= 0x800) {
+      send[i*4] = (cmsg.getAddress() << 3) | 5;
+    } else {
+      send[i*4] = (cmsg.getAddress() << 21) | 1;
+    }
+    auto can_data = cmsg.getDat();
+    send[i*4+1] = can_data.size() | (cmsg.getSrc() << 4);
+    memcpy(&send[i*4+2], can_data.begin(), can_data.size());
+  }
+}
+
+// bench with the heap allocations of the timed cycles
+template <typename F>
+static void bench_allocations(const char *name, int cycles, F f) {
+  f();  // warm up, reused buffers grow here
+  uint64_t start_allocations = allocations;
+  double us = bench_us(cycles, f);
+  printf("%-16s %8.2f us/cycle, %6.2f allocations/cycle\n", name, us, (double)(allocations - start_allocations) / cycles);
+}
+
+int main(int argc, char *argv[]) {
+  int cycles = argc > 1 ? atoi(argv[1]) : 100000;
+
+  // a full FIFO of 8 byte frames, like a busy bus
+  std::mt19937 rng(0);
+  uint32_t payload[RECV_SIZE/4];
+  for (int i = 0; i < NUM_FRAMES; i++) {
+    uint32_t addr = rng() % 0x800;
+    payload[i*4] = addr << 21;
+    payload[i*4+1] = ((rng() & 0xFFFF) << 16) | ((rng() % 3) << 4) | 8;
+    payload[i*4+2] = rng();
+    payload[i*4+3] = rng();
+  }
+
+  MessageBuilder sendcan_msg;
+  auto sendcan = sendcan_msg.initEvent().initSendcan(NUM_FRAMES);
+  can_unpack_payload(payload, RECV_SIZE, sendcan);
+  auto sendcan_reader = sendcan_msg.getRoot<cereal::Event>().asReader().getSendcan();
+
+  // both paths have to produce the same bytes
+  ArenaMessageBuilder msg(CAN_EVENT_WORDS);
+  auto evt = msg.initEvent(true);
+  can_unpack_payload(payload, RECV_SIZE, evt.initCan(NUM_FRAMES));
+  auto bytes = msg.toBytes();
+  capnp::FlatArrayMessageReader reader(kj::arrayPtr((const capnp::word *)bytes.begin(), bytes.size() / sizeof(capnp::word)));
+  auto legacy = legacy_can_receive(payload, RECV_SIZE);
+  capnp::FlatArrayMessageReader legacy_reader(legacy);
+  auto can = reader.getRoot<cereal::Event>().getCan(), legacy_can = legacy_reader.getRoot<cereal::Event>().getCan();
+  bool same = can.size() == legacy_can.size();
+  for (int i = 0; same && i < (int)can.size(); i++) {
+    same = can[i].getAddress() == legacy_can[i].getAddress() && can[i].getBusTime() == legacy_can[i].getBusTime() &&
+           can[i].getSrc() == legacy_can[i].getSrc() && can[i].getDat() == legacy_can[i].getDat();
+  }
+
+  std::vector<uint32_t> legacy_send, send;
+  legacy_can_send(sendcan_reader, legacy_send);
+  can_pack_payload(sendcan_reader, send);
+  same = same && memcmp(legacy_send.data(), send.data(), send.size() * sizeof(uint32_t)) == 0;
+
+  printf("%d frames per cycle, %zu bytes per can event (%s)\n", NUM_FRAMES, bytes.size(),
+         bytes.size() <= CAN_EVENT_WORDS * sizeof(capnp::word) ? "fits the first segment" : "outgrew the first segment");
+
+  volatile size_t sink = 0;
+  bench_allocations("receive legacy", cycles, [&]() {
+    auto out = legacy_can_receive(payload, RECV_SIZE);
+    sink += out.size();
+  });
+  bench_allocations("receive arena", cycles, [&]() {
+    auto evt = msg.initEvent(true);
+    can_unpack_payload(payload, RECV_SIZE, evt.initCan(NUM_FRAMES));
+    sink += msg.toBytes().size();
+  });
+  bench_allocations("send legacy", cycles, [&]() {
+    legacy_can_send(sendcan_reader, legacy_send);
+    sink += legacy_send.size();
+  });
+  bench_allocations("send reused", cycles, [&]() {
+    can_pack_payload(sendcan_reader, send);
+    sink += send.size();
+  });
+
+  printf("%s\n", same ? "outputs match" : "outputs differ");
+  return same ? 0 : 1;
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <chrono>
+#include <cstdio>
+#include <type_traits>
+
+// Timing loop of the *_benchmark programs. f is called with the iteration
+// number if it takes one.
+
+// average us per call of f over iterations calls
+template <typename F>
+double bench_us(int iterations, F f) {
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < iterations; i++) {
+    if constexpr (std::is_invocable_v<F, int>) {
+      f(i);
+    } else {
+      f();
+    }
+  }
+  return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count() / iterations;
+}
+
+inline void print_bench(const char *name, double us, const char *unit) {
+  printf("%-28s %10.3f us/%s\n", name, us, unit);
+}
+
+// bench_us after one untimed call that fills caches and grows reused buffers, printed
+template <typename F>
+double bench(const char *name, int iterations, const char *unit, F f) {
+  bench_us(1, f);
+  double us = bench_us(iterations, f);
+  print_bench(name, us, unit);
+  return us;
+}
@@ -0,0 +1,82 @@
+#include "selfdrive/common/latency.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+
+#include "selfdrive/common/swaglog.h"
+
+const std::string latency_fn_prefix = "latency_";  // + <pid>_<name>
+
+LatencyHistogram::LatencyHistogram(const char *name) {
+  path = "/dev/shm/" + latency_fn_prefix + std::to_string(getpid()) + "_" + name;
+  int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0664);
+  if (fd == -1 || ftruncate(fd, sizeof(LatencyHistogramData)) != 0) {
+    LOGE("can't create latency histogram %s, errno=%d", path.c_str(), errno);
+    if (fd != -1) close(fd);
+    return;
+  }
+  void *mem = mmap(nullptr, sizeof(LatencyHistogramData), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mem == MAP_FAILED) {
+    LOGE("can't map latency histogram %s, errno=%d", path.c_str(), errno);
+    return;
+  }
+
+  // the file is zeroed by ftruncate, the magic is written last
+  data = (LatencyHistogramData *)mem;
+  strncpy(data->name, name, LATENCY_NAME_LEN - 1);
+  data->pid = getpid();
+  data->tid = syscall(SYS_gettid);
+  std::atomic_thread_fence(std::memory_order_release);
+  data->magic = LATENCY_MAGIC;
+}
+
+LatencyHistogram::~LatencyHistogram() {
+  if (data) {
+    munmap(data, sizeof(LatencyHistogramData));
+    unlink(path.c_str());
+  }
+}
+
+std::vector<LatencySnapshot> read_latency_histograms(const std::string &dir) {
+  std::vector<LatencySnapshot> ret;
+  DIR *d = opendir(dir.c_str());
+  if (!d) return ret;
+
+  struct dirent *de = NULL;
+  while ((de = readdir(d))) {
+    if (strncmp(de->d_name, latency_fn_prefix.c_str(), latency_fn_prefix.size()) != 0) continue;
+
+    std::string path = dir + "/" + de->d_name;
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1) continue;
+    LatencyHistogramData data;
+    ssize_t n = pread(fd, &data, sizeof(data), 0);
+    close(fd);
+    if (n != sizeof(data) || data.magic != LATENCY_MAGIC) continue;
+
+    // left behind by a process that was killed
+    if (kill(data.pid, 0) != 0 && errno == ESRCH) {
+      unlink(path.c_str());
+      continue;
+    }
+
+    LatencySnapshot &s = ret.emplace_back();
+    s.name.assign(data.name, strnlen(data.name, LATENCY_NAME_LEN));
+    s.pid = data.pid;
+    s.tid = data.tid;
+    s.count = data.count;
+    s.total_ns = data.total_ns;
+    s.max_ns = data.max_ns;
+    for (int i = 0; i < LATENCY_BUCKETS; i++) s.buckets[i] = data.buckets[i];
+  }
+  closedir(d);
+  return ret;
+}
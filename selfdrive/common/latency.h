@@ -0,0 +1,75 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "selfdrive/common/timing.h"
+
+// Latency histograms in shared memory, proclogd publishes them in procLog.
+// Drop a LATENCY_SCOPE("name") at the top of a loop body or function to time it:
+//
+//   while (!do_exit) {
+//     LATENCY_SCOPE("can_recv");
+//     ...
+//   }
+//
+// Bucket i counts the durations under 2^i us, the last one everything longer.
+#define LATENCY_BUCKETS 24
+#define LATENCY_NAME_LEN 32
+#define LATENCY_MAGIC 0x3159434e4554414cULL  // "LATENCY1"
+
+struct LatencyHistogramData {
+  uint64_t magic;
+  char name[LATENCY_NAME_LEN];
+  int32_t pid, tid;  // of the thread that created it
+  std::atomic<uint64_t> count, total_ns, max_ns;
+  std::atomic<uint64_t> buckets[LATENCY_BUCKETS];
+};
+
+// /dev/shm/latency_<pid>_<name>, removed on exit. Names are unique within a process.
+class LatencyHistogram {
+ public:
+  LatencyHistogram(const char *name);
+  ~LatencyHistogram();
+
+  inline void add(uint64_t ns) {
+    if (data == nullptr) return;
+    uint64_t us = ns / 1000;
+    int bucket = us == 0 ? 0 : 64 - __builtin_clzll(us);
+    data->buckets[bucket < LATENCY_BUCKETS ? bucket : LATENCY_BUCKETS - 1].fetch_add(1, std::memory_order_relaxed);
+    data->count.fetch_add(1, std::memory_order_relaxed);
+    data->total_ns.fetch_add(ns, std::memory_order_relaxed);
+    uint64_t max_ns = data->max_ns.load(std::memory_order_relaxed);
+    while (ns > max_ns && !data->max_ns.compare_exchange_weak(max_ns, ns, std::memory_order_relaxed)) {}
+  }
+
+ private:
+  std::string path;
+  LatencyHistogramData *data = nullptr;
+};
+
+class ScopedLatency {
+ public:
+  ScopedLatency(LatencyHistogram &histogram) : histogram(histogram), start_ns(nanos_since_boot()) {}
+  ~ScopedLatency() { histogram.add(nanos_since_boot() - start_ns); }
+
+ private:
+  LatencyHistogram &histogram;
+  uint64_t start_ns;
+};
+
+#define LATENCY_SCOPE(name)                               \
+  static LatencyHistogram __latency_histogram(name);      \
+  ScopedLatency __scoped_latency(__latency_histogram)
+
+struct LatencySnapshot {
+  std::string name;
+  int pid, tid;
+  uint64_t count, total_ns, max_ns;
+  uint64_t buckets[LATENCY_BUCKETS];
+};
+
+// the histograms in dir, removing the ones of processes that are gone
+std::vector<LatencySnapshot> read_latency_histograms(const std::string &dir = "/dev/shm");
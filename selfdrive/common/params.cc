@@ -5,18 +5,30 @@
 #endif  // _GNU_SOURCE
 
 #include <dirent.h>
+#include <poll.h>
+#include <pthread.h>
 #include <sys/file.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
 
+#include <algorithm>
+#include <condition_variable>
 #include <csignal>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <mutex>
+#include <new>
+#include <thread>
+#include <tuple>
 #include <unordered_map>
+#include <vector>
 
 #include "selfdrive/common/swaglog.h"
+#include "selfdrive/common/timing.h"
 #include "selfdrive/common/util.h"
 #include "selfdrive/hardware/hw.h"
 
@@ -352,6 +364,289 @@ std::unordered_map<std::string, uint32_t> keys = {
 
 } // namespace
 
+// Values read from one params directory, kept until inotify reports a change to
+// their file. Without a watch, e.g. off Linux or once the directory is replaced,
+// reads go to the files until it can be watched again.
+class ParamsCache {
+public:
+  // one per params path, for the life of the process
+  static ParamsCache *get(const std::string &params_path);
+
+  std::string read(const std::string &key, uint64_t *generation = nullptr);
+  // blocks until a change after generation or the timeout
+  void wait(uint64_t generation, int timeout_ms);
+  // written or removed by this process, dropped at once so it reads its own writes
+  void invalidate(const std::string &key);
+
+  int watch(const std::string &key, std::function<void(const std::string &)> callback);
+  void unwatch(int id);
+
+private:
+  ParamsCache(const std::string &path) : params_path(path) {}
+  bool ensure_watching();
+  void drop(const std::string &key);
+  void drop_all();
+  void lose_watch();
+  void watcher_thread(int inotify_fd);
+  static void lock_all();
+  static void unlock_all();
+  static void after_fork();
+
+  const std::string params_path;
+  std::mutex lock;
+  std::condition_variable cv;
+  std::unordered_map<std::string, std::string> values;
+  uint64_t generation = 0;  // bumped on every change
+
+  int fd = -1, dir_wd = -1, key_wd = -1;
+  bool watching = false;
+  double last_watch_attempt = 0;
+
+  int next_watch_id = 0;
+  std::map<int, std::pair<std::string, std::function<void(const std::string &)>>> watchers;
+  // watches whose callbacks are running and on which thread, unwatch waits for them
+  std::vector<std::pair<int, std::thread::id>> running;
+};
+
+namespace {
+
+// retry a lost watch at most this often
+#define PARAMS_REWATCH_MS 1000
+
+std::mutex caches_lock;
+std::map<std::string, ParamsCache *> *caches;
+
+} // namespace
+
+ParamsCache *ParamsCache::get(const std::string &params_path) {
+  std::unique_lock lk(caches_lock);
+  if (caches == nullptr) {
+    caches = new std::map<std::string, ParamsCache *>;
+    // a forked child has no watcher threads, it starts over with its own
+    pthread_atfork(lock_all, unlock_all, after_fork);
+  }
+  ParamsCache *&cache = (*caches)[params_path];
+  if (cache == nullptr) cache = new ParamsCache(params_path);
+  return cache;
+}
+
+void ParamsCache::lock_all() {
+  caches_lock.lock();
+  for (auto &[path, cache] : *caches) cache->lock.lock();
+}
+
+void ParamsCache::unlock_all() {
+  for (auto &[path, cache] : *caches) cache->lock.unlock();
+  caches_lock.unlock();
+}
+
+void ParamsCache::after_fork() {
+  for (auto &[path, cache] : *caches) {
+    if (cache->fd >= 0) close(cache->fd);
+    cache->fd = -1;
+    cache->watching = false;
+    cache->last_watch_attempt = 0;
+    cache->values.clear();
+    cache->watchers.clear();
+    cache->running.clear();
+    // a blocking get of the parent may have been waiting on it
+    new (&cache->cv) std::condition_variable();
+  }
+  unlock_all();
+}
+
+bool ParamsCache::ensure_watching() {
+#ifdef __linux__
+  if (watching) return true;
+  double tms = millis_since_boot();
+  if (tms - last_watch_attempt < PARAMS_REWATCH_MS) return false;
+  last_watch_attempt = tms;
+
+  if (fd < 0) {
+    fd = inotify_init1(IN_CLOEXEC);
+    if (fd < 0) {
+      LOGE("params inotify_init1 failed, errno=%d", errno);
+      return false;
+    }
+    std::thread(&ParamsCache::watcher_thread, this, fd).detach();
+  }
+  // the params directory, for d being replaced, and the directory d links to for the values
+  dir_wd = inotify_add_watch(fd, params_path.c_str(), IN_CREATE | IN_DELETE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE_SELF | IN_ONLYDIR);
+  key_wd = inotify_add_watch(fd, (params_path + "/d").c_str(),
+                             IN_CLOSE_WRITE | IN_MODIFY | IN_CREATE | IN_DELETE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE_SELF | IN_ONLYDIR);
+  watching = dir_wd >= 0 && key_wd >= 0;
+  if (!watching) {
+    LOGW("can't watch %s, errno=%d", params_path.c_str(), errno);
+  }
+  return watching;
+#else
+  return false;
+#endif
+}
+
+void ParamsCache::drop(const std::string &key) {
+  values.erase(key);
+  generation++;
+  cv.notify_all();
+}
+
+void ParamsCache::drop_all() {
+  values.clear();
+  generation++;
+  cv.notify_all();
+}
+
+std::string ParamsCache::read(const std::string &key, uint64_t *read_generation) {
+  std::string path = params_path + "/d/" + key;
+  std::unique_lock lk(lock);
+  if (read_generation) *read_generation = generation;
+  if (!ensure_watching()) {
+    lk.unlock();
+    return util::read_file(path);
+  }
+
+  if (auto it = values.find(key); it != values.end()) {
+    return it->second;
+  }
+
+  // read outside the lock, any change meanwhile makes the value too old to keep
+  uint64_t gen = generation;
+  lk.unlock();
+  std::string value = util::read_file(path);
+  lk.lock();
+  if (watching && gen == generation) {
+    values[key] = value;
+  }
+  return value;
+}
+
+void ParamsCache::wait(uint64_t seen_generation, int timeout_ms) {
+  std::unique_lock lk(lock);
+  if (!watching) {
+    lk.unlock();
+    util::sleep_for(timeout_ms);
+    return;
+  }
+  cv.wait_for(lk, std::chrono::milliseconds(timeout_ms), [&] { return generation != seen_generation; });
+}
+
+void ParamsCache::invalidate(const std::string &key) {
+  std::unique_lock lk(lock);
+  drop(key);
+}
+
+int ParamsCache::watch(const std::string &key, std::function<void(const std::string &)> callback) {
+  std::unique_lock lk(lock);
+  ensure_watching();
+  int id = next_watch_id++;
+  watchers[id] = {key, callback};
+  return id;
+}
+
+void ParamsCache::unwatch(int id) {
+  std::unique_lock lk(lock);
+  watchers.erase(id);
+  // a callback may unwatch itself, anyone else must not return while it still runs
+  const std::thread::id self = std::this_thread::get_id();
+  cv.wait(lk, [&] {
+    return std::none_of(running.begin(), running.end(), [&](auto &r) { return r.first == id && r.second != self; });
+  });
+}
+
+// forget everything, reads go to the files until the directory is watched again
+void ParamsCache::lose_watch() {
+#ifdef __linux__
+  if (dir_wd >= 0) inotify_rm_watch(fd, dir_wd);
+  if (key_wd >= 0) inotify_rm_watch(fd, key_wd);
+#endif
+  dir_wd = key_wd = -1;
+  watching = false;
+  drop_all();
+}
+
+void ParamsCache::watcher_thread(int inotify_fd) {
+#ifdef __linux__
+  const std::thread::id self = std::this_thread::get_id();
+  alignas(struct inotify_event) char buf[4096];
+  while (true) {
+    struct pollfd pfd = {.fd = inotify_fd, .events = POLLIN};
+    int ret = HANDLE_EINTR(poll(&pfd, 1, PARAMS_REWATCH_MS));
+    if (ret == 0) {
+      // with nothing reading, watch again for the watchers
+      std::unique_lock lk(lock);
+      if (inotify_fd != fd) return;
+      if (!watchers.empty()) ensure_watching();
+      continue;
+    }
+    ssize_t len = ret < 0 ? ret : HANDLE_EINTR(::read(inotify_fd, buf, sizeof(buf)));
+
+    std::vector<std::string> changed;
+    std::vector<std::tuple<int, std::string, std::function<void(const std::string &)>>> callbacks;
+    {
+      std::unique_lock lk(lock);
+      if (inotify_fd != fd) return;  // closed after a fork
+
+      if (len <= 0) {
+        // nothing tells the cache about changes anymore, a later read starts a new watcher
+        LOGE("params inotify read failed, errno=%d", errno);
+        lose_watch();
+        close(fd);
+        fd = -1;
+        last_watch_attempt = 0;
+        for (auto &[id, w] : watchers) {
+          callbacks.push_back({id, w.first, w.second});
+        }
+      }
+
+      for (char *p = buf; len > 0 && p < buf + len; p += sizeof(struct inotify_event) + ((struct inotify_event *)p)->len) {
+        const struct inotify_event *event = (const struct inotify_event *)p;
+        const std::string name = event->len > 0 ? event->name : "";
+        bool lost = event->mask & IN_Q_OVERFLOW;
+        if (key_wd >= 0 && event->wd == key_wd) {
+          if (event->mask & (IN_IGNORED | IN_DELETE_SELF)) {
+            lost = true;
+          } else if (!name.empty()) {
+            drop(name);
+            changed.push_back(name);
+          }
+        } else if (dir_wd >= 0 && event->wd == dir_wd) {
+          lost = lost || (event->mask & (IN_IGNORED | IN_DELETE_SELF)) || name == "d";
+        }
+
+        if (lost) {
+          // watch again on the next read
+          lose_watch();
+          changed.push_back("");
+        }
+      }
+
+      for (auto &[id, w] : watchers) {
+        for (auto &key : changed) {
+          if (w.first.empty() || key.empty() || w.first == key) {
+            callbacks.push_back({id, key.empty() ? w.first : key, w.second});
+          }
+        }
+      }
+    }
+
+    for (auto &[id, key, callback] : callbacks) {
+      {
+        std::unique_lock lk(lock);
+        if (watchers.count(id) == 0) continue;
+        running.push_back({id, self});
+      }
+      callback(key);
+      {
+        std::unique_lock lk(lock);
+        running.erase(std::find(running.begin(), running.end(), std::make_pair(id, self)));
+      }
+      cv.notify_all();
+    }
+    if (len <= 0) return;
+  }
+#endif
+}
+
 Params::Params(bool persistent_param) : Params(persistent_param ? Path::persistent_params() : Path::params()) {}
 
 std::once_flag default_params_path_ensured;
@@ -361,6 +656,7 @@ Params::Params(const std::string &path) : params_path(path) {
   } else {
     ensure_params_path(path);
   }
+  cache = ParamsCache::get(path);
 }
 
 bool Params::checkKey(const std::string &key) {
@@ -403,6 +699,8 @@ int Params::put(const char* key, const char* value, size_t value_size) {
     std::string path = params_path + "/d/" + std::string(key);
     if ((result = rename(tmp_path.c_str(), path.c_str())) < 0) break;
 
+    cache->invalidate(key);
+
     // fsync parent directory
     path = params_path + "/d";
     result = fsync_dir(path.c_str());
@@ -419,6 +717,7 @@ int Params::remove(const char *key) {
   // Delete value.
   std::string path = params_path + "/d/" + key;
   int result = ::remove(path.c_str());
+  cache->invalidate(key);
   if (result != 0) {
     result = ERR_NO_VALUE;
     return result;
@@ -429,9 +728,8 @@ int Params::remove(const char *key) {
 }
 
 std::string Params::get(const char *key, bool block) {
-  std::string path = params_path + "/d/" + key;
   if (!block) {
-    return util::read_file(path);
+    return cache->read(key);
   } else {
     // blocking read until successful
     params_do_exit = 0;
@@ -440,10 +738,12 @@ std::string Params::get(const char *key, bool block) {
 
     std::string value;
     while (!params_do_exit) {
-      if (value = util::read_file(path); !value.empty()) {
+      uint64_t generation;
+      if (value = cache->read(key, &generation); !value.empty()) {
         break;
       }
-      util::sleep_for(100);  // 0.1 s
+      // woken by the write while watched, the timeout is for the signals
+      cache->wait(generation, 100);
     }
 
     std::signal(SIGINT, prev_handler_sigint);
@@ -467,3 +767,11 @@ void Params::clearAll(ParamKeyType key_type) {
     }
   }
 }
+
+int Params::watch(const std::string &key, std::function<void(const std::string &key)> callback) {
+  return cache->watch(key, callback);
+}
+
+void Params::unwatch(int id) {
+  cache->unwatch(id);
+}
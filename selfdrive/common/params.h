@@ -1,6 +1,8 @@
 #pragma once
 
+#include <functional>
 #include <map>
+#include <optional>
 #include <sstream>
 #include <string>
 
@@ -16,9 +18,12 @@ enum ParamKeyType {
   ALL = 0x02 | 0x04 | 0x08 | 0x10 | 0x20 | 0x40
 };
 
+class ParamsCache;
+
 class Params {
 private:
   std::string params_path;
+  ParamsCache *cache;
 
 public:
   Params(bool persistent_param = false);
@@ -37,7 +42,8 @@ public:
   // read all values
   std::map<std::string, std::string> readAll();
 
-  // helpers for reading values
+  // helpers for reading values, served from memory while the params
+  // directory is watched and re-read once changed
   std::string get(const char *key, bool block = false);
 
   inline std::string get(const std::string &key, bool block = false) {
@@ -79,6 +85,14 @@ public:
     return putBool(key.c_str(), val);
   }
 
+  // Calls callback on a background thread after key is written or removed, by
+  // this process or another. An empty key is called for every change, with ""
+  // when the whole directory may have changed. Returns the id to unwatch with.
+  int watch(const std::string &key, std::function<void(const std::string &key)> callback);
+  // Once it returns the callback isn't running and won't be called again, unless
+  // called from the callback itself.
+  void unwatch(int id);
+
   inline int getInt( const char *key )
   {
     int   ret_code = 0;
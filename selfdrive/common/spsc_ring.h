@@ -0,0 +1,65 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// Fixed size ring between one producer and one consumer thread, without locks.
+// Items stay in place: the producer fills back() and publishes it with push(),
+// the consumer reads at(i) and hands the slots back with pop().
+template <class T, size_t N>
+class SpscRing {
+  static_assert(N > 0 && (N & (N - 1)) == 0, "the indices wrap at 2^32, N has to divide it");
+
+public:
+  // producer: the next free slot, nullptr while full
+  T *back() {
+    uint32_t h = head.load(std::memory_order_relaxed);
+    if (h - tail.load(std::memory_order_acquire) >= N) return nullptr;
+    return &items[h % N];
+  }
+
+  // producer: publishes the slot back() returned
+  void push() {
+    head.store(head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+  }
+
+  bool try_push(const T &v) {
+    T *slot = back();
+    if (slot == nullptr) return false;
+    *slot = v;
+    push();
+    return true;
+  }
+
+  // the number of pushed items not popped yet, exact on the consumer and at
+  // most that on the producer
+  size_t size() const {
+    return head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire);
+  }
+
+  bool empty() const { return size() == 0; }
+
+  // consumer: the i-th oldest item, nullptr past the end
+  T *at(size_t i) {
+    if (i >= size()) return nullptr;
+    return &items[(tail.load(std::memory_order_relaxed) + i) % N];
+  }
+
+  // consumer: drops the n oldest items, n at most size()
+  void pop(size_t n = 1) {
+    tail.store(tail.load(std::memory_order_relaxed) + n, std::memory_order_release);
+  }
+
+  bool try_pop(T &v) {
+    T *item = at(0);
+    if (item == nullptr) return false;
+    v = *item;
+    pop();
+    return true;
+  }
+
+private:
+  std::atomic<uint32_t> head = 0, tail = 0;
+  T items[N];
+};
@@ -4,18 +4,62 @@
 
 #include "selfdrive/common/swaglog.h"
 
+#include <pthread.h>
+
+#include <algorithm>
 #include <cassert>
+#include <condition_variable>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
 #include <cstring>
+#include <memory>
 #include <mutex>
+#include <new>
 #include <string>
+#include <thread>
+#include <vector>
 
 #include <zmq.h>
 #include "json11.hpp"
 
+#include "selfdrive/common/spsc_ring.h"
 #include "selfdrive/common/util.h"
 #include "selfdrive/common/version.h"
 #include "selfdrive/hardware/hw.h"
 
+// records per thread, a thread that logs faster than they are sent drops the rest
+#define LOG_RING_SIZE 64
+#define LOG_MAX_ARGS 16
+#define LOG_DATA_SIZE 512
+// the sender thread wakes at least this often
+#define LOG_FLUSH_MS 100
+
+// A message as logged, formatted on the sender thread. Without a fmt the
+// message is in data already formatted, or in long_msg if it didn't fit.
+struct LogRecord {
+  int levelnum;
+  const CloudlogSite *site;
+  const char *fmt;
+  char *long_msg;
+  double created;
+  int num_args;
+  int data_len;
+  union {
+    int64_t i;
+    double d;
+    int str;  // offset of the string in data
+  } args[LOG_MAX_ARGS];
+  char data[LOG_DATA_SIZE];
+};
+
+// the records of one logging thread, taken by the sender
+struct LogRing {
+  SpscRing<LogRecord, LOG_RING_SIZE> records;
+  std::atomic<uint64_t> dropped = 0;
+  std::atomic<bool> orphaned = false;  // its thread exited
+};
+
 class LogState {
  public:
   LogState() = default;
@@ -26,9 +70,20 @@ class LogState {
   void *zctx;
   void *sock;
   int print_level;
+
+  // rings of the threads that logged, the sender frees the ones of exited threads
+  std::mutex rings_lock;
+  std::vector<LogRing *> rings;
+  std::thread *sender = nullptr;
+  std::condition_variable cv, sent_cv;
+  std::atomic<bool> wake = false;
+  bool exit = false;
 };
 
+static void stop_sender();
+
 LogState::~LogState() {
+  stop_sender();
   zmq_close(sock);
   zmq_ctx_destroy(zctx);
 }
@@ -39,6 +94,36 @@ static void cloudlog_bind_locked(const char* k, const char* v) {
   s.ctx_j[k] = v;
 }
 
+static void sender_thread();
+
+static void before_fork() {
+  s.lock.lock();
+  s.rings_lock.lock();
+}
+
+static void after_fork_parent() {
+  s.rings_lock.unlock();
+  s.lock.unlock();
+}
+
+static void ring_owner_reset();
+
+static void after_fork_child() {
+  // the parent sends what was logged before, the child starts a sender of its own.
+  // only the forking thread lives on, it gets a new ring so its next log inits again
+  for (LogRing *ring : s.rings) {
+    ring->records.pop(ring->records.size());
+    ring->orphaned = true;
+  }
+  ring_owner_reset();
+  // the parent's sender waited on them, a waiter the child doesn't have would block their next use
+  new (&s.cv) std::condition_variable();
+  new (&s.sent_cv) std::condition_variable();
+  s.sender = nullptr;
+  s.inited = false;
+  after_fork_parent();
+}
+
 static void cloudlog_init() {
   if (s.inited) return;
   s.ctx_j = json11::Json::object {};
@@ -79,41 +164,395 @@ static void cloudlog_init() {
     cloudlog_bind_locked("device", "pc");
   }
 
+  static std::once_flag at_fork;
+  std::call_once(at_fork, [] { pthread_atfork(before_fork, after_fork_parent, after_fork_child); });
+  s.sender = new std::thread(sender_thread);
   s.inited = true;
 }
 
-void log(int levelnum, const char* filename, int lineno, const char* func, const char* msg, const std::string& log_s) {
-  std::lock_guard lk(s.lock);
-  cloudlog_init();
-  if (levelnum >= s.print_level) {
-    printf("%s: %s\n", filename, msg);
+// ***** logging thread side *****
+
+// a thread's ring is orphaned when it exits, the sender frees it once it's drained
+struct LogRingOwner {
+  LogRing *ring = nullptr;
+  ~LogRingOwner() {
+    if (ring) ring->orphaned = true;
   }
-  char levelnum_c = levelnum;
-  zmq_send(s.sock, (levelnum_c + log_s).c_str(), log_s.length() + 1, ZMQ_NOBLOCK);
+};
+static thread_local LogRingOwner ring_owner;
+
+static void ring_owner_reset() {
+  ring_owner.ring = nullptr;
+}
+
+static LogRing *thread_ring() {
+  if (ring_owner.ring == nullptr) {
+    std::unique_lock lk(s.lock);
+    cloudlog_init();
+    ring_owner.ring = new LogRing();
+    std::unique_lock rings_lk(s.rings_lock);
+    s.rings.push_back(ring_owner.ring);
+  }
+  return ring_owner.ring;
+}
+
+static LogRecord *ring_reserve(LogRing *ring) {
+  LogRecord *r = ring->records.back();
+  if (r == nullptr) {
+    ring->dropped.fetch_add(1, std::memory_order_relaxed);
+  }
+  return r;
+}
+
+static void ring_commit(LogRing *ring, int levelnum) {
+  ring->records.push();
+  if (levelnum >= CLOUDLOG_ERROR) {
+    // errors are sent before the call returns, the process may be about to die
+    std::unique_lock lk(s.lock);
+    if (s.sender == nullptr) return;
+    s.wake = true;
+    s.cv.notify_one();
+    s.sent_cv.wait_for(lk, std::chrono::milliseconds(LOG_FLUSH_MS), [&] {
+      return ring->records.empty() || s.sender == nullptr;
+    });
+  } else if (!s.wake.exchange(true, std::memory_order_acq_rel)) {
+    // one notify per wakeup of the sender, under the lock so it can't come between its check and its wait
+    std::unique_lock lk(s.lock);
+    s.cv.notify_one();
+  }
+}
+
+static int copy_string(LogRecord *r, const char *str, size_t max_len) {
+  if (str == nullptr) str = "(null)";
+  size_t len = strnlen(str, max_len);
+  if (r->data_len + len + 1 > LOG_DATA_SIZE) return -1;
+  int offset = r->data_len;
+  memcpy(r->data + offset, str, len);
+  r->data[offset + len] = '\0';
+  r->data_len += len + 1;
+  return offset;
+}
+
+// Walks the conversions of a printf format. f(spec, spec_len, conversion, length)
+// is called for each, length as in the C standard ("", "hh", "l", "ll", ...),
+// and before it with '*' for a width and '.' for a precision taken from the
+// arguments. Returns false on conversions it doesn't know.
+template <typename F>
+static bool parse_format(const char *fmt, F f) {
+  for (const char *p = fmt; *p; p++) {
+    if (*p != '%') continue;
+    const char *spec = p++;
+    if (*p == '%') continue;
+
+    while (*p && strchr("-+ #0'", *p)) p++;
+    if (*p == '*') { f(spec, 0, '*', ""); p++; }
+    while (*p >= '0' && *p <= '9') p++;
+    if (*p == '.') {
+      p++;
+      if (*p == '*') { f(spec, 0, '.', ""); p++; }
+      while (*p >= '0' && *p <= '9') p++;
+    }
+
+    const char *length = "";
+    if (p[0] == 'h' && p[1] == 'h') { length = "hh"; p += 2; }
+    else if (p[0] == 'l' && p[1] == 'l') { length = "ll"; p += 2; }
+    else if (*p && strchr("hljztL", *p)) { length = *p == 'h' ? "h" : *p == 'l' ? "l" : *p == 'j' ? "j" :
+                                                  *p == 'z' ? "z" : *p == 't' ? "t" : "L"; p++; }
+
+    if (*p == '\0' || !strchr("diouxXcsfFeEgGaAp", *p)) return false;
+    if (!f(spec, p - spec + 1, *p, length)) return false;
+  }
+  return true;
+}
+
+// copies the arguments of fmt into the record, false if they don't fit
+static bool capture_args(LogRecord *r, const char *fmt, va_list args) {
+  int precision = -1;
+  return parse_format(fmt, [&](const char *spec, int spec_len, char conv, const char *length) {
+    if (r->num_args >= LOG_MAX_ARGS) return false;
+    auto &arg = r->args[r->num_args++];
+    if (conv == '*') {
+      arg.i = va_arg(args, int);
+      return true;
+    } else if (conv == '.') {
+      // the precision of a %.*s limits how much of the string is read
+      arg.i = precision = va_arg(args, int);
+      return true;
+    }
+
+    if (strchr("fFeEgGaA", conv)) {
+      arg.d = length[0] == 'L' ? (double)va_arg(args, long double) : va_arg(args, double);
+    } else if (conv == 's') {
+      const char *dot = (const char *)memchr(spec, '.', spec_len);
+      size_t max_len = LOG_DATA_SIZE;
+      if (dot && dot[1] == '*') {
+        max_len = precision >= 0 ? precision : LOG_DATA_SIZE;
+      } else if (dot) {
+        max_len = atoi(dot + 1);
+      }
+      arg.str = copy_string(r, va_arg(args, const char *), max_len);
+      if (arg.str < 0) return false;
+    } else if (conv == 'p') {
+      arg.i = (int64_t)(uintptr_t)va_arg(args, void *);
+    } else if (strcmp(length, "ll") == 0 || strcmp(length, "j") == 0) {
+      arg.i = va_arg(args, long long);
+    } else if (length[0] == 'l' || length[0] == 'z' || length[0] == 't') {
+      arg.i = va_arg(args, long);
+    } else {
+      arg.i = va_arg(args, int);
+    }
+    precision = -1;
+    return true;
+  });
+}
+
+// false while the site is over its budget for this window
+static bool site_allowed(CloudlogSite *site, uint32_t *suppressed) {
+  uint64_t ts = nanos_since_boot();
+  uint64_t start = site->window_start.load(std::memory_order_relaxed);
+  if (start == 0 || ts - start > CLOUDLOG_SITE_WINDOW_MS * 1000000ULL) {
+    if (site->window_start.compare_exchange_strong(start, ts)) {
+      site->count = 0;
+      *suppressed = site->suppressed.exchange(0);
+    }
+  }
+  if (site->count.fetch_add(1, std::memory_order_relaxed) < CLOUDLOG_SITE_BURST) return true;
+  site->suppressed.fetch_add(1, std::memory_order_relaxed);
+  return false;
+}
+
+static void log_formatted(LogRing *ring, int levelnum, const char* filename, int lineno, const char* func,
+                          const CloudlogSite *site, const char *fmt, va_list args) {
+  LogRecord *r = ring_reserve(ring);
+  if (r == nullptr) return;
+
+  r->levelnum = levelnum;
+  r->site = site;
+  r->fmt = nullptr;
+  r->long_msg = nullptr;
+  r->created = seconds_since_epoch();
+  r->num_args = 0;
+  r->data_len = 0;
+  if (site == nullptr) {
+    // the call site's strings may not outlive the call
+    r->args[0].str = copy_string(r, filename, LOG_DATA_SIZE / 4);
+    r->args[1].str = copy_string(r, func, LOG_DATA_SIZE / 4);
+    r->args[2].i = lineno;
+  }
+  va_list copy;
+  va_copy(copy, args);
+  int len = vsnprintf(r->data + r->data_len, LOG_DATA_SIZE - r->data_len, fmt, copy);
+  va_end(copy);
+  r->args[3].str = r->data_len;
+  if (len >= LOG_DATA_SIZE - r->data_len && vasprintf(&r->long_msg, fmt, args) == -1) {
+    r->long_msg = nullptr;
+  }
+  ring_commit(ring, levelnum);
+}
+
+void cloudlog_site(int levelnum, CloudlogSite* site, bool fmt_is_static, const char* fmt, ...) {
+  uint32_t suppressed = 0;
+  if (!site_allowed(site, &suppressed)) return;
+  LogRing *ring = thread_ring();
+  if (suppressed > 0) {
+    static CloudlogSite suppressed_site = {__FILE__, __LINE__, __func__, {0}, {0}, {0}};
+    LogRecord *r = ring_reserve(ring);
+    if (r) {
+      *r = {.levelnum = CLOUDLOG_WARNING, .site = &suppressed_site, .fmt = "cloudlog: %d messages suppressed at %s:%d",
+            .long_msg = nullptr, .created = seconds_since_epoch(), .num_args = 3};
+      r->args[0].i = suppressed;
+      r->args[1].str = copy_string(r, site->filename, 256);
+      r->args[2].i = site->lineno;
+      ring_commit(ring, CLOUDLOG_WARNING);
+    }
+  }
+
+  va_list args;
+  va_start(args, fmt);
+  LogRecord *r = fmt_is_static ? ring_reserve(ring) : nullptr;
+  if (r) {
+    r->levelnum = levelnum;
+    r->site = site;
+    r->fmt = fmt;
+    r->long_msg = nullptr;
+    r->created = seconds_since_epoch();
+    r->num_args = 0;
+    r->data_len = 0;
+    va_list copy;
+    va_copy(copy, args);
+    bool captured = capture_args(r, fmt, copy);
+    va_end(copy);
+    if (captured) {
+      ring_commit(ring, levelnum);
+    } else {
+      log_formatted(ring, levelnum, site->filename, site->lineno, site->func, site, fmt, args);
+    }
+  } else if (!fmt_is_static) {
+    log_formatted(ring, levelnum, site->filename, site->lineno, site->func, site, fmt, args);
+  }
+  va_end(args);
 }
 
 void cloudlog_e(int levelnum, const char* filename, int lineno, const char* func,
                 const char* fmt, ...) {
-  char* msg_buf = nullptr;
   va_list args;
   va_start(args, fmt);
-  vasprintf(&msg_buf, fmt, args);
+  log_formatted(thread_ring(), levelnum, filename, lineno, func, nullptr, fmt, args);
   va_end(args);
+}
+
+// ***** sender thread side *****
+
+// literal text of a format, "%%" is a '%'
+static void append_literal(std::string &msg, const char *begin, const char *end) {
+  for (const char *p = begin; p < end; p++) {
+    msg += *p;
+    if (p[0] == '%' && p + 1 < end && p[1] == '%') p++;
+  }
+}
+
+static std::string format_record(const LogRecord &r) {
+  if (r.fmt == nullptr) return r.long_msg ? r.long_msg : r.data + r.args[3].str;
+
+  std::string msg;
+  char buf[LOG_DATA_SIZE];
+  int arg = 0;
+  const char *last = r.fmt;
+  std::vector<int> stars;
+  parse_format(r.fmt, [&](const char *spec, int spec_len, char conv, const char *length) {
+    if (conv == '*' || conv == '.') {
+      stars.push_back(r.args[arg++].i);
+      return true;
+    }
+    append_literal(msg, last, spec);
+    last = spec + spec_len;
+
+    std::string one(spec, spec_len);
+    const auto &a = r.args[arg++];
+    // long doubles and intmax_ts were stored as double and long long
+    if (length[0] == 'L') one.erase(one.size() - 2, 1);
+    if (length[0] == 'j') one.replace(one.size() - 2, 1, "ll");
+    auto print = [&](auto value) {
+      if (stars.size() == 2) snprintf(buf, sizeof(buf), one.c_str(), stars[0], stars[1], value);
+      else if (stars.size() == 1) snprintf(buf, sizeof(buf), one.c_str(), stars[0], value);
+      else snprintf(buf, sizeof(buf), one.c_str(), value);
+    };
+    if (strchr("fFeEgGaA", conv)) print(a.d);
+    else if (conv == 's') print(r.data + a.str);
+    else if (conv == 'p') print((void *)(uintptr_t)a.i);
+    else if (strcmp(length, "ll") == 0 || length[0] == 'j') print((long long)a.i);
+    else if (length[0] == 'l' || length[0] == 'z' || length[0] == 't') print((long)a.i);
+    else print((int)a.i);
+    stars.clear();
+    msg += buf;
+    return true;
+  });
+  append_literal(msg, last, last + strlen(last));
+  return msg;
+}
 
-  if (!msg_buf) return;
+static void send_record(const LogRecord &r) {
+  std::string msg = format_record(r);
+  const char *filename = r.site ? r.site->filename : r.data + r.args[0].str;
+  const char *func = r.site ? r.site->func : r.data + r.args[1].str;
+  int lineno = r.site ? r.site->lineno : r.args[2].i;
 
+  json11::Json::object ctx;
+  {
+    std::unique_lock lk(s.lock);
+    ctx = s.ctx_j;
+  }
   json11::Json log_j = json11::Json::object {
-    {"msg", msg_buf},
-    {"ctx", s.ctx_j},
-    {"levelnum", levelnum},
+    {"msg", msg},
+    {"ctx", ctx},
+    {"levelnum", r.levelnum},
     {"filename", filename},
     {"lineno", lineno},
     {"funcname", func},
-    {"created", seconds_since_epoch()}
+    {"created", r.created}
   };
   std::string log_s = log_j.dump();
-  log(levelnum, filename, lineno, func, msg_buf, log_s);
-  free(msg_buf);
+
+  if (r.levelnum >= s.print_level) {
+    printf("%s: %s\n", filename, msg.c_str());
+  }
+  char levelnum_c = r.levelnum;
+  zmq_send(s.sock, (levelnum_c + log_s).c_str(), log_s.length() + 1, ZMQ_NOBLOCK);
+}
+
+// sends every committed record, returns false if there were none
+static bool drain() {
+  std::vector<LogRing *> rings;
+  {
+    std::unique_lock lk(s.rings_lock);
+    rings = s.rings;
+  }
+
+  bool sent = false;
+  for (LogRing *ring : rings) {
+    uint64_t dropped = ring->dropped.exchange(0);
+    while (LogRecord *r = ring->records.at(0)) {
+      send_record(*r);
+      free(r->long_msg);
+      ring->records.pop();
+      sent = true;
+    }
+    if (dropped > 0) {
+      static CloudlogSite dropped_site = {__FILE__, __LINE__, __func__, {0}, {0}, {0}};
+      LogRecord r = {.levelnum = CLOUDLOG_WARNING, .site = &dropped_site, .fmt = "cloudlog: %lu messages dropped",
+                     .long_msg = nullptr, .created = seconds_since_epoch(), .num_args = 1};
+      r.args[0].i = dropped;
+      send_record(r);
+    }
+
+    if (ring->orphaned && ring->records.empty()) {
+      std::unique_lock lk(s.rings_lock);
+      s.rings.erase(std::find(s.rings.begin(), s.rings.end(), ring));
+      delete ring;
+    }
+  }
+  return sent;
+}
+
+static void sender_thread() {
+  set_thread_name("swaglog");
+  while (true) {
+    {
+      std::unique_lock lk(s.lock);
+      s.cv.wait_for(lk, std::chrono::milliseconds(LOG_FLUSH_MS), [] { return s.wake.load() || s.exit; });
+      if (s.exit) return;
+    }
+    s.wake = false;
+    drain();
+
+    std::unique_lock lk(s.lock);
+    s.sent_cv.notify_all();
+  }
+}
+
+// joins the sender and sends what it left
+static void stop_sender() {
+  std::thread *sender = nullptr;
+  {
+    std::unique_lock lk(s.lock);
+    if (s.sender == nullptr) return;
+    s.exit = true;
+    std::swap(sender, s.sender);
+  }
+  s.cv.notify_one();
+  s.sent_cv.notify_all();
+  sender->join();
+  delete sender;
+  drain();
+}
+
+void cloudlog_flush() {
+  stop_sender();
+  std::unique_lock lk(s.lock);
+  if (s.inited && s.sender == nullptr) {
+    s.exit = false;
+    s.sender = new std::thread(sender_thread);
+  }
 }
 
 void cloudlog_bind(const char* k, const char* v) {
@@ -1,5 +1,8 @@
 #pragma once
 
+#include <atomic>
+#include <cstdint>
+
 #include "selfdrive/common/timing.h"
 
 #define CLOUDLOG_DEBUG 10
@@ -8,14 +11,39 @@
 #define CLOUDLOG_ERROR 40
 #define CLOUDLOG_CRITICAL 50
 
+// messages of one call site allowed per window, the rest are counted and reported
+#define CLOUDLOG_SITE_BURST 100
+#define CLOUDLOG_SITE_WINDOW_MS 1000
+
+// a LOGx call site, its address identifies the site and its format string
+struct CloudlogSite {
+  const char* filename;
+  int lineno;
+  const char* func;
+  std::atomic<uint64_t> window_start;
+  std::atomic<uint32_t> count, suppressed;
+};
+
+// Logs through a ring of the calling thread, a background thread formats and
+// sends the messages. The arguments are copied and formatted there, unless fmt
+// isn't a literal (fmt_is_static), then the message is formatted right away.
+void cloudlog_site(int levelnum, CloudlogSite* site, bool fmt_is_static,
+                   const char* fmt, ...) /*__attribute__ ((format (printf, 4, 5)))*/;
+
+// for call sites that aren't static, always formatted right away
 void cloudlog_e(int levelnum, const char* filename, int lineno, const char* func,
-                const char* fmt, ...) /*__attribute__ ((format (printf, 6, 7)))*/;
+                const char* fmt, ...) /*__attribute__ ((format (printf, 5, 6)))*/;
 
 void cloudlog_bind(const char* k, const char* v);
 
-#define cloudlog(lvl, fmt, ...) cloudlog_e(lvl, __FILE__, __LINE__, \
-                                           __func__, \
-                                           fmt, ## __VA_ARGS__)
+// sends everything logged so far, called at exit
+void cloudlog_flush();
+
+#define cloudlog(lvl, fmt, ...)                                                 \
+do {                                                                            \
+  static CloudlogSite __site = {__FILE__, __LINE__, __func__, {0}, {0}, {0}};   \
+  cloudlog_site(lvl, &__site, __builtin_constant_p(fmt), fmt, ## __VA_ARGS__);  \
+} while (0)
 
 #define cloudlog_rl(burst, millis, lvl, fmt, ...)   \
 {                                                   \
@@ -0,0 +1,94 @@
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "selfdrive/common/benchmark.h"
+#include "selfdrive/common/params.h"
+#include "selfdrive/common/timing.h"
+#include "selfdrive/common/util.h"
+
+// get() latency reading the file each time, as it did before the cache, against
+// the cached get(), and how long a blocking get() and a watch take to see a put.
+// The puts come from outside of Params, as they would from another process, so
+// only inotify can tell the cache about them.
+//
+// usage: params_benchmark [iterations]
+
+#define NUM_KEYS 40
+
+// written like Params::put does it, without invalidating this process's cache
+static void external_put(const std::string &params_path, const std::string &key, const std::string &value) {
+  const std::string tmp_path = params_path + "/.tmp_external";
+  util::write_file(tmp_path.c_str(), value.data(), value.size(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  rename(tmp_path.c_str(), (params_path + "/d/" + key).c_str());
+}
+
+static void print_latency(const char *name, std::vector<double> &ms) {
+  std::sort(ms.begin(), ms.end());
+  printf("%-28s median %.3f ms, max %.3f ms\n", name, ms[ms.size() / 2], ms.back());
+}
+
+int main(int argc, char *argv[]) {
+  int iterations = argc > 1 ? atoi(argv[1]) : 100000;
+
+  char tmp_path[] = "/tmp/params_benchmark_XXXXXX";
+  const std::string params_path = mkdtemp(tmp_path);
+  Params params(params_path);
+
+  std::vector<std::string> keys;
+  for (int i = 0; i < NUM_KEYS; i++) {
+    keys.push_back("Key" + std::to_string(i));
+    params.put(keys.back(), std::to_string(i));
+  }
+
+  volatile size_t sink = 0;
+  bench("read_file (uncached get)", iterations, "get", [&](int i) {
+    sink += util::read_file(params_path + "/d/" + keys[i % NUM_KEYS]).size();
+  });
+  bench("get", iterations, "get", [&](int i) {
+    sink += params.get(keys[i % NUM_KEYS]).size();
+  });
+
+  // an outside put shows up at once, not on the next 100 ms poll
+  std::vector<double> get_ms, blocking_ms, watch_ms;
+  std::atomic<double> put_tms = 0, watch_tms = 0;
+  int id = params.watch("Watched", [&](const std::string &key) { watch_tms = millis_since_boot(); });
+  for (int i = 0; i < 20; i++) {
+    const std::string value = std::to_string(i);
+    double start_tms = millis_since_boot();
+    external_put(params_path, keys[0], value);
+    while (params.get(keys[0]) != value && millis_since_boot() - start_tms < 1000) {}
+    get_ms.push_back(millis_since_boot() - start_tms);
+
+    params.remove("Blocking");
+    std::thread t([&]() {
+      params.get("Blocking", true);
+      blocking_ms.push_back(millis_since_boot() - put_tms);
+    });
+    util::sleep_for(10);
+    put_tms = millis_since_boot();
+    external_put(params_path, "Blocking", "1");
+    t.join();
+
+    watch_tms = 0;
+    start_tms = millis_since_boot();
+    external_put(params_path, "Watched", value);
+    while (watch_tms == 0 && millis_since_boot() - start_tms < 1000) util::sleep_for(1);
+    watch_ms.push_back(watch_tms - start_tms);
+  }
+  params.unwatch(id);
+  print_latency("get after outside put", get_ms);
+  print_latency("blocking get after put", blocking_ms);
+  print_latency("watch after put", watch_ms);
+
+  for (auto &key : keys) params.remove(key);
+  params.remove("Blocking");
+  params.remove("Watched");
+  return 0;
+}
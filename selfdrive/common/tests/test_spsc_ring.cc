@@ -0,0 +1,77 @@
+#define CATCH_CONFIG_MAIN
+#include "catch2/catch.hpp"
+
+#include <cstdint>
+#include <thread>
+
+#include "selfdrive/common/spsc_ring.h"
+
+TEST_CASE("SpscRing keeps order and refuses pushes when full") {
+  SpscRing<int, 4> ring;
+  REQUIRE(ring.empty());
+  REQUIRE(ring.at(0) == nullptr);
+
+  // a few times around so the indices wrap
+  int next_push = 0, next_pop = 0;
+  for (int round = 0; round < 10; round++) {
+    while (ring.try_push(next_push)) next_push++;
+    REQUIRE(ring.size() == 4);
+    REQUIRE(ring.back() == nullptr);
+
+    for (size_t i = 0; i < 4; i++) {
+      REQUIRE(*ring.at(i) == next_pop + (int)i);
+    }
+    REQUIRE(ring.at(4) == nullptr);
+
+    ring.pop(3);
+    next_pop += 3;
+    REQUIRE(ring.size() == 1);
+    REQUIRE(*ring.at(0) == next_pop);
+
+    int v = -1;
+    REQUIRE(ring.try_pop(v));
+    REQUIRE(v == next_pop++);
+    REQUIRE(!ring.try_pop(v));
+  }
+}
+
+TEST_CASE("SpscRing fills slots in place") {
+  struct Item {
+    int n;
+    char data[16];
+  };
+  SpscRing<Item, 2> ring;
+  Item *slot = ring.back();
+  REQUIRE(slot != nullptr);
+  slot->n = 7;
+  // not visible before it's pushed
+  REQUIRE(ring.empty());
+  ring.push();
+  REQUIRE(ring.at(0) == slot);
+  REQUIRE(ring.at(0)->n == 7);
+}
+
+TEST_CASE("SpscRing hands items from one thread to another") {
+  const uint32_t count = 1000000;
+  SpscRing<uint32_t, 64> ring;
+
+  std::thread producer([&]() {
+    for (uint32_t i = 0; i < count; i++) {
+      while (!ring.try_push(i)) std::this_thread::yield();
+    }
+  });
+
+  uint32_t expected = 0;
+  bool in_order = true;
+  while (expected < count) {
+    size_t n = ring.size();
+    for (size_t i = 0; i < n; i++) {
+      in_order = in_order && *ring.at(i) == expected++;
+    }
+    ring.pop(n);
+    if (n == 0) std::this_thread::yield();
+  }
+  producer.join();
+  REQUIRE(in_order);
+  REQUIRE(ring.empty());
+}
@@ -0,0 +1,125 @@
+#include <sys/wait.h>
+#include <unistd.h>
+#include <zmq.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+#define CATCH_CONFIG_MAIN
+#include "catch2/catch.hpp"
+
+#include "json11.hpp"
+#include "selfdrive/common/swaglog.h"
+
+const char *SWAGLOG_ADDR = "ipc:///tmp/logmessage";
+
+class LogReceiver {
+public:
+  LogReceiver() {
+    zctx = zmq_ctx_new();
+    sock = zmq_socket(zctx, ZMQ_PULL);
+    int timeout = 1000;
+    zmq_setsockopt(sock, ZMQ_RCVTIMEO, &timeout, sizeof(timeout));
+    REQUIRE(zmq_bind(sock, SWAGLOG_ADDR) == 0);
+  }
+  ~LogReceiver() {
+    zmq_close(sock);
+    zmq_ctx_destroy(zctx);
+  }
+
+  json11::Json recv() {
+    char buf[8192] = {};
+    int len = zmq_recv(sock, buf, sizeof(buf) - 1, 0);
+    REQUIRE(len > 1);
+    std::string err;
+    json11::Json msg = json11::Json::parse(buf + 1, err);
+    REQUIRE(err.empty());
+    REQUIRE(msg["levelnum"].int_value() == buf[0]);
+    return msg;
+  }
+
+private:
+  void *zctx, *sock;
+};
+
+// the arguments of a literal format are copied and formatted by the sender thread,
+// which has to come up with what printf does
+#define REQUIRE_FORMAT(r, fmt, ...)                            \
+  do {                                                         \
+    char expected[4096];                                       \
+    snprintf(expected, sizeof(expected), fmt, ## __VA_ARGS__); \
+    LOGD(fmt, ## __VA_ARGS__);                                 \
+    REQUIRE(r.recv()["msg"].string_value() == expected);       \
+  } while (0)
+
+TEST_CASE("swaglog formats like printf") {
+  LogReceiver r;
+  // the first message waits for the sender to connect
+  LOGD("connect");
+  r.recv();
+
+  SECTION("strings") {
+    REQUIRE_FORMAT(r, "%s", "hello");
+    REQUIRE_FORMAT(r, "[%10s] [%-10s]", "right", "left");
+    REQUIRE_FORMAT(r, "%.3s %.*s", "abcdef", 2, "abcdef");
+  }
+  SECTION("widths and precisions from the arguments") {
+    REQUIRE_FORMAT(r, "[%*d] [%-*d]", 6, 42, 6, -42);
+    REQUIRE_FORMAT(r, "[%*.*f]", 10, 3, 3.14159);
+    REQUIRE_FORMAT(r, "[%.*s] %d", 3, "abcdef", 7);
+  }
+  SECTION("integers") {
+    REQUIRE_FORMAT(r, "%d %i %u %x %X %o", -1, 2, 3u, 255u, 255u, 8u);
+    REQUIRE_FORMAT(r, "%lld %llu", -1234567890123LL, 18446744073709551615ULL);
+    REQUIRE_FORMAT(r, "%ld %lu %zu", -123456789L, 123456789UL, (size_t)4096);
+    REQUIRE_FORMAT(r, "%hhd %hd %jd", (signed char)-5, (short)-300, (intmax_t)-7);
+    REQUIRE_FORMAT(r, "%c%c", 'o', 'k');
+  }
+  SECTION("floats") {
+    REQUIRE_FORMAT(r, "%f %.2f %e %g", 3.14159, 2.71828, 0.000123, 1e10);
+    REQUIRE_FORMAT(r, "%Lf", (long double)2.5L);
+  }
+  SECTION("percent signs") {
+    REQUIRE_FORMAT(r, "%%");
+    REQUIRE_FORMAT(r, "100%% of %d%%", 50);
+    REQUIRE_FORMAT(r, "%s%%%s", "a", "b");
+  }
+  SECTION("formats it can't copy are formatted right away") {
+    std::string fmt = "not a literal %d";
+    LOGD(fmt.c_str(), 1);
+    REQUIRE(r.recv()["msg"].string_value() == "not a literal 1");
+
+    std::string long_str(2000, 'x');
+    REQUIRE_FORMAT(r, "%s", long_str.c_str());
+    REQUIRE_FORMAT(r, "%d %d %d %d %d %d %d %d %d %d %d %d %d %d %d %d %d", 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17);
+  }
+}
+
+TEST_CASE("swaglog sends where it was logged") {
+  LogReceiver r;
+  LOGE("error %d", 1); int lineno = __LINE__;
+  json11::Json msg = r.recv();
+  REQUIRE(msg["msg"].string_value() == "error 1");
+  REQUIRE(msg["levelnum"].int_value() == CLOUDLOG_ERROR);
+  REQUIRE(msg["lineno"].int_value() == lineno);
+  REQUIRE(msg["funcname"].string_value() == __func__);
+  REQUIRE(msg["filename"].string_value() == __FILE__);
+}
+
+TEST_CASE("swaglog logs from a forked child") {
+  LogReceiver r;
+  LOGD("parent");
+  REQUIRE(r.recv()["msg"].string_value() == "parent");
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    // the child's first log starts a sender of its own, exit waits for it to send
+    LOGE("child %d", getpid());
+    exit(0);
+  }
+  REQUIRE(pid > 0);
+  REQUIRE(r.recv()["msg"].string_value() == "child " + std::to_string(pid));
+  waitpid(pid, nullptr, 0);
+}
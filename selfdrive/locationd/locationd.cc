@@ -3,6 +3,8 @@
 
 #include <cmath>
 
+#include "cereal/services.h"
+#include "selfdrive/common/latency.h"
 #include "locationd.h"
 
 using namespace EKFS;
@@ -440,26 +442,31 @@ bool Localizer::isGpsOK() {
 }
 
 int Localizer::locationd_thread() {
-  const std::initializer_list<const char *> service_list =
-      { "gpsLocationExternal", "sensorEvents", "cameraOdometry", "liveCalibration", "carState" };
+  const std::initializer_list<ServiceId> service_list =
+      { ServiceId::gpsLocationExternal, ServiceId::sensorEvents, ServiceId::cameraOdometry,
+        ServiceId::liveCalibration, ServiceId::carState };
   PubMaster pm({ "liveLocationKalman" });
-  SubMaster sm(service_list, nullptr, { "gpsLocationExternal" });
+  IndexedSubMaster sm(service_list, nullptr, { ServiceId::gpsLocationExternal });
 
   Params params;
 
   while (!do_exit) {
     sm.update();
-    for (const char* service : service_list) {
-      if (sm.updated(service) && sm.valid(service)) {
-        const cereal::Event::Reader log = sm[service];
-        this->handle_msg(log);
+    {
+      LATENCY_SCOPE("locationd_msgs");
+      for (ServiceId service : service_list) {
+        if (sm.updated(service) && sm.valid(service)) {
+          const cereal::Event::Reader log = sm[service];
+          this->handle_msg(log);
+        }
       }
     }
 
-    if (sm.updated("cameraOdometry")) {
-      uint64_t logMonoTime = sm["cameraOdometry"].getLogMonoTime();
+    if (sm.updated(ServiceId::cameraOdometry)) {
+      LATENCY_SCOPE("locationd_publish");
+      uint64_t logMonoTime = sm[ServiceId::cameraOdometry].getLogMonoTime();
       bool inputsOK = sm.allAliveAndValid();
-      bool sensorsOK = sm.alive("sensorEvents") && sm.valid("sensorEvents");
+      bool sensorsOK = sm.alive(ServiceId::sensorEvents) && sm.valid(ServiceId::sensorEvents);
       bool gpsOK = this->isGpsOK();
 
       MessageBuilder msg_builder;
@@ -0,0 +1,243 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <kaitai/kaitaistream.h>
+
+#include "cereal/messaging/messaging.h"
+#include "selfdrive/common/benchmark.h"
+#include "selfdrive/common/util.h"
+#include "selfdrive/locationd/generated/ubx.h"
+#include "selfdrive/locationd/tests/ublox_kaitai_parser.h"
+#include "selfdrive/locationd/ublox_msg.h"
+
+// Times UbloxMsgParser on recorded ubloxRaw, or a synthetic 10 Hz stream with
+// 32 RAWX measurements, against parsing the same messages with the kaitai ubx_t
+// it used before. First checks both decode every message to the same event, and
+// exits with 1 if they don't. With --fuzz, feeds it mutated messages with valid
+// checksums.
+//
+// usage: ublox_benchmark [--fuzz iterations] [rlog]
+//   rlog: an uncompressed rlog with ubloxRaw
+
+static std::string frame(uint16_t msg_type, const void *payload, size_t len) {
+  std::string msg = "\xb5\x62"s;
+  msg.push_back(msg_type >> 8);
+  msg.push_back(msg_type & 0xff);
+  msg.push_back(len & 0xff);
+  msg.push_back(len >> 8);
+  msg.append((const char *)payload, len);
+  return ublox::ubx_add_checksum(msg);
+}
+
+static std::vector<std::string> synthetic_messages(int seconds) {
+  std::vector<std::string> ret;
+  for (int i = 0; i < seconds * 10; i++) {
+    ublox::ubx_nav_pvt_t pvt = {.iTow = (uint32_t)i * 100, .year = 2021, .month = 6, .day = 1, .hour = 12, .min = 0, .sec = 0,
+                                .nano = i * 100000, .fixType = 3, .flags = 1, .numSV = 20, .lon = -1223928320, .lat = 377749240,
+                                .height = 12000, .hAcc = 1500, .vAcc = 2500, .velN = 1000, .velE = -500, .gSpeed = 1118, .headMot = 2000000};
+    ret.push_back(frame(ublox::MSG_NAV_PVT, &pvt, sizeof(pvt)));
+
+    std::string rawx;
+    ublox::ubx_rxm_rawx_t head = {.rcvTow = i * 0.1, .week = 2160, .leapS = 18, .numMeas = 32, .recStat = 1};
+    rawx.append((const char *)&head, sizeof(head));
+    for (int m = 0; m < head.numMeas; m++) {
+      ublox::ubx_rxm_rawx_meas_t meas = {.prMes = 2.1e7 + m * 1e4, .cpMes = 1.1e8 + m, .doMes = -1000.f + m, .gnssId = (uint8_t)(m % 3 ? 0 : 6),
+                                         .svId = (uint8_t)(m + 1), .locktime = 64500, .cno = 40, .prStdev = 5, .cpStdev = 2, .doStdev = 6, .trkStat = 7};
+      rawx.append((const char *)&meas, sizeof(meas));
+    }
+    ret.push_back(frame(ublox::MSG_RXM_RAWX, rawx.data(), rawx.size()));
+
+    if (i % 10 == 0) {
+      ublox::ubx_mon_hw_t hw = {.noisePerMS = 90, .agcCnt = 5000, .aStatus = 2, .aPower = 1, .jamInd = 10};
+      ret.push_back(frame(ublox::MSG_MON_HW, &hw, sizeof(hw)));
+      ublox::ubx_mon_hw2_t hw2 = {.ofsI = -3, .magI = 100, .ofsQ = 2, .magQ = 110, .cfgSource = 113};
+      ret.push_back(frame(ublox::MSG_MON_HW2, &hw2, sizeof(hw2)));
+    }
+
+    // the five GPS subframes of one satellite in turn, 10 words of 24 data bits
+    std::string sfrbx;
+    ublox::ubx_rxm_sfrbx_t sf = {.gnssId = ublox::GNSS_ID_GPS, .svId = (uint8_t)(i / 5 % 32 + 1), .numWords = 10, .version = 2};
+    sfrbx.append((const char *)&sf, sizeof(sf));
+    for (int w = 0; w < 10; w++) {
+      uint32_t data = (i * 7919 + w) & 0xffffff;
+      if (w == 0) data = 0x8b0000 | (data & 0xffff);  // TLM preamble
+      if (w == 1) data = (i % 5 + 1) << 2;           // HOW subframe id
+      uint32_t word = data << 6;
+      sfrbx.append((const char *)&word, sizeof(word));
+    }
+    ret.push_back(frame(ublox::MSG_RXM_SFRBX, sfrbx.data(), sfrbx.size()));
+  }
+  return ret;
+}
+
+static std::vector<std::string> recorded_messages(const char *path) {
+  std::vector<std::string> ret;
+  std::string log = util::read_file(path);
+  kj::Array<capnp::word> buf = kj::heapArray<capnp::word>(log.size() / sizeof(capnp::word));
+  memcpy(buf.begin(), log.data(), buf.size() * sizeof(capnp::word));
+  kj::ArrayPtr<const capnp::word> words = buf;
+
+  UbloxMsgParser parser;
+  while (words.size() > 0) {
+    capnp::FlatArrayMessageReader reader(words);
+    words = kj::arrayPtr(reader.getEnd(), words.end());
+    cereal::Event::Reader event = reader.getRoot<cereal::Event>();
+    if (event.which() != cereal::Event::UBLOX_RAW) continue;
+
+    auto raw = event.getUbloxRaw();
+    size_t consumed = 0;
+    while (consumed < raw.size()) {
+      size_t n = 0;
+      if (parser.add_data(raw.begin() + consumed, raw.size() - consumed, n)) {
+        ret.push_back(parser.data());
+        parser.reset();
+      }
+      consumed += n;
+    }
+  }
+  return ret;
+}
+
+// the whole stream through add_data and gen_msg, returns the messages generated
+static size_t parse_all(UbloxMsgParser &parser, const std::vector<std::string> &messages) {
+  size_t generated = 0;
+  for (auto &m : messages) {
+    size_t consumed = 0;
+    while (consumed < m.size()) {
+      size_t n = 0;
+      if (parser.add_data((const uint8_t *)m.data() + consumed, m.size() - consumed, n)) {
+        try {
+          generated += parser.gen_msg().second.size() > 0;
+        } catch (const std::exception &e) {
+        }
+        parser.reset();
+      }
+      consumed += n;
+    }
+  }
+  return generated;
+}
+
+// the event without its logMonoTime, "" for no event
+static std::string event_text(const kj::Array<capnp::word> &words) {
+  if (words.size() == 0) return "";
+  capnp::FlatArrayMessageReader reader(words);
+  capnp::MallocMessageBuilder copy;
+  copy.setRoot(reader.getRoot<cereal::Event>());
+  auto event = copy.getRoot<cereal::Event>();
+  event.setLogMonoTime(0);
+  return kj::str(event).cStr();
+}
+
+// both decoders over the whole stream, returns the messages they decoded differently
+static size_t compare_decoders(const std::vector<std::string> &messages) {
+  UbloxMsgParser parser;
+  KaitaiUbloxMsgParser kaitai_parser;
+  size_t decoded = 0, differ = 0;
+  for (auto &m : messages) {
+    size_t consumed = 0;
+    while (consumed < m.size()) {
+      size_t n = 0;
+      if (parser.add_data((const uint8_t *)m.data() + consumed, m.size() - consumed, n)) {
+        std::string service, kaitai_service, text, kaitai_text;
+        try {
+          auto [s, words] = parser.gen_msg();
+          service = s;
+          text = event_text(words);
+        } catch (const std::exception &e) {
+        }
+        try {
+          auto [s, words] = kaitai_parser.gen_msg(parser.data());
+          kaitai_service = s;
+          kaitai_text = event_text(words);
+        } catch (const std::exception &e) {
+        }
+        parser.reset();
+
+        decoded++;
+        if (text != kaitai_text || (!text.empty() && service != kaitai_service)) {
+          if (differ++ < 5) {
+            printf("message %zu differs\n  kaitai: %s %s\n  new:    %s %s\n", decoded,
+                   kaitai_service.c_str(), kaitai_text.c_str(), service.c_str(), text.c_str());
+          }
+        }
+      }
+      consumed += n;
+    }
+  }
+  printf("%zu messages, %zu decoded differently than with kaitai\n", decoded, differ);
+  return differ;
+}
+
+static void fuzz(const std::vector<std::string> &messages, int iterations) {
+  std::mt19937 rng(1234);
+  UbloxMsgParser parser;
+  size_t generated = 0;
+  for (int i = 0; i < iterations; i++) {
+    std::string m = messages[rng() % messages.size()];
+    std::string payload = m.substr(ublox::UBLOX_HEADER_SIZE, m.size() - ublox::UBLOX_HEADER_SIZE - ublox::UBLOX_CHECKSUM_SIZE);
+    switch (rng() % 4) {
+      case 0:  // flip bytes, the counts in the headers too
+        for (int n = rng() % 8 + 1; n > 0 && payload.size() > 0; n--) payload[rng() % payload.size()] = rng();
+        break;
+      case 1:  // truncate
+        payload.resize(rng() % (payload.size() + 1));
+        break;
+      case 2:  // extend with garbage
+        for (int n = rng() % 64; n > 0; n--) payload.push_back(rng());
+        break;
+      case 3:  // another type
+        m[3] = "\x07\x13\x15\x09\x0b"[rng() % 5];
+        break;
+    }
+    generated += parse_all(parser, {frame((uint8_t)m[2] << 8 | (uint8_t)m[3], payload.data(), payload.size())});
+  }
+  printf("fuzzed %d messages, %zu generated events\n", iterations, generated);
+}
+
+int main(int argc, char *argv[]) {
+  int fuzz_iterations = 0;
+  const char *path = nullptr;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--fuzz") == 0 && i + 1 < argc) {
+      fuzz_iterations = atoi(argv[++i]);
+    } else {
+      path = argv[i];
+    }
+  }
+
+  std::vector<std::string> messages = path ? recorded_messages(path) : synthetic_messages(60);
+  if (messages.empty()) {
+    printf("no ublox messages\n");
+    return 1;
+  }
+  printf("%zu messages\n", messages.size());
+  if (compare_decoders(messages) > 0) {
+    return 1;
+  }
+
+  UbloxMsgParser parser;
+  printf("%zu events\n", parse_all(parser, messages));
+  const int iterations = 20;
+  double kaitai_us = bench_us(iterations, [&]() {
+    for (auto &m : messages) {
+      try {
+        kaitai::kstream stream(m);
+        ubx_t ubx_message(&stream);
+      } catch (const std::exception &e) {
+      }
+    }
+  });
+  print_bench("kaitai ubx_t, no events", kaitai_us / messages.size(), "message");
+  double parser_us = bench_us(iterations, [&]() { parse_all(parser, messages); });
+  print_bench("UbloxMsgParser", parser_us / messages.size(), "message");
+
+  if (fuzz_iterations > 0) {
+    fuzz(messages, fuzz_iterations);
+  }
+  return 0;
+}
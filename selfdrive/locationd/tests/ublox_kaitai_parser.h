@@ -0,0 +1,26 @@
+#pragma once
+
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+#include "cereal/messaging/messaging.h"
+#include "selfdrive/locationd/generated/gps.h"
+#include "selfdrive/locationd/generated/ubx.h"
+
+// The kaitai based decoding UbloxMsgParser did before it read the payloads
+// in place, kept for ublox_benchmark to check the events of both match.
+class KaitaiUbloxMsgParser {
+  public:
+    // dat is a whole message with header and checksum, as UbloxMsgParser::data()
+    std::pair<std::string, kj::Array<capnp::word>> gen_msg(const std::string &dat);
+
+  private:
+    kj::Array<capnp::word> gen_nav_pvt(ubx_t::nav_pvt_t *msg);
+    kj::Array<capnp::word> gen_rxm_sfrbx(ubx_t::rxm_sfrbx_t *msg);
+    kj::Array<capnp::word> gen_rxm_rawx(ubx_t::rxm_rawx_t *msg);
+    kj::Array<capnp::word> gen_mon_hw(ubx_t::mon_hw_t *msg);
+    kj::Array<capnp::word> gen_mon_hw2(ubx_t::mon_hw2_t *msg);
+
+    std::unordered_map<int, std::unordered_map<int, std::string>> gps_subframes;
+};
@@ -7,10 +7,12 @@
 #include <cmath>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <ctime>
 #include <unordered_map>
 
 #include "selfdrive/common/swaglog.h"
+#include "selfdrive/locationd/generated/gps.h"
 
 const double gpsPi = 3.1415926535898;
 #define UBLOX_MSG_SIZE(hdr) (*(uint16_t *)&hdr[4])
@@ -19,6 +21,14 @@ inline static bool bit_to_bool(uint8_t val, int shifts) {
   return (bool)(val & (1 << shifts));
 }
 
+// copies the T at offset out of the payload, false if the payload is too short for it
+template <typename T>
+inline static bool read_payload(const uint8_t *payload, size_t len, size_t offset, T &out) {
+  if (offset + sizeof(T) > len) return false;
+  memcpy(&out, payload + offset, sizeof(T));
+  return true;
+}
+
 inline int UbloxMsgParser::needed_bytes() {
   // Msg header incomplete?
   if(bytes_in_parse_buf < ublox::UBLOX_HEADER_SIZE)
@@ -94,99 +104,115 @@ bool UbloxMsgParser::add_data(const uint8_t *incoming_data, uint32_t incoming_da
 
 
 std::pair<std::string, kj::Array<capnp::word>> UbloxMsgParser::gen_msg() {
-  std::string dat = data();
-  kaitai::kstream stream(dat);
-
-  ubx_t ubx_message(&stream);
-  auto body = ubx_message.body();
-
-  switch (ubx_message.msg_type()) {
-  case 0x0107:
-    return {"gpsLocationExternal", gen_nav_pvt(static_cast<ubx_t::nav_pvt_t*>(body))};
-    break;
-  case 0x0213:
-    return {"ubloxGnss", gen_rxm_sfrbx(static_cast<ubx_t::rxm_sfrbx_t*>(body))};
-    break;
-  case 0x0215:
-    return {"ubloxGnss", gen_rxm_rawx(static_cast<ubx_t::rxm_rawx_t*>(body))};
-    break;
-  case 0x0a09:
-    return {"ubloxGnss", gen_mon_hw(static_cast<ubx_t::mon_hw_t*>(body))};
-    break;
-  case 0x0a0b:
-    return {"ubloxGnss", gen_mon_hw2(static_cast<ubx_t::mon_hw2_t*>(body))};
-    break;
+  uint16_t msg_type = (msg_parse_buf[2] << 8) | msg_parse_buf[3];
+  const uint8_t *payload = msg_parse_buf + ublox::UBLOX_HEADER_SIZE;
+  size_t len = UBLOX_MSG_SIZE(msg_parse_buf);
+
+  switch (msg_type) {
+  case ublox::MSG_NAV_PVT:
+    return {"gpsLocationExternal", gen_nav_pvt(payload, len)};
+  case ublox::MSG_RXM_SFRBX:
+    return {"ubloxGnss", gen_rxm_sfrbx(payload, len)};
+  case ublox::MSG_RXM_RAWX:
+    return {"ubloxGnss", gen_rxm_rawx(payload, len)};
+  case ublox::MSG_MON_HW:
+    return {"ubloxGnss", gen_mon_hw(payload, len)};
+  case ublox::MSG_MON_HW2:
+    return {"ubloxGnss", gen_mon_hw2(payload, len)};
   default:
-    LOGE("Unknown message type %x", ubx_message.msg_type());
+    LOGE("Unknown message type %x", msg_type);
     return {"ubloxGnss", kj::Array<capnp::word>()};
-    break;
   }
 }
 
 
-kj::Array<capnp::word> UbloxMsgParser::gen_nav_pvt(ubx_t::nav_pvt_t *msg) {
+kj::Array<capnp::word> UbloxMsgParser::gen_nav_pvt(const uint8_t *payload, size_t len) {
+  ublox::ubx_nav_pvt_t msg;
+  if (!read_payload(payload, len, 0, msg)) {
+    LOGE("NAV-PVT too short: %zu bytes", len);
+    return kj::Array<capnp::word>();
+  }
+
   MessageBuilder msg_builder;
   auto gpsLoc = msg_builder.initEvent().initGpsLocationExternal();
   gpsLoc.setSource(cereal::GpsLocationData::SensorSource::UBLOX);
-  gpsLoc.setFlags(msg->flags());
-  gpsLoc.setLatitude(msg->lat() * 1e-07);
-  gpsLoc.setLongitude(msg->lon() * 1e-07);
-  gpsLoc.setAltitude(msg->height() * 1e-03);
-  gpsLoc.setSpeed(msg->g_speed() * 1e-03);
-  gpsLoc.setBearingDeg(msg->head_mot() * 1e-5);
-  gpsLoc.setAccuracy(msg->h_acc() * 1e-03);
+  gpsLoc.setFlags(msg.flags);
+  gpsLoc.setLatitude(msg.lat * 1e-07);
+  gpsLoc.setLongitude(msg.lon * 1e-07);
+  gpsLoc.setAltitude(msg.height * 1e-03);
+  gpsLoc.setSpeed(msg.gSpeed * 1e-03);
+  gpsLoc.setBearingDeg(msg.headMot * 1e-5);
+  gpsLoc.setAccuracy(msg.hAcc * 1e-03);
   std::tm timeinfo = std::tm();
-  timeinfo.tm_year = msg->year() - 1900;
-  timeinfo.tm_mon = msg->month() - 1;
-  timeinfo.tm_mday = msg->day();
-  timeinfo.tm_hour = msg->hour();
-  timeinfo.tm_min = msg->min();
-  timeinfo.tm_sec = msg->sec();
+  timeinfo.tm_year = msg.year - 1900;
+  timeinfo.tm_mon = msg.month - 1;
+  timeinfo.tm_mday = msg.day;
+  timeinfo.tm_hour = msg.hour;
+  timeinfo.tm_min = msg.min;
+  timeinfo.tm_sec = msg.sec;
 
   std::time_t utc_tt = timegm(&timeinfo);
-  gpsLoc.setTimestamp(utc_tt * 1e+03 + msg->nano() * 1e-06);
-  float f[] = { msg->vel_n() * 1e-03f, msg->vel_e() * 1e-03f, msg->vel_d() * 1e-03f };
+  gpsLoc.setTimestamp(utc_tt * 1e+03 + msg.nano * 1e-06);
+  float f[] = { msg.velN * 1e-03f, msg.velE * 1e-03f, msg.velD * 1e-03f };
   gpsLoc.setVNED(f);
-  gpsLoc.setVerticalAccuracy(msg->v_acc() * 1e-03);
-  gpsLoc.setSpeedAccuracy(msg->s_acc() * 1e-03);
-  gpsLoc.setBearingAccuracyDeg(msg->head_acc() * 1e-05);
+  gpsLoc.setVerticalAccuracy(msg.vAcc * 1e-03);
+  gpsLoc.setSpeedAccuracy(msg.sAcc * 1e-03);
+  gpsLoc.setBearingAccuracyDeg(msg.headAcc * 1e-05);
   return capnp::messageToFlatArray(msg_builder);
 }
 
 
-kj::Array<capnp::word> UbloxMsgParser::gen_rxm_sfrbx(ubx_t::rxm_sfrbx_t *msg) {
-  auto body = *msg->body();
+kj::Array<capnp::word> UbloxMsgParser::gen_rxm_sfrbx(const uint8_t *payload, size_t len) {
+  ublox::ubx_rxm_sfrbx_t msg;
+  if (!read_payload(payload, len, 0, msg) || sizeof(msg) + msg.numWords * sizeof(uint32_t) > len) {
+    LOGE("RXM-SFRBX too short: %zu bytes", len);
+    return kj::Array<capnp::word>();
+  }
 
-  if (msg->gnss_id() == ubx_t::gnss_type_t::GNSS_TYPE_GPS) {
+  if (msg.gnssId == ublox::GNSS_ID_GPS) {
     // GPS subframes are packed into 10x 4 bytes, each containing 3 actual bytes
     // We will first need to separate the data from the padding and parity
-    assert(body.size() == 10);
+    if (msg.numWords != 10) {
+      LOGE("GPS subframe with %d words", msg.numWords);
+      return kj::Array<capnp::word>();
+    }
 
-    std::string subframe_data;
-    subframe_data.reserve(30);
-    for (uint32_t word : body) {
+    char subframe_data[30];
+    for (int i = 0; i < 10; i++) {
+      uint32_t word = 0;
+      read_payload(payload, len, sizeof(msg) + i * sizeof(word), word);
       word = word >> 6; // TODO: Verify parity
-      subframe_data.push_back(word >> 16);
-      subframe_data.push_back(word >> 8);
-      subframe_data.push_back(word >> 0);
+      subframe_data[i * 3 + 0] = word >> 16;
+      subframe_data[i * 3 + 1] = word >> 8;
+      subframe_data[i * 3 + 2] = word >> 0;
+    }
+
+    // Every subframe starts with the TLM preamble
+    if ((uint8_t)subframe_data[0] != 0x8b) {
+      LOGE("Invalid GPS subframe preamble %x", (uint8_t)subframe_data[0]);
+      return kj::Array<capnp::word>();
     }
 
-    // Collect subframes in map and parse when we have all the parts
-    kaitai::kstream stream(subframe_data);
-    gps_t subframe(&stream);
-    int subframe_id = subframe.how()->subframe_id();
+    // Collect subframes in map and parse when we have all the parts. The subframe id
+    // is in bits 20-22 of the handover word, the second one.
+    int subframe_id = ((uint8_t)subframe_data[5] >> 2) & 0x7;
+    if (subframe_id < 1 || subframe_id > 5) {
+      LOGE("Invalid GPS subframe id %d", subframe_id);
+      return kj::Array<capnp::word>();
+    }
 
-    if (subframe_id == 1) gps_subframes[msg->sv_id()].clear();
-    gps_subframes[msg->sv_id()][subframe_id] = subframe_data;
+    auto &subframes = gps_subframes[msg.svId];
+    if (subframe_id == 1) subframes.clear();
+    subframes[subframe_id].assign(subframe_data, sizeof(subframe_data));
 
-    if (gps_subframes[msg->sv_id()].size() == 5) {
+    if (subframes.size() == 5) {
       MessageBuilder msg_builder;
       auto eph = msg_builder.initEvent().initUbloxGnss().initEphemeris();
-      eph.setSvId(msg->sv_id());
+      eph.setSvId(msg.svId);
 
       // Subframe 1
       {
-        kaitai::kstream stream(gps_subframes[msg->sv_id()][1]);
+        kaitai::kstream stream(subframes[1]);
         gps_t subframe(&stream);
         gps_t::subframe_1_t* subframe_1 = static_cast<gps_t::subframe_1_t*>(subframe.body());
 
@@ -200,7 +226,7 @@ kj::Array<capnp::word> UbloxMsgParser::gen_rxm_sfrbx(ubx_t::rxm_sfrbx_t *msg) {
 
       // Subframe 2
       {
-        kaitai::kstream stream(gps_subframes[msg->sv_id()][2]);
+        kaitai::kstream stream(subframes[2]);
         gps_t subframe(&stream);
         gps_t::subframe_2_t* subframe_2 = static_cast<gps_t::subframe_2_t*>(subframe.body());
 
@@ -216,7 +242,7 @@ kj::Array<capnp::word> UbloxMsgParser::gen_rxm_sfrbx(ubx_t::rxm_sfrbx_t *msg) {
 
       // Subframe 3
       {
-        kaitai::kstream stream(gps_subframes[msg->sv_id()][3]);
+        kaitai::kstream stream(subframes[3]);
         gps_t subframe(&stream);
         gps_t::subframe_3_t* subframe_3 = static_cast<gps_t::subframe_3_t*>(subframe.body());
 
@@ -233,7 +259,7 @@ kj::Array<capnp::word> UbloxMsgParser::gen_rxm_sfrbx(ubx_t::rxm_sfrbx_t *msg) {
 
       // Subframe 4
       {
-        kaitai::kstream stream(gps_subframes[msg->sv_id()][4]);
+        kaitai::kstream stream(subframes[4]);
         gps_t subframe(&stream);
         gps_t::subframe_4_t* subframe_4 = static_cast<gps_t::subframe_4_t*>(subframe.body());
 
@@ -260,75 +286,92 @@ kj::Array<capnp::word> UbloxMsgParser::gen_rxm_sfrbx(ubx_t::rxm_sfrbx_t *msg) {
   return kj::Array<capnp::word>();
 }
 
-kj::Array<capnp::word> UbloxMsgParser::gen_rxm_rawx(ubx_t::rxm_rawx_t *msg) {
+kj::Array<capnp::word> UbloxMsgParser::gen_rxm_rawx(const uint8_t *payload, size_t len) {
+  ublox::ubx_rxm_rawx_t msg;
+  if (!read_payload(payload, len, 0, msg) || sizeof(msg) + msg.numMeas * sizeof(ublox::ubx_rxm_rawx_meas_t) > len) {
+    LOGE("RXM-RAWX too short: %zu bytes", len);
+    return kj::Array<capnp::word>();
+  }
+
   MessageBuilder msg_builder;
   auto mr = msg_builder.initEvent().initUbloxGnss().initMeasurementReport();
-  mr.setRcvTow(msg->rcv_tow());
-  mr.setGpsWeek(msg->week());
-  mr.setLeapSeconds(msg->leap_s());
-  mr.setGpsWeek(msg->week());
-
-  auto mb = mr.initMeasurements(msg->num_meas());
-  auto measurements = *msg->measurements();
-  for(int8_t i = 0; i < msg->num_meas(); i++) {
-    mb[i].setSvId(measurements[i]->sv_id());
-    mb[i].setPseudorange(measurements[i]->pr_mes());
-    mb[i].setCarrierCycles(measurements[i]->cp_mes());
-    mb[i].setDoppler(measurements[i]->do_mes());
-    mb[i].setGnssId(measurements[i]->gnss_id());
-    mb[i].setGlonassFrequencyIndex(measurements[i]->freq_id());
-    mb[i].setLocktime(measurements[i]->lock_time());
-    mb[i].setCno(measurements[i]->cno());
-    mb[i].setPseudorangeStdev(0.01 * (pow(2, (measurements[i]->pr_stdev() & 15)))); // weird scaling, might be wrong
-    mb[i].setCarrierPhaseStdev(0.004 * (measurements[i]->cp_stdev() & 15));
-    mb[i].setDopplerStdev(0.002 * (pow(2, (measurements[i]->do_stdev() & 15)))); // weird scaling, might be wrong
+  mr.setRcvTow(msg.rcvTow);
+  mr.setGpsWeek(msg.week);
+  mr.setLeapSeconds(msg.leapS);
+
+  auto mb = mr.initMeasurements(msg.numMeas);
+  for (int i = 0; i < msg.numMeas; i++) {
+    ublox::ubx_rxm_rawx_meas_t meas = {};
+    read_payload(payload, len, sizeof(msg) + i * sizeof(meas), meas);
+    mb[i].setSvId(meas.svId);
+    mb[i].setPseudorange(meas.prMes);
+    mb[i].setCarrierCycles(meas.cpMes);
+    mb[i].setDoppler(meas.doMes);
+    mb[i].setGnssId(meas.gnssId);
+    mb[i].setGlonassFrequencyIndex(meas.freqId);
+    mb[i].setLocktime(meas.locktime);
+    mb[i].setCno(meas.cno);
+    mb[i].setPseudorangeStdev(0.01 * (pow(2, (meas.prStdev & 15)))); // weird scaling, might be wrong
+    mb[i].setCarrierPhaseStdev(0.004 * (meas.cpStdev & 15));
+    mb[i].setDopplerStdev(0.002 * (pow(2, (meas.doStdev & 15)))); // weird scaling, might be wrong
 
     auto ts = mb[i].initTrackingStatus();
-    auto trk_stat = measurements[i]->trk_stat();
-    ts.setPseudorangeValid(bit_to_bool(trk_stat, 0));
-    ts.setCarrierPhaseValid(bit_to_bool(trk_stat, 1));
-    ts.setHalfCycleValid(bit_to_bool(trk_stat, 2));
-    ts.setHalfCycleSubtracted(bit_to_bool(trk_stat, 3));
+    ts.setPseudorangeValid(bit_to_bool(meas.trkStat, 0));
+    ts.setCarrierPhaseValid(bit_to_bool(meas.trkStat, 1));
+    ts.setHalfCycleValid(bit_to_bool(meas.trkStat, 2));
+    ts.setHalfCycleSubtracted(bit_to_bool(meas.trkStat, 3));
   }
 
-  mr.setNumMeas(msg->num_meas());
+  mr.setNumMeas(msg.numMeas);
   auto rs = mr.initReceiverStatus();
-  rs.setLeapSecValid(bit_to_bool(msg->rec_stat(), 0));
-  rs.setClkReset(bit_to_bool(msg->rec_stat(), 2));
+  rs.setLeapSecValid(bit_to_bool(msg.recStat, 0));
+  rs.setClkReset(bit_to_bool(msg.recStat, 2));
   return capnp::messageToFlatArray(msg_builder);
 }
 
-kj::Array<capnp::word> UbloxMsgParser::gen_mon_hw(ubx_t::mon_hw_t *msg) {
+kj::Array<capnp::word> UbloxMsgParser::gen_mon_hw(const uint8_t *payload, size_t len) {
+  ublox::ubx_mon_hw_t msg;
+  if (!read_payload(payload, len, 0, msg)) {
+    LOGE("MON-HW too short: %zu bytes", len);
+    return kj::Array<capnp::word>();
+  }
+
   MessageBuilder msg_builder;
   auto hwStatus = msg_builder.initEvent().initUbloxGnss().initHwStatus();
-  hwStatus.setNoisePerMS(msg->noise_per_ms());
-  hwStatus.setFlags(msg->flags());
-  hwStatus.setAgcCnt(msg->agc_cnt());
-  hwStatus.setAStatus((cereal::UbloxGnss::HwStatus::AntennaSupervisorState) msg->a_status());
-  hwStatus.setAPower((cereal::UbloxGnss::HwStatus::AntennaPowerStatus) msg->a_power());
-  hwStatus.setJamInd(msg->jam_ind());
+  hwStatus.setNoisePerMS(msg.noisePerMS);
+  hwStatus.setFlags(msg.flags);
+  hwStatus.setAgcCnt(msg.agcCnt);
+  hwStatus.setAStatus((cereal::UbloxGnss::HwStatus::AntennaSupervisorState) msg.aStatus);
+  hwStatus.setAPower((cereal::UbloxGnss::HwStatus::AntennaPowerStatus) msg.aPower);
+  hwStatus.setJamInd(msg.jamInd);
   return capnp::messageToFlatArray(msg_builder);
 }
 
-kj::Array<capnp::word> UbloxMsgParser::gen_mon_hw2(ubx_t::mon_hw2_t *msg) {
+kj::Array<capnp::word> UbloxMsgParser::gen_mon_hw2(const uint8_t *payload, size_t len) {
+  ublox::ubx_mon_hw2_t msg;
+  if (!read_payload(payload, len, 0, msg)) {
+    LOGE("MON-HW2 too short: %zu bytes", len);
+    return kj::Array<capnp::word>();
+  }
+
   MessageBuilder msg_builder;
   auto hwStatus = msg_builder.initEvent().initUbloxGnss().initHwStatus2();
-  hwStatus.setOfsI(msg->ofs_i());
-  hwStatus.setMagI(msg->mag_i());
-  hwStatus.setOfsQ(msg->ofs_q());
-  hwStatus.setMagQ(msg->mag_q());
+  hwStatus.setOfsI(msg.ofsI);
+  hwStatus.setMagI(msg.magI);
+  hwStatus.setOfsQ(msg.ofsQ);
+  hwStatus.setMagQ(msg.magQ);
 
-  switch (msg->cfg_source()) {
-    case ubx_t::mon_hw2_t::config_source_t::CONFIG_SOURCE_ROM:
+  switch (msg.cfgSource) {
+    case ublox::CFG_SOURCE_ROM:
       hwStatus.setCfgSource(cereal::UbloxGnss::HwStatus2::ConfigSource::ROM);
       break;
-    case ubx_t::mon_hw2_t::config_source_t::CONFIG_SOURCE_OTP:
+    case ublox::CFG_SOURCE_OTP:
       hwStatus.setCfgSource(cereal::UbloxGnss::HwStatus2::ConfigSource::OTP);
       break;
-    case ubx_t::mon_hw2_t::config_source_t::CONFIG_SOURCE_CONFIG_PINS:
+    case ublox::CFG_SOURCE_CONFIG_PINS:
       hwStatus.setCfgSource(cereal::UbloxGnss::HwStatus2::ConfigSource::CONFIGPINS);
       break;
-    case ubx_t::mon_hw2_t::config_source_t::CONFIG_SOURCE_FLASH:
+    case ublox::CFG_SOURCE_FLASH:
       hwStatus.setCfgSource(cereal::UbloxGnss::HwStatus2::ConfigSource::FLASH);
       break;
     default:
@@ -336,8 +379,8 @@ kj::Array<capnp::word> UbloxMsgParser::gen_mon_hw2(ubx_t::mon_hw2_t *msg) {
       break;
   }
 
-  hwStatus.setLowLevCfg(msg->low_lev_cfg());
-  hwStatus.setPostStatus(msg->post_status());
+  hwStatus.setLowLevCfg(msg.lowLevCfg);
+  hwStatus.setPostStatus(msg.postStatus);
 
   return capnp::messageToFlatArray(msg_builder);
 }
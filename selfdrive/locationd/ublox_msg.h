@@ -9,8 +9,6 @@
 
 #include "cereal/messaging/messaging.h"
 #include "selfdrive/common/util.h"
-#include "selfdrive/locationd/generated/gps.h"
-#include "selfdrive/locationd/generated/ubx.h"
 
 using namespace std::string_literals;
 
@@ -28,6 +26,113 @@ namespace ublox {
   const uint8_t CLASS_RXM = 0x02;
   const uint8_t CLASS_MON = 0x0A;
 
+  const uint16_t MSG_NAV_PVT = 0x0107;
+  const uint16_t MSG_RXM_SFRBX = 0x0213;
+  const uint16_t MSG_RXM_RAWX = 0x0215;
+  const uint16_t MSG_MON_HW = 0x0a09;
+  const uint16_t MSG_MON_HW2 = 0x0a0b;
+
+  const uint8_t GNSS_ID_GPS = 0;
+
+  // MON-HW2 cfgSource
+  const uint8_t CFG_SOURCE_FLASH = 102;
+  const uint8_t CFG_SOURCE_OTP = 111;
+  const uint8_t CFG_SOURCE_CONFIG_PINS = 112;
+  const uint8_t CFG_SOURCE_ROM = 113;
+
+  // Payloads as sent by the receiver, little endian like the hosts we run on.
+  // Decoded by copying them out of the parse buffer after checking their length.
+  static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__);
+
+  struct ubx_nav_pvt_t {
+    uint32_t iTow;
+    uint16_t year;
+    uint8_t month, day, hour, min, sec;
+    uint8_t valid;
+    uint32_t tAcc;
+    int32_t nano;
+    uint8_t fixType, flags, flags2, numSV;
+    int32_t lon, lat, height, hMSL;
+    uint32_t hAcc, vAcc;
+    int32_t velN, velE, velD, gSpeed, headMot;
+    int32_t sAcc;
+    uint32_t headAcc;
+    uint16_t pDOP;
+    uint8_t flags3;
+    uint8_t reserved1[5];
+    int32_t headVeh;
+    int16_t magDec;
+    uint16_t magAcc;
+  } __attribute__((packed));
+  static_assert(sizeof(ubx_nav_pvt_t) == 92);
+
+  struct ubx_rxm_rawx_t {
+    double rcvTow;
+    uint16_t week;
+    int8_t leapS;
+    uint8_t numMeas;
+    uint8_t recStat;
+    uint8_t reserved1[3];
+  } __attribute__((packed));
+  static_assert(sizeof(ubx_rxm_rawx_t) == 16);
+
+  // numMeas of them follow ubx_rxm_rawx_t
+  struct ubx_rxm_rawx_meas_t {
+    double prMes;
+    double cpMes;
+    float doMes;
+    uint8_t gnssId, svId;
+    uint8_t reserved2;
+    uint8_t freqId;
+    uint16_t locktime;
+    uint8_t cno;
+    uint8_t prStdev, cpStdev, doStdev;
+    uint8_t trkStat;
+    uint8_t reserved3;
+  } __attribute__((packed));
+  static_assert(sizeof(ubx_rxm_rawx_meas_t) == 32);
+
+  // numWords uint32_t follow
+  struct ubx_rxm_sfrbx_t {
+    uint8_t gnssId, svId;
+    uint8_t reserved1;
+    uint8_t freqId;
+    uint8_t numWords;
+    uint8_t chn;
+    uint8_t version;
+    uint8_t reserved2;
+  } __attribute__((packed));
+  static_assert(sizeof(ubx_rxm_sfrbx_t) == 8);
+
+  struct ubx_mon_hw_t {
+    uint32_t pinSel, pinBank, pinDir, pinVal;
+    uint16_t noisePerMS;
+    uint16_t agcCnt;
+    uint8_t aStatus, aPower;
+    uint8_t flags;
+    uint8_t reserved1;
+    uint32_t usedMask;
+    uint8_t VP[17];
+    uint8_t jamInd;
+    uint8_t reserved2[2];
+    uint32_t pinIrq, pullH, pullL;
+  } __attribute__((packed));
+  static_assert(sizeof(ubx_mon_hw_t) == 60);
+
+  struct ubx_mon_hw2_t {
+    int8_t ofsI;
+    uint8_t magI;
+    int8_t ofsQ;
+    uint8_t magQ;
+    uint8_t cfgSource;
+    uint8_t reserved1[3];
+    uint32_t lowLevCfg;
+    uint8_t reserved2[8];
+    uint32_t postStatus;
+    uint8_t reserved3[4];
+  } __attribute__((packed));
+  static_assert(sizeof(ubx_mon_hw2_t) == 28);
+
   struct ubx_mga_ini_time_utc_t {
     uint8_t type;
     uint8_t version;
@@ -95,12 +200,14 @@ class UbloxMsgParser {
     inline int needed_bytes();
     inline std::string data() {return std::string((const char*)msg_parse_buf, bytes_in_parse_buf);}
 
+    // Decodes the message in the parse buffer straight out of it. The array is
+    // empty for messages that aren't published, or too short for their type.
     std::pair<std::string, kj::Array<capnp::word>> gen_msg();
-    kj::Array<capnp::word> gen_nav_pvt(ubx_t::nav_pvt_t *msg);
-    kj::Array<capnp::word> gen_rxm_sfrbx(ubx_t::rxm_sfrbx_t *msg);
-    kj::Array<capnp::word> gen_rxm_rawx(ubx_t::rxm_rawx_t *msg);
-    kj::Array<capnp::word> gen_mon_hw(ubx_t::mon_hw_t *msg);
-    kj::Array<capnp::word> gen_mon_hw2(ubx_t::mon_hw2_t *msg);
+    kj::Array<capnp::word> gen_nav_pvt(const uint8_t *payload, size_t len);
+    kj::Array<capnp::word> gen_rxm_sfrbx(const uint8_t *payload, size_t len);
+    kj::Array<capnp::word> gen_rxm_rawx(const uint8_t *payload, size_t len);
+    kj::Array<capnp::word> gen_mon_hw(const uint8_t *payload, size_t len);
+    kj::Array<capnp::word> gen_mon_hw2(const uint8_t *payload, size_t len);
 
   private:
     inline bool valid_cheksum();
@@ -110,7 +217,6 @@ class UbloxMsgParser {
     std::unordered_map<int, std::unordered_map<int, std::string>> gps_subframes;
 
     size_t bytes_in_parse_buf = 0;
-    uint8_t msg_parse_buf[ublox::UBLOX_HEADER_SIZE + ublox::UBLOX_MAX_MSG_SIZE];
+    uint8_t msg_parse_buf[ublox::UBLOX_HEADER_SIZE + ublox::UBLOX_MAX_MSG_SIZE + ublox::UBLOX_CHECKSUM_SIZE];
 
 };
-
@@ -0,0 +1,336 @@
+#include "selfdrive/loggerd/compressor.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+
+#include <bzlib.h>
+#ifdef USE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "selfdrive/common/swaglog.h"
+#include "selfdrive/common/util.h"
+#include "selfdrive/loggerd/indexed_log.h"
+#include "selfdrive/loggerd/logger.h"
+
+// blocks waiting for workers before the logging thread is held up
+#define MAX_PENDING_BLOCKS_PER_WORKER 4
+
+static void write_file(FILE *file, const void *data, size_t size, bool &error_logged) {
+  if (fwrite(data, 1, size, file) != size && !error_logged) {
+    LOGE("log write error, errno=%d", errno);
+    error_logged = true;
+  }
+}
+
+// a setting this build can't honor stops loggerd, rather than silently logging
+// in another format than the one that was asked for
+static void unsupported_option(const char *what) {
+  LOGE("loggerd: %s", what);
+  exit(1);
+}
+
+CompressionOptions compression_options_from_env() {
+  CompressionOptions options;
+  if (const char *env = getenv("LOGGERD_COMPRESSION")) {
+    std::string spec = env;
+    std::string name = spec.substr(0, spec.find(':'));
+    if (name == "zstd") {
+      if (!compression_supported(CompressionType::ZSTD)) {
+        unsupported_option("LOGGERD_COMPRESSION=zstd, but this build has no libzstd");
+      }
+      options.type = CompressionType::ZSTD;
+      options.level = 3;
+    } else if (name != "bz2") {
+      unsupported_option(("unknown LOGGERD_COMPRESSION " + spec).c_str());
+    }
+    if (spec.find(':') != std::string::npos) {
+      options.level = atoi(spec.substr(spec.find(':') + 1).c_str());
+    }
+    if (options.type == CompressionType::BZ2) {
+      options.level = std::min(std::max(options.level, 1), 9);
+    }
+  }
+  if (const char *env = getenv("LOGGERD_COMPRESS_WORKERS")) {
+    options.workers = std::max(atoi(env), 0);
+  }
+  if (const char *env = getenv("LOGGERD_ZSTD_DICT")) {
+    options.dict_path = env;
+  }
+  if (getenv("LOGGERD_INDEXED")) {
+    if (options.type != CompressionType::ZSTD) {
+      unsupported_option("LOGGERD_INDEXED needs LOGGERD_COMPRESSION=zstd");
+    }
+    options.indexed = true;
+    // finer blocks, less to decompress for a seek
+    options.block_size = 1 << 20;
+  }
+  return options;
+}
+
+bool compression_supported(CompressionType type) {
+#ifdef USE_ZSTD
+  return true;
+#else
+  return type == CompressionType::BZ2;
+#endif
+}
+
+// ***** block compressors *****
+
+class BZ2BlockCompressor : public BlockCompressor {
+ public:
+  BZ2BlockCompressor(int level) : level(level) {}
+  void compress(const uint8_t *data, size_t size, std::vector<uint8_t> &out) override {
+    // worst case from the bzip2 docs
+    unsigned int out_size = size + size / 100 + 600;
+    out.resize(out_size);
+    int err = BZ2_bzBuffToBuffCompress((char *)out.data(), &out_size, (char *)data, size, level, 0, 30);
+    assert(err == BZ_OK);
+    out.resize(out_size);
+  }
+
+ private:
+  int level;
+};
+
+#ifdef USE_ZSTD
+class ZstdBlockCompressor : public BlockCompressor {
+ public:
+  ZstdBlockCompressor(int level, const std::string &dict) {
+    cctx = ZSTD_createCCtx();
+    ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, level);
+    ZSTD_CCtx_setParameter(cctx, ZSTD_c_checksumFlag, 1);
+    if (!dict.empty()) {
+      ZSTD_CCtx_loadDictionary(cctx, dict.data(), dict.size());
+    }
+  }
+  ~ZstdBlockCompressor() { ZSTD_freeCCtx(cctx); }
+  void compress(const uint8_t *data, size_t size, std::vector<uint8_t> &out) override {
+    out.resize(ZSTD_compressBound(size));
+    size_t out_size = ZSTD_compress2(cctx, out.data(), out.size(), data, size);
+    assert(!ZSTD_isError(out_size));
+    out.resize(out_size);
+  }
+
+ private:
+  ZSTD_CCtx *cctx;
+};
+
+// Streams into one zstd frame on the caller's thread, like BZFile
+class ZstdFile : public LogFile {
+ public:
+  ZstdFile(const char* path, int level, const std::string &dict) {
+    file = fopen(path, "wb");
+    assert(file != nullptr);
+    cctx = ZSTD_createCCtx();
+    ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, level);
+    ZSTD_CCtx_setParameter(cctx, ZSTD_c_checksumFlag, 1);
+    if (!dict.empty()) {
+      ZSTD_CCtx_loadDictionary(cctx, dict.data(), dict.size());
+    }
+    out_buf.resize(ZSTD_CStreamOutSize());
+  }
+  ~ZstdFile() {
+    ZSTD_inBuffer in = {nullptr, 0, 0};
+    size_t remaining;
+    do {
+      remaining = compress(in, ZSTD_e_end);
+    } while (remaining > 0 && !ZSTD_isError(remaining));
+    ZSTD_freeCCtx(cctx);
+    int err = fclose(file);
+    assert(err == 0);
+  }
+  void write(void* data, size_t size) override {
+    ZSTD_inBuffer in = {data, size, 0};
+    while (in.pos < in.size) {
+      compress(in, ZSTD_e_continue);
+    }
+  }
+
+ private:
+  size_t compress(ZSTD_inBuffer &in, ZSTD_EndDirective mode) {
+    ZSTD_outBuffer out = {out_buf.data(), out_buf.size(), 0};
+    size_t ret = ZSTD_compressStream2(cctx, &out, &in, mode);
+    if (ZSTD_isError(ret)) {
+      if (!error_logged) {
+        LOGE("ZSTD_compressStream2 error %s", ZSTD_getErrorName(ret));
+        error_logged = true;
+      }
+      in.pos = in.size;
+      return 0;
+    }
+    write_file(file, out_buf.data(), out.pos, error_logged);
+    return ret;
+  }
+
+  bool error_logged = false;
+  FILE* file = nullptr;
+  ZSTD_CCtx *cctx = nullptr;
+  std::vector<uint8_t> out_buf;
+};
+#endif
+
+std::unique_ptr<BlockCompressor> block_compressor_create(const CompressionOptions &options, const std::string &dict) {
+#ifdef USE_ZSTD
+  if (options.type == CompressionType::ZSTD) {
+    return std::make_unique<ZstdBlockCompressor>(options.level, dict);
+  }
+#endif
+  return std::make_unique<BZ2BlockCompressor>(options.level);
+}
+
+static std::string load_dict(const CompressionOptions &options) {
+  if (options.type != CompressionType::ZSTD || options.dict_path.empty()) return "";
+  std::string dict = util::read_file(options.dict_path);
+  if (dict.empty()) {
+    LOGE("can't read zstd dictionary %s, compressing without", options.dict_path.c_str());
+  }
+  return dict;
+}
+
+// ***** block compression *****
+
+CompressorPool::CompressorPool(const CompressionOptions &options) : options(options) {
+  dict = load_dict(options);
+  for (int i = 0; i < std::max(options.workers, 1); i++) {
+    threads.push_back(std::thread(&CompressorPool::worker_thread, this));
+  }
+}
+
+CompressorPool::~CompressorPool() {
+  {
+    std::unique_lock lk(lock);
+    exit = true;
+  }
+  cv.notify_all();
+  for (auto &t : threads) t.join();
+}
+
+void CompressorPool::submit(std::shared_ptr<Job> job) {
+  {
+    std::unique_lock lk(lock);
+    jobs.push_back(job);
+  }
+  cv.notify_one();
+}
+
+void CompressorPool::worker_thread() {
+  set_thread_name("loggerd_compress");
+  std::unique_ptr<BlockCompressor> compressor = block_compressor_create(options, dict);
+
+  while (true) {
+    std::shared_ptr<Job> job;
+    {
+      std::unique_lock lk(lock);
+      cv.wait(lk, [&] { return exit || !jobs.empty(); });
+      // files wait for their blocks before closing, so the queue is empty on exit
+      if (jobs.empty()) return;
+      job = jobs.front();
+      jobs.pop_front();
+    }
+
+    compressor->compress(job->raw.data(), job->raw.size(), job->out);
+    job->file->job_done(job.get());
+  }
+}
+
+BlockLogFile::BlockLogFile(const char* path, const CompressionOptions &options, CompressorPool *pool) : pool(pool) {
+  file = fopen(path, "wb");
+  assert(file != nullptr);
+  block_size = pool ? pool->options.block_size : options.block_size;
+  if (pool == nullptr) {
+    compressor = block_compressor_create(options, load_dict(options));
+  }
+  block.reserve(block_size);
+}
+
+BlockLogFile::~BlockLogFile() {
+  close();
+  int err = fclose(file);
+  assert(err == 0);
+}
+
+void BlockLogFile::close() {
+  if (closed) return;
+  closed = true;
+
+  flush_block();
+  std::unique_lock lk(lock);
+  cv.wait(lk, [&] { return pending.empty(); });
+}
+
+void BlockLogFile::write(void* data, size_t size) {
+  block.insert(block.end(), (uint8_t *)data, (uint8_t *)data + size);
+  if (block.size() >= block_size) {
+    flush_block();
+  }
+}
+
+void BlockLogFile::flush_block() {
+  if (block.empty()) return;
+
+  auto job = std::make_shared<CompressorPool::Job>();
+  job->file = this;
+  job->block = blocks_submitted++;
+  job->raw.swap(block);
+  block_submitted(job->block);
+  {
+    std::unique_lock lk(lock);
+    size_t max_pending = pool ? std::max(pool->options.workers, 1) * MAX_PENDING_BLOCKS_PER_WORKER : 1;
+    if (pending.size() >= max_pending) {
+      LOGW("compression is behind, %zu blocks pending", pending.size());
+      cv.wait(lk, [&] { return pending.size() < max_pending; });
+    }
+    pending.push_back(job);
+    if (!spare_blocks.empty()) {
+      block.swap(spare_blocks.back());
+      spare_blocks.pop_back();
+    }
+  }
+  block.clear();
+  block.reserve(block_size);
+
+  if (pool) {
+    pool->submit(job);
+  } else {
+    compressor->compress(job->raw.data(), job->raw.size(), job->out);
+    job_done(job.get());
+  }
+}
+
+void BlockLogFile::job_done(CompressorPool::Job *job) {
+  std::unique_lock lk(lock);
+  job->done = true;
+
+  // append in order, a block that finished early waits for the ones before it
+  while (!pending.empty() && pending.front()->done) {
+    auto &front = pending.front();
+    write_file(file, front->out.data(), front->out.size(), error_logged);
+    block_written(front->block, offset, front->out.size(), front->raw.size());
+    offset += front->out.size();
+    spare_blocks.push_back(std::move(front->raw));
+    pending.pop_front();
+  }
+  cv.notify_all();
+}
+
+// *****
+
+std::unique_ptr<LogFile> log_file_open(const char* path, const CompressionOptions &options, CompressorPool *pool) {
+  if (options.indexed) {
+    return std::make_unique<IndexedLogFile>(path, options, pool);
+  }
+  if (pool != nullptr) {
+    return std::make_unique<BlockLogFile>(path, options, pool);
+  }
+#ifdef USE_ZSTD
+  if (options.type == CompressionType::ZSTD) {
+    return std::make_unique<ZstdFile>(path, options.level, load_dict(options));
+  }
+#endif
+  return std::make_unique<BZFile>(path, options.level);
+}
@@ -0,0 +1,126 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <capnp/serialize.h>
+#include <kj/array.h>
+
+enum class CompressionType {
+  BZ2,
+  ZSTD,
+};
+
+struct CompressionOptions {
+  CompressionType type = CompressionType::BZ2;
+  int level = 9;
+  // 0 compresses on the logging thread, otherwise blocks go to this many workers
+  int workers = 0;
+  size_t block_size = 4 << 20;
+  // trained zstd dictionary, see tests/compress_benchmark --train
+  std::string dict_path;
+  // zstd only, appends an index of the blocks, see indexed_log.h
+  bool indexed = false;
+
+  const char *extension() const { return type == CompressionType::ZSTD ? "zst" : "bz2"; }
+};
+
+// LOGGERD_COMPRESSION=<bz2|zstd>[:level], LOGGERD_COMPRESS_WORKERS=<n>,
+// LOGGERD_ZSTD_DICT=<path> and LOGGERD_INDEXED=1, bz2 level 9 on the logging
+// thread without them. Exits if this build can't do what they ask for
+CompressionOptions compression_options_from_env();
+bool compression_supported(CompressionType type);
+
+class LogFile {
+ public:
+  virtual ~LogFile() {}
+  virtual void write(void* data, size_t size) = 0;
+  inline void write(kj::ArrayPtr<capnp::byte> array) { write(array.begin(), array.size()); }
+};
+
+// Compresses a block into a self contained bz2 stream or zstd frame. Both
+// decompress as one when concatenated, so blocks can be compressed out of order.
+class BlockCompressor {
+ public:
+  virtual ~BlockCompressor() {}
+  virtual void compress(const uint8_t *data, size_t size, std::vector<uint8_t> &out) = 0;
+};
+
+std::unique_ptr<BlockCompressor> block_compressor_create(const CompressionOptions &options, const std::string &dict);
+
+class BlockLogFile;
+
+// Worker threads that compress the blocks of every BlockLogFile opened with it
+class CompressorPool {
+ public:
+  CompressorPool(const CompressionOptions &options);
+  ~CompressorPool();
+
+  struct Job {
+    BlockLogFile *file;
+    size_t block;
+    std::vector<uint8_t> raw, out;
+    bool done = false;
+  };
+  void submit(std::shared_ptr<Job> job);
+
+  const CompressionOptions options;
+
+ private:
+  void worker_thread();
+
+  std::string dict;
+  std::mutex lock;
+  std::condition_variable cv;
+  std::deque<std::shared_ptr<Job>> jobs;
+  std::vector<std::thread> threads;
+  bool exit = false;
+};
+
+// Collects writes into blocks that are compressed on their own, by the workers
+// of the pool if given or else on the writing thread, and appends the
+// compressed blocks to the file in order as they finish.
+class BlockLogFile : public LogFile {
+ public:
+  BlockLogFile(const char* path, const CompressionOptions &options, CompressorPool *pool=nullptr);
+  ~BlockLogFile();
+  void write(void* data, size_t size) override;
+
+ protected:
+  // compresses the last block and waits until every block is in the file
+  void close();
+  // called on the writing thread when a block is cut, with everything written since the last one
+  virtual void block_submitted(size_t block) {}
+  // called for each block in file order, with the lock held, once it is appended
+  virtual void block_written(size_t block, uint64_t offset, size_t size, size_t raw_size) {}
+
+  FILE* file = nullptr;
+
+ private:
+  friend class CompressorPool;
+  void flush_block();
+  void job_done(CompressorPool::Job *job);
+
+  bool closed = false;
+  bool error_logged = false;
+  size_t blocks_submitted = 0;
+  uint64_t offset = 0;
+  size_t block_size;
+  CompressorPool *pool;
+  std::unique_ptr<BlockCompressor> compressor;  // without a pool
+  std::vector<uint8_t> block;
+  std::vector<std::vector<uint8_t>> spare_blocks;
+  std::mutex lock;
+  std::condition_variable cv;
+  std::deque<std::shared_ptr<CompressorPool::Job>> pending;
+};
+
+// Opens path for streaming compression on the caller's thread, or through pool if given
+std::unique_ptr<LogFile> log_file_open(const char* path, const CompressionOptions &options, CompressorPool *pool=nullptr);
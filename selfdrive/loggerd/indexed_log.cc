@@ -0,0 +1,169 @@
+#include "selfdrive/loggerd/indexed_log.h"
+
+#include <cassert>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+
+#ifdef USE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "selfdrive/common/swaglog.h"
+#include "selfdrive/common/util.h"
+
+// ***** writer *****
+
+IndexedLogFile::IndexedLogFile(const char* path, const CompressionOptions &options, CompressorPool *pool)
+    : BlockLogFile(path, options, pool) {
+  assert(options.type == CompressionType::ZSTD);
+}
+
+IndexedLogFile::~IndexedLogFile() {
+  close();
+
+  IndexFooter footer = {.num_entries = (uint32_t)index.size(), .version = INDEX_VERSION, .magic = INDEX_MAGIC};
+  uint32_t header[2] = {INDEX_FRAME_MAGIC, (uint32_t)(index.size() * sizeof(IndexEntry) + sizeof(footer))};
+  if (fwrite(header, sizeof(header), 1, file) != 1 ||
+      fwrite(index.data(), sizeof(IndexEntry), index.size(), file) != index.size() ||
+      fwrite(&footer, sizeof(footer), 1, file) != 1) {
+    LOGE("failed to write log index, errno=%d", errno);
+  }
+}
+
+void IndexedLogFile::write(void* data, size_t size) {
+  kj::ArrayPtr<const capnp::word> words((const capnp::word *)data, size / sizeof(capnp::word));
+  try {
+    while (words.size() > 0) {
+      capnp::FlatArrayMessageReader reader(words);
+      cereal::Event::Reader event = reader.getRoot<cereal::Event>();
+      uint64_t mono_time = event.getLogMonoTime();
+
+      auto [it, inserted] = cur_block.try_emplace(event.which(), ServiceRange{0, mono_time, mono_time});
+      ServiceRange &range = it->second;
+      range.count++;
+      range.min_mono_time = std::min(range.min_mono_time, mono_time);
+      range.max_mono_time = std::max(range.max_mono_time, mono_time);
+
+      words = kj::arrayPtr(reader.getEnd(), words.end());
+    }
+  } catch (const kj::Exception &e) {
+    LOGE("can't index event: %s", e.getDescription().cStr());
+  }
+  BlockLogFile::write(data, size);
+}
+
+void IndexedLogFile::block_submitted(size_t block) {
+  std::unique_lock lk(index_lock);
+  submitted[block].swap(cur_block);
+  cur_block.clear();
+}
+
+void IndexedLogFile::block_written(size_t block, uint64_t offset, size_t size, size_t raw_size) {
+  std::unique_lock lk(index_lock);
+  auto it = submitted.find(block);
+  assert(it != submitted.end());
+  for (auto &[service, range] : it->second) {
+    index.push_back({.service = service, .reserved = 0, .count = range.count,
+                     .min_mono_time = range.min_mono_time, .max_mono_time = range.max_mono_time,
+                     .offset = offset, .size = (uint32_t)size, .raw_size = (uint32_t)raw_size});
+  }
+  submitted.erase(it);
+}
+
+// ***** reader *****
+
+bool IndexedLogReader::open(const std::string &file_path, const std::string &dict_path) {
+#ifdef USE_ZSTD
+  path = file_path;
+  index.clear();
+  FILE *f = fopen(path.c_str(), "rb");
+  if (f == nullptr) return false;
+
+  bool ok = false;
+  IndexFooter footer;
+  if (fseek(f, -(long)sizeof(footer), SEEK_END) == 0 && fread(&footer, sizeof(footer), 1, f) == 1 &&
+      footer.magic == INDEX_MAGIC && footer.version == INDEX_VERSION) {
+    // a corrupt footer must not make us allocate more than the file holds
+    long footer_pos = ftell(f) - (long)sizeof(footer);
+    uint64_t index_size = (uint64_t)footer.num_entries * sizeof(IndexEntry);
+    if (footer_pos >= 0 && index_size <= (uint64_t)footer_pos) {
+      index.resize(footer.num_entries);
+      ok = fseek(f, footer_pos - (long)index_size, SEEK_SET) == 0 &&
+           fread(index.data(), sizeof(IndexEntry), index.size(), f) == index.size();
+    } else {
+      LOGE("log index of %u entries doesn't fit in %s", footer.num_entries, path.c_str());
+    }
+  }
+  fclose(f);
+  if (!ok) {
+    index.clear();
+    return false;
+  }
+
+  dict = dict_path.empty() ? "" : util::read_file(dict_path);
+  return true;
+#else
+  LOGE("indexed logs need zstd");
+  return false;
+#endif
+}
+
+size_t IndexedLogReader::read(uint64_t start_mono_time, uint64_t end_mono_time, const std::set<cereal::Event::Which> &services,
+                              std::function<void(cereal::Event::Reader)> f) {
+  size_t count = 0;
+#ifdef USE_ZSTD
+  auto wanted = [&](uint16_t service) {
+    return services.empty() || services.count((cereal::Event::Which)service) > 0;
+  };
+
+  // the blocks with a wanted service in the time range, in file order
+  std::map<uint64_t, const IndexEntry *> blocks;
+  for (const auto &e : index) {
+    if (wanted(e.service) && e.max_mono_time >= start_mono_time && e.min_mono_time < end_mono_time) {
+      blocks[e.offset] = &e;
+    }
+  }
+  if (blocks.empty()) return 0;
+
+  FILE *file = fopen(path.c_str(), "rb");
+  if (file == nullptr) return 0;
+  ZSTD_DCtx *dctx = ZSTD_createDCtx();
+  if (!dict.empty()) {
+    ZSTD_DCtx_loadDictionary(dctx, dict.data(), dict.size());
+  }
+
+  std::vector<uint8_t> compressed;
+  std::vector<capnp::word> raw;
+  for (auto &[offset, e] : blocks) {
+    compressed.resize(e->size);
+    raw.resize((e->raw_size + sizeof(capnp::word) - 1) / sizeof(capnp::word));
+    if (fseek(file, offset, SEEK_SET) != 0 || fread(compressed.data(), 1, e->size, file) != e->size) {
+      LOGE("can't read block at %lu of %s", (unsigned long)offset, path.c_str());
+      break;
+    }
+    size_t raw_size = ZSTD_decompressDCtx(dctx, raw.data(), e->raw_size, compressed.data(), compressed.size());
+    if (ZSTD_isError(raw_size)) {
+      LOGE("can't decompress block at %lu of %s: %s", (unsigned long)offset, path.c_str(), ZSTD_getErrorName(raw_size));
+      break;
+    }
+    blocks_read++;
+
+    kj::ArrayPtr<const capnp::word> words(raw.data(), raw_size / sizeof(capnp::word));
+    while (words.size() > 0) {
+      capnp::FlatArrayMessageReader reader(words);
+      cereal::Event::Reader event = reader.getRoot<cereal::Event>();
+      uint64_t mono_time = event.getLogMonoTime();
+      if (wanted(event.which()) && mono_time >= start_mono_time && mono_time < end_mono_time) {
+        f(event);
+        count++;
+      }
+      words = kj::arrayPtr(reader.getEnd(), words.end());
+    }
+  }
+
+  ZSTD_freeDCtx(dctx);
+  fclose(file);
+#endif
+  return count;
+}
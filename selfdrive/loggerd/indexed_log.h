@@ -0,0 +1,82 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "cereal/gen/cpp/log.capnp.h"
+#include "selfdrive/loggerd/compressor.h"
+
+// An indexed log is a zstd log of independently compressed blocks, followed by
+// a skippable frame holding the index. zstd tools skip the index and read it as
+// any other log, IndexedLogReader uses it to only decompress the blocks it needs.
+//
+// index frame: magic, size, IndexEntry[num_entries], IndexFooter
+#define INDEX_FRAME_MAGIC 0x184D2A5EU
+#define INDEX_MAGIC 0x31584449474f4c52ULL  // "RLOGIDX1"
+#define INDEX_VERSION 1
+
+// events of one service in one block
+struct IndexEntry {
+  uint16_t service;  // cereal::Event::Which
+  uint16_t reserved;
+  uint32_t count;
+  uint64_t min_mono_time, max_mono_time;
+  uint64_t offset;  // of the block in the file
+  uint32_t size, raw_size;
+};
+static_assert(sizeof(IndexEntry) == 40);
+
+struct IndexFooter {
+  uint32_t num_entries;
+  uint32_t version;
+  uint64_t magic;
+};
+static_assert(sizeof(IndexFooter) == 16);
+
+// Indexes every event written to it, writes must hold whole events
+class IndexedLogFile : public BlockLogFile {
+ public:
+  IndexedLogFile(const char* path, const CompressionOptions &options, CompressorPool *pool=nullptr);
+  // appends the index after the last block
+  ~IndexedLogFile();
+  void write(void* data, size_t size) override;
+  using LogFile::write;
+
+ private:
+  struct ServiceRange {
+    uint32_t count;
+    uint64_t min_mono_time, max_mono_time;
+  };
+  void block_submitted(size_t block) override;
+  void block_written(size_t block, uint64_t offset, size_t size, size_t raw_size) override;
+
+  std::map<uint16_t, ServiceRange> cur_block;
+  std::mutex index_lock;
+  // ranges of the blocks that are still compressing
+  std::map<size_t, std::map<uint16_t, ServiceRange>> submitted;
+  std::vector<IndexEntry> index;
+};
+
+class IndexedLogReader {
+ public:
+  // false if the file isn't an indexed log, dict_path as it was written with
+  bool open(const std::string &path, const std::string &dict_path="");
+  const std::vector<IndexEntry> &entries() const { return index; }
+
+  // calls f for the events of the given services (all if empty) with logMonoTime
+  // in [start, end), in file order. Only the blocks that hold such events are read.
+  // Returns the number of events f was called with.
+  size_t read(uint64_t start_mono_time, uint64_t end_mono_time, const std::set<cereal::Event::Which> &services,
+              std::function<void(cereal::Event::Reader)> f);
+  // blocks decompressed by read so far
+  size_t blocks_read = 0;
+
+ private:
+  std::string path, dict;
+  std::vector<IndexEntry> index;
+};
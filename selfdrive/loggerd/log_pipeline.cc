@@ -0,0 +1,263 @@
+#include "selfdrive/loggerd/log_pipeline.h"
+
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <unordered_map>
+
+#include "cereal/services.h"
+#include "selfdrive/common/swaglog.h"
+#include "selfdrive/common/timing.h"
+#include "selfdrive/common/util.h"
+
+// ***** batch ring *****
+
+// the oldest batch, nullptr if there is none
+static LogBatch *pop_batch(LogBatchRing &ring) {
+  LogBatch *batch = nullptr;
+  ring.try_pop(batch);
+  return batch;
+}
+
+// ***** receiver *****
+
+// logMonoTime of a serialized event, messages are word aligned copies so they are read in place
+static uint64_t event_mono_time(const uint8_t *data, size_t size) {
+  try {
+    capnp::FlatArrayMessageReader reader(kj::ArrayPtr<const capnp::word>((const capnp::word *)data, size / sizeof(capnp::word)));
+    return reader.getRoot<cereal::Event>().getLogMonoTime();
+  } catch (const kj::Exception &e) {
+    return 0;
+  }
+}
+
+LogReceiver::LogReceiver(LogPipeline *pipeline, const std::vector<uint16_t> &services) : pipeline(pipeline), service_ids(services) {
+  poller.reset(Poller::create());
+  for (auto id : service_ids) {
+    poller->registerSocket(pipeline->services[id]->sock);
+  }
+
+  storage = std::make_unique<LogBatch[]>(LOG_BATCHES_PER_RECEIVER);
+  for (int i = 0; i < LOG_BATCHES_PER_RECEIVER; i++) {
+    storage[i].data.reserve(LOG_BATCH_SIZE);
+    free.try_push(&storage[i]);
+  }
+  cur = pop_batch(free);
+}
+
+LogReceiver::~LogReceiver() {
+  if (thread.joinable()) thread.join();
+}
+
+void LogReceiver::flush() {
+  if (cur == nullptr || cur->entries.empty()) return;
+
+  // every batch is either here, filled or free, so filled never overflows
+  bool pushed = filled.try_push(cur);
+  assert(pushed);
+  cur = pop_batch(free);
+}
+
+// drains the socket of a service into the current batch
+void LogReceiver::receive(uint16_t id) {
+  LogService &service = *pipeline->services[id];
+  Message *msg = nullptr;
+  while (!pipeline->exit && (msg = service.sock->receive(true))) {
+    const bool in_qlog = service.qlog_freq != -1 && (service.qlog_counter++ % service.qlog_freq == 0);
+    if (cur == nullptr) cur = pop_batch(free);
+
+    if (cur != nullptr) {
+      if (cur->entries.empty()) cur->recv_tms = millis_since_boot();
+      const uint8_t *data = (const uint8_t *)msg->getData();
+      const size_t size = msg->getSize();
+      cur->entries.push_back({event_mono_time(data, size), (uint32_t)cur->data.size(), (uint32_t)size, id, in_qlog});
+      cur->data.insert(cur->data.end(), data, data + size);
+      if (cur->data.size() >= LOG_BATCH_SIZE) {
+        flush();
+        pipeline->batch_full();
+      }
+    } else {
+      // the writer holds every batch
+      service.dropped.fetch_add(1, std::memory_order_relaxed);
+    }
+    delete msg;
+  }
+}
+
+void LogReceiver::receiver_thread() {
+  set_thread_name(service_ids.size() == 1 ? pipeline->services[service_ids[0]]->name.c_str() : "loggerd_recv");
+
+  std::unordered_map<SubSocket *, uint16_t> sock_ids;
+  for (auto id : service_ids) {
+    sock_ids[pipeline->services[id]->sock] = id;
+  }
+
+  // starts from the last acknowledged epoch, so a write that began before the thread did still gets its answer
+  uint32_t epoch = flushed_epoch;
+  while (!pipeline->exit) {
+    for (auto sock : poller->poll(10)) {
+      receive(sock_ids[sock]);
+    }
+
+    uint32_t requested = pipeline->flush_epoch;
+    if (requested != epoch) {
+      // everything published before the writer asked goes into this write
+      for (auto id : service_ids) {
+        receive(id);
+      }
+      flush();
+      epoch = requested;
+      pipeline->receiver_flushed(this, epoch);
+    }
+  }
+  flush();
+}
+
+// ***** pipeline *****
+
+LogPipeline::LogPipeline(Context *ctx) {
+  std::vector<uint16_t> shared;
+  std::vector<std::vector<uint16_t>> own;
+  for (const auto& it : ::services) {
+    if (!it.should_log) continue;
+
+    SubSocket *sock = SubSocket::create(ctx, it.name);
+    assert(sock != NULL);
+    auto service = std::make_unique<LogService>();
+    service->name = it.name;
+    service->sock = sock;
+    service->qlog_counter = 0;
+    service->qlog_freq = it.decimation;
+
+    uint16_t id = services.size();
+    services.push_back(std::move(service));
+    if (it.frequency >= LOG_OWN_RECEIVER_HZ) {
+      own.push_back({id});
+    } else {
+      shared.push_back(id);
+    }
+  }
+
+  for (auto &ids : own) {
+    receivers.push_back(std::make_unique<LogReceiver>(this, ids));
+  }
+  if (!shared.empty()) {
+    receivers.push_back(std::make_unique<LogReceiver>(this, shared));
+  }
+  reported_dropped.resize(services.size());
+  reported_late.resize(services.size());
+}
+
+LogPipeline::~LogPipeline() {
+  stop();
+  receivers.clear();
+  for (auto &service : services) delete service->sock;
+}
+
+void LogPipeline::start() {
+  for (auto &r : receivers) {
+    r->thread = std::thread(&LogReceiver::receiver_thread, r.get());
+  }
+}
+
+void LogPipeline::stop() {
+  exit = true;
+  for (auto &r : receivers) {
+    if (r->thread.joinable()) r->thread.join();
+  }
+}
+
+void LogPipeline::batch_full() {
+  {
+    std::unique_lock lk(lock);
+    full_seq++;
+  }
+  cv.notify_all();
+}
+
+void LogPipeline::receiver_flushed(LogReceiver *r, uint32_t epoch) {
+  {
+    std::unique_lock lk(lock);
+    r->flushed_epoch = epoch;
+  }
+  cv.notify_all();
+}
+
+void LogPipeline::wake() {
+  {
+    std::unique_lock lk(lock);
+    wake_requested = true;
+  }
+  cv.notify_all();
+}
+
+size_t LogPipeline::write(const Sink &sink, int timeout_ms) {
+  {
+    std::unique_lock lk(lock);
+    cv.wait_for(lk, std::chrono::milliseconds(timeout_ms), [&] { return wake_requested || full_seq != written_full_seq; });
+    wake_requested = false;
+    written_full_seq = full_seq;
+
+    // collect the batches of every receiver, stopped receivers have already flushed
+    const uint32_t epoch = ++flush_epoch;
+    cv.wait_for(lk, std::chrono::milliseconds(LOG_FLUSH_TIMEOUT_MS), [&] {
+      return exit || std::all_of(receivers.begin(), receivers.end(), [&](auto &r) { return r->flushed_epoch == epoch; });
+    });
+  }
+
+  // merge the batches by logMonoTime, events of one service keep their order
+  merged.clear();
+  drained.clear();
+  for (auto &r : receivers) {
+    while (LogBatch *batch = pop_batch(r->filled)) {
+      for (const LogEntry &e : batch->entries) {
+        merged.push_back({batch, &e});
+      }
+      drained.push_back({r.get(), batch});
+    }
+  }
+  std::stable_sort(merged.begin(), merged.end(), [](const auto &a, const auto &b) {
+    return a.second->mono_time < b.second->mono_time;
+  });
+
+  rlog.clear();
+  qlog.clear();
+  for (auto &[batch, e] : merged) {
+    const uint8_t *data = batch->data.data() + e->offset;
+    rlog.insert(rlog.end(), data, data + e->size);
+    if (e->in_qlog) {
+      qlog.insert(qlog.end(), data, data + e->size);
+    }
+  }
+  if (!merged.empty()) {
+    sink(rlog.data(), rlog.size(), qlog.data(), qlog.size());
+  }
+  bytes_written += rlog.size();
+
+  const double cur_tms = millis_since_boot();
+  for (auto &[r, batch] : drained) {
+    const bool late = cur_tms - batch->recv_tms > LOG_LATE_MS;
+    for (const LogEntry &e : batch->entries) {
+      services[e.service]->written.fetch_add(1, std::memory_order_relaxed);
+      if (late) services[e.service]->late.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    batch->data.clear();
+    batch->entries.clear();
+    bool pushed = r->free.try_push(batch);
+    assert(pushed);
+  }
+  return merged.size();
+}
+
+void LogPipeline::log_stats() {
+  for (size_t i = 0; i < services.size(); i++) {
+    uint64_t dropped = services[i]->dropped, late = services[i]->late;
+    if (dropped != reported_dropped[i] || late != reported_late[i]) {
+      LOGW("%s: %lu messages dropped, %lu late (of %lu written)", services[i]->name.c_str(),
+           dropped - reported_dropped[i], late - reported_late[i], (uint64_t)services[i]->written);
+      reported_dropped[i] = dropped;
+      reported_late[i] = late;
+    }
+  }
+}
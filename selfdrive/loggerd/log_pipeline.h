@@ -0,0 +1,129 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "cereal/messaging/messaging.h"
+#include "selfdrive/common/spsc_ring.h"
+#include "selfdrive/loggerd/logger.h"
+
+// a batch is handed to the writer once it holds this much, or when the writer collects
+// the batches of every receiver, which it does every LOG_BATCH_MS
+#define LOG_BATCH_SIZE (256 * 1024)
+#define LOG_BATCH_MS 50
+// how long the writer waits for the receivers to hand over their batches
+#define LOG_FLUSH_TIMEOUT_MS 100
+// batches a receiver can fill before the writer returns one, messages are dropped past that
+#define LOG_BATCHES_PER_RECEIVER 16
+// services at or above this frequency get a receiver thread of their own
+#define LOG_OWN_RECEIVER_HZ 100
+// messages written this long after they were received count as late
+#define LOG_LATE_MS 1000
+
+struct LogService {
+  std::string name;
+  SubSocket *sock;
+  int qlog_counter, qlog_freq;
+  // dropped is only written by the service's receiver, late and written only by the writer
+  std::atomic<uint64_t> dropped = 0, late = 0, written = 0;
+};
+
+struct LogEntry {
+  uint64_t mono_time;  // logMonoTime of the event
+  uint32_t offset, size;
+  uint16_t service;
+  bool in_qlog;
+};
+
+// Messages of one receiver, back to back in the order they were received
+struct LogBatch {
+  std::vector<uint8_t> data;
+  std::vector<LogEntry> entries;
+  double recv_tms;  // first message
+};
+
+typedef SpscRing<LogBatch *, LOG_BATCHES_PER_RECEIVER> LogBatchRing;
+
+class LogPipeline;
+
+// Drains its sockets into batches on a thread of its own
+class LogReceiver {
+ public:
+  LogReceiver(LogPipeline *pipeline, const std::vector<uint16_t> &services);
+  ~LogReceiver();
+
+ private:
+  friend class LogPipeline;
+  void receiver_thread();
+  void receive(uint16_t id);
+  void flush();
+
+  LogPipeline *pipeline;
+  std::vector<uint16_t> service_ids;
+  std::unique_ptr<Poller> poller;
+  std::unique_ptr<LogBatch[]> storage;
+  LogBatch *cur = nullptr;
+  // filled batches go to the writer, written ones come back
+  LogBatchRing filled, free;
+  uint32_t flushed_epoch = 0;  // guarded by LogPipeline::lock
+  std::thread thread;
+};
+
+// Subscribes to every logged service. Receiver threads batch the messages and
+// the writer appends them to the rlog and qlog, so a slow compress or fsync holds
+// up the writer but never the sockets. On every write all receivers hand over
+// what they have received and the messages are written in logMonoTime order,
+// so every write, and with it every segment, covers the same span for all services.
+class LogPipeline {
+ public:
+  LogPipeline(Context *ctx);
+  ~LogPipeline();
+  void start();
+  // stops the receivers, their last batches are left for write
+  void stop();
+  // rlog and qlog bytes of one write
+  typedef std::function<void(uint8_t *rlog, size_t rlog_size, uint8_t *qlog, size_t qlog_size)> Sink;
+
+  // waits up to timeout_ms, or until a batch fills up or wake() is called, then collects the
+  // batches of every receiver and writes them. Returns the messages written.
+  size_t write(const Sink &sink, int timeout_ms);
+  size_t write(LoggerState *s, int timeout_ms) {
+    return write([s](uint8_t *rlog, size_t rlog_size, uint8_t *qlog, size_t qlog_size) {
+      logger_log_batch(s, rlog, rlog_size, qlog, qlog_size);
+    }, timeout_ms);
+  }
+  // ends the wait of write early, e.g. when the logger has to rotate
+  void wake();
+  // logs the services that dropped or were late since the last call
+  void log_stats();
+
+  uint64_t bytes_written = 0;
+
+ private:
+  friend class LogReceiver;
+  void batch_full();
+  void receiver_flushed(LogReceiver *r, uint32_t epoch);
+
+  std::vector<std::unique_ptr<LogService>> services;
+  std::vector<std::unique_ptr<LogReceiver>> receivers;
+  std::vector<uint64_t> reported_dropped, reported_late;
+  std::atomic<bool> exit = false;
+
+  std::mutex lock;
+  std::condition_variable cv;
+  uint64_t full_seq = 0, written_full_seq = 0;
+  bool wake_requested = false;
+  std::atomic<uint32_t> flush_epoch = 0;  // bumped by the writer to collect the batches
+
+  // reused by the writer to merge the batches
+  std::vector<std::pair<LogReceiver *, LogBatch *>> drained;
+  std::vector<std::pair<const LogBatch *, const LogEntry *>> merged;
+  std::vector<uint8_t> rlog, qlog;
+};
@@ -144,7 +144,8 @@ static void log_sentinel(LoggerState *s, cereal::Sentinel::SentinelType type, in
 
 // ***** logging functions *****
 
-void logger_init(LoggerState *s, const char* log_name, bool has_qlog) {
+void logger_init(LoggerState *s, const char* log_name, bool has_qlog,
+                 const CompressionOptions &compression) {
   umask(0);
 
   pthread_mutex_init(&s->lock, NULL);
@@ -154,6 +155,10 @@ void logger_init(LoggerState *s, const char* log_name, bool has_qlog) {
   s->route_name = logger_get_route_name();
   snprintf(s->log_name, sizeof(s->log_name), "%s", log_name);
   s->init_data = logger_build_init_data();
+  s->compression = compression;
+  if (compression.workers > 0) {
+    s->compressor_pool = std::make_unique<CompressorPool>(compression);
+  }
 }
 
 static LoggerHandle* logger_open(LoggerState *s, const char* root_path) {
@@ -171,8 +176,9 @@ static LoggerHandle* logger_open(LoggerState *s, const char* root_path) {
   snprintf(h->segment_path, sizeof(h->segment_path),
           "%s/%s--%d", root_path, s->route_name.c_str(), s->part);
 
-  snprintf(h->log_path, sizeof(h->log_path), "%s/%s.bz2", h->segment_path, s->log_name);
-  snprintf(h->qlog_path, sizeof(h->qlog_path), "%s/qlog.bz2", h->segment_path);
+  const char *ext = s->compression.extension();
+  snprintf(h->log_path, sizeof(h->log_path), "%s/%s.%s", h->segment_path, s->log_name, ext);
+  snprintf(h->qlog_path, sizeof(h->qlog_path), "%s/qlog.%s", h->segment_path, ext);
   snprintf(h->lock_path, sizeof(h->lock_path), "%s.lock", h->log_path);
 
   err = logger_mkpath(h->log_path);
@@ -182,9 +188,9 @@ static LoggerHandle* logger_open(LoggerState *s, const char* root_path) {
   if (lock_file == NULL) return NULL;
   fclose(lock_file);
 
-  h->log = std::make_unique<BZFile>(h->log_path);
+  h->log = log_file_open(h->log_path, s->compression, s->compressor_pool.get());
   if (s->has_qlog) {
-    h->q_log = std::make_unique<BZFile>(h->qlog_path);
+    h->q_log = log_file_open(h->qlog_path, s->compression, s->compressor_pool.get());
   }
 
   pthread_mutex_init(&h->lock, NULL);
@@ -247,6 +253,23 @@ void logger_log(LoggerState *s, uint8_t* data, size_t data_size, bool in_qlog) {
   pthread_mutex_unlock(&s->lock);
 }
 
+void logger_log_batch(LoggerState *s, uint8_t* rlog_data, size_t rlog_size, uint8_t* qlog_data, size_t qlog_size) {
+  pthread_mutex_lock(&s->lock);
+  LoggerHandle *h = s->cur_handle;
+  if (h) {
+    pthread_mutex_lock(&h->lock);
+    assert(h->refcnt > 0);
+    if (rlog_size > 0) {
+      h->log->write(rlog_data, rlog_size);
+    }
+    if (qlog_size > 0 && h->q_log) {
+      h->q_log->write(qlog_data, qlog_size);
+    }
+    pthread_mutex_unlock(&h->lock);
+  }
+  pthread_mutex_unlock(&s->lock);
+}
+
 void logger_close(LoggerState *s, ExitHandler *exit_handler) {
   int signal = exit_handler == nullptr ? 0 : exit_handler->signal.load();
   log_sentinel(s, cereal::Sentinel::SentinelType::END_OF_ROUTE, signal);
@@ -14,18 +14,19 @@
 #include "selfdrive/common/util.h"
 #include "selfdrive/common/swaglog.h"
 #include "selfdrive/hardware/hw.h"
+#include "selfdrive/loggerd/compressor.h"
 
 const std::string LOG_ROOT = Path::log_root();
 
 #define LOGGER_MAX_HANDLES 16
 
-class BZFile {
+class BZFile : public LogFile {
  public:
-  BZFile(const char* path) {
+  BZFile(const char* path, int level = 9) {
     file = fopen(path, "wb");
     assert(file != nullptr);
     int bzerror;
-    bz_file = BZ2_bzWriteOpen(&bzerror, file, 9, 0, 30);
+    bz_file = BZ2_bzWriteOpen(&bzerror, file, level, 0, 30);
     assert(bzerror == BZ_OK);
   }
   ~BZFile() {
@@ -37,7 +38,7 @@ class BZFile {
     int err = fclose(file);
     assert(err == 0);
   }
-  inline void write(void* data, size_t size) {
+  void write(void* data, size_t size) override {
     int bzerror;
     do {
       BZ2_bzWrite(&bzerror, bz_file, data, size);
@@ -48,7 +49,7 @@ class BZFile {
       error_logged = true;
     }
   }
-  inline void write(kj::ArrayPtr<capnp::byte> array) { write(array.begin(), array.size()); }
+  using LogFile::write;
 
  private:
   bool error_logged = false;
@@ -63,7 +64,7 @@ typedef struct LoggerHandle {
   char log_path[4096];
   char qlog_path[4096];
   char lock_path[4096];
-  std::unique_ptr<BZFile> log, q_log;
+  std::unique_ptr<LogFile> log, q_log;
 } LoggerHandle;
 
 typedef struct LoggerState {
@@ -73,6 +74,9 @@ typedef struct LoggerState {
   std::string route_name;
   char log_name[64];
   bool has_qlog;
+  CompressionOptions compression;
+  // only with compression.workers, shared by the rlog and qlog of every handle
+  std::unique_ptr<CompressorPool> compressor_pool;
 
   LoggerHandle handles[LOGGER_MAX_HANDLES];
   LoggerHandle* cur_handle;
@@ -81,13 +85,16 @@ typedef struct LoggerState {
 int logger_mkpath(char* file_path);
 kj::Array<capnp::word> logger_build_init_data();
 std::string logger_get_route_name();
-void logger_init(LoggerState *s, const char* log_name, bool has_qlog);
+void logger_init(LoggerState *s, const char* log_name, bool has_qlog,
+                 const CompressionOptions &compression=CompressionOptions());
 int logger_next(LoggerState *s, const char* root_path,
                             char* out_segment_path, size_t out_segment_path_len,
                             int* out_part);
 LoggerHandle* logger_get_handle(LoggerState *s);
 void logger_close(LoggerState *s, ExitHandler *exit_handler=nullptr);
 void logger_log(LoggerState *s, uint8_t* data, size_t data_size, bool in_qlog);
+// appends already batched messages, taking the locks once for all of them
+void logger_log_batch(LoggerState *s, uint8_t* rlog_data, size_t rlog_size, uint8_t* qlog_data, size_t qlog_size);
 
 void lh_log(LoggerHandle* h, uint8_t* data, size_t data_size, bool in_qlog);
 void lh_close(LoggerHandle* h);
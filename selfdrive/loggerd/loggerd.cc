@@ -15,7 +15,6 @@
 #include <random>
 #include <string>
 #include <thread>
-#include <unordered_map>
 
 #include "cereal/messaging/messaging.h"
 #include "cereal/services.h"
@@ -29,6 +28,7 @@
 #include "selfdrive/hardware/hw.h"
 
 #include "selfdrive/loggerd/encoder.h"
+#include "selfdrive/loggerd/log_pipeline.h"
 #include "selfdrive/loggerd/logger.h"
 #if defined(QCOM) || defined(QCOM2)
 #include "selfdrive/loggerd/omx_encoder.h"
@@ -107,6 +107,7 @@ struct LoggerdState {
   std::atomic<int> waiting_rotate;
   int max_waiting = 0;
   double last_rotate_tms = 0.;
+  LogPipeline *pipeline = nullptr;
 };
 LoggerdState s;
 
@@ -156,7 +157,10 @@ void encoder_thread(int cam_idx) {
 
       if (cam_info.trigger_rotate && (cnt >= SEGMENT_LENGTH * MAIN_FPS)) {
         // trigger rotate and wait logger rotated to new segment
-        ++s.waiting_rotate;
+        if (++s.waiting_rotate == s.max_waiting) {
+          // rotate now instead of after the pipeline's next write
+          s.pipeline->wake();
+        }
         std::unique_lock lk(s.rotate_lock);
         s.rotate_cv.wait(lk, [&] { return s.rotate_segment > cur_seg || do_exit; });
       }
@@ -276,28 +280,14 @@ int main(int argc, char** argv) {
   clear_locks();
 
   // setup messaging
-  typedef struct QlogState {
-    int counter, freq;
-  } QlogState;
-  std::unordered_map<SubSocket*, QlogState> qlog_states;
-
   s.ctx = Context::create();
-  Poller * poller = Poller::create();
-
-  // subscribe to all socks
-  for (const auto& it : services) {
-    if (!it.should_log) continue;
-
-    SubSocket * sock = SubSocket::create(s.ctx, it.name);
-    assert(sock != NULL);
-    poller->registerSocket(sock);
-    qlog_states[sock] = {.counter = 0, .freq = it.decimation};
-  }
+  std::unique_ptr<LogPipeline> pipeline = std::make_unique<LogPipeline>(s.ctx);
+  s.pipeline = pipeline.get();
 
   Params params;
 
   // init logger
-  logger_init(&s.logger, "rlog", true);
+  logger_init(&s.logger, "rlog", true, compression_options_from_env());
   logger_rotate();
   params.put("CurrentRoute", s.logger.route_name);
 
@@ -323,30 +313,31 @@ int main(int argc, char** argv) {
     }
   }
 
-  uint64_t msg_count = 0, bytes_count = 0;
+  // receivers batch the messages, this thread writes the batches and rotates between them.
+  // rotate before waiting for the next write, so the encoders never wait a batch interval
+  pipeline->start();
+  uint64_t msg_count = 0, last_msg_count = 0;
+  int stats_segment = s.rotate_segment;
   double start_ts = millis_since_boot();
   while (!do_exit) {
-    // poll for new messages on all sockets
-    for (auto sock : poller->poll(1000)) {
-      // drain socket
-      QlogState &qs = qlog_states[sock];
-      Message *msg = nullptr;
-      while (!do_exit && (msg = sock->receive(true))) {
-        const bool in_qlog = qs.freq != -1 && (qs.counter++ % qs.freq == 0);
-        logger_log(&s.logger, (uint8_t *)msg->getData(), msg->getSize(), in_qlog);
-        bytes_count += msg->getSize();
-        delete msg;
-
-        rotate_if_needed();
-
-        if ((++msg_count % 1000) == 0) {
-          double seconds = (millis_since_boot() - start_ts) / 1000.0;
-          LOGD("%lu messages, %.2f msg/sec, %.2f KB/sec", msg_count, msg_count / seconds, bytes_count * 0.001 / seconds);
-        }
-      }
+    rotate_if_needed();
+    msg_count += pipeline->write(&s.logger, LOG_BATCH_MS);
+
+    if (s.rotate_segment != stats_segment) {
+      stats_segment = s.rotate_segment;
+      pipeline->log_stats();
     }
+    if (msg_count / 1000 != last_msg_count / 1000) {
+      double seconds = (millis_since_boot() - start_ts) / 1000.0;
+      LOGD("%lu messages, %.2f msg/sec, %.2f KB/sec", msg_count, msg_count / seconds, pipeline->bytes_written * 0.001 / seconds);
+    }
+    last_msg_count = msg_count;
   }
 
+  pipeline->stop();
+  pipeline->write(&s.logger, 0);
+  pipeline->log_stats();
+
   LOGW("closing encoders");
   s.rotate_cv.notify_all();
   for (auto &t : encoder_threads) t.join();
@@ -361,8 +352,7 @@ int main(int argc, char** argv) {
   }
 
   // messaging cleanup
-  for (auto &[sock, qs] : qlog_states) delete sock;
-  delete poller;
+  pipeline.reset();
   delete s.ctx;
 
   return 0;
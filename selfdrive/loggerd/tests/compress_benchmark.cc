@@ -0,0 +1,169 @@
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <bzlib.h>
+#ifdef USE_ZSTD
+#include <zdict.h>
+#endif
+
+#include "selfdrive/loggerd/logger.h"
+
+// Compresses real segments with bz2 and zstd at a few levels, with and without
+// a dictionary, on the logging thread and through the pool. Reports the CPU
+// time the process spent, the wall time the writes took and the ratio.
+//
+// usage: compress_benchmark [--dict <dict>] <rlog.bz2|rlog>...
+//        compress_benchmark --train <dict out> <rlog.bz2|rlog>...
+
+static std::string read_log(const std::string &path) {
+  if (path.size() < 4 || path.substr(path.size() - 4) != ".bz2") {
+    return util::read_file(path);
+  }
+
+  std::string out;
+  FILE *f = fopen(path.c_str(), "rb");
+  if (f == nullptr) return out;
+  int bzerror;
+  BZFILE *bz = BZ2_bzReadOpen(&bzerror, f, 0, 0, nullptr, 0);
+  char buf[1 << 16];
+  while (bzerror == BZ_OK) {
+    int n = BZ2_bzRead(&bzerror, bz, buf, sizeof(buf));
+    if (bzerror == BZ_OK || bzerror == BZ_STREAM_END) out.append(buf, n);
+  }
+  BZ2_bzReadClose(&bzerror, bz);
+  fclose(f);
+  return out;
+}
+
+static double cpu_seconds() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+// feeds the log event by event like lh_log does
+static void bench(const char *name, const CompressionOptions &options, const std::vector<std::string> &logs) {
+  const char *path = "/tmp/compress_benchmark.out";
+  size_t raw_size = 0, compressed_size = 0;
+  double wall = 0, cpu = 0;
+
+  std::unique_ptr<CompressorPool> pool;
+  if (options.workers > 0) pool = std::make_unique<CompressorPool>(options);
+
+  for (const auto &log : logs) {
+    double cpu_start = cpu_seconds();
+    auto start = std::chrono::steady_clock::now();
+    {
+      std::unique_ptr<LogFile> file = log_file_open(path, options, pool.get());
+      kj::ArrayPtr<const capnp::word> words((const capnp::word *)log.data(), log.size() / sizeof(capnp::word));
+      while (words.size() > 0) {
+        capnp::FlatArrayMessageReader reader(words);
+        const capnp::word *end = reader.getEnd();
+        file->write((void *)words.begin(), (end - words.begin()) * sizeof(capnp::word));
+        words = kj::arrayPtr(end, words.end());
+      }
+    }
+    wall += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    cpu += cpu_seconds() - cpu_start;
+    raw_size += log.size();
+    compressed_size += util::read_file(path).size();
+  }
+  unlink(path);
+
+  printf("%-24s %8.2f s cpu %8.2f s wall %8.2f MB/s %6.2fx\n", name, cpu, wall,
+         raw_size / wall / 1e6, (double)raw_size / compressed_size);
+}
+
+#ifdef USE_ZSTD
+static int train(const char *dict_path, const std::vector<std::string> &logs) {
+  // samples are single events, the dictionary helps most on small frames
+  std::string samples;
+  std::vector<size_t> sizes;
+  for (const auto &log : logs) {
+    kj::ArrayPtr<const capnp::word> words((const capnp::word *)log.data(), log.size() / sizeof(capnp::word));
+    while (words.size() > 0) {
+      capnp::FlatArrayMessageReader reader(words);
+      const capnp::word *end = reader.getEnd();
+      size_t size = (end - words.begin()) * sizeof(capnp::word);
+      samples.append((const char *)words.begin(), size);
+      sizes.push_back(size);
+      words = kj::arrayPtr(end, words.end());
+    }
+  }
+
+  std::vector<char> dict(112640);
+  size_t dict_size = ZDICT_trainFromBuffer(dict.data(), dict.size(), samples.data(), sizes.data(), sizes.size());
+  if (ZDICT_isError(dict_size)) {
+    fprintf(stderr, "training failed: %s\n", ZDICT_getErrorName(dict_size));
+    return 1;
+  }
+  FILE *f = fopen(dict_path, "wb");
+  if (f == nullptr) return 1;
+  fwrite(dict.data(), 1, dict_size, f);
+  fclose(f);
+  printf("trained %zu byte dictionary on %zu events\n", dict_size, sizes.size());
+  return 0;
+}
+#endif
+
+int main(int argc, char *argv[]) {
+  std::string dict_path, train_path;
+  std::vector<std::string> logs;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--dict") == 0 && i + 1 < argc) {
+      dict_path = argv[++i];
+    } else if (strcmp(argv[i], "--train") == 0 && i + 1 < argc) {
+      train_path = argv[++i];
+    } else {
+      std::string log = read_log(argv[i]);
+      if (log.empty()) {
+        fprintf(stderr, "can't read %s\n", argv[i]);
+        return 1;
+      }
+      logs.push_back(log);
+    }
+  }
+  if (logs.empty()) {
+    fprintf(stderr, "usage: %s [--dict <dict>] [--train <dict out>] <rlog.bz2|rlog>...\n", argv[0]);
+    return 1;
+  }
+
+  if (!train_path.empty()) {
+#ifdef USE_ZSTD
+    return train(train_path.c_str(), logs);
+#else
+    fprintf(stderr, "built without zstd\n");
+    return 1;
+#endif
+  }
+
+  int workers = std::max((int)std::thread::hardware_concurrency() - 1, 1);
+  CompressionOptions options;
+  bench("bz2 9", options, logs);
+  options.workers = workers;
+  bench("bz2 9 pooled", options, logs);
+
+  if (!compression_supported(CompressionType::ZSTD)) return 0;
+  options.type = CompressionType::ZSTD;
+  for (int level : {1, 3, 9, 19}) {
+    std::string name = "zstd " + std::to_string(level);
+    options.level = level;
+    options.workers = 0;
+    bench(name.c_str(), options, logs);
+    options.workers = workers;
+    bench((name + " pooled").c_str(), options, logs);
+    if (!dict_path.empty()) {
+      options.dict_path = dict_path;
+      options.workers = 0;
+      bench((name + " dict").c_str(), options, logs);
+      options.dict_path = "";
+    }
+  }
+  return 0;
+}
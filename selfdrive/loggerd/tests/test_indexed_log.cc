@@ -0,0 +1,124 @@
+#define CATCH_CONFIG_MAIN
+#include "catch2/catch.hpp"
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+
+#include <zstd.h>
+
+#include "cereal/messaging/messaging.h"
+#include "selfdrive/common/util.h"
+#include "selfdrive/loggerd/indexed_log.h"
+
+// 10 seconds of can at 100hz, carState at 100hz and deviceState at 2hz, split
+// into many small blocks
+static void write_log(const char *path, CompressorPool *pool, const CompressionOptions &options) {
+  std::unique_ptr<LogFile> file = log_file_open(path, options, pool);
+  for (int i = 0; i < 1000; i++) {
+    uint64_t mono_time = 1e9 + i * 1e7;
+    MessageBuilder can;
+    can.initEvent().initCan(4);
+    can.getRoot<cereal::Event>().setLogMonoTime(mono_time);
+    file->write(can.toBytes());
+
+    MessageBuilder car_state;
+    car_state.initEvent().initCarState().setVEgo(i);
+    car_state.getRoot<cereal::Event>().setLogMonoTime(mono_time + 1);
+    file->write(car_state.toBytes());
+
+    if (i % 50 == 0) {
+      MessageBuilder device_state;
+      device_state.initEvent().initDeviceState();
+      device_state.getRoot<cereal::Event>().setLogMonoTime(mono_time + 2);
+      file->write(device_state.toBytes());
+    }
+  }
+}
+
+// like any zstd tool, a stream decompressor that skips the skippable frames
+static std::string zstd_decompress(const std::string &compressed) {
+  std::string raw;
+  std::vector<char> buf(ZSTD_DStreamOutSize());
+  ZSTD_DCtx *dctx = ZSTD_createDCtx();
+  ZSTD_inBuffer in = {compressed.data(), compressed.size(), 0};
+  while (in.pos < in.size) {
+    ZSTD_outBuffer out = {buf.data(), buf.size(), 0};
+    size_t ret = ZSTD_decompressStream(dctx, &out, &in);
+    if (ZSTD_isError(ret)) break;
+    raw.append(buf.data(), out.pos);
+  }
+  ZSTD_freeDCtx(dctx);
+  return raw;
+}
+
+static void check_log(const char *path) {
+  std::string raw = zstd_decompress(util::read_file(path));
+  kj::Array<capnp::word> buf = kj::heapArray<capnp::word>(raw.size() / sizeof(capnp::word));
+  memcpy(buf.begin(), raw.data(), raw.size());
+  kj::ArrayPtr<const capnp::word> words = buf;
+  size_t events = 0;
+  while (words.size() > 0) {
+    capnp::FlatArrayMessageReader reader(words);
+    words = kj::arrayPtr(reader.getEnd(), words.end());
+    events++;
+  }
+  REQUIRE(events == 2020);
+
+  IndexedLogReader log;
+  REQUIRE(log.open(path));
+  REQUIRE(log.entries().size() > 10);
+
+  // one service in a one second window only touches the blocks of that second
+  std::vector<uint64_t> times;
+  size_t count = log.read(3e9, 4e9, {cereal::Event::CAN}, [&](cereal::Event::Reader event) {
+    REQUIRE(event.which() == cereal::Event::CAN);
+    times.push_back(event.getLogMonoTime());
+  });
+  REQUIRE(count == 100);
+  REQUIRE(times.front() == 3e9);
+  REQUIRE(times.back() == 3e9 + 99 * 1e7);
+  REQUIRE(std::is_sorted(times.begin(), times.end()));
+  REQUIRE(log.blocks_read < log.entries().size() / 3);
+
+  // every service over the whole log
+  count = log.read(0, UINT64_MAX, {}, [](cereal::Event::Reader event) {});
+  REQUIRE(count == 2020);
+  count = log.read(0, UINT64_MAX, {cereal::Event::DEVICE_STATE}, [](cereal::Event::Reader event) {});
+  REQUIRE(count == 20);
+}
+
+TEST_CASE("IndexedLogFile seeks by time and service") {
+  char path[] = "/tmp/test_indexed_log_XXXXXX";
+  int fd = mkstemp(path);
+  REQUIRE(fd != -1);
+  close(fd);
+
+  CompressionOptions options;
+  options.type = CompressionType::ZSTD;
+  options.level = 3;
+  options.indexed = true;
+  options.block_size = 16 << 10;
+
+  SECTION("on the writing thread") {
+    write_log(path, nullptr, options);
+    check_log(path);
+  }
+  SECTION("through the pool") {
+    options.workers = 3;
+    CompressorPool pool(options);
+    write_log(path, &pool, options);
+    check_log(path);
+  }
+
+  // a plain log has no index
+  {
+    CompressionOptions plain = options;
+    plain.indexed = false;
+    write_log(path, nullptr, plain);
+  }
+  IndexedLogReader log;
+  REQUIRE(!log.open(path));
+  unlink(path);
+}
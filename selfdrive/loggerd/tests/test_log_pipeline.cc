@@ -0,0 +1,89 @@
+#define CATCH_CONFIG_MAIN
+#include "catch2/catch.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+#include "cereal/messaging/messaging.h"
+#include "selfdrive/loggerd/log_pipeline.h"
+
+struct Segment {
+  std::vector<uint64_t> rlog, qlog;
+};
+
+static std::vector<uint64_t> mono_times(const uint8_t *data, size_t size) {
+  kj::Array<capnp::word> buf = kj::heapArray<capnp::word>(size / sizeof(capnp::word));
+  memcpy(buf.begin(), data, size);
+  kj::ArrayPtr<const capnp::word> words = buf;
+
+  std::vector<uint64_t> times;
+  while (words.size() > 0) {
+    capnp::FlatArrayMessageReader reader(words);
+    times.push_back(reader.getRoot<cereal::Event>().getLogMonoTime());
+    words = kj::arrayPtr(reader.getEnd(), words.end());
+  }
+  return times;
+}
+
+static void publish(PubSocket *sock, uint64_t mono_time) {
+  MessageBuilder msg;
+  msg.initEvent().initCan(1);
+  msg.getRoot<cereal::Event>().setLogMonoTime(mono_time);
+  auto bytes = msg.toBytes();
+  REQUIRE(sock->send((char *)bytes.begin(), bytes.size()) == (int)bytes.size());
+}
+
+TEST_CASE("LogPipeline writes every service in logMonoTime order") {
+  Context *ctx = Context::create();
+  // publishers first, a new publisher evicts the subscribers of its queue
+  // can and carState get receivers of their own, deviceState goes to the shared one
+  std::unique_ptr<PubSocket> can(PubSocket::create(ctx, "can"));
+  std::unique_ptr<PubSocket> car_state(PubSocket::create(ctx, "carState"));
+  std::unique_ptr<PubSocket> device_state(PubSocket::create(ctx, "deviceState"));
+
+  auto pipeline = std::make_unique<LogPipeline>(ctx);
+  pipeline->start();
+
+  // the writer rotates between writes, every write has to end up in one segment
+  // with everything that was published before it
+  const int rounds = 100;
+  std::vector<Segment> segments;
+  for (int seg = 0; seg < 3; seg++) {
+    // published newest service first, so only the merge puts them in order
+    for (int i = seg * rounds; i < (seg + 1) * rounds; i++) {
+      publish(device_state.get(), 3 * i + 2);
+      publish(car_state.get(), 3 * i + 1);
+      publish(can.get(), 3 * i);
+    }
+
+    Segment segment;
+    size_t written = pipeline->write([&](uint8_t *rlog, size_t rlog_size, uint8_t *qlog, size_t qlog_size) {
+      segment.rlog = mono_times(rlog, rlog_size);
+      segment.qlog = mono_times(qlog, qlog_size);
+    }, 0);
+    REQUIRE(written == 3 * rounds);
+    segments.push_back(segment);
+  }
+
+  for (int seg = 0; seg < 3; seg++) {
+    const Segment &segment = segments[seg];
+    REQUIRE(segment.rlog.size() == 3 * rounds);
+    for (int i = 0; i < 3 * rounds; i++) {
+      REQUIRE(segment.rlog[i] == (uint64_t)(3 * seg * rounds + i));
+    }
+
+    // every deviceState, every 10th carState and no can
+    REQUIRE(segment.qlog.size() == rounds + rounds / 10);
+    REQUIRE(std::is_sorted(segment.qlog.begin(), segment.qlog.end()));
+  }
+
+  pipeline->stop();
+  REQUIRE(pipeline->write([](uint8_t *, size_t, uint8_t *, size_t) {}, 0) == 0);
+  pipeline.reset();
+  can.reset();
+  car_state.reset();
+  device_state.reset();
+  delete ctx;
+}
@@ -7,6 +7,7 @@
 #include "cereal/messaging/messaging.h"
 #include "cereal/visionipc/visionipc_client.h"
 #include "selfdrive/common/clutil.h"
+#include "selfdrive/common/latency.h"
 #include "selfdrive/common/params.h"
 #include "selfdrive/common/swaglog.h"
 #include "selfdrive/common/util.h"
@@ -96,6 +97,7 @@ void run_model(ModelState &model, VisionIpcClient &vipc_client) {
     frame_id = sm["roadCameraState"].getRoadCameraState().getFrameId();
 
     if (run_model_this_iter) {
+      LATENCY_SCOPE("run_model");
       run_count++;
 
       float vec_desire[DESIRE_LEN] = {0};
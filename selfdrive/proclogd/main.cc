@@ -1,6 +1,8 @@
 
 #include <sys/resource.h>
 
+#include <sstream>
+
 #include "selfdrive/common/util.h"
 #include "selfdrive/proclogd/proclog.h"
 
@@ -9,13 +11,31 @@ ExitHandler do_exit;
 int main(int argc, char **argv) {
   setpriority(PRIO_PROCESS, 0, -15);
 
+  // sampling is cheap enough to go down to 100 ms for finer CPU attribution
+  const int interval_ms = util::getenv("PROCLOG_INTERVAL_MS", 2000);
+
+  // the realtime daemons, PROCLOG_THREADS=name,name,... or * for every process
+  std::vector<std::string> thread_procs = {"controlsd", "plannerd", "radard", "boardd", "modeld", "dmonitoringmodeld",
+                                           "locationd", "paramsd", "calibrationd", "camerad", "sensord", "ubloxd"};
+  if (const char *env = getenv("PROCLOG_THREADS")) {
+    thread_procs.clear();
+    std::istringstream stream(env);
+    for (std::string name; std::getline(stream, name, ',');) {
+      if (!name.empty()) thread_procs.push_back(name);
+    }
+  }
+
+  ProcSampler sampler;
+  sampler.collectThreads(thread_procs);
   PubMaster publisher({"procLog"});
   while (!do_exit) {
+    sampler.sample();
     MessageBuilder msg;
-    buildProcLogMessage(msg);
+    auto procLog = msg.initEvent().initProcLog();
+    sampler.build(procLog);
     publisher.send("procLog", msg);
 
-    util::sleep_for(2000);  // 2 secs
+    util::sleep_for(interval_ms);
   }
 
   return 0;
@@ -1,13 +1,17 @@
 #include "selfdrive/proclogd/proclog.h"
 
-#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include <cassert>
+#include <cstring>
 #include <fstream>
 #include <iterator>
 #include <sstream>
+#include <utility>
 
 #include "selfdrive/common/swaglog.h"
+#include "selfdrive/common/timing.h"
 #include "selfdrive/common/util.h"
 
 namespace Parser {
@@ -157,55 +161,309 @@ const ProcCache &getProcExtraInfo(int pid, const std::string &name) {
 const double jiffy = sysconf(_SC_CLK_TCK);
 const size_t page_size = sysconf(_SC_PAGE_SIZE);
 
-void buildCPUTimes(cereal::ProcLog::Builder &builder) {
-  std::ifstream stream("/proc/stat");
-  std::vector<CPUTime> stats = Parser::cpuTimes(stream);
+// ***** ProcSampler *****
 
-  auto log_cpu_times = builder.initCpuTimes(stats.size());
-  for (int i = 0; i < stats.size(); ++i) {
-    auto l = log_cpu_times[i];
-    const CPUTime &r = stats[i];
-    l.setCpuNum(r.id);
-    l.setUser(r.utime / jiffy);
-    l.setNice(r.ntime / jiffy);
-    l.setSystem(r.stime / jiffy);
-    l.setIdle(r.itime / jiffy);
-    l.setIowait(r.iowtime / jiffy);
-    l.setIrq(r.irqtime / jiffy);
-    l.setSoftirq(r.sirqtime / jiffy);
+// Reads numbers and fields out of a /proc buffer without allocating
+struct ProcScanner {
+  const char *p, *end;
+
+  void skipSpace() {
+    while (p < end && (*p == ' ' || *p == '\t')) p++;
+  }
+  template <typename T>
+  bool number(T &v) {
+    skipSpace();
+    bool neg = p < end && *p == '-';
+    if (neg) p++;
+    if (p >= end || *p < '0' || *p > '9') return false;
+    unsigned long long n = 0;
+    for (; p < end && *p >= '0' && *p <= '9'; p++) n = n * 10 + (*p - '0');
+    v = neg ? (T)-(long long)n : (T)n;
+    return true;
   }
+  bool startsWith(const char *prefix, size_t len) {
+    return (size_t)(end - p) >= len && memcmp(p, prefix, len) == 0;
+  }
+  // moves past the next newline, false at the end
+  bool nextLine() {
+    const char *nl = (const char *)memchr(p, '\n', end - p);
+    p = nl ? nl + 1 : end;
+    return p < end;
+  }
+};
+
+// whole file at fd into buf, 0 terminated
+static ssize_t pread_file(int fd, char *buf, size_t size) {
+  ssize_t n = pread(fd, buf, size - 1, 0);
+  buf[std::max(n, (ssize_t)0)] = '\0';
+  return n;
 }
 
-void buildMemInfo(cereal::ProcLog::Builder &builder) {
-  std::ifstream stream("/proc/meminfo");
-  auto mem_info = Parser::memInfo(stream);
+ProcSampler::ProcSampler(const std::string &path, const std::string &shm_path) : proc_path(path), shm_path(shm_path) {
+  proc_dir = opendir(proc_path.c_str());
+  assert(proc_dir);
+  stat_fd = open((proc_path + "/stat").c_str(), O_RDONLY | O_CLOEXEC);
+  meminfo_fd = open((proc_path + "/meminfo").c_str(), O_RDONLY | O_CLOEXEC);
+}
 
-  auto mem = builder.initMem();
-  mem.setTotal(mem_info["MemTotal:"]);
-  mem.setFree(mem_info["MemFree:"]);
-  mem.setAvailable(mem_info["MemAvailable:"]);
-  mem.setBuffers(mem_info["Buffers:"]);
-  mem.setCached(mem_info["Cached:"]);
-  mem.setActive(mem_info["Active:"]);
-  mem.setInactive(mem_info["Inactive:"]);
-  mem.setShared(mem_info["Shmem:"]);
-}
-
-void buildProcs(cereal::ProcLog::Builder &builder) {
-  auto pids = Parser::pids();
-  std::vector<ProcStat> proc_stats;
-  proc_stats.reserve(pids.size());
-  for (int pid : pids) {
-    std::string path = "/proc/" + std::to_string(pid) + "/stat";
-    if (auto stat = Parser::procStat(util::read_file(path))) {
-      proc_stats.push_back(*stat);
-    }
-  }
-
-  auto procs = builder.initProcs(proc_stats.size());
-  for (size_t i = 0; i < proc_stats.size(); i++) {
-    auto l = procs[i];
-    const ProcStat &r = proc_stats[i];
+ProcSampler::~ProcSampler() {
+  for (auto &[pid, proc] : procs_) closeProc(proc);
+  if (stat_fd != -1) close(stat_fd);
+  if (meminfo_fd != -1) close(meminfo_fd);
+  closedir(proc_dir);
+}
+
+// parses a /proc/pid/stat or /proc/pid/task/tid/stat read into buf
+static bool parse_stat(const char *buf, ssize_t len, int pid, ProcStat &st) {
+  if (len <= 0) return false;
+
+  // To avoid being fooled by names containing a closing paren, scan backwards.
+  const char *open_paren = (const char *)memchr(buf, '(', len);
+  const char *close_paren = (const char *)memrchr(buf, ')', len);
+  if (open_paren == nullptr || close_paren == nullptr || open_paren > close_paren) return false;
+
+  size_t name_len = close_paren - open_paren - 1;
+  if (st.name.compare(0, std::string::npos, open_paren + 1, name_len) != 0) {
+    st.name.assign(open_paren + 1, name_len);
+  }
+
+  // fields from state on, numbered as in proc(5)
+  ProcScanner sc = {close_paren + 1, buf + len};
+  sc.skipSpace();
+  if (sc.p >= sc.end) return false;
+  st.state = *sc.p++;
+  using namespace Parser;
+  long long v[StatPos::processor + 1] = {};
+  for (int i = StatPos::ppid; i <= StatPos::processor; i++) {
+    if (!sc.number(v[i])) {
+      LOGE("failed to parse procStat of %d", pid);
+      return false;
+    }
+  }
+  st.pid = pid;
+  st.ppid = v[StatPos::ppid];
+  st.utime = v[StatPos::utime];
+  st.stime = v[StatPos::stime];
+  st.cutime = v[StatPos::cutime];
+  st.cstime = v[StatPos::cstime];
+  st.priority = v[StatPos::priority];
+  st.nice = v[StatPos::nice];
+  st.num_threads = v[StatPos::num_threads];
+  st.starttime = v[StatPos::starttime];
+  st.vms = v[StatPos::vsize];
+  st.rss = v[StatPos::rss];
+  st.processor = v[StatPos::processor];
+  return true;
+}
+
+// reads /proc/pid/stat into proc.stat, false if the process is gone
+bool ProcSampler::readStat(Proc &proc, int pid) {
+  return parse_stat(buf, pread_file(proc.fd, buf, sizeof(buf)), pid, proc.stat);
+}
+
+// reads tid/name relative to dir_fd into buf, opening and closing it
+ssize_t ProcSampler::readAt(int dir_fd, int tid, const char *name) {
+  char path[64];
+  snprintf(path, sizeof(path), "%d/%s", tid, name);
+  int fd = openat(dir_fd, path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) return -1;
+  ssize_t n = pread_file(fd, buf, sizeof(buf));
+  close(fd);
+  return n;
+}
+
+void ProcSampler::sampleThreads(Proc &proc, int pid, double dt) {
+  if (proc.task_dir == nullptr) {
+    std::string path = proc_path + "/" + std::to_string(pid) + "/task";
+    proc.task_dir = opendir(path.c_str());
+    if (proc.task_dir == nullptr) return;
+  }
+
+  rewinddir(proc.task_dir);
+  int dir_fd = dirfd(proc.task_dir);
+  struct dirent *de = NULL;
+  while ((de = readdir(proc.task_dir))) {
+    char *p_end;
+    int tid = strtol(de->d_name, &p_end, 10);
+    if (p_end == de->d_name || *p_end != '\0') continue;
+
+    auto [it, is_new] = proc.threads.try_emplace(tid);
+    Thread &t = it->second;
+    unsigned long long prev_starttime = t.stat.starttime;
+    unsigned long prev_cpu = t.stat.utime + t.stat.stime;
+    if (!parse_stat(buf, readAt(dir_fd, tid, "stat"), tid, t.stat)) continue;
+    unsigned long cpu = t.stat.utime + t.stat.stime;
+    bool same = !is_new && t.stat.starttime == prev_starttime;
+    t.cpu_usage = same && dt > 0 && cpu >= prev_cpu ? (cpu - prev_cpu) / jiffy / dt * 100 : 0;
+
+    // schedstat: time on the cpu, time waiting for it (ns) and timeslices
+    ssize_t len = readAt(dir_fd, tid, "schedstat");
+    if (len > 0) {
+      ProcScanner sc = {buf, buf + len};
+      sc.number(t.run_ns);
+      sc.number(t.run_delay_ns);
+      sc.number(t.timeslices);
+    }
+
+    len = readAt(dir_fd, tid, "status");
+    if (len > 0) {
+      ProcScanner sc = {buf, buf + len};
+      do {
+        if (sc.startsWith("voluntary_ctxt_switches:", 24)) {
+          sc.p += 24;
+          sc.number(t.voluntary_switches);
+        } else if (sc.startsWith("nonvoluntary_ctxt_switches:", 27)) {
+          sc.p += 27;
+          sc.number(t.involuntary_switches);
+        }
+      } while (sc.nextLine());
+    }
+    t.sample_id = sample_id;
+  }
+  for (auto it = proc.threads.begin(); it != proc.threads.end();) {
+    it = it->second.sample_id != sample_id ? proc.threads.erase(it) : std::next(it);
+  }
+}
+
+void ProcSampler::closeProc(Proc &proc) {
+  if (proc.fd != -1) close(proc.fd);
+  proc.fd = -1;
+  if (proc.task_dir) closedir(proc.task_dir);
+  proc.task_dir = nullptr;
+  proc.threads.clear();
+}
+
+void ProcSampler::collectThreads(const std::vector<std::string> &names) {
+  thread_procs = names;
+  for (auto &[pid, proc] : procs_) {
+    proc.collect_threads = collectsThreads(proc);
+  }
+}
+
+bool ProcSampler::collectsThreads(const Proc &proc) const {
+  for (auto &name : thread_procs) {
+    if (name == "*" || proc.stat.name == name ||
+        (!proc.extra.cmdline.empty() && proc.extra.cmdline[0].find(name) != std::string::npos)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void ProcSampler::readExtra(Proc &proc, int pid) {
+  std::string path = proc_path + "/" + std::to_string(pid);
+  proc.extra.pid = pid;
+  proc.extra.name = proc.stat.name;
+  proc.extra.exe = util::readlink(path + "/exe");
+  std::istringstream stream(util::read_file(path + "/cmdline"));
+  proc.extra.cmdline = Parser::cmdline(stream);
+  proc.collect_threads = collectsThreads(proc);
+}
+
+void ProcSampler::sample() {
+  sample_id++;
+  prev_sample_sec = sample_sec;
+  sample_sec = nanos_since_boot() * 1e-9;
+  double dt = sample_sec - prev_sample_sec;
+
+  // processes
+  char path[64];
+  rewinddir(proc_dir);
+  struct dirent *de = NULL;
+  while ((de = readdir(proc_dir))) {
+    char *p_end;
+    int pid = strtol(de->d_name, &p_end, 10);
+    if (de->d_type != DT_DIR || p_end == de->d_name || *p_end != '\0') continue;
+
+    auto [it, is_new] = procs_.try_emplace(pid);
+    Proc &proc = it->second;
+    unsigned long long prev_starttime = proc.stat.starttime;
+    unsigned long prev_cpu = proc.stat.utime + proc.stat.stime;
+    // the fd of an exited process fails to read even if its pid is reused, open it again then
+    if (!is_new && !readStat(proc, pid)) {
+      closeProc(proc);
+    }
+    if (proc.fd == -1) {
+      snprintf(path, sizeof(path), "%s/%d/stat", proc_path.c_str(), pid);
+      proc.fd = open(path, O_RDONLY | O_CLOEXEC);
+      if (proc.fd == -1 || !readStat(proc, pid)) continue;
+    }
+
+    if (is_new || proc.stat.starttime != prev_starttime || proc.extra.name != proc.stat.name) {
+      if (!is_new && proc.stat.starttime != prev_starttime) {
+        int fd = std::exchange(proc.fd, -1);
+        closeProc(proc);
+        proc.fd = fd;
+      }
+      readExtra(proc, pid);
+      proc.cpu_usage = 0;
+    } else {
+      unsigned long cpu = proc.stat.utime + proc.stat.stime;
+      proc.cpu_usage = dt > 0 && cpu >= prev_cpu ? (cpu - prev_cpu) / jiffy / dt * 100 : 0;
+    }
+    if (proc.collect_threads) {
+      sampleThreads(proc, pid, dt);
+    }
+    proc.sample_id = sample_id;
+  }
+  for (auto it = procs_.begin(); it != procs_.end();) {
+    if (it->second.sample_id != sample_id) {
+      closeProc(it->second);
+      it = procs_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+
+  // /proc/stat, the line of every cpu after the total
+  cpu_times.clear();
+  if (stat_fd != -1 && pread_file(stat_fd, buf, sizeof(buf)) > 0) {
+    ProcScanner sc = {buf, buf + strlen(buf)};
+    while (sc.nextLine() && sc.startsWith("cpu", 3)) {
+      sc.p += 3;
+      CPUTime t = {};
+      if (sc.number(t.id) && sc.number(t.utime) && sc.number(t.ntime) && sc.number(t.stime) && sc.number(t.itime) &&
+          sc.number(t.iowtime) && sc.number(t.irqtime) && sc.number(t.sirqtime)) {
+        cpu_times.push_back(t);
+      }
+    }
+  }
+
+  // /proc/meminfo
+  if (meminfo_fd != -1 && pread_file(meminfo_fd, buf, sizeof(buf)) > 0) {
+    static const struct {
+      const char *key;
+      uint64_t MemInfo::*field;
+    } keys[] = {
+      {"MemTotal:", &MemInfo::total}, {"MemFree:", &MemInfo::free}, {"MemAvailable:", &MemInfo::available},
+      {"Buffers:", &MemInfo::buffers}, {"Cached:", &MemInfo::cached}, {"Active:", &MemInfo::active},
+      {"Inactive:", &MemInfo::inactive}, {"Shmem:", &MemInfo::shared},
+    };
+    mem_info = {};
+    ProcScanner sc = {buf, buf + strlen(buf)};
+    do {
+      for (auto &k : keys) {
+        size_t len = strlen(k.key);
+        if (sc.startsWith(k.key, len)) {
+          sc.p += len;
+          uint64_t kb = 0;
+          sc.number(kb);
+          mem_info.*k.field = kb * 1024;
+          break;
+        }
+      }
+    } while (sc.nextLine());
+  }
+
+  latencies = read_latency_histograms(shm_path);
+}
+
+void ProcSampler::build(cereal::ProcLog::Builder &builder) {
+  auto procs = builder.initProcs(procs_.size());
+  size_t i = 0;
+  for (auto &[pid, proc] : procs_) {
+    auto l = procs[i++];
+    const ProcStat &r = proc.stat;
     l.setPid(r.pid);
     l.setState(r.state);
     l.setPpid(r.ppid);
@@ -221,19 +479,81 @@ void buildProcs(cereal::ProcLog::Builder &builder) {
     l.setMemRss((uint64_t)r.rss * page_size);
     l.setProcessor(r.processor);
     l.setName(r.name);
+    l.setCpuUsage(proc.cpu_usage);
+
+    l.setExe(proc.extra.exe);
+    auto lcmdline = l.initCmdline(proc.extra.cmdline.size());
+    for (size_t j = 0; j < lcmdline.size(); j++) {
+      lcmdline.set(j, proc.extra.cmdline[j]);
+    }
 
-    const ProcCache &extra_info = Parser::getProcExtraInfo(r.pid, r.name);
-    l.setExe(extra_info.exe);
-    auto lcmdline = l.initCmdline(extra_info.cmdline.size());
-    for (size_t i = 0; i < lcmdline.size(); i++) {
-      lcmdline.set(i, extra_info.cmdline[i]);
+    if (proc.collect_threads) {
+      auto lthreads = l.initThreads(proc.threads.size());
+      size_t j = 0;
+      for (auto &[tid, t] : proc.threads) {
+        auto lt = lthreads[j++];
+        lt.setTid(tid);
+        lt.setName(t.stat.name);
+        lt.setState(t.stat.state);
+        lt.setProcessor(t.stat.processor);
+        lt.setPriority(t.stat.priority);
+        lt.setNice(t.stat.nice);
+        lt.setCpuUser(t.stat.utime / jiffy);
+        lt.setCpuSystem(t.stat.stime / jiffy);
+        lt.setCpuUsage(t.cpu_usage);
+        lt.setRunTime(t.run_ns * 1e-9);
+        lt.setRunDelay(t.run_delay_ns * 1e-9);
+        lt.setTimeslices(t.timeslices);
+        lt.setVoluntarySwitches(t.voluntary_switches);
+        lt.setInvoluntarySwitches(t.involuntary_switches);
+      }
+    }
+  }
+
+  auto llatencies = builder.initLatencies(latencies.size());
+  for (size_t j = 0; j < latencies.size(); j++) {
+    auto l = llatencies[j];
+    const LatencySnapshot &r = latencies[j];
+    l.setName(r.name);
+    l.setPid(r.pid);
+    l.setTid(r.tid);
+    l.setCount(r.count);
+    l.setTotal(r.total_ns * 1e-9);
+    l.setMax(r.max_ns * 1e-9);
+    auto lbuckets = l.initBuckets(LATENCY_BUCKETS);
+    for (int k = 0; k < LATENCY_BUCKETS; k++) {
+      lbuckets.set(k, r.buckets[k]);
     }
   }
+
+  auto log_cpu_times = builder.initCpuTimes(cpu_times.size());
+  for (size_t j = 0; j < cpu_times.size(); ++j) {
+    auto l = log_cpu_times[j];
+    const CPUTime &r = cpu_times[j];
+    l.setCpuNum(r.id);
+    l.setUser(r.utime / jiffy);
+    l.setNice(r.ntime / jiffy);
+    l.setSystem(r.stime / jiffy);
+    l.setIdle(r.itime / jiffy);
+    l.setIowait(r.iowtime / jiffy);
+    l.setIrq(r.irqtime / jiffy);
+    l.setSoftirq(r.sirqtime / jiffy);
+  }
+
+  auto mem = builder.initMem();
+  mem.setTotal(mem_info.total);
+  mem.setFree(mem_info.free);
+  mem.setAvailable(mem_info.available);
+  mem.setBuffers(mem_info.buffers);
+  mem.setCached(mem_info.cached);
+  mem.setActive(mem_info.active);
+  mem.setInactive(mem_info.inactive);
+  mem.setShared(mem_info.shared);
 }
 
 void buildProcLogMessage(MessageBuilder &msg) {
+  static ProcSampler sampler;
+  sampler.sample();
   auto procLog = msg.initEvent().initProcLog();
-  buildProcs(procLog);
-  buildCPUTimes(procLog);
-  buildMemInfo(procLog);
+  sampler.build(procLog);
 }
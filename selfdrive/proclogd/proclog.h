@@ -1,9 +1,13 @@
+#include <dirent.h>
+
+#include <map>
 #include <optional>
 #include <string>
 #include <unordered_map>
 #include <vector>
 
 #include "cereal/messaging/messaging.h"
+#include "selfdrive/common/latency.h"
 
 struct CPUTime {
   int id;
@@ -37,4 +41,67 @@ const ProcCache &getProcExtraInfo(int pid, const std::string &name);
 
 };  // namespace Parser
 
+struct MemInfo {
+  uint64_t total, free, available, buffers, cached, active, inactive, shared;
+};
+
+// Samples /proc through fds kept open between samples, parsing what it reads in
+// place. cmdline and exe are only read for new processes, and the CPU usage of
+// each process is computed from the difference to the last sample. Along with
+// them go the latency histograms in shm_path.
+class ProcSampler {
+ public:
+  ProcSampler(const std::string &proc_path = "/proc", const std::string &shm_path = "/dev/shm");
+  ~ProcSampler();
+  // processes to also sample every thread of, by name or part of their
+  // cmdline[0], "*" for all of them
+  void collectThreads(const std::vector<std::string> &names);
+  void sample();
+  // procLog of the last sample
+  void build(cereal::ProcLog::Builder &builder);
+
+  struct Thread {
+    ProcStat stat;
+    uint64_t run_ns, run_delay_ns, timeslices;
+    uint64_t voluntary_switches, involuntary_switches;
+    float cpu_usage;
+    uint64_t sample_id;
+  };
+  struct Proc {
+    int fd = -1;  // of stat
+    ProcStat stat;
+    ProcCache extra;
+    float cpu_usage;  // percent of one cpu since the previous sample
+    uint64_t sample_id;
+
+    bool collect_threads;
+    DIR *task_dir = nullptr;
+    std::map<int, Thread> threads;
+  };
+  const std::map<int, Proc> &procs() const { return procs_; }
+  const std::vector<CPUTime> &cpuTimes() const { return cpu_times; }
+  const MemInfo &memInfo() const { return mem_info; }
+  const std::vector<LatencySnapshot> &latencySnapshots() const { return latencies; }
+
+ private:
+  bool readStat(Proc &proc, int pid);
+  void readExtra(Proc &proc, int pid);
+  ssize_t readAt(int dir_fd, int tid, const char *name);
+  void sampleThreads(Proc &proc, int pid, double dt);
+  bool collectsThreads(const Proc &proc) const;
+  void closeProc(Proc &proc);
+
+  std::string proc_path, shm_path;
+  std::vector<std::string> thread_procs;
+  DIR *proc_dir = nullptr;
+  int stat_fd = -1, meminfo_fd = -1;
+  uint64_t sample_id = 0;
+  double sample_sec = 0, prev_sample_sec = 0;
+  std::map<int, Proc> procs_;
+  std::vector<CPUTime> cpu_times;
+  MemInfo mem_info = {};
+  std::vector<LatencySnapshot> latencies;
+  char buf[8192];
+};
+
 void buildProcLogMessage(MessageBuilder &msg);
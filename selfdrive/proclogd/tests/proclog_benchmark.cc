@@ -0,0 +1,94 @@
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+
+#include "selfdrive/common/benchmark.h"
+#include "selfdrive/common/util.h"
+#include "selfdrive/proclogd/proclog.h"
+
+// One full sample of a synthetic /proc tree with the parsers proclogd used
+// before, reopening and re-parsing every file, against ProcSampler.
+//
+// usage: proclog_benchmark [processes] [samples]
+
+static void write_file(const std::string &path, const std::string &content) {
+  util::write_file(path.c_str(), content.data(), content.size(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+}
+
+static void build_tree(const std::string &root, int num_procs) {
+  std::string stat = "cpu  10 20 30 40 50 60 70 0 0 0\n";
+  for (int i = 0; i < 8; i++) stat += util::string_format("cpu%d 1 2 3 4 5 6 7 0 0 0\n", i);
+  stat += "intr 12345" + std::string(2000, ' ') + "\n";
+  write_file(root + "/stat", stat);
+  write_file(root + "/meminfo", util::read_file("/proc/meminfo"));
+
+  for (int pid = 1; pid <= num_procs; pid++) {
+    std::string dir = root + "/" + std::to_string(pid);
+    mkdir(dir.c_str(), 0755);
+    write_file(dir + "/stat", util::string_format(
+      "%d (proc_%d) S 1 %d %d 0 -1 4194560 2150 0 3 0 %d 17 0 0 20 0 4 0 %d 125997056 4023 "
+      "18446744073709551615 1 1 0 0 0 0 0 4096 0 0 0 0 17 2 0 0 0 0 0 0 0 0 0 0 0 0 0\n",
+      pid, pid, pid, pid, pid * 3, pid * 10));
+    write_file(dir + "/cmdline", std::string("./proc\0--arg\0", 13));
+    symlink("/usr/bin/proc", (dir + "/exe").c_str());
+  }
+}
+
+// what buildProcLogMessage did before ProcSampler
+static size_t legacy_sample(const std::string &root) {
+  size_t n = 0;
+  {
+    std::ifstream stream(root + "/stat");
+    n += Parser::cpuTimes(stream).size();
+  }
+  {
+    std::ifstream stream(root + "/meminfo");
+    n += Parser::memInfo(stream).size();
+  }
+  static std::unordered_map<int, ProcCache> proc_cache;
+  DIR *d = opendir(root.c_str());
+  while (struct dirent *de = readdir(d)) {
+    int pid = atoi(de->d_name);
+    if (de->d_type != DT_DIR || pid <= 0) continue;
+    std::string path = root + "/" + std::to_string(pid);
+    if (auto stat = Parser::procStat(util::read_file(path + "/stat"))) {
+      ProcCache &cache = proc_cache[pid];
+      if (cache.pid != pid || cache.name != stat->name) {
+        cache.pid = pid;
+        cache.name = stat->name;
+        cache.exe = util::readlink(path + "/exe");
+        std::ifstream stream(path + "/cmdline");
+        cache.cmdline = Parser::cmdline(stream);
+      }
+      n++;
+    }
+  }
+  closedir(d);
+  return n;
+}
+
+int main(int argc, char *argv[]) {
+  int num_procs = argc > 1 ? atoi(argv[1]) : 300;
+  int samples = argc > 2 ? atoi(argv[2]) : 100;
+
+  char tmp_path[] = "/tmp/proclog_benchmark_XXXXXX";
+  const std::string root = mkdtemp(tmp_path);
+  build_tree(root, num_procs);
+  printf("%d processes\n", num_procs);
+
+  // the untimed first sample reads every cmdline
+  volatile size_t sink = 0;
+  bench("legacy", samples, "sample", [&]() { sink += legacy_sample(root); });
+  ProcSampler sampler(root);
+  bench("ProcSampler", samples, "sample", [&]() { sampler.sample(); sink += sampler.procs().size(); });
+  ProcSampler proc_sampler;
+  bench("ProcSampler on /proc", samples, "sample", [&]() { proc_sampler.sample(); sink += proc_sampler.procs().size(); });
+
+  system(("rm -rf " + root).c_str());
+  return 0;
+}
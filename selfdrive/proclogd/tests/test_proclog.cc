@@ -0,0 +1,192 @@
+#define CATCH_CONFIG_MAIN
+#include "catch2/catch.hpp"
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+
+#include "selfdrive/common/util.h"
+#include "selfdrive/proclogd/proclog.h"
+
+const long clk_tck = sysconf(_SC_CLK_TCK);
+
+static void write_file(const std::string &path, const std::string &content) {
+  REQUIRE(util::write_file(path.c_str(), content.data(), content.size(), O_WRONLY | O_CREAT | O_TRUNC, 0644) == 0);
+}
+
+// fields as in proc(5), rewritten in place as the kernel would
+static void write_proc(const std::string &root, int pid, const std::string &name, unsigned long utime,
+                       unsigned long long starttime, const std::string &cmdline) {
+  std::vector<std::string> fields(53, "0");
+  fields[1] = std::to_string(pid);
+  fields[2] = "(" + name + ")";
+  fields[3] = "S";
+  fields[4] = "1";
+  fields[14] = std::to_string(utime);
+  fields[15] = "5";
+  fields[18] = "20";
+  fields[20] = "3";
+  fields[22] = std::to_string(starttime);
+  fields[23] = "123456789";
+  fields[24] = "2000";
+  fields[39] = "2";
+  std::string stat;
+  for (size_t i = 1; i < fields.size(); i++) stat += fields[i] + (i + 1 < fields.size() ? " " : "\n");
+
+  std::string dir = root + "/" + std::to_string(pid);
+  mkdir(dir.c_str(), 0755);
+  write_file(dir + "/stat", stat);
+  write_file(dir + "/cmdline", cmdline);
+  unlink((dir + "/exe").c_str());
+  REQUIRE(symlink(("/usr/bin/" + name).c_str(), (dir + "/exe").c_str()) == 0);
+}
+
+TEST_CASE("ProcSampler: synthetic /proc") {
+  char tmp_path[] = "/tmp/test_proclog_XXXXXX";
+  const std::string root = mkdtemp(tmp_path);
+  write_file(root + "/stat", "cpu  10 20 30 40 50 60 70 0 0 0\n"
+                             "cpu0 1 2 3 4 5 6 7 0 0 0\n"
+                             "cpu1 8 9 10 11 12 13 14 0 0 0\n"
+                             "intr 12345 0 0\n");
+  write_file(root + "/meminfo", "MemTotal:        3791244 kB\n"
+                                "MemFree:          208760 kB\n"
+                                "MemAvailable:    1914444 kB\n"
+                                "Buffers:           77068 kB\n"
+                                "Cached:          1643632 kB\n"
+                                "SwapCached:            0 kB\n"
+                                "Active:          2058384 kB\n"
+                                "Inactive:         997572 kB\n"
+                                "Shmem:             13448 kB\n");
+  write_proc(root, 1, "init", 100, 1, std::string("/sbin/init\0", 11));
+  write_proc(root, 42, "a (b) c", 100, 500, std::string("./a\0--flag\0\0", 12));
+
+  ProcSampler sampler(root);
+  sampler.sample();
+
+  auto &cpus = sampler.cpuTimes();
+  REQUIRE(cpus.size() == 2);
+  REQUIRE(cpus[1].id == 1);
+  REQUIRE(cpus[1].utime == 8);
+  REQUIRE(cpus[1].sirqtime == 14);
+
+  auto &mem = sampler.memInfo();
+  REQUIRE(mem.total == 3791244ULL * 1024);
+  REQUIRE(mem.available == 1914444ULL * 1024);
+  REQUIRE(mem.inactive == 997572ULL * 1024);
+  REQUIRE(mem.shared == 13448ULL * 1024);
+
+  auto &procs = sampler.procs();
+  REQUIRE(procs.size() == 2);
+  const auto &p = procs.at(42);
+  REQUIRE(p.stat.name == "a (b) c");
+  REQUIRE(p.stat.state == 'S');
+  REQUIRE(p.stat.ppid == 1);
+  REQUIRE(p.stat.utime == 100);
+  REQUIRE(p.stat.priority == 20);
+  REQUIRE(p.stat.num_threads == 3);
+  REQUIRE(p.stat.starttime == 500);
+  REQUIRE(p.stat.rss == 2000);
+  REQUIRE(p.stat.processor == 2);
+  REQUIRE(p.extra.exe == "/usr/bin/a (b) c");
+  REQUIRE(p.extra.cmdline == std::vector<std::string>{"./a", "--flag"});
+
+  SECTION("cpu usage from the previous sample") {
+    util::sleep_for(100);
+    write_proc(root, 42, "a (b) c", 100 + clk_tck / 10, 500, std::string("changed\0", 8));
+    sampler.sample();
+    REQUIRE(p.cpu_usage > 10);
+    REQUIRE(p.cpu_usage <= 100);
+    REQUIRE(procs.at(1).cpu_usage == 0);
+    // cmdline is only read once
+    REQUIRE(p.extra.cmdline[0] == "./a");
+  }
+  SECTION("reused pid") {
+    write_proc(root, 42, "b", 10, 900, std::string("./b\0", 4));
+    sampler.sample();
+    REQUIRE(p.stat.name == "b");
+    REQUIRE(p.cpu_usage == 0);
+    REQUIRE(p.extra.cmdline == std::vector<std::string>{"./b"});
+  }
+  SECTION("exited process") {
+    system(("rm -rf " + root + "/42").c_str());
+    sampler.sample();
+    REQUIRE(procs.size() == 1);
+    REQUIRE(procs.count(42) == 0);
+  }
+  system(("rm -rf " + root).c_str());
+}
+
+TEST_CASE("ProcSampler: /proc") {
+  ProcSampler sampler;
+  sampler.sample();
+  sampler.sample();
+  REQUIRE(sampler.cpuTimes().size() > 0);
+  REQUIRE(sampler.memInfo().total > 0);
+
+  auto &procs = sampler.procs();
+  auto it = procs.find(getpid());
+  REQUIRE(it != procs.end());
+  REQUIRE(it->second.stat.state == 'R');
+  REQUIRE(it->second.stat.num_threads >= 1);
+  REQUIRE(it->second.extra.exe == util::readlink("/proc/self/exe"));
+  REQUIRE(it->second.extra.cmdline.size() > 0);
+}
+
+TEST_CASE("ProcSampler: threads") {
+  std::atomic<bool> stop = false;
+  std::thread busy([&]() {
+    set_thread_name("busy");
+    while (!stop) {}
+  });
+
+  ProcSampler sampler;
+  sampler.collectThreads({util::base_name(util::readlink("/proc/self/exe"))});
+  sampler.sample();
+  util::sleep_for(200);
+  sampler.sample();
+  stop = true;
+  busy.join();
+
+  auto &self = sampler.procs().at(getpid());
+  REQUIRE(self.collect_threads);
+  REQUIRE(self.threads.size() == 2);
+  REQUIRE(self.threads.count(getpid()) == 1);
+  auto it = std::find_if(self.threads.begin(), self.threads.end(), [](auto &t) { return t.second.stat.name == "busy"; });
+  REQUIRE(it != self.threads.end());
+  REQUIRE(it->second.cpu_usage > 10);
+  REQUIRE(it->second.involuntary_switches + it->second.voluntary_switches > 0);
+
+  // the other processes are left alone
+  for (auto &[pid, proc] : sampler.procs()) {
+    if (pid != getpid()) REQUIRE(proc.threads.empty());
+  }
+}
+
+TEST_CASE("ProcSampler: latency histograms") {
+  {
+    LatencyHistogram histogram("test_proclog");
+    histogram.add(500);        // < 1 us
+    histogram.add(3000);       // < 4 us
+    histogram.add(3500);
+    histogram.add(20000000);   // 20 ms
+    for (int i = 0; i < 10; i++) {
+      ScopedLatency scope(histogram);
+    }
+
+    ProcSampler sampler;
+    sampler.sample();
+    auto &snapshots = sampler.latencySnapshots();
+    auto it = std::find_if(snapshots.begin(), snapshots.end(), [](auto &s) { return s.pid == getpid() && s.name == "test_proclog"; });
+    REQUIRE(it != snapshots.end());
+    REQUIRE(it->count == 14);
+    REQUIRE(it->max_ns == 20000000);
+    REQUIRE(it->buckets[2] == 2);
+    REQUIRE(it->buckets[15] == 1);
+    REQUIRE(it->total_ns >= 20007000);
+  }
+  // removed with the histogram
+  REQUIRE(!util::file_exists("/dev/shm/latency_" + std::to_string(getpid()) + "_test_proclog"));
+}